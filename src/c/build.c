@@ -1,11 +1,116 @@
 #include "src/std/eql.c"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #ifdef _WIN32
 #define OUT "bin\\bc.exe"
+#define PROF_OUT "bin\\bcprof.exe"
 #else
 #define OUT "./bin/bc"
+#define PROF_OUT "./bin/bcprof"
+#define RUN_OUT "./bin/bbrun"
+#endif
+
+#ifdef _WIN32
+// Weird Windows thing
+#define PLATFORM_FLAGS " -Wno-used-but-marked-unused"
+#else
+#define PLATFORM_FLAGS ""
+#endif
+
+#define CC                                                                     \
+  "zig cc"                                                                     \
+  " -Wall"                                                                     \
+  " -Wextra"                                                                   \
+  " -Wpedantic"                                                                \
+  " -Weverything"                                                              \
+  " -Werror"                                                                   \
+                                                                               \
+  " -Wno-padded"                                                               \
+  " -Wno-declaration-after-statement"                                          \
+  " -Wno-unsafe-buffer-usage" PLATFORM_FLAGS
+
+#ifndef _WIN32
+// Every program in ../../tests is compiled in each mode and run with bbrun,
+// and has to print exactly what its .out file holds
+static const char *const tests[] = {
+    "arithmetic",
+    "conditionals",
+    "loops",
+    "inlining",
+    "scopes",
+    "tailcalls",
+    "peephole",
+    "temporaries",
+    "minify",
+    "ir",
+    "hoisting",
+    "cse",
+    "types",
+    "pure",
+    "memo",
+    "subroutines",
+    "macros",
+    "results",
+    "switch",
+    "ordering",
+    "output",
+    "arrays",
+    "loopbatch",
+};
+
+static const char *const modes[] = {
+    "",
+    " --minify",
+    " --macros",
+    " --macros --inline-threshold=0",
+    " --inline-threshold=0",
+    " --profile",
+};
+
+bool runTests(void) {
+  size_t test_count = sizeof(tests) / sizeof(tests[0]);
+  size_t mode_count = sizeof(modes) / sizeof(modes[0]);
+  char command[256];
+  for (size_t t = 0; t < test_count; t++) {
+    for (size_t m = 0; m < mode_count; m++) {
+      snprintf(command, sizeof(command),
+               OUT "%s ../../tests/%s.bb bin/test.cmd > /dev/null", modes[m],
+               tests[t]);
+      bool failed = system(command) != 0;
+      if (!failed) {
+        snprintf(command, sizeof(command),
+                 RUN_OUT " bin/test.cmd 2> /dev/null"
+                         " | diff -u ../../tests/%s.out -",
+                 tests[t]);
+        failed = system(command) != 0;
+      }
+      if (failed) {
+        printf("Test %s failed%s%s\n", tests[t], modes[m][0] ? " with" : "",
+               modes[m]);
+        return false;
+      }
+    }
+  }
+  // the cost report is meant to be diffed between compiler versions, so any
+  // change to it has to show up here too
+  if (system(OUT " --cost-report=bin/cost.json ../../tests/costreport.bb"
+                 " bin/test.cmd > /dev/null") ||
+      system("diff -u ../../tests/costreport.json bin/cost.json")) {
+    printf("Test costreport failed\n");
+    return false;
+  }
+  // the trace was recorded from tests/bcprof/fib.bb, with the times spread
+  // out to give the report something to show
+  if (system(PROF_OUT " ../../tests/bcprof/fib.cmd"
+                      " | diff -u ../../tests/bcprof/fib.out -")) {
+    printf("Test bcprof failed\n");
+    return false;
+  }
+  printf("%zu tests passed in %zu modes\n", test_count, mode_count);
+  return true;
+}
 #endif
 
 bool releaseMode(int argc, char **argv) {
@@ -19,23 +124,15 @@ bool releaseMode(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
-  if (system("zig cc"
-             " -Wall"
-             " -Wextra"
-             " -Wpedantic"
-             " -Weverything"
-             " -Werror"
-
-             " -Wno-padded"
-             " -Wno-declaration-after-statement"
-             " -Wno-unsafe-buffer-usage"
-
-#ifdef _WIN32
-             // Weird Windows thing
-             " -Wno-used-but-marked-unused"
-#endif
-             " -o " OUT " src/main.c"))
+  if (system(CC " -o " OUT " src/main.c"))
     exit(1);
+  if (system(CC " -o " PROF_OUT " src/bcprof.c"))
+    exit(1);
+#ifndef _WIN32
+  // bbrun stands in for cmd.exe to run the output here
+  if (system(CC " -o " RUN_OUT " src/bbrun.c"))
+    exit(1);
+#endif
   if (releaseMode(argc, argv)) {
     if (system("zig cc"
                " -O2"
@@ -57,6 +154,10 @@ int main(int argc, char **argv) {
   if (system("cmd.exe /c ../../main.cmd"))
     exit(1);
 #else
+  if (system(RUN_OUT " ../../main.cmd"))
+    exit(1);
+  if (!runTests())
+    exit(1);
   if (releaseMode(argc, argv))
     system("ls -lh bin");
 #endif
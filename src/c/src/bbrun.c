@@ -0,0 +1,1700 @@
+// for clock_gettime, localtime_r and friends under -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "std/Allocator.c"
+#include "std/Vec.c"
+#include "std/panic.c"
+#include "std/readFile.c"
+#include "std/writeAll.c"
+
+// Runs the subset of batch that bc emits, so generated scripts can be tested
+// and benchmarked without Windows. Like cmd it goes back to the script file
+// for every line it runs, reloading it when it changed, and a goto or call
+// scans for its label from the current position, wrapping around at the end
+// of the file. Both count towards the statistics printed at the end.
+
+#define SCRATCH (16 * 1024 * 1024)
+#define MAX_LABEL 256
+
+typedef struct {
+  Slice(char) name;
+  Slice(char) value;
+} Variable;
+
+DefSlice(Variable);
+DefVec(Variable);
+DefResult(Vec_Variable);
+
+typedef struct {
+  Vec(Variable) variables;
+  bool delayed;
+} Environment;
+
+DefSlice(Environment);
+DefVec(Environment);
+DefResult(Vec_Environment);
+DefVec(char);
+DefResult(Vec_char);
+
+typedef enum {
+  CommandNode,
+  BlockNode,
+  IfNode,
+  ForRangeNode,
+  ForTextNode,
+  ForListNode,
+} NodeType;
+
+typedef struct Node Node;
+struct Node {
+  NodeType type;
+  // the command, the for /l range, the for /f text or the plain for list
+  Slice(char) text;
+  // the > and < of a command or block, taken off while parsing like cmd
+  // does, so escaped ones stay part of the command
+  Slice(char) redirections;
+  char variable;
+  bool negate;
+  bool ignore_case;
+  bool defined;
+  Slice(char) left;
+  Slice(char) op;
+  Slice(char) right;
+  // block contents, if branch or for body
+  Node *body;
+  Node *alternate;
+  // the next command of a sequence and how it is joined: & always runs it,
+  // + is && and | is ||
+  Node *next;
+  char join;
+};
+
+typedef enum {
+  FlowNext,
+  FlowFailed,
+  FlowGoto,
+  FlowExit,
+} Flow;
+
+typedef struct {
+  Slice(Slice_char) args;
+  // offset of the next line to read
+  size_t pos;
+} Frame;
+
+typedef struct {
+  size_t commands;
+  size_t lines_read;
+  size_t bytes_read;
+  size_t reloads;
+  size_t label_scans;
+  size_t bytes_scanned;
+  size_t files_opened;
+  size_t peak_variables;
+  size_t peak_environment_bytes;
+  size_t peak_setlocal;
+  size_t peak_calls;
+} Statistics;
+
+typedef struct {
+  Allocator heap;
+  Allocator scratch;
+  Bump *scratch_state;
+  const char *path;
+  Slice(char) script;
+  struct stat loaded;
+  Environment env;
+  Vec(Environment) saved;
+  Slice(char) for_values[128];
+  FILE *out;
+  // pushd saves the directory to return to here
+  Vec(Slice_char) directories;
+  size_t calls;
+  int errorlevel;
+  unsigned int random;
+  bool terminated;
+  bool failed;
+  char goto_label[MAX_LABEL];
+  Statistics stats;
+} Interpreter;
+
+static void *heapRealloc(void *ptr, size_t size, size_t old_size,
+                         void *state) {
+  (void)old_size;
+  (void)state;
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, size);
+}
+
+static Slice(char) slice(char *ptr, size_t len) {
+  return (Slice(char)){.ptr = ptr, .len = len};
+}
+
+static Slice(char) cstring(char *str) { return slice(str, strlen(str)); }
+
+static bool startsWithIgnoreCase(Slice(char) text, const char *prefix) {
+  size_t len = strlen(prefix);
+  if (text.len < len)
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    if (tolower(text.ptr[i]) != tolower(prefix[i]))
+      return false;
+  }
+  return true;
+}
+
+static bool eqlIgnoreCase(Slice(char) a, Slice(char) b) {
+  return a.len == b.len && strncasecmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+static Slice(char) trimStart(Slice(char) text, const char *chars) {
+  while (text.len > 0 && strchr(chars, text.ptr[0])) {
+    text.ptr++;
+    text.len--;
+  }
+  return text;
+}
+
+static Slice(char) copy(Allocator ally, Slice(char) text) {
+  Result(Slice_char) res = alloc(ally, char, text.len + 1);
+  if (!res.ok)
+    panic(res.err);
+  memcpy(res.val.ptr, text.ptr, text.len);
+  res.val.ptr[text.len] = 0;
+  res.val.len = text.len;
+  return res.val;
+}
+
+static void freeText(Allocator ally, Slice(char) text) {
+  if (!text.ptr)
+    return;
+  text.len++;
+  resizeAllocation(ally, char, &text, 0);
+}
+
+static Vec(char) builder(Interpreter *interp, size_t cap) {
+  Result(Vec_char) res = createVec(interp->scratch, char, cap + 1);
+  if (!res.ok)
+    panic("Out of scratch memory");
+  return res.val;
+}
+
+static void appendText(Vec(char) * out, Slice(char) text) {
+  if (!appendSlice(out, char, text))
+    panic("Out of scratch memory");
+}
+
+static void appendChar(Vec(char) * out, char c) {
+  if (!append(out, char, &c))
+    panic("Out of scratch memory");
+}
+
+// ---- environment
+
+static Variable *findVariable(Interpreter *interp, Slice(char) name) {
+  Slice(Variable) variables = interp->env.variables.slice;
+  for (size_t i = 0; i < variables.len; i++) {
+    if (eqlIgnoreCase(variables.ptr[i].name, name))
+      return &variables.ptr[i];
+  }
+  return NULL;
+}
+
+static void updatePeaks(Interpreter *interp) {
+  Slice(Variable) variables = interp->env.variables.slice;
+  size_t bytes = 0;
+  for (size_t i = 0; i < variables.len; i++) {
+    bytes += variables.ptr[i].name.len + variables.ptr[i].value.len + 2;
+  }
+  if (variables.len > interp->stats.peak_variables)
+    interp->stats.peak_variables = variables.len;
+  if (bytes > interp->stats.peak_environment_bytes)
+    interp->stats.peak_environment_bytes = bytes;
+}
+
+static void setVariable(Interpreter *interp, Slice(char) name,
+                        Slice(char) value) {
+  Variable *existing = findVariable(interp, name);
+  if (value.len == 0) {
+    if (!existing)
+      return;
+    freeText(interp->heap, existing->name);
+    freeText(interp->heap, existing->value);
+    Vec(Variable) *variables = &interp->env.variables;
+    *existing = variables->slice.ptr[--variables->slice.len];
+    return;
+  }
+  if (existing) {
+    freeText(interp->heap, existing->value);
+    existing->value = copy(interp->heap, value);
+    return;
+  }
+  Variable variable = {.name = copy(interp->heap, name),
+                       .value = copy(interp->heap, value)};
+  if (!append(&interp->env.variables, Variable, &variable))
+    panic("Failed to append variable");
+}
+
+static Environment copyEnvironment(Interpreter *interp, Environment env) {
+  Result(Vec_Variable) res =
+      createVec(interp->heap, Variable, env.variables.slice.len + 8);
+  if (!res.ok)
+    panic(res.err);
+  Environment result = {.variables = res.val, .delayed = env.delayed};
+  for (size_t i = 0; i < env.variables.slice.len; i++) {
+    Variable variable = {
+        .name = copy(interp->heap, env.variables.slice.ptr[i].name),
+        .value = copy(interp->heap, env.variables.slice.ptr[i].value)};
+    if (!append(&result.variables, Variable, &variable))
+      panic("Failed to append variable");
+  }
+  return result;
+}
+
+static void freeEnvironment(Interpreter *interp, Environment env) {
+  for (size_t i = 0; i < env.variables.slice.len; i++) {
+    freeText(interp->heap, env.variables.slice.ptr[i].name);
+    freeText(interp->heap, env.variables.slice.ptr[i].value);
+  }
+  Slice(Variable) variables = {.ptr = env.variables.slice.ptr,
+                               .len = env.variables.cap};
+  resizeAllocation(interp->heap, Variable, &variables, 0);
+}
+
+static void setlocal(Interpreter *interp) {
+  Environment saved = copyEnvironment(interp, interp->env);
+  if (!append(&interp->saved, Environment, &saved))
+    panic("Failed to append environment");
+  if (interp->saved.slice.len > interp->stats.peak_setlocal)
+    interp->stats.peak_setlocal = interp->saved.slice.len;
+}
+
+static void endlocal(Interpreter *interp) {
+  if (interp->saved.slice.len == 0)
+    return;
+  freeEnvironment(interp, interp->env);
+  interp->env = interp->saved.slice.ptr[--interp->saved.slice.len];
+}
+
+// Dynamic variables only apply when nothing of that name is set
+static Slice(char) dynamicVariable(Interpreter *interp, Slice(char) name,
+                                   bool *found) {
+  char buffer[4096];
+  int len = -1;
+  if (eqlIgnoreCase(name, cstring("random"))) {
+    // fixed seed, so runs can be compared
+    interp->random = interp->random * 1103515245 + 12345;
+    len = snprintf(buffer, sizeof(buffer), "%u",
+                   (interp->random >> 16) % 32768);
+  } else if (eqlIgnoreCase(name, cstring("errorlevel"))) {
+    len = snprintf(buffer, sizeof(buffer), "%d", interp->errorlevel);
+  } else if (eqlIgnoreCase(name, cstring("time"))) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm local;
+    localtime_r(&now.tv_sec, &local);
+    len = snprintf(buffer, sizeof(buffer), "%2d:%02d:%02d.%02ld", local.tm_hour,
+                   local.tm_min, local.tm_sec, now.tv_nsec / 10000000);
+  } else if (eqlIgnoreCase(name, cstring("cd"))) {
+    if (getcwd(buffer, sizeof(buffer)))
+      len = (int)strlen(buffer);
+  }
+  *found = len >= 0;
+  if (len < 0)
+    return slice(NULL, 0);
+  Vec(char) out = builder(interp, (size_t)len);
+  appendText(&out, slice(buffer, (size_t)len));
+  return out.slice;
+}
+
+static bool lookup(Interpreter *interp, Slice(char) name, Slice(char) *value) {
+  Variable *variable = findVariable(interp, name);
+  if (variable) {
+    *value = variable->value;
+    return true;
+  }
+  bool found = false;
+  *value = dynamicVariable(interp, name, &found);
+  return found;
+}
+
+// ---- expansion
+
+// %~dpnx modifiers of an argument, only the script path has a directory
+static void appendArgument(Vec(char) * out, Slice(char) arg,
+                           Slice(char) modifiers) {
+  if (modifiers.len == 0) {
+    appendText(out, arg);
+    return;
+  }
+  if (arg.len >= 2 && arg.ptr[0] == '"' && arg.ptr[arg.len - 1] == '"')
+    arg = slice(arg.ptr + 1, arg.len - 2);
+  size_t dir = 0;
+  for (size_t i = 0; i < arg.len; i++) {
+    if (arg.ptr[i] == '/' || arg.ptr[i] == '\\')
+      dir = i + 1;
+  }
+  size_t ext = arg.len;
+  for (size_t i = arg.len; i > dir; i--) {
+    if (arg.ptr[i - 1] == '.') {
+      ext = i - 1;
+      break;
+    }
+  }
+  bool path_parts = false;
+  for (size_t i = 0; i < modifiers.len; i++) {
+    if (strchr("dpnx", tolower(modifiers.ptr[i])))
+      path_parts = true;
+  }
+  if (!path_parts) {
+    appendText(out, arg);
+    return;
+  }
+  for (size_t i = 0; i < modifiers.len; i++) {
+    char modifier = (char)tolower(modifiers.ptr[i]);
+    if (modifier == 'p')
+      appendText(out, dir ? slice(arg.ptr, dir) : cstring("./"));
+    else if (modifier == 'n')
+      appendText(out, slice(arg.ptr + dir, ext - dir));
+    else if (modifier == 'x')
+      appendText(out, slice(arg.ptr + ext, arg.len - ext));
+  }
+}
+
+// The first phase of cmd, run once over a whole line or block
+static Slice(char) expandPercent(Interpreter *interp, Frame *frame,
+                                 Slice(char) text) {
+  Vec(char) out = builder(interp, text.len);
+  size_t i = 0;
+  while (i < text.len) {
+    char c = text.ptr[i];
+    if (c != '%') {
+      appendChar(&out, c);
+      i++;
+      continue;
+    }
+    if (i + 1 < text.len && text.ptr[i + 1] == '%') {
+      appendChar(&out, '%');
+      i += 2;
+      continue;
+    }
+    size_t j = i + 1;
+    if (j < text.len && text.ptr[j] == '~') {
+      j++;
+      while (j < text.len && isalpha(text.ptr[j]))
+        j++;
+    }
+    if (j < text.len && (isdigit(text.ptr[j]) || text.ptr[j] == '*')) {
+      // modifiers keep their ~, so a bare %~1 still strips quotes
+      Slice(char) modifiers = slice(text.ptr + i + 1, j - i - 1);
+      if (text.ptr[i + 1] != '~')
+        modifiers.len = 0;
+      Slice(Slice_char) args = frame->args;
+      if (text.ptr[j] == '*') {
+        for (size_t a = 1; a < args.len; a++) {
+          if (a > 1)
+            appendChar(&out, ' ');
+          appendText(&out, args.ptr[a]);
+        }
+      } else {
+        size_t n = (size_t)(text.ptr[j] - '0');
+        if (n < args.len)
+          appendArgument(&out, args.ptr[n], modifiers);
+      }
+      i = j + 1;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < text.len && text.ptr[end] != '%' && text.ptr[end] != '\n')
+      end++;
+    if (end >= text.len || text.ptr[end] != '%') {
+      // a lone percent sign disappears
+      i++;
+      continue;
+    }
+    Slice(char) value;
+    if (lookup(interp, slice(text.ptr + i + 1, end - i - 1), &value))
+      appendText(&out, value);
+    i = end + 1;
+  }
+  return out.slice;
+}
+
+static Slice(char) expandForVariables(Interpreter *interp, Slice(char) text) {
+  if (!memchr(text.ptr, '%', text.len))
+    return text;
+  Vec(char) out = builder(interp, text.len);
+  for (size_t i = 0; i < text.len; i++) {
+    if (text.ptr[i] == '%' && i + 1 < text.len) {
+      bool tilde = text.ptr[i + 1] == '~' && i + 2 < text.len;
+      unsigned char name = (unsigned char)text.ptr[i + (tilde ? 2 : 1)];
+      Slice(char) value =
+          name < 128 ? interp->for_values[name] : slice(NULL, 0);
+      if (value.ptr) {
+        if (tilde && value.len >= 2 && value.ptr[0] == '"' &&
+            value.ptr[value.len - 1] == '"')
+          value = slice(value.ptr + 1, value.len - 2);
+        appendText(&out, value);
+        i += tilde ? 2 : 1;
+        continue;
+      }
+    }
+    appendChar(&out, text.ptr[i]);
+  }
+  return out.slice;
+}
+
+// Delayed expansion runs per command, and only when the command has a !
+static Slice(char) expandDelayed(Interpreter *interp, Slice(char) text) {
+  if (!interp->env.delayed || !memchr(text.ptr, '!', text.len))
+    return text;
+  Vec(char) out = builder(interp, text.len);
+  size_t i = 0;
+  while (i < text.len) {
+    char c = text.ptr[i];
+    if (c == '^' && i + 1 < text.len) {
+      appendChar(&out, text.ptr[i + 1]);
+      i += 2;
+      continue;
+    }
+    if (c != '!') {
+      appendChar(&out, c);
+      i++;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < text.len && text.ptr[end] != '!')
+      end++;
+    if (end >= text.len) {
+      i++;
+      continue;
+    }
+    Slice(char) value;
+    if (lookup(interp, slice(text.ptr + i + 1, end - i - 1), &value))
+      appendText(&out, value);
+    i = end + 1;
+  }
+  return out.slice;
+}
+
+static Slice(char) expandCommand(Interpreter *interp, Slice(char) text) {
+  return expandDelayed(interp, expandForVariables(interp, text));
+}
+
+// ---- parsing
+
+typedef struct {
+  Interpreter *interp;
+  Slice(char) text;
+  size_t pos;
+  size_t depth;
+} Parser;
+
+static Node *newNode(Parser *p, NodeType type) {
+  Result(Slice_void) res = alloc_(p->interp->scratch, sizeof(Node), 1);
+  if (!res.ok)
+    panic("Out of scratch memory");
+  Node *node = res.val.ptr;
+  memset(node, 0, sizeof(Node));
+  node->type = type;
+  node->join = '&';
+  return node;
+}
+
+static Slice(char) rest(Parser *p) {
+  return slice(p->text.ptr + p->pos, p->text.len - p->pos);
+}
+
+static void skipBlanks(Parser *p) {
+  while (p->pos < p->text.len && strchr(" \t@;,", p->text.ptr[p->pos]))
+    p->pos++;
+}
+
+static bool parseKeyword(Parser *p, const char *keyword) {
+  size_t len = strlen(keyword);
+  Slice(char) text = rest(p);
+  if (!startsWithIgnoreCase(text, keyword) ||
+      (text.len > len && !strchr(" \t(", text.ptr[len])))
+    return false;
+  p->pos += len;
+  skipBlanks(p);
+  return true;
+}
+
+// An if operand, quoted or up to the next blank or comparison
+static Slice(char) parseOperand(Parser *p) {
+  size_t start = p->pos;
+  bool quoted = false;
+  while (p->pos < p->text.len) {
+    char c = p->text.ptr[p->pos];
+    if (c == '"')
+      quoted = !quoted;
+    else if (!quoted && (c == ' ' || c == '\t' || c == '\n' ||
+                         (c == '=' && p->pos + 1 < p->text.len &&
+                          p->text.ptr[p->pos + 1] == '=')))
+      break;
+    p->pos++;
+  }
+  return slice(p->text.ptr + start, p->pos - start);
+}
+
+static Node *parseSequence(Parser *p, bool line);
+
+static Node *parseCommand(Parser *p);
+
+// Without a block the rest of the line belongs to an if or for, & chains
+// included
+static Node *parseBody(Parser *p) {
+  skipBlanks(p);
+  if (p->pos < p->text.len && p->text.ptr[p->pos] == '(')
+    return parseCommand(p);
+  return parseSequence(p, true);
+}
+
+static Node *parseIf(Parser *p) {
+  Node *node = newNode(p, IfNode);
+  if (parseKeyword(p, "/i"))
+    node->ignore_case = true;
+  if (parseKeyword(p, "not"))
+    node->negate = true;
+  if (parseKeyword(p, "defined")) {
+    node->defined = true;
+    node->left = parseOperand(p);
+  } else {
+    node->left = parseOperand(p);
+    skipBlanks(p);
+    Slice(char) text = rest(p);
+    if (startsWithIgnoreCase(text, "==")) {
+      node->op = slice(text.ptr, 2);
+      p->pos += 2;
+    } else {
+      node->op = slice(text.ptr, text.len < 3 ? text.len : 3);
+      p->pos += node->op.len;
+    }
+    while (p->pos < p->text.len && p->text.ptr[p->pos] == ' ')
+      p->pos++;
+    node->right = parseOperand(p);
+  }
+  skipBlanks(p);
+  node->body = parseBody(p);
+  skipBlanks(p);
+  if (parseKeyword(p, "else"))
+    node->alternate = parseBody(p);
+  return node;
+}
+
+static Node *parseFor(Parser *p) {
+  bool range = parseKeyword(p, "/l");
+  bool text = !range && parseKeyword(p, "/f");
+  if (text && p->pos < p->text.len && p->text.ptr[p->pos] == '"') {
+    // only "delims=" is emitted, which keeps the whole line
+    char *close = memchr(p->text.ptr + p->pos + 1, '"',
+                         p->text.len - p->pos - 1);
+    p->pos = close ? (size_t)(close - p->text.ptr) + 1 : p->text.len;
+    skipBlanks(p);
+  }
+  Node *node = newNode(p, range  ? ForRangeNode
+                          : text ? ForTextNode
+                                 : ForListNode);
+  if (p->pos + 1 < p->text.len && p->text.ptr[p->pos] == '%')
+    p->pos++;
+  if (p->pos < p->text.len && p->text.ptr[p->pos] == '%')
+    p->pos++;
+  if (p->pos < p->text.len)
+    node->variable = p->text.ptr[p->pos++];
+  skipBlanks(p);
+  if (!parseKeyword(p, "in") || p->pos >= p->text.len ||
+      p->text.ptr[p->pos] != '(') {
+    p->interp->failed = true;
+    fprintf(stderr, "bbrun: unsupported for: %.*s\n", (int)p->text.len,
+            p->text.ptr);
+    return node;
+  }
+  size_t start = ++p->pos;
+  bool quoted = false;
+  while (p->pos < p->text.len && (quoted || p->text.ptr[p->pos] != ')')) {
+    if (p->text.ptr[p->pos] == '"')
+      quoted = !quoted;
+    p->pos++;
+  }
+  node->text = slice(p->text.ptr + start, p->pos - start);
+  if (p->pos < p->text.len)
+    p->pos++;
+  skipBlanks(p);
+  parseKeyword(p, "do");
+  node->body = parseBody(p);
+  return node;
+}
+
+// Moves one > file, >> file or < file from the text into out
+static void parseRedirection(Parser *p, Vec(char) * out) {
+  while (p->pos < p->text.len && strchr("<>", p->text.ptr[p->pos]))
+    appendChar(out, p->text.ptr[p->pos++]);
+  while (p->pos < p->text.len && strchr(" \t", p->text.ptr[p->pos]))
+    p->pos++;
+  bool quoted = false;
+  while (p->pos < p->text.len) {
+    char c = p->text.ptr[p->pos];
+    if (c == '"')
+      quoted = !quoted;
+    else if (!quoted && strchr(" \t\n&|<>)", c))
+      break;
+    appendChar(out, c);
+    p->pos++;
+  }
+  appendChar(out, ' ');
+}
+
+// A simple command runs up to the next unquoted &, | or line break, or the
+// ) that closes the block it is in. Escaping carets are dropped here.
+static Node *parseSimple(Parser *p) {
+  Node *node = newNode(p, CommandNode);
+  Vec(char) out = builder(p->interp, 32);
+  Vec(char) redirections = builder(p->interp, 16);
+  bool quoted = false;
+  while (p->pos < p->text.len) {
+    char c = p->text.ptr[p->pos];
+    if (c == '^' && !quoted && p->pos + 1 < p->text.len) {
+      appendChar(&out, p->text.ptr[p->pos + 1]);
+      p->pos += 2;
+      continue;
+    }
+    if (!quoted && (c == '>' || c == '<')) {
+      parseRedirection(p, &redirections);
+      continue;
+    }
+    if (c == '"')
+      quoted = !quoted;
+    else if (!quoted && (c == '\n' || c == '&' || c == '|' ||
+                         (c == ')' && p->depth > 0)))
+      break;
+    appendChar(&out, c);
+    p->pos++;
+  }
+  node->text = out.slice;
+  node->redirections = redirections.slice;
+  return node;
+}
+
+static Node *parseCommand(Parser *p) {
+  skipBlanks(p);
+  if (p->pos < p->text.len && p->text.ptr[p->pos] == '(') {
+    p->pos++;
+    p->depth++;
+    Node *node = newNode(p, BlockNode);
+    node->body = parseSequence(p, false);
+    if (p->pos < p->text.len && p->text.ptr[p->pos] == ')')
+      p->pos++;
+    p->depth--;
+    Vec(char) redirections = builder(p->interp, 16);
+    skipBlanks(p);
+    while (p->pos < p->text.len && strchr("<>", p->text.ptr[p->pos])) {
+      parseRedirection(p, &redirections);
+      skipBlanks(p);
+    }
+    node->redirections = redirections.slice;
+    return node;
+  }
+  if (parseKeyword(p, "if"))
+    return parseIf(p);
+  if (parseKeyword(p, "for"))
+    return parseFor(p);
+  return parseSimple(p);
+}
+
+static Node *parseSequence(Parser *p, bool line) {
+  Node *head = NULL;
+  Node *tail = NULL;
+  char join = '&';
+  while (true) {
+    skipBlanks(p);
+    if (p->pos >= p->text.len)
+      break;
+    char c = p->text.ptr[p->pos];
+    if (c == '\n' && line)
+      break;
+    if (c == '\n') {
+      p->pos++;
+      join = '&';
+      continue;
+    }
+    if (c == ')' && p->depth > 0)
+      break;
+    Node *node = parseCommand(p);
+    if (tail) {
+      tail->next = node;
+      tail->join = join;
+    } else {
+      head = node;
+    }
+    tail = node;
+    skipBlanks(p);
+    Slice(char) text = rest(p);
+    join = '&';
+    if (startsWithIgnoreCase(text, "&&")) {
+      join = '+';
+      p->pos += 2;
+    } else if (startsWithIgnoreCase(text, "||")) {
+      join = '|';
+      p->pos += 2;
+    } else if (startsWithIgnoreCase(text, "&")) {
+      p->pos++;
+    } else if (startsWithIgnoreCase(text, "|")) {
+      size_t end = 0;
+      while (end < text.len && !strchr("\r\n", text.ptr[end]))
+        end++;
+      p->interp->failed = true;
+      fprintf(stderr, "bbrun: unsupported pipe: %.*s\n", (int)end, text.ptr);
+      p->pos++;
+    }
+  }
+  return head;
+}
+
+// ---- arithmetic
+
+typedef struct {
+  Interpreter *interp;
+  Slice(char) text;
+  size_t pos;
+  const char *error;
+} Arithmetic;
+
+static int32_t wrap(int64_t value) { return (int32_t)(uint32_t)value; }
+
+static void skipSpaces(Arithmetic *a) {
+  while (a->pos < a->text.len && isspace(a->text.ptr[a->pos]))
+    a->pos++;
+}
+
+static bool isOperatorChar(char c) {
+  return strchr("+-*/%()!~&|^<>=, \t", c) != NULL;
+}
+
+// Numbers follow C: 0x is hex and a leading 0 octal
+static int32_t parseInteger(Slice(char) text, size_t *pos) {
+  int base = 10;
+  if (*pos + 1 < text.len && text.ptr[*pos] == '0' &&
+      tolower(text.ptr[*pos + 1]) == 'x') {
+    base = 16;
+    *pos += 2;
+  } else if (*pos < text.len && text.ptr[*pos] == '0') {
+    base = 8;
+  }
+  int64_t value = 0;
+  while (*pos < text.len) {
+    char c = (char)tolower(text.ptr[*pos]);
+    int digit = isdigit(c)                 ? c - '0'
+                : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                         : 99;
+    if (digit >= base)
+      break;
+    value = wrap(value * base + digit);
+    (*pos)++;
+  }
+  return (int32_t)value;
+}
+
+static int32_t variableValue(Interpreter *interp, Slice(char) name) {
+  Slice(char) value;
+  if (!lookup(interp, name, &value))
+    return 0;
+  size_t pos = 0;
+  while (pos < value.len && isspace(value.ptr[pos]))
+    pos++;
+  bool negative = pos < value.len && value.ptr[pos] == '-';
+  if (negative || (pos < value.len && value.ptr[pos] == '+'))
+    pos++;
+  int32_t result = parseInteger(value, &pos);
+  return negative ? wrap(-(int64_t)result) : result;
+}
+
+static int32_t parseComma(Arithmetic *a);
+
+static Slice(char) parseName(Arithmetic *a) {
+  skipSpaces(a);
+  size_t start = a->pos;
+  if (a->pos < a->text.len && isdigit(a->text.ptr[a->pos]))
+    return slice(NULL, 0);
+  while (a->pos < a->text.len && !isOperatorChar(a->text.ptr[a->pos]))
+    a->pos++;
+  return slice(a->text.ptr + start, a->pos - start);
+}
+
+static int32_t parseUnary(Arithmetic *a) {
+  skipSpaces(a);
+  if (a->pos >= a->text.len) {
+    a->error = "Missing operand.";
+    return 0;
+  }
+  char c = a->text.ptr[a->pos];
+  if (c == '(') {
+    a->pos++;
+    int32_t value = parseComma(a);
+    skipSpaces(a);
+    if (a->pos >= a->text.len || a->text.ptr[a->pos] != ')')
+      a->error = "Unbalanced parentheses.";
+    else
+      a->pos++;
+    return value;
+  }
+  if (c == '-' || c == '+' || c == '!' || c == '~') {
+    a->pos++;
+    int32_t value = parseUnary(a);
+    if (c == '-')
+      return wrap(-(int64_t)value);
+    if (c == '!')
+      return value == 0;
+    if (c == '~')
+      return ~value;
+    return value;
+  }
+  if (isdigit(c))
+    return parseInteger(a->text, &a->pos);
+  Slice(char) name = parseName(a);
+  if (name.len == 0) {
+    a->error = "Missing operand.";
+    return 0;
+  }
+  return variableValue(a->interp, name);
+}
+
+typedef struct {
+  const char *op;
+  int level;
+} BinaryOperator;
+
+// lowest to highest precedence, longer spellings first
+static const BinaryOperator binary_operators[] = {
+    {"|", 0},  {"^", 1},  {"&", 2}, {"<<", 3}, {">>", 3},
+    {"+", 4},  {"-", 4},  {"*", 5}, {"/", 5},  {"%", 5},
+};
+
+static const char *peekBinary(Arithmetic *a, int level) {
+  skipSpaces(a);
+  Slice(char) text = slice(a->text.ptr + a->pos, a->text.len - a->pos);
+  for (size_t i = 0; i < sizeof(binary_operators) / sizeof(*binary_operators);
+       i++) {
+    BinaryOperator op = binary_operators[i];
+    size_t len = strlen(op.op);
+    if (op.level != level || !startsWithIgnoreCase(text, op.op))
+      continue;
+    // an assignment like += belongs to the level above
+    if (text.len > len && text.ptr[len] == '=')
+      return NULL;
+    return op.op;
+  }
+  return NULL;
+}
+
+static int32_t applyBinary(Arithmetic *a, const char *op, int32_t left,
+                           int32_t right) {
+  switch (op[0]) {
+  case '|':
+    return left | right;
+  case '^':
+    return left ^ right;
+  case '&':
+    return left & right;
+  case '<':
+    return right < 0 || right > 31 ? 0 : wrap((int64_t)left << right);
+  case '>':
+    return right < 0 || right > 31 ? (left < 0 ? -1 : 0) : left >> right;
+  case '+':
+    return wrap((int64_t)left + right);
+  case '-':
+    return wrap((int64_t)left - right);
+  case '*':
+    return wrap((int64_t)left * right);
+  default:
+    break;
+  }
+  if (right == 0) {
+    a->error = "Divide by zero error.";
+    return 0;
+  }
+  if (op[0] == '/')
+    return wrap((int64_t)left / right);
+  return wrap((int64_t)left % right);
+}
+
+static int32_t parseBinary(Arithmetic *a, int level) {
+  if (level > 5)
+    return parseUnary(a);
+  int32_t value = parseBinary(a, level + 1);
+  const char *op;
+  while (!a->error && (op = peekBinary(a, level))) {
+    a->pos += strlen(op);
+    int32_t right = parseBinary(a, level + 1);
+    value = applyBinary(a, op, value, right);
+  }
+  return value;
+}
+
+static int32_t parseAssignment(Arithmetic *a) {
+  size_t start = a->pos;
+  Slice(char) name = parseName(a);
+  skipSpaces(a);
+  Slice(char) text = slice(a->text.ptr + a->pos, a->text.len - a->pos);
+  const char *op = NULL;
+  static const char *const assignments[] = {
+      "<<=", ">>=", "*=", "/=", "%=", "+=", "-=", "&=", "^=", "|=", "="};
+  for (size_t i = 0; name.len && i < sizeof(assignments) / sizeof(*assignments);
+       i++) {
+    if (startsWithIgnoreCase(text, assignments[i]) &&
+        !(assignments[i][0] == '=' && text.len > 1 && text.ptr[1] == '=')) {
+      op = assignments[i];
+      break;
+    }
+  }
+  if (!op) {
+    a->pos = start;
+    return parseBinary(a, 0);
+  }
+  a->pos += strlen(op);
+  int32_t value = parseAssignment(a);
+  if (a->error)
+    return 0;
+  if (op[0] != '=')
+    value = applyBinary(a, op, variableValue(a->interp, name), value);
+  char buffer[16];
+  int len = snprintf(buffer, sizeof(buffer), "%d", value);
+  setVariable(a->interp, name, slice(buffer, (size_t)len));
+  return value;
+}
+
+static int32_t parseComma(Arithmetic *a) {
+  int32_t value = parseAssignment(a);
+  skipSpaces(a);
+  while (!a->error && a->pos < a->text.len && a->text.ptr[a->pos] == ',') {
+    a->pos++;
+    value = parseAssignment(a);
+    skipSpaces(a);
+  }
+  return value;
+}
+
+static Flow runArithmetic(Interpreter *interp, Slice(char) text) {
+  // cmd drops quotes anywhere in the expression
+  Vec(char) expr = builder(interp, text.len);
+  for (size_t i = 0; i < text.len; i++) {
+    if (text.ptr[i] != '"')
+      appendChar(&expr, text.ptr[i]);
+  }
+  Arithmetic a = {
+      .interp = interp, .text = expr.slice, .pos = 0, .error = NULL};
+  parseComma(&a);
+  skipSpaces(&a);
+  if (!a.error && a.pos < a.text.len)
+    a.error = "Missing operator.";
+  if (a.error) {
+    fprintf(stderr, "%s\n", a.error);
+    interp->errorlevel = 1073750993;
+    return FlowFailed;
+  }
+  return FlowNext;
+}
+
+// ---- commands
+
+static Flow runSequence(Interpreter *interp, Frame *frame, Node *node);
+
+static Flow runLines(Interpreter *interp, Frame *frame);
+
+static Flow runSet(Interpreter *interp, Slice(char) text) {
+  text = trimStart(text, " \t");
+  if (startsWithIgnoreCase(text, "/a"))
+    return runArithmetic(interp, slice(text.ptr + 2, text.len - 2));
+  // input only ever comes from nul, so set /p just writes its prompt and
+  // fails like it does at the end of the input
+  bool prompt = startsWithIgnoreCase(text, "/p");
+  if (prompt)
+    text = trimStart(slice(text.ptr + 2, text.len - 2), " \t");
+  if (text.len > 0 && text.ptr[0] == '"') {
+    char *close = NULL;
+    for (size_t i = text.len; i > 1; i--) {
+      if (text.ptr[i - 1] == '"') {
+        close = text.ptr + i - 1;
+        break;
+      }
+    }
+    text = slice(text.ptr + 1, close ? (size_t)(close - text.ptr) - 1 : 0);
+  }
+  char *equals = memchr(text.ptr, '=', text.len);
+  if (!prompt && (!equals || equals == text.ptr)) {
+    Slice(Variable) variables = interp->env.variables.slice;
+    for (size_t i = 0; i < variables.len; i++) {
+      if (variables.ptr[i].name.len >= text.len &&
+          strncasecmp(variables.ptr[i].name.ptr, text.ptr, text.len) == 0)
+        fprintf(interp->out, "%s=%s\n", variables.ptr[i].name.ptr,
+                variables.ptr[i].value.ptr);
+    }
+    return FlowNext;
+  }
+  size_t name_len = (size_t)(equals - text.ptr);
+  if (prompt) {
+    writeAll(interp->out, slice(equals + 1, text.len - name_len - 1));
+    return FlowFailed;
+  }
+  setVariable(interp, slice(text.ptr, name_len),
+              slice(equals + 1, text.len - name_len - 1));
+  return FlowNext;
+}
+
+static size_t lineEnd(Slice(char) script, size_t pos) {
+  char *newline = memchr(script.ptr + pos, '\n', script.len - pos);
+  return newline ? (size_t)(newline - script.ptr) + 1 : script.len;
+}
+
+static bool labelMatches(Slice(char) line, Slice(char) label) {
+  line = trimStart(line, " \t@");
+  if (line.len == 0 || line.ptr[0] != ':')
+    return false;
+  line = trimStart(slice(line.ptr + 1, line.len - 1), " \t");
+  if (line.len < label.len ||
+      strncasecmp(line.ptr, label.ptr, label.len) != 0)
+    return false;
+  return line.len == label.len || strchr(" \t\r\n:+&", line.ptr[label.len]);
+}
+
+// cmd scans from where it is to the end of the file and then from the start,
+// reading every line on the way
+static bool findLabel(Interpreter *interp, Slice(char) label, size_t from,
+                      size_t *found) {
+  Slice(char) script = interp->script;
+  interp->stats.label_scans++;
+  size_t pos = from < script.len ? from : script.len;
+  for (size_t pass = 0; pass < 2; pass++) {
+    size_t end = pass == 0 ? script.len : from;
+    while (pos < end) {
+      size_t next = lineEnd(script, pos);
+      interp->stats.bytes_scanned += next - pos;
+      if (labelMatches(slice(script.ptr + pos, next - pos), label)) {
+        *found = next;
+        return true;
+      }
+      pos = next;
+    }
+    pos = 0;
+  }
+  return false;
+}
+
+static void reloadScript(Interpreter *interp) {
+  struct stat now;
+  if (stat(interp->path, &now) != 0 ||
+      (now.st_size == interp->loaded.st_size &&
+       now.st_mtime == interp->loaded.st_mtime))
+    return;
+  Result(Slice_char) res = readFile(interp->heap, interp->path);
+  if (!res.ok)
+    return;
+  if (interp->script.ptr) {
+    interp->stats.reloads++;
+    resizeAllocation(interp->heap, char, &interp->script, 0);
+  }
+  interp->script = res.val;
+  interp->loaded = now;
+}
+
+static Slice(Slice_char) splitArguments(Interpreter *interp, Slice(char) label,
+                                       Slice(char) text) {
+  Result(Vec_Slice_char) res = createVec(interp->scratch, Slice_char, 8);
+  if (!res.ok)
+    panic("Out of scratch memory");
+  Vec(Slice_char) args = res.val;
+  if (!append(&args, Slice_char, &label))
+    panic("Out of scratch memory");
+  size_t pos = 0;
+  while (pos < text.len) {
+    while (pos < text.len && strchr(" \t,;=", text.ptr[pos]))
+      pos++;
+    if (pos >= text.len)
+      break;
+    size_t start = pos;
+    bool quoted = false;
+    while (pos < text.len && (quoted || !strchr(" \t,;=", text.ptr[pos]))) {
+      if (text.ptr[pos] == '"')
+        quoted = !quoted;
+      pos++;
+    }
+    Slice(char) arg = slice(text.ptr + start, pos - start);
+    if (!append(&args, Slice_char, &arg))
+      panic("Out of scratch memory");
+  }
+  shrinkToLength(&args, Slice_char);
+  return args.slice;
+}
+
+static Flow runCall(Interpreter *interp, Frame *frame, Slice(char) text) {
+  text = trimStart(text, " \t");
+  size_t len = 1;
+  while (len < text.len && !strchr(" \t,;=", text.ptr[len]))
+    len++;
+  Slice(char) label = slice(text.ptr + 1, len - 1);
+  size_t pos;
+  if (!findLabel(interp, label, frame->pos, &pos)) {
+    fprintf(stderr, "The system cannot find the batch label specified - %.*s\n",
+            (int)label.len, label.ptr);
+    interp->failed = true;
+    return FlowFailed;
+  }
+  Frame callee = {
+      .args = splitArguments(interp, slice(text.ptr, len),
+                             slice(text.ptr + len, text.len - len)),
+      .pos = pos,
+  };
+  size_t saved = interp->saved.slice.len;
+  interp->calls++;
+  if (interp->calls > interp->stats.peak_calls)
+    interp->stats.peak_calls = interp->calls;
+  runLines(interp, &callee);
+  interp->calls--;
+  // leaving a call ends the setlocals it left open
+  while (interp->saved.slice.len > saved)
+    endlocal(interp);
+  return interp->errorlevel ? FlowFailed : FlowNext;
+}
+
+static Flow runChangeDirectory(Interpreter *interp, Slice(char) text) {
+  text = trimStart(text, " \t");
+  if (text.len >= 2 && text.ptr[0] == '"' && text.ptr[text.len - 1] == '"')
+    text = slice(text.ptr + 1, text.len - 2);
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd)))
+    return FlowFailed;
+  Slice(char) saved = copy(interp->heap, cstring(cwd));
+  if (!append(&interp->directories, Slice_char, &saved))
+    panic("Failed to append directory");
+  Slice(char) path = copy(interp->scratch, text);
+  return chdir(path.ptr) == 0 ? FlowNext : FlowFailed;
+}
+
+// Opens the file of the > and >> redirections the parser took off a command
+// or block. Input redirections are dropped, as no command reads any. Like cmd,
+// a file that cannot be opened fails the command before it runs.
+static bool redirect(Interpreter *interp, Slice(char) redirections,
+                     FILE **file) {
+  size_t i = 0;
+  while (i < redirections.len) {
+    char c = redirections.ptr[i];
+    if (c != '>' && c != '<') {
+      i++;
+      continue;
+    }
+    bool input = c == '<';
+    bool append_mode = !input && i + 1 < redirections.len &&
+                       redirections.ptr[i + 1] == '>';
+    i += append_mode ? 2 : 1;
+    size_t start = i;
+    bool quoted_path = i < redirections.len && redirections.ptr[i] == '"';
+    if (quoted_path)
+      start = ++i;
+    while (i < redirections.len && (quoted_path ? redirections.ptr[i] != '"'
+                                                : redirections.ptr[i] != ' '))
+      i++;
+    Slice(char) path =
+        copy(interp->scratch, slice(redirections.ptr + start, i - start));
+    if (quoted_path && i < redirections.len)
+      i++;
+    if (input)
+      continue;
+    if (*file)
+      fclose(*file);
+    interp->stats.files_opened++;
+    *file = eqlIgnoreCase(path, cstring("nul"))
+                ? fopen("/dev/null", "w")
+                : fopen(path.ptr, append_mode ? "a" : "w");
+    if (!*file) {
+      fprintf(stderr, "The system cannot find the path specified.\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+static Flow runEcho(Interpreter *interp, Slice(char) text) {
+  Slice(char) rest_text =
+      text.len > 0 ? slice(text.ptr + 1, text.len - 1) : text;
+  Slice(char) word = trimStart(rest_text, " \t");
+  // only the separator after echo keeps it from reporting its state
+  if (text.len == 0 ||
+      (word.len == 0 && (text.ptr[0] == ' ' || text.ptr[0] == '\t'))) {
+    fprintf(interp->out, "ECHO is off.\n");
+    return FlowNext;
+  }
+  if (text.ptr[0] != '.' &&
+      (eqlIgnoreCase(word, cstring("off")) ||
+       eqlIgnoreCase(word, cstring("on"))))
+    return FlowNext;
+  writeAll(interp->out, rest_text);
+  fputc('\n', interp->out);
+  return FlowNext;
+}
+
+static Flow runType(Interpreter *interp, Slice(char) path) {
+  while (path.len > 0 && isspace(path.ptr[path.len - 1]))
+    path.len--;
+  if (path.len >= 2 && path.ptr[0] == '"' && path.ptr[path.len - 1] == '"')
+    path = slice(path.ptr + 1, path.len - 2);
+  if (eqlIgnoreCase(path, cstring("nul")))
+    return FlowNext;
+  Result(Slice_char) res =
+      readFile(interp->scratch, copy(interp->scratch, path).ptr);
+  if (!res.ok) {
+    fprintf(stderr, "The system cannot find the file specified.\n");
+    return FlowFailed;
+  }
+  writeAll(interp->out, res.val);
+  return FlowNext;
+}
+
+static Flow runSimple(Interpreter *interp, Frame *frame, Slice(char) text,
+                      Slice(char) redirections) {
+  text = trimStart(expandCommand(interp, text), " \t@");
+  if (text.len == 0 || text.ptr[0] == ':')
+    return FlowNext;
+  interp->stats.commands++;
+  FILE *file = NULL;
+  if (redirections.len > 0 &&
+      !redirect(interp, expandCommand(interp, redirections), &file))
+    return FlowFailed;
+  FILE *out = interp->out;
+  if (file)
+    interp->out = file;
+  size_t word = 0;
+  while (word < text.len && !strchr(" \t./(", text.ptr[word]))
+    word++;
+  Slice(char) name = slice(text.ptr, word);
+  Slice(char) args = slice(text.ptr + word, text.len - word);
+  Flow flow = FlowNext;
+  if (eqlIgnoreCase(name, cstring("rem"))) {
+  } else if (eqlIgnoreCase(name, cstring("echo"))) {
+    flow = runEcho(interp, args);
+  } else if (eqlIgnoreCase(name, cstring("set"))) {
+    flow = runSet(interp, args);
+  } else if (eqlIgnoreCase(name, cstring("type"))) {
+    flow = runType(interp, trimStart(args, " \t"));
+  } else if (eqlIgnoreCase(name, cstring("setlocal"))) {
+    setlocal(interp);
+    if (startsWithIgnoreCase(trimStart(args, " \t"), "enabledelayed"))
+      interp->env.delayed = true;
+    if (startsWithIgnoreCase(trimStart(args, " \t"), "disabledelayed"))
+      interp->env.delayed = false;
+  } else if (eqlIgnoreCase(name, cstring("endlocal"))) {
+    endlocal(interp);
+  } else if (eqlIgnoreCase(name, cstring("goto"))) {
+    Slice(char) label = trimStart(args, " \t:");
+    size_t len = 0;
+    while (len < label.len && !strchr(" \t", label.ptr[len]))
+      len++;
+    if (len >= MAX_LABEL)
+      len = MAX_LABEL - 1;
+    memcpy(interp->goto_label, label.ptr, len);
+    interp->goto_label[len] = 0;
+    flow = FlowGoto;
+  } else if (eqlIgnoreCase(name, cstring("call"))) {
+    Slice(char) target = trimStart(args, " \t");
+    if (target.len > 0 && target.ptr[0] == ':')
+      flow = runCall(interp, frame, target);
+    else
+      // call runs the percent phase a second time
+      flow = runSimple(interp, frame, expandPercent(interp, frame, target),
+                       slice(NULL, 0));
+  } else if (eqlIgnoreCase(name, cstring("exit"))) {
+    Slice(char) code = trimStart(args, " \t");
+    if (startsWithIgnoreCase(code, "/b")) {
+      code = trimStart(slice(code.ptr + 2, code.len - 2), " \t");
+      if (code.len > 0)
+        interp->errorlevel = atoi(copy(interp->scratch, code).ptr);
+    } else {
+      interp->terminated = true;
+    }
+    flow = FlowExit;
+  } else if (eqlIgnoreCase(name, cstring("pushd"))) {
+    flow = runChangeDirectory(interp, args);
+  } else if (eqlIgnoreCase(name, cstring("popd"))) {
+    Vec(Slice_char) *dirs = &interp->directories;
+    if (dirs->slice.len > 0) {
+      Slice(char) dir = dirs->slice.ptr[--dirs->slice.len];
+      if (chdir(dir.ptr) != 0)
+        flow = FlowFailed;
+      freeText(interp->heap, dir);
+    }
+  } else {
+    fprintf(stderr, "bbrun: unsupported command: %.*s\n", (int)text.len,
+            text.ptr);
+    interp->errorlevel = 9009;
+    interp->failed = true;
+    flow = FlowFailed;
+  }
+  if (file) {
+    fclose(file);
+    interp->out = out;
+  }
+  updatePeaks(interp);
+  return flow;
+}
+
+static bool parseNumber(Slice(char) text, int64_t *value) {
+  size_t pos = 0;
+  bool negative = text.len > 0 && text.ptr[0] == '-';
+  if (negative || (text.len > 0 && text.ptr[0] == '+'))
+    pos++;
+  if (pos >= text.len || !isdigit(text.ptr[pos]))
+    return false;
+  int64_t result = parseInteger(text, &pos);
+  *value = negative ? -result : result;
+  return pos == text.len;
+}
+
+static bool compare(Node *node, Slice(char) left, Slice(char) right) {
+  int order;
+  int64_t a;
+  int64_t b;
+  if (node->op.len == 2 && node->op.ptr[0] == '=') {
+    if (left.len != right.len)
+      return false;
+    return node->ignore_case ? strncasecmp(left.ptr, right.ptr, left.len) == 0
+                             : memcmp(left.ptr, right.ptr, left.len) == 0;
+  }
+  if (parseNumber(left, &a) && parseNumber(right, &b)) {
+    order = (a > b) - (a < b);
+  } else {
+    size_t len = left.len < right.len ? left.len : right.len;
+    order = node->ignore_case ? strncasecmp(left.ptr, right.ptr, len)
+                              : memcmp(left.ptr, right.ptr, len);
+    if (order == 0)
+      order = (left.len > right.len) - (left.len < right.len);
+  }
+  Slice(char) op = node->op;
+  if (eqlIgnoreCase(op, cstring("EQU")))
+    return order == 0;
+  if (eqlIgnoreCase(op, cstring("NEQ")))
+    return order != 0;
+  if (eqlIgnoreCase(op, cstring("LSS")))
+    return order < 0;
+  if (eqlIgnoreCase(op, cstring("LEQ")))
+    return order <= 0;
+  if (eqlIgnoreCase(op, cstring("GTR")))
+    return order > 0;
+  if (eqlIgnoreCase(op, cstring("GEQ")))
+    return order >= 0;
+  fprintf(stderr, "bbrun: unsupported comparison: %.*s\n", (int)op.len,
+          op.ptr);
+  return false;
+}
+
+static Flow runIf(Interpreter *interp, Frame *frame, Node *node) {
+  interp->stats.commands++;
+  bool result;
+  if (node->defined) {
+    Slice(char) value;
+    result = lookup(interp, expandCommand(interp, node->left), &value);
+  } else {
+    result = compare(node, expandCommand(interp, node->left),
+                     expandCommand(interp, node->right));
+  }
+  if (node->negate)
+    result = !result;
+  if (result)
+    return runSequence(interp, frame, node->body);
+  if (node->alternate)
+    return runSequence(interp, frame, node->alternate);
+  return FlowNext;
+}
+
+static Flow runForRange(Interpreter *interp, Frame *frame, Node *node) {
+  interp->stats.commands++;
+  Slice(char) range = expandCommand(interp, node->text);
+  int64_t bounds[3] = {0, 0, 0};
+  size_t pos = 0;
+  for (size_t i = 0; i < 3; i++) {
+    while (pos < range.len && strchr(" \t,", range.ptr[pos]))
+      pos++;
+    size_t start = pos;
+    while (pos < range.len && !strchr(" \t,", range.ptr[pos]))
+      pos++;
+    parseNumber(slice(range.ptr + start, pos - start), &bounds[i]);
+  }
+  unsigned char variable = (unsigned char)node->variable;
+  Slice(char) saved = interp->for_values[variable % 128];
+  Flow flow = FlowNext;
+  for (int64_t i = bounds[0];
+       bounds[1] > 0 ? i <= bounds[2] : bounds[1] < 0 && i >= bounds[2];
+       i += bounds[1]) {
+    size_t mark = interp->scratch_state->cur;
+    char buffer[24];
+    int len = snprintf(buffer, sizeof(buffer), "%lld", (long long)i);
+    interp->for_values[variable % 128] = slice(buffer, (size_t)len);
+    flow = runSequence(interp, frame, node->body);
+    interp->scratch_state->cur = mark;
+    if (flow == FlowGoto || flow == FlowExit)
+      break;
+  }
+  interp->for_values[variable % 128] = saved;
+  return flow;
+}
+
+// Only the ("string") form is emitted, with "delims=" keeping it whole
+static Flow runForText(Interpreter *interp, Frame *frame, Node *node) {
+  interp->stats.commands++;
+  Slice(char) text = node->text;
+  if (text.len < 2 || text.ptr[0] != '"' || text.ptr[text.len - 1] != '"') {
+    fprintf(stderr, "bbrun: unsupported for /f source: %.*s\n",
+            (int)text.len, text.ptr);
+    interp->failed = true;
+    return FlowFailed;
+  }
+  text = expandCommand(interp, slice(text.ptr + 1, text.len - 2));
+  if (text.len == 0)
+    return FlowNext;
+  unsigned char variable = (unsigned char)node->variable;
+  Slice(char) saved = interp->for_values[variable % 128];
+  interp->for_values[variable % 128] = text;
+  Flow flow = runSequence(interp, frame, node->body);
+  interp->for_values[variable % 128] = saved;
+  return flow;
+}
+
+// Runs the body for every word of the list, which must not have wildcards
+// as there are no files to match them against
+static Flow runForList(Interpreter *interp, Frame *frame, Node *node) {
+  interp->stats.commands++;
+  Slice(char) list = expandCommand(interp, node->text);
+  if (memchr(list.ptr, '*', list.len) || memchr(list.ptr, '?', list.len)) {
+    fprintf(stderr, "bbrun: unsupported for list: %.*s\n", (int)list.len,
+            list.ptr);
+    interp->failed = true;
+    return FlowFailed;
+  }
+  unsigned char variable = (unsigned char)node->variable;
+  Slice(char) saved = interp->for_values[variable % 128];
+  Flow flow = FlowNext;
+  size_t pos = 0;
+  while (pos < list.len) {
+    while (pos < list.len && strchr(" \t,;=", list.ptr[pos]))
+      pos++;
+    size_t start = pos;
+    while (pos < list.len && !strchr(" \t,;=", list.ptr[pos]))
+      pos++;
+    if (pos == start)
+      break;
+    size_t mark = interp->scratch_state->cur;
+    interp->for_values[variable % 128] = slice(list.ptr + start, pos - start);
+    flow = runSequence(interp, frame, node->body);
+    interp->scratch_state->cur = mark;
+    if (flow == FlowGoto || flow == FlowExit)
+      break;
+  }
+  interp->for_values[variable % 128] = saved;
+  return flow;
+}
+
+// A redirection after the block holds its file open for all of the commands
+// in it
+static Flow runBlock(Interpreter *interp, Frame *frame, Node *node) {
+  if (node->redirections.len == 0)
+    return runSequence(interp, frame, node->body);
+  FILE *file = NULL;
+  if (!redirect(interp, expandCommand(interp, node->redirections), &file))
+    return FlowFailed;
+  FILE *out = interp->out;
+  if (file)
+    interp->out = file;
+  Flow flow = runSequence(interp, frame, node->body);
+  if (file) {
+    fclose(file);
+    interp->out = out;
+  }
+  return flow;
+}
+
+static Flow runNode(Interpreter *interp, Frame *frame, Node *node) {
+  if (!node)
+    return FlowNext;
+  switch (node->type) {
+  case CommandNode:
+    return runSimple(interp, frame, node->text, node->redirections);
+  case BlockNode:
+    return runBlock(interp, frame, node);
+  case IfNode:
+    return runIf(interp, frame, node);
+  case ForRangeNode:
+    return runForRange(interp, frame, node);
+  case ForTextNode:
+    return runForText(interp, frame, node);
+  case ForListNode:
+    return runForList(interp, frame, node);
+  }
+  return FlowNext;
+}
+
+static Flow runSequence(Interpreter *interp, Frame *frame, Node *node) {
+  Flow flow = FlowNext;
+  char join = '&';
+  for (; node && !interp->terminated; node = node->next) {
+    bool skip = (join == '+' && flow == FlowFailed) ||
+                (join == '|' && flow != FlowFailed);
+    join = node->join;
+    if (skip)
+      continue;
+    flow = runNode(interp, frame, node);
+    if (flow == FlowGoto || flow == FlowExit)
+      return flow;
+  }
+  return flow;
+}
+
+// A line that ends in ( opens a block, which cmd reads and expands in one go
+// up to its closing line
+static size_t logicalLineEnd(Slice(char) script, size_t pos) {
+  size_t depth = 0;
+  do {
+    size_t next = lineEnd(script, pos);
+    Slice(char) line = trimStart(slice(script.ptr + pos, next - pos), " \t@");
+    while (line.len > 0 && isspace(line.ptr[line.len - 1]))
+      line.len--;
+    if (line.len > 0 && line.ptr[0] == ')' && depth > 0)
+      depth--;
+    if (line.len > 0 && line.ptr[line.len - 1] == '(' && line.ptr[0] != ':')
+      depth++;
+    pos = next;
+  } while (depth > 0 && pos < script.len);
+  return pos;
+}
+
+static Flow runLines(Interpreter *interp, Frame *frame) {
+  while (!interp->terminated) {
+    reloadScript(interp);
+    Slice(char) script = interp->script;
+    if (frame->pos >= script.len)
+      return FlowExit;
+    size_t start = frame->pos;
+    frame->pos = logicalLineEnd(script, start);
+    interp->stats.lines_read++;
+    interp->stats.bytes_read += frame->pos - start;
+
+    size_t mark = interp->scratch_state->cur;
+    Vec(char) line = builder(interp, frame->pos - start);
+    for (size_t i = start; i < frame->pos; i++) {
+      if (script.ptr[i] != '\r')
+        appendChar(&line, script.ptr[i]);
+    }
+    Parser parser = {
+        .interp = interp,
+        .text = expandPercent(interp, frame, line.slice),
+        .pos = 0,
+        .depth = 0,
+    };
+    Node *tree = parseSequence(&parser, false);
+    Flow flow = runSequence(interp, frame, tree);
+    interp->scratch_state->cur = mark;
+
+    if (flow == FlowExit)
+      return flow;
+    if (flow != FlowGoto)
+      continue;
+    Slice(char) label = cstring(interp->goto_label);
+    if (eqlIgnoreCase(label, cstring("eof")))
+      return FlowExit;
+    if (!findLabel(interp, label, frame->pos, &frame->pos)) {
+      fprintf(stderr,
+              "The system cannot find the batch label specified - %s\n",
+              interp->goto_label);
+      interp->failed = true;
+      interp->terminated = true;
+    }
+  }
+  return FlowExit;
+}
+
+static void printStatistics(Statistics stats) {
+  fprintf(stderr,
+          "bbrun: %zu commands, %zu lines read (%zu bytes, %zu reloads), "
+          "%zu label scans (%zu bytes), %zu files opened\n"
+          "bbrun: peak %zu variables (%zu bytes), setlocal depth %zu, "
+          "call depth %zu\n",
+          stats.commands, stats.lines_read, stats.bytes_read, stats.reloads,
+          stats.label_scans, stats.bytes_scanned, stats.files_opened,
+          stats.peak_variables, stats.peak_environment_bytes,
+          stats.peak_setlocal, stats.peak_calls);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+    panic("usage: bbrun script.cmd [arguments]");
+  Bump state = {
+      .mem =
+          {
+              .ptr = malloc(SCRATCH),
+              .len = SCRATCH,
+          },
+      .cur = 0,
+  };
+  if (!state.mem.ptr)
+    panic("Failed to allocate memory");
+  Allocator heap = {.realloc = heapRealloc, .state = NULL};
+  Result(Vec_Variable) variables_res = createVec(heap, Variable, 32);
+  Result(Vec_Environment) saved_res = createVec(heap, Environment, 8);
+  Result(Vec_Slice_char) directories_res = createVec(heap, Slice_char, 4);
+  if (!variables_res.ok || !saved_res.ok || !directories_res.ok)
+    panic("Failed to allocate interpreter");
+
+  // %~dp0 expands to a full path, which stays valid after a pushd
+  Slice(char) path = cstring(argv[1]);
+  char cwd[4096];
+  if (path.len > 0 && path.ptr[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+    Result(Slice_char) res = alloc(heap, char, strlen(cwd) + path.len + 2);
+    if (!res.ok)
+      panic(res.err);
+    snprintf(res.val.ptr, res.val.len, "%s/%s", cwd, argv[1]);
+    path = slice(res.val.ptr, res.val.len - 1);
+  }
+
+  Interpreter interp = {
+      .heap = heap,
+      .scratch = {.realloc = bumpRealloc, .state = &state},
+      .scratch_state = &state,
+      .path = path.ptr,
+      .env = {.variables = variables_res.val, .delayed = false},
+      .saved = saved_res.val,
+      .out = stdout,
+      .directories = directories_res.val,
+      .random = 1,
+  };
+
+  reloadScript(&interp);
+  if (!interp.script.ptr) {
+    fprintf(stderr, "Error: Could not read %s\n", argv[1]);
+    return 1;
+  }
+  Result(Vec_Slice_char) args_res = createVec(heap, Slice_char, (size_t)argc);
+  if (!args_res.ok)
+    panic(args_res.err);
+  Vec(Slice_char) args = args_res.val;
+  for (int i = 1; i < argc; i++) {
+    Slice(char) arg = i == 1 ? path : cstring(argv[i]);
+    if (!append(&args, Slice_char, &arg))
+      panic("Failed to append argument");
+  }
+  Frame frame = {.args = args.slice, .pos = 0};
+  runLines(&interp, &frame);
+  fflush(stdout);
+  printStatistics(interp.stats);
+  return interp.failed ? 1 : interp.errorlevel;
+}
@@ -0,0 +1,424 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "std/Allocator.c"
+#include "std/Vec.c"
+#include "std/eql.c"
+#include "std/panic.c"
+#include "std/readFile.c"
+
+// Reads the trace a program compiled with bc --profile leaves next to
+// itself and reports where the time went, per function and per .bb line.
+// cmd only offers %time% with centisecond resolution, so short runs are
+// better profiled inside a loop.
+
+#define DAY (24 * 60 * 60 * 100)
+#define HOT_LINES 10
+// traces of long runs get big, so unlike bc this does not fit on the stack
+#define MEMORY (64 * 1024 * 1024)
+
+typedef struct {
+  Slice(char) name;
+  size_t calls;
+  size_t total;
+  size_t self;
+  // frames of this function currently on the stack, so recursion only
+  // counts the outermost call towards the total
+  size_t active;
+} FunctionStats;
+
+typedef struct {
+  size_t line;
+  size_t time;
+  size_t hits;
+} LineStats;
+
+typedef struct {
+  size_t function;
+  size_t start;
+  size_t children;
+} Frame;
+
+typedef struct {
+  size_t cmd_line;
+  size_t bb_line;
+} MapEntry;
+
+DefVec(char);
+DefResult(Vec_char);
+DefSlice(FunctionStats);
+DefVec(FunctionStats);
+DefResult(Vec_FunctionStats);
+DefSlice(LineStats);
+DefVec(LineStats);
+DefResult(Vec_LineStats);
+DefSlice(Frame);
+DefVec(Frame);
+DefResult(Vec_Frame);
+DefSlice(size_t);
+DefVec(size_t);
+DefResult(Vec_size_t);
+DefSlice(MapEntry);
+DefVec(MapEntry);
+DefResult(Vec_MapEntry);
+
+typedef struct {
+  Vec(FunctionStats) functions;
+  Vec(LineStats) lines;
+  Vec(Frame) frames;
+  Vec(size_t) sites;
+  size_t total;
+  // a self tail call jumps back to the entry, whose C continues the call
+  bool tail_call;
+} Profile;
+
+static size_t readNumber(Slice(char) text, size_t *pos) {
+  size_t value = 0;
+  while (*pos < text.len && isdigit((unsigned char)text.ptr[*pos]))
+    value = value * 10 + (size_t)(text.ptr[(*pos)++] - '0');
+  return value;
+}
+
+// %time% looks like " 9:05:03.27", with a comma instead of the dot in some
+// locales
+static size_t parseTime(Slice(char) text) {
+  size_t fields[4] = {0, 0, 0, 0};
+  size_t pos = 0;
+  for (size_t i = 0; i < 4 && pos < text.len; i++) {
+    while (pos < text.len && !isdigit((unsigned char)text.ptr[pos]))
+      pos++;
+    fields[i] = readNumber(text, &pos);
+  }
+  return ((fields[0] * 60 + fields[1]) * 60 + fields[2]) * 100 + fields[3];
+}
+
+static LineStats *lineStats(Profile *profile, size_t line) {
+  for (size_t i = 0; i < profile->lines.slice.len; i++) {
+    if (profile->lines.slice.ptr[i].line == line)
+      return &profile->lines.slice.ptr[i];
+  }
+  LineStats stats = {.line = line, .time = 0, .hits = 0};
+  if (!append(&profile->lines, LineStats, &stats))
+    panic("Failed to append line");
+  return &profile->lines.slice.ptr[profile->lines.slice.len - 1];
+}
+
+// generated statements have no location of their own
+static void countHit(Profile *profile, size_t line) {
+  if (line > 0)
+    lineStats(profile, line)->hits++;
+}
+
+static size_t functionIndex(Profile *profile, Slice(char) name) {
+  for (size_t i = 0; i < profile->functions.slice.len; i++) {
+    if (eql(profile->functions.slice.ptr[i].name, name))
+      return i;
+  }
+  FunctionStats stats = {
+      .name = name, .calls = 0, .total = 0, .self = 0, .active = 0};
+  if (!append(&profile->functions, FunctionStats, &stats))
+    panic("Failed to append function");
+  return profile->functions.slice.len - 1;
+}
+
+static void enterSite(Profile *profile, size_t line) {
+  if (!append(&profile->sites, size_t, &line))
+    panic("Failed to append site");
+}
+
+static void setSite(Profile *profile, size_t line) {
+  if (profile->sites.slice.len == 0)
+    enterSite(profile, line);
+  else
+    profile->sites.slice.ptr[profile->sites.slice.len - 1] = line;
+}
+
+static void enterFunction(Profile *profile, Slice(char) name, size_t now) {
+  Frame frame = {
+      .function = functionIndex(profile, name), .start = now, .children = 0};
+  FunctionStats *stats = &profile->functions.slice.ptr[frame.function];
+  stats->calls++;
+  stats->active++;
+  if (!append(&profile->frames, Frame, &frame))
+    panic("Failed to append frame");
+}
+
+static void leaveFunction(Profile *profile, size_t now) {
+  if (profile->frames.slice.len == 0)
+    return;
+  Frame frame = profile->frames.slice.ptr[--profile->frames.slice.len];
+  FunctionStats *stats = &profile->functions.slice.ptr[frame.function];
+  size_t total = now - frame.start;
+  stats->self += total > frame.children ? total - frame.children : 0;
+  if (stats->active == 1)
+    stats->total += total;
+  stats->active--;
+  if (profile->frames.slice.len > 0)
+    profile->frames.slice.ptr[profile->frames.slice.len - 1].children += total;
+}
+
+// #<event> <line>:<col> [function] <time>
+static void readTrace(Profile *profile, Slice(char) trace) {
+  bool started = false;
+  size_t previous = 0;
+  size_t offset = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= trace.len; i++) {
+    if (i < trace.len && trace.ptr[i] != '\n')
+      continue;
+    Slice(char) text = {.ptr = trace.ptr + start, .len = i - start};
+    start = i + 1;
+    while (text.len > 0 && isspace((unsigned char)text.ptr[text.len - 1]))
+      text.len--;
+    if (text.len < 4 || text.ptr[0] != '#')
+      continue;
+    char event = text.ptr[1];
+    size_t pos = 3;
+    size_t line = readNumber(text, &pos);
+    if (pos < text.len && text.ptr[pos] == ':')
+      pos++;
+    readNumber(text, &pos);
+    size_t time_start = text.len;
+    while (time_start > pos && text.ptr[time_start - 1] != ' ')
+      time_start--;
+    Slice(char) name = {.ptr = text.ptr + pos, .len = time_start - pos};
+    while (name.len > 0 && name.ptr[0] == ' ') {
+      name.ptr++;
+      name.len--;
+    }
+    while (name.len > 0 && name.ptr[name.len - 1] == ' ')
+      name.len--;
+    Slice(char) stamp = {.ptr = text.ptr + time_start,
+                         .len = text.len - time_start};
+
+    size_t now = parseTime(stamp) + offset;
+    if (started && now < previous) {
+      // past midnight
+      offset += DAY;
+      now += DAY;
+    }
+    if (started && profile->sites.slice.len > 0) {
+      size_t site = profile->sites.slice.ptr[profile->sites.slice.len - 1];
+      if (site > 0)
+        lineStats(profile, site)->time += now - previous;
+    }
+    if (!started)
+      profile->total = 0;
+    else
+      profile->total += now - previous;
+    started = true;
+    previous = now;
+
+    switch (event) {
+    case 'S':
+    case 'L': {
+      setSite(profile, line);
+      countHit(profile, line);
+    } break;
+    case 'E': {
+      setSite(profile, line);
+    } break;
+    case 'C': {
+      if (profile->tail_call) {
+        profile->tail_call = false;
+        break;
+      }
+      enterSite(profile, line);
+      countHit(profile, line);
+      enterFunction(profile, name, now);
+    } break;
+    case 'T': {
+      profile->tail_call = true;
+    } break;
+    case 'R': {
+      if (profile->sites.slice.len > 1)
+        profile->sites.slice.len--;
+      leaveFunction(profile, now);
+    } break;
+    case 'P':
+    case 'Q': {
+      profile->sites.slice.len = 0;
+      while (profile->frames.slice.len > 0)
+        leaveFunction(profile, now);
+    } break;
+    default:
+      fprintf(stderr, "Unknown trace event: %c\n", event);
+    }
+  }
+}
+
+static Slice(MapEntry) readMap(Allocator ally, Slice(char) map) {
+  Result(Vec_MapEntry) entries_res = createVec(ally, MapEntry, 64);
+  if (!entries_res.ok)
+    panic(entries_res.err);
+  Vec(MapEntry) entries = entries_res.val;
+  size_t pos = 0;
+  while (pos < map.len) {
+    MapEntry entry;
+    entry.cmd_line = readNumber(map, &pos);
+    if (pos < map.len && map.ptr[pos] == ' ')
+      pos++;
+    entry.bb_line = readNumber(map, &pos);
+    while (pos < map.len && map.ptr[pos] != '\n')
+      pos++;
+    pos++;
+    if (entry.cmd_line > 0 && !append(&entries, MapEntry, &entry))
+      panic("Failed to append map entry");
+  }
+  shrinkToLength(&entries, MapEntry);
+  return entries.slice;
+}
+
+// qsort is not stable, so ties go to the function seen first in the trace
+// and to the lower line
+static int bySelfTime(const void *a, const void *b) {
+  const FunctionStats *x = a;
+  const FunctionStats *y = b;
+  if (x->self != y->self)
+    return (x->self < y->self) - (x->self > y->self);
+  return (x->name.ptr > y->name.ptr) - (x->name.ptr < y->name.ptr);
+}
+
+static int byLineTime(const void *a, const void *b) {
+  const LineStats *x = a;
+  const LineStats *y = b;
+  if (x->time != y->time)
+    return (x->time < y->time) - (x->time > y->time);
+  return (x->line > y->line) - (x->line < y->line);
+}
+
+static void printTime(size_t centiseconds) {
+  printf("%6zu.%02zus", centiseconds / 100, centiseconds % 100);
+}
+
+static void printShare(size_t part, size_t total) {
+  printf(" %5.1f%%", total ? (double)part * 100 / (double)total : 0.0);
+}
+
+static void printCmdLines(Slice(MapEntry) map, size_t bb_line) {
+  size_t first = 0;
+  size_t last = 0;
+  bool any = false;
+  for (size_t i = 0; i <= map.len; i++) {
+    bool matches = i < map.len && map.ptr[i].bb_line == bb_line;
+    if (matches && first && map.ptr[i].cmd_line == last + 1) {
+      last = map.ptr[i].cmd_line;
+      continue;
+    }
+    if (first) {
+      printf(any ? "," : "  cmd ");
+      if (first == last)
+        printf("%zu", first);
+      else
+        printf("%zu-%zu", first, last);
+      any = true;
+      first = 0;
+    }
+    if (matches)
+      first = last = map.ptr[i].cmd_line;
+  }
+}
+
+static void printReport(Profile *profile, Slice(MapEntry) map) {
+  Slice(FunctionStats) functions = profile->functions.slice;
+  Slice(LineStats) lines = profile->lines.slice;
+  qsort(functions.ptr, functions.len, sizeof(FunctionStats), bySelfTime);
+  qsort(lines.ptr, lines.len, sizeof(LineStats), byLineTime);
+
+  printf("Total: ");
+  printTime(profile->total);
+  printf("\n\nFunctions by self time:\n");
+  printf("%8s %10s %10s %7s  name\n", "calls", "total", "self", "self%");
+  for (size_t i = 0; i < functions.len; i++) {
+    FunctionStats stats = functions.ptr[i];
+    printf("%8zu ", stats.calls);
+    printTime(stats.total);
+    printf(" ");
+    printTime(stats.self);
+    printShare(stats.self, profile->total);
+    printf("  %1.*s\n", (int)stats.name.len, stats.name.ptr);
+  }
+
+  printf("\nHot lines:\n");
+  printf("%8s %10s %7s %8s\n", "line", "time", "time%", "hits");
+  for (size_t i = 0; i < lines.len && i < HOT_LINES; i++) {
+    LineStats stats = lines.ptr[i];
+    printf("%8zu ", stats.line);
+    printTime(stats.time);
+    printShare(stats.time, profile->total);
+    printf(" %8zu", stats.hits);
+    printCmdLines(map, stats.line);
+    printf("\n");
+  }
+}
+
+static char *pathWith(Allocator ally, char *path, size_t len,
+                      char *extension) {
+  Result(Vec_char) res = createVec(ally, char, len + strlen(extension) + 1);
+  if (!res.ok)
+    panic(res.err);
+  Vec(char) result = res.val;
+  if (!appendMany(&result, char, path, len) ||
+      !appendManyCString(&result, extension) || !append(&result, char, ""))
+    panic("Failed to build path");
+  return result.slice.ptr;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2)
+    panic("usage: bcprof outputfile.cmd");
+  Bump state = {
+      .mem =
+          {
+              .ptr = malloc(MEMORY),
+              .len = MEMORY,
+          },
+      .cur = 0,
+  };
+  if (!state.mem.ptr)
+    panic("Failed to allocate memory");
+  Allocator ally = {.realloc = bumpRealloc, .state = &state};
+
+  // the program writes its trace to %~dpn0.trace
+  char *output = argv[1];
+  size_t stem = strlen(output);
+  char *dot = strrchr(output, '.');
+  if (dot && !strpbrk(dot, "/\\"))
+    stem = (size_t)(dot - output);
+  char *trace_path = pathWith(ally, output, stem, ".trace");
+  char *map_path = pathWith(ally, output, strlen(output), ".map");
+
+  Result(Slice_char) trace_res = readFile(ally, trace_path);
+  if (!trace_res.ok) {
+    fprintf(stderr, "Error: Could not read trace: %s\n", trace_path);
+    return 1;
+  }
+  Slice(MapEntry) map = {.ptr = NULL, .len = 0};
+  Result(Slice_char) map_res = readFile(ally, map_path);
+  if (map_res.ok)
+    map = readMap(ally, map_res.val);
+  else
+    fprintf(stderr, "Warning: No source map at %s\n", map_path);
+
+  Result(Vec_FunctionStats) functions_res =
+      createVec(ally, FunctionStats, 16);
+  Result(Vec_LineStats) lines_res = createVec(ally, LineStats, 64);
+  Result(Vec_Frame) frames_res = createVec(ally, Frame, 16);
+  Result(Vec_size_t) sites_res = createVec(ally, size_t, 16);
+  if (!functions_res.ok || !lines_res.ok || !frames_res.ok || !sites_res.ok)
+    panic("Failed to allocate profile");
+  Profile profile = {
+      .functions = functions_res.val,
+      .lines = lines_res.val,
+      .frames = frames_res.val,
+      .sites = sites_res.val,
+      .total = 0,
+      .tail_call = false,
+  };
+  readTrace(&profile, trace_res.val);
+  printReport(&profile, map);
+  return 0;
+}
@@ -4,8 +4,19 @@
 #include <string.h>
 
 #include "parser/codegen.c"
+#include "parser/cost.c"
+#include "parser/evaluator.c"
+#include "parser/inliner.c"
+#include "parser/ir.c"
+#include "parser/loops.c"
+#include "parser/minify.c"
 #include "parser/parser.c"
+#include "parser/passes.c"
+#include "parser/peephole.c"
+#include "parser/profile.c"
+#include "parser/scopes.c"
 #include "parser/sema.c"
+#include "parser/tailcalls.c"
 #include "parser/tokenizer.c"
 #include "std/Allocator.c"
 
@@ -50,8 +61,47 @@ int main(int argc, char **argv, char **envp) {
   char *cyan = noColor ? "" : "\x1b[96m";
   char *reset = noColor ? "" : "\x1b[0m";
 
-  if (argc < 3) {
-    panic("usage: bc [inputfile.bb] [outputfile.cmd]");
+  char *input = NULL;
+  char *output = NULL;
+  size_t inline_threshold = DEFAULT_INLINE_THRESHOLD;
+  bool minify = false;
+  char *name_map = NULL;
+  bool profile = false;
+  char *cost_report = NULL;
+  bool emit_ir = false;
+  bool macros = false;
+  for (int i = 1; i < argc; i++) {
+    if (startsWith(argv[i], "--inline-threshold=")) {
+      inline_threshold = strtoul(argv[i] + strlen("--inline-threshold="),
+                                 NULL, 10);
+    } else if (strcmp(argv[i], "--minify") == 0) {
+      minify = true;
+    } else if (startsWith(argv[i], "--name-map=")) {
+      name_map = argv[i] + strlen("--name-map=");
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (startsWith(argv[i], "--cost-report=")) {
+      cost_report = argv[i] + strlen("--cost-report=");
+    } else if (strcmp(argv[i], "--macros") == 0) {
+      macros = true;
+    } else if (strcmp(argv[i], "--emit=ir") == 0) {
+      emit_ir = true;
+    } else if (strcmp(argv[i], "--emit=batch") == 0) {
+      emit_ir = false;
+    } else if (startsWith(argv[i], "--")) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    } else if (!input) {
+      input = argv[i];
+    } else if (!output) {
+      output = argv[i];
+    }
+  }
+
+  if (!input || !output) {
+    panic("usage: bc [--inline-threshold=N] [--minify [--name-map=FILE]] "
+          "[--profile] [--cost-report=FILE] [--macros] [--emit=batch|ir] "
+          "[inputfile.bb] [outputfile.cmd]");
   }
 
   char mem[1048576];
@@ -70,9 +120,9 @@ int main(int argc, char **argv, char **envp) {
       .state = &state,
   };
 
-  Result(Slice_char) res = readFile(ally, argv[1]);
+  Result(Slice_char) res = readFile(ally, input);
   if (!res.ok) {
-    fprintf(stderr, "Error: %s: %s\n", res.err, argv[1]);
+    fprintf(stderr, "Error: %s: %s\n", res.err, input);
     return 1;
   }
   Slice(char) data = res.val;
@@ -120,8 +170,23 @@ int main(int argc, char **argv, char **envp) {
   fprintf(stdout, "---  ANALYZE ---%s\n", red);
   fflush(stdout);
   analyze(ally, prog);
+  inferTypes(ally, prog);
   fprintf(stdout, "%s--- /ANALYZE ---\n", gray);
 
+  fprintf(stdout, "---  OPTIMIZE ---%s\n", green);
+  fflush(stdout);
+  evaluatePureCalls(ally, &prog);
+  // an inlined body keeps reading the names visible where it was defined
+  resolveScopes(ally, prog);
+  inlineFunctions(ally, &prog, inline_threshold);
+  findCountedLoops(ally, prog);
+  findTailCalls(prog);
+  if (profile)
+    instrumentProgram(ally, &prog);
+  IrProgram ir = buildIr(ally, prog);
+  runIrPasses(ally, &ir);
+  fprintf(stdout, "%s--- /OPTIMIZE ---\n", gray);
+
   fprintf(stdout, "---  CODEGEN ---%s\n", pink);
   fflush(stdout);
 
@@ -129,12 +194,29 @@ int main(int argc, char **argv, char **envp) {
   if (!outputVecRes.ok)
     panic(outputVecRes.err);
   Vec(char) outputVec = outputVecRes.val;
-  outputBatch(prog, ally, &outputVec);
-  FILE *outputFile = fopen(argv[2], "w");
-  writeAll(outputFile, outputVec.slice);
-  fclose(outputFile);
-  fprintf(stdout, "%sOutput Batch stored in %s:%s\n\n", cyan, argv[2], reset);
-  Result(Slice_char) outputRes = readFile(ally, argv[2]);
+  if (emit_ir) {
+    FILE *irFile = fopen(output, "w");
+    printIr(irFile, ir);
+    fclose(irFile);
+  } else {
+    outputBatch(ir, ally, &outputVec, macros);
+    peephole(ally, &outputVec);
+    if (minify)
+      minifyBatch(ally, prog, &ir, &outputVec, name_map);
+    FILE *outputFile = fopen(output, "w");
+    writeAll(outputFile, outputVec.slice);
+    fclose(outputFile);
+    if (profile) {
+      char map_path[4096];
+      snprintf(map_path, sizeof(map_path), "%s.map", output);
+      writeSourceMap(outputVec.slice, map_path);
+    }
+    if (cost_report)
+      writeCostReport(ally, &ir, outputVec.slice, cost_report);
+  }
+  fprintf(stdout, "%sOutput %s stored in %s:%s\n\n", cyan,
+          emit_ir ? "IR" : "Batch", output, reset);
+  Result(Slice_char) outputRes = readFile(ally, output);
   if (!outputRes.ok) {
     panic(outputRes.err);
   }
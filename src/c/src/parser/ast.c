@@ -0,0 +1,396 @@
+#ifndef AST_H
+#define AST_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "../std/eql.c"
+#include "parser.c"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Helpers for passes that rewrite the syntax tree between analyze and
+// outputBatch
+
+typedef struct {
+  Slice(char) from;
+  Expression to;
+} Rename;
+
+DefSlice(Rename);
+DefVec(Rename);
+DefResult(Vec_Rename);
+
+static Slice(char) allocName(Allocator ally, const char *name, size_t len) {
+  Result(Slice_char) res = alloc(ally, char, len);
+  if (!res.ok)
+    panic(res.err);
+  for (size_t i = 0; i < len; i++) {
+    res.val.ptr[i] = name[i];
+  }
+  return res.val;
+}
+
+static Slice(char) makeName(Allocator ally, const char *prefix, size_t id,
+                            Slice(char) suffix) {
+  char name[128];
+  int name_len = snprintf(name, sizeof(name), "_%s%zu_%.*s%s", prefix, id,
+                          (int)suffix.len, suffix.ptr, suffix.len ? "_" : "");
+  return allocName(ally, name, (size_t)name_len);
+}
+
+static Expression *findRename(Slice(Rename) renames, Slice(char) name) {
+  // later entries shadow earlier ones
+  for (size_t i = renames.len; i > 0; i--) {
+    if (eql(renames.ptr[i - 1].from, name))
+      return &renames.ptr[i - 1].to;
+  }
+  return NULL;
+}
+
+static Slice(char) renameTarget(Slice(Rename) renames, Slice(char) name) {
+  Expression *to = findRename(renames, name);
+  if (!to)
+    return name;
+  if (to->type != IdentifierExpression)
+    panic("renameTarget: Assignment target renamed to a non-identifier");
+  return to->identifier;
+}
+
+static Statement cloneStatement(Allocator ally, Statement stmt,
+                                Slice(Rename) renames);
+
+static Expression cloneExpression(Allocator ally, Expression expr,
+                                  Slice(Rename) renames) {
+  switch (expr.type) {
+  case IdentifierExpression: {
+    Expression *to = findRename(renames, expr.identifier);
+    if (!to)
+      return expr;
+    Expression renamed = *to;
+    // a renamed variable still holds what sema inferred for the name
+    if (renamed.type == IdentifierExpression)
+      renamed.value_type = expr.value_type;
+    return renamed;
+  }
+  case NumericExpression:
+  case StringExpression: {
+    return expr;
+  }
+  case CallExpression: {
+    Result(Slice_Expression) res =
+        alloc(ally, Expression, expr.call.parameters_len + 1);
+    if (!res.ok)
+      panic(res.err);
+    res.val.ptr[0] = cloneExpression(ally, *expr.call.callee, renames);
+    for (size_t i = 0; i < expr.call.parameters_len; i++) {
+      res.val.ptr[i + 1] =
+          cloneExpression(ally, expr.call.parameters[i], renames);
+    }
+    expr.call.callee = &res.val.ptr[0];
+    expr.call.parameters = res.val.ptr + 1;
+    return expr;
+  }
+  case ArithmeticExpression: {
+    Result(Slice_Expression) res = alloc(ally, Expression, 2);
+    if (!res.ok)
+      panic(res.err);
+    res.val.ptr[0] = cloneExpression(ally, *expr.arithmetic.left, renames);
+    res.val.ptr[1] = cloneExpression(ally, *expr.arithmetic.right, renames);
+    expr.arithmetic.left = &res.val.ptr[0];
+    expr.arithmetic.right = &res.val.ptr[1];
+    return expr;
+  }
+  case FunctionExpression: {
+    // nested functions are separate labels with their own scope
+    Result(Slice_Statement) body_res = alloc(ally, Statement, 1);
+    if (!body_res.ok)
+      panic(body_res.err);
+    *body_res.val.ptr = cloneStatement(ally, *expr.function_expression.body,
+                                       (Slice(Rename)){.ptr = NULL, .len = 0});
+    expr.function_expression.body = body_res.val.ptr;
+    return expr;
+  }
+  case ArrayExpression: {
+    Result(Slice_Expression) res =
+        alloc(ally, Expression, expr.array.elements_len);
+    if (!res.ok)
+      panic(res.err);
+    for (size_t i = 0; i < expr.array.elements_len; i++) {
+      res.val.ptr[i] = cloneExpression(ally, expr.array.elements[i], renames);
+    }
+    expr.array.elements = res.val.ptr;
+    return expr;
+  }
+  case IndexExpression: {
+    Result(Slice_Expression) res = alloc(ally, Expression, 1);
+    if (!res.ok)
+      panic(res.err);
+    *res.val.ptr = cloneExpression(ally, *expr.element.index, renames);
+    expr.element.index = res.val.ptr;
+    // elements follow their array when it is renamed to another variable
+    Expression *to = findRename(renames, expr.element.array);
+    if (to && to->type == IdentifierExpression)
+      expr.element.array = to->identifier;
+    return expr;
+  }
+  }
+}
+
+static Statement *cloneStatementPtr(Allocator ally, Statement *stmt,
+                                    Slice(Rename) renames) {
+  if (!stmt)
+    return NULL;
+  Result(Slice_Statement) res = alloc(ally, Statement, 1);
+  if (!res.ok)
+    panic(res.err);
+  *res.val.ptr = cloneStatement(ally, *stmt, renames);
+  return res.val.ptr;
+}
+
+static Statement cloneStatement(Allocator ally, Statement stmt,
+                                Slice(Rename) renames) {
+  switch (stmt.type) {
+  case ExpressionStatement: {
+    stmt.expression = cloneExpression(ally, stmt.expression, renames);
+  } break;
+  case DeclarationStatement: {
+    stmt.declaration.name = renameTarget(renames, stmt.declaration.name);
+    stmt.declaration.value =
+        cloneExpression(ally, stmt.declaration.value, renames);
+  } break;
+  case AssignmentStatement: {
+    stmt.assignment.name = renameTarget(renames, stmt.assignment.name);
+    stmt.assignment.value =
+        cloneExpression(ally, stmt.assignment.value, renames);
+    if (stmt.assignment.index) {
+      Result(Slice_Expression) res = alloc(ally, Expression, 1);
+      if (!res.ok)
+        panic(res.err);
+      *res.val.ptr = cloneExpression(ally, *stmt.assignment.index, renames);
+      stmt.assignment.index = res.val.ptr;
+    }
+  } break;
+  case InlineBatchStatement: {
+  } break;
+  case BlockStatement: {
+    Result(Slice_Block) block_res = alloc(ally, Block, 1);
+    if (!block_res.ok)
+      panic(block_res.err);
+    Result(Slice_Statement) statements_res =
+        alloc(ally, Statement, stmt.block->statements.len);
+    if (!statements_res.ok)
+      panic(statements_res.err);
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      statements_res.val.ptr[i] =
+          cloneStatement(ally, stmt.block->statements.ptr[i], renames);
+    }
+    block_res.val.ptr->statements = statements_res.val;
+    block_res.val.ptr->scoped = stmt.block->scoped;
+    stmt.block = block_res.val.ptr;
+  } break;
+  case IfStatement: {
+    Result(Slice_If) if_res = alloc(ally, If, 1);
+    if (!if_res.ok)
+      panic(if_res.err);
+    *if_res.val.ptr = (If){
+        .condition =
+            cloneExpression(ally, stmt.if_statement->condition, renames),
+        .consequence =
+            cloneStatementPtr(ally, stmt.if_statement->consequence, renames),
+        .alternate =
+            cloneStatementPtr(ally, stmt.if_statement->alternate, renames),
+    };
+    stmt.if_statement = if_res.val.ptr;
+  } break;
+  case WhileStatement: {
+    Result(Slice_While) while_res = alloc(ally, While, 1);
+    if (!while_res.ok)
+      panic(while_res.err);
+    *while_res.val.ptr = (While){
+        .condition =
+            cloneExpression(ally, stmt.while_statement->condition, renames),
+        .body = cloneStatementPtr(ally, stmt.while_statement->body, renames),
+        .counted = NULL,
+    };
+    stmt.while_statement = while_res.val.ptr;
+  } break;
+  case SwitchStatement: {
+    Switch *from = stmt.switch_statement;
+    Result(Slice_Switch) switch_res = alloc(ally, Switch, 1);
+    if (!switch_res.ok)
+      panic(switch_res.err);
+    Result(Slice_Case) cases_res = alloc(ally, Case, from->cases.len);
+    if (!cases_res.ok)
+      panic(cases_res.err);
+    for (size_t i = 0; i < from->cases.len; i++) {
+      cases_res.val.ptr[i] = (Case){
+          .value = from->cases.ptr[i].value,
+          .body = cloneStatementPtr(ally, from->cases.ptr[i].body, renames),
+      };
+    }
+    *switch_res.val.ptr = (Switch){
+        .subject = cloneExpression(ally, from->subject, renames),
+        .cases = cases_res.val,
+        .otherwise = cloneStatementPtr(ally, from->otherwise, renames),
+    };
+    stmt.switch_statement = switch_res.val.ptr;
+  } break;
+  case ReturnStatement: {
+    if (stmt.return_statement) {
+      Result(Slice_Expression) ret_res = alloc(ally, Expression, 1);
+      if (!ret_res.ok)
+        panic(ret_res.err);
+      *ret_res.val.ptr =
+          cloneExpression(ally, *stmt.return_statement, renames);
+      stmt.return_statement = ret_res.val.ptr;
+    }
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+  return stmt;
+}
+
+static size_t expressionSize(Expression expr) {
+  switch (expr.type) {
+  case CallExpression: {
+    size_t size = 1;
+    for (size_t i = 0; i < expr.call.parameters_len; i++) {
+      size += expressionSize(expr.call.parameters[i]);
+    }
+    return size;
+  }
+  case ArithmeticExpression: {
+    return 1 + expressionSize(*expr.arithmetic.left) +
+           expressionSize(*expr.arithmetic.right);
+  }
+  case ArrayExpression: {
+    size_t size = 1;
+    for (size_t i = 0; i < expr.array.elements_len; i++) {
+      size += expressionSize(expr.array.elements[i]);
+    }
+    return size;
+  }
+  case IndexExpression: {
+    return 1 + expressionSize(*expr.element.index);
+  }
+  case IdentifierExpression:
+  case NumericExpression:
+  case StringExpression:
+  case FunctionExpression: {
+    return 1;
+  }
+  }
+}
+
+// Number of syntax nodes, used as the size estimate of function bodies
+static size_t statementSize(Statement stmt) {
+  switch (stmt.type) {
+  case ExpressionStatement: {
+    return 1 + expressionSize(stmt.expression);
+  }
+  case DeclarationStatement: {
+    return 1 + expressionSize(stmt.declaration.value);
+  }
+  case AssignmentStatement: {
+    return 1 + expressionSize(stmt.assignment.value) +
+           (stmt.assignment.index ? expressionSize(*stmt.assignment.index)
+                                  : 0);
+  }
+  case InlineBatchStatement: {
+    return 1;
+  }
+  case BlockStatement: {
+    size_t size = 0;
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      size += statementSize(stmt.block->statements.ptr[i]);
+    }
+    return size;
+  }
+  case IfStatement: {
+    return 1 + expressionSize(stmt.if_statement->condition) +
+           statementSize(*stmt.if_statement->consequence) +
+           (stmt.if_statement->alternate
+                ? statementSize(*stmt.if_statement->alternate)
+                : 0);
+  }
+  case WhileStatement: {
+    return 1 + expressionSize(stmt.while_statement->condition) +
+           statementSize(*stmt.while_statement->body);
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    size_t size = 1 + expressionSize(switch_statement->subject);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      size += 1 + statementSize(*switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      size += statementSize(*switch_statement->otherwise);
+    return size;
+  }
+  case ReturnStatement: {
+    return 1 + (stmt.return_statement
+                    ? expressionSize(*stmt.return_statement)
+                    : 0);
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static bool containsInlineBatch(Statement stmt) {
+  switch (stmt.type) {
+  case InlineBatchStatement: {
+    return true;
+  }
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      if (containsInlineBatch(stmt.block->statements.ptr[i]))
+        return true;
+    }
+    return false;
+  }
+  case IfStatement: {
+    return containsInlineBatch(*stmt.if_statement->consequence) ||
+           (stmt.if_statement->alternate &&
+            containsInlineBatch(*stmt.if_statement->alternate));
+  }
+  case WhileStatement: {
+    return containsInlineBatch(*stmt.while_statement->body);
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      if (containsInlineBatch(*switch_statement->cases.ptr[i].body))
+        return true;
+    }
+    return switch_statement->otherwise &&
+           containsInlineBatch(*switch_statement->otherwise);
+  }
+  case ExpressionStatement:
+  case DeclarationStatement:
+  case AssignmentStatement:
+  case ReturnStatement: {
+    return false;
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+// The names a pass declares in the block are its own, so the block only
+// needs a setlocal of its own around inline batch code
+static Statement blockOf(Allocator ally, Slice(Statement) statements) {
+  Result(Slice_Block) block_res = alloc(ally, Block, 1);
+  if (!block_res.ok)
+    panic(block_res.err);
+  block_res.val.ptr->statements = statements;
+  Statement block = {.type = BlockStatement, .block = block_res.val.ptr};
+  block_res.val.ptr->scoped = containsInlineBatch(block);
+  return block;
+}
+
+#endif /* AST_H */
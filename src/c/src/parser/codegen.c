@@ -1,593 +1,1839 @@
 #include "../std/Vec.c"
 #include "../std/eql.c"
-#include "parser.c"
-#include "sema.c"
+#include "ir.c"
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 DefVec(char);
 DefResult(Vec_char);
 
-static void emitExpression(Expression expr, StatementType parent,
-                           Allocator ally, Vec(Statement) * temporaries,
-                           Vec(char) * out, size_t *call_labels) {
-  switch (expr.type) {
-  case IdentifierExpression: {
-    if (parent == IfStatement || parent == WhileStatement) {
-      appendManyCString(out, "\"%");
-      appendSlice(out, char, expr.identifier);
-      appendManyCString(out, "%\"==\"true\"");
-    } else {
-      char perc = '%';
-      append(out, char, &perc);
-      appendSlice(out, char, expr.identifier);
-      append(out, char, &perc);
+// Longest macro body, which every call expands into its line
+#define MAX_MACRO_LENGTH 1024
+// Longest number a switch case can be to go in a jump table, which keeps
+// the bounds arithmetic away from overflow
+#define MAX_CASE_DIGITS 9
+
+// Lowers the IR to batch. Every region of blocks between a branch and its
+// merge becomes a cmd ( ... ) block when nothing in it needs a label, and a
+// chain of gotos otherwise.
+
+typedef struct {
+  Allocator ally;
+  IrProgram *program;
+  IrFunction *fn;
+  Vec(char) * out;
+  // which blocks have been written out
+  bool *emitted;
+  // label counters shared by all functions
+  size_t *branch_labels;
+  size_t *loop_labels;
+  size_t *return_labels;
+  size_t *switch_labels;
+  // which functions are also defined as macros, and whether the body of one
+  // is being written
+  bool *macros;
+  bool macro;
+  // whether the function can return what the last call left in __ret__
+  bool falls_off;
+  // the file of the ( ... ) > file block being written, whose prints need
+  // no redirection of their own
+  Value output;
+  // the counter of the innermost for /l while %%i still holds its value,
+  // empty otherwise
+  Slice(char) counter;
+} Lowering;
+
+static Slice(char) trim(Slice(char) str) {
+  while (isblank(str.ptr[0]) || isspace(str.ptr[0])) {
+    str.ptr++;
+    str.len--;
+  }
+  while (isblank(str.ptr[str.len - 1]) || isspace(str.ptr[str.len - 1])) {
+    str.len--;
+  }
+  return str;
+}
+
+static bool inlineBatchCanParenthesize(Slice(char) batch) {
+  int depth = 0;
+  bool line_start = true;
+  for (size_t i = 0; i < batch.len; i++) {
+    char c = batch.ptr[i];
+    if (c == '\n') {
+      line_start = true;
+      continue;
     }
+    if (line_start && (isblank(c) || c == '@'))
+      continue;
+    if (line_start && c == ':')
+      return false;
+    line_start = false;
+    if (c == '%')
+      return false;
+    if (c == '(')
+      depth++;
+    if (c == ')' && --depth < 0)
+      return false;
+    if (i + 4 <= batch.len && tolower(c) == 'g' &&
+        tolower(batch.ptr[i + 1]) == 'o' && tolower(batch.ptr[i + 2]) == 't' &&
+        tolower(batch.ptr[i + 3]) == 'o')
+      return false;
+  }
+  return depth == 0;
+}
+
+static void emitLabelName(Vec(char) * out, const char *kind, size_t id) {
+  char label[64];
+  int len = snprintf(label, sizeof(label), "_%s%zu_", kind, id);
+  appendMany(out, char, label, (size_t)len);
+}
+
+static void emitVariable(Lowering *l, Value value) {
+  if (value.kind == ValueTemporary) {
+    Slice(char) name = l->fn->temporaries.slice.ptr[value.id].name;
+    if (name.len == 0)
+      panic("emitName: Temporary without a variable");
+    appendSlice(l->out, char, name);
+    return;
+  }
+  appendSlice(l->out, char, value.text);
+}
+
+static void emitValue(Lowering *l, Value value, bool delayed) {
+  // inside parenthesized blocks %var% would be expanded once for the whole
+  // block, so read through delayed expansion instead
+  char perc = delayed ? '!' : '%';
+  switch (value.kind) {
+  case ValueVariable:
+  case ValueTemporary: {
+    append(l->out, char, &perc);
+    emitVariable(l, value);
+    append(l->out, char, &perc);
   } break;
-  case NumericExpression: {
-    appendSlice(out, char, expr.number);
+  case ValueNumber: {
+    appendSlice(l->out, char, value.text);
   } break;
-  case StringExpression: {
-    for (size_t i = 0; i < expr.string.len; i++) {
-      char c = expr.string.ptr[i];
+  case ValueString: {
+    for (size_t i = 0; i < value.text.len; i++) {
+      char c = value.text.ptr[i];
       char caret = '^';
-      if (c == '\\')
-        append(out, char, &caret);
-      else
-        append(out, char, &c);
-    }
-  } break;
-  case CallExpression: {
-    Result(Vec_char) call_res = createVec(ally, char, 32);
-    if (!call_res.ok)
-      panic(call_res.err);
-    Vec(char) call = call_res.val;
-    appendManyCString(&call, "@call :");
-    appendSlice(&call, char, expr.call.callee->identifier);
-    for (size_t i = 0; i < expr.call.parameters_len; i++) {
-      appendManyCString(&call, " ");
-      Expression param = expr.call.parameters[i];
-      emitExpression(param, parent, ally, temporaries, &call, call_labels);
-    }
-    appendManyCString(&call, "\r\n");
-    Statement call_stmt = {
-        .type = InlineBatchStatement,
-        .inline_batch = call.slice,
-    };
-    if (!append(temporaries, Statement, &call_stmt)) {
-      panic("Failed to append");
-    }
-    Result(Vec_char) ret_res = createVec(ally, char, 32);
-    if (!ret_res.ok)
-      panic(ret_res.err);
-    Vec(char) ret = ret_res.val;
-    size_t call_label = *call_labels;
-    *call_labels += 1;
-    ret.slice.len += (size_t)sprintf(ret.slice.ptr, "_ret%zu_", call_label);
-    Statement ret_tmp = {
-        .type = DeclarationStatement,
-        .declaration =
-            {
-                .name = ret.slice,
-                .value =
-                    {
-                        .type = IdentifierExpression,
-                        .identifier = {.ptr = "__ret__", .len = 7},
-                    },
-                .constant = true,
-            },
-    };
-    if (!append(temporaries, Statement, &ret_tmp)) {
-      panic("Failed to append");
-    }
-    appendManyCString(out, "%");
-    appendSlice(out, char, ret.slice);
-    appendManyCString(out, "%");
-  } break;
-  case ArithmeticExpression: {
-    if ((parent != DeclarationStatement && parent != AssignmentStatement &&
-         expr.arithmetic.op != '=' && expr.arithmetic.op != '!') ||
-        ((parent == DeclarationStatement || parent == AssignmentStatement) &&
-         (expr.arithmetic.op == '=' || expr.arithmetic.op == '!'))) {
-      // Create a temporary
-      char temporary_string[128];
-      int temporary_string_len =
-          sprintf(temporary_string, "_tmp%zu_", temporaries->slice.len);
-      Result(Slice_char) tmp_str =
-          alloc(ally, char, (size_t)temporary_string_len);
-      if (!tmp_str.ok)
-        panic(tmp_str.err);
-      for (int i = 0; i < temporary_string_len; i++) {
-        tmp_str.val.ptr[i] = temporary_string[i];
-      }
-      Statement temporary;
-      if (expr.arithmetic.op == '=' || expr.arithmetic.op == '!') {
-        Result(Slice_If) if_res = alloc(ally, If, 1);
-        if (!if_res.ok)
-          panic(if_res.err);
-        if_res.val.ptr->condition = expr;
-        Result(Slice_Statement) con_res = alloc(ally, Statement, 1);
-        if (!con_res.ok)
-          panic(con_res.err);
-        con_res.val.ptr->type = DeclarationStatement;
-        con_res.val.ptr->declaration = (Declaration){
-            .name = tmp_str.val,
-            .value = {.type = StringExpression,
-                      .string = {.ptr = "true", .len = 4}},
-            .constant = true,
-        };
-        if_res.val.ptr->consequence = con_res.val.ptr;
-        Result(Slice_Statement) alt_res = alloc(ally, Statement, 1);
-        if (!alt_res.ok)
-          panic(alt_res.err);
-        alt_res.val.ptr->type = DeclarationStatement;
-        alt_res.val.ptr->declaration = (Declaration){
-            .name = tmp_str.val,
-            .value = {.type = StringExpression,
-                      .string = {.ptr = "false", .len = 5}},
-            .constant = true,
-        };
-        if_res.val.ptr->alternate = alt_res.val.ptr;
-        temporary =
-            (Statement){.type = IfStatement, .if_statement = if_res.val.ptr};
-      } else {
-        temporary = (Statement){
-            .type = DeclarationStatement,
-            .declaration = {.name = tmp_str.val, .value = expr},
-        };
-      }
-      append(temporaries, Statement, &temporary);
-      emitExpression(
-          (Expression){.type = IdentifierExpression, .identifier = tmp_str.val},
-          parent, ally, temporaries, out, call_labels);
-    } else {
-      char quot = '"';
-      if (expr.arithmetic.op == '=' || expr.arithmetic.op == '!') {
-        append(out, char, &quot);
-      }
-      emitExpression(*expr.arithmetic.left, DeclarationStatement, ally,
-                     temporaries, out, call_labels);
-      if (expr.arithmetic.op == '=') {
-        appendManyCString(out, "\"==\"");
-      } else if (expr.arithmetic.op == '!') {
-        appendManyCString(out, "\" NEQ \"");
-      } else if (expr.arithmetic.op == '%') {
-        appendManyCString(out, "%%");
+      if (c == '\\') {
+        append(l->out, char, &caret);
       } else {
-        append(out, char, &expr.arithmetic.op);
-      }
-      emitExpression(*expr.arithmetic.right, DeclarationStatement, ally,
-                     temporaries, out, call_labels);
-      if (expr.arithmetic.op == '=' || expr.arithmetic.op == '!') {
-        append(out, char, &quot);
+        if (delayed && c == ')')
+          append(l->out, char, &caret);
+        append(l->out, char, &c);
       }
     }
   } break;
-  case FunctionExpression: {
-    panic("emitExpression with FunctionExpression: Should not be called");
+  case ValueNone: {
+    panic("emitValue without a value");
   }
   }
 }
 
-static Slice(char) trim(Slice(char) str) {
-  while (isblank(str.ptr[0]) || isspace(str.ptr[0])) {
-    str.ptr++;
-    str.len--;
+// Writes value between quotes, where carets would be kept
+static void emitQuoted(Lowering *l, Value value, bool delayed) {
+  appendManyCString(l->out, "\"");
+  if (value.kind == ValueString)
+    appendSlice(l->out, char, value.text);
+  else
+    emitValue(l, value, delayed);
+  appendManyCString(l->out, "\"");
+}
+
+static bool sameFile(Value a, Value b) {
+  return a.kind != ValueNone && a.kind == b.kind && a.id == b.id &&
+         eql(a.text, b.text);
+}
+
+// Numbers and booleans never hold spaces or quotes, so they compare as
+// integers without quoting
+static bool isNumeric(Value value) {
+  return value.kind == ValueNumber || value.type == TypeNumber ||
+         value.type == TypeBoolean;
+}
+
+static char *comparisonWord(char symbol) {
+  return symbol == '='   ? " EQU "
+         : symbol == '!' ? " NEQ "
+         : symbol == '<' ? " LSS "
+         : symbol == 'L' ? " LEQ "
+         : symbol == '>' ? " GTR "
+                         : " GEQ ";
+}
+
+static void emitCondition(Lowering *l, char symbol, Value a, Value b,
+                          bool negated, bool delayed) {
+  if (negated)
+    symbol = negateComparison(symbol);
+  // < and friends only ever compare numbers. A variable is read with
+  // delayed expansion, which comes after the if is parsed, so that one
+  // that is empty does not leave it without an operand.
+  if ((symbol != '=' && symbol != '!') || (isNumeric(a) && isNumeric(b))) {
+    emitValue(l, a, delayed || a.kind == ValueVariable);
+    appendManyCString(l->out, comparisonWord(symbol));
+    emitValue(l, b, delayed || b.kind == ValueVariable);
+    return;
   }
-  while (isblank(str.ptr[str.len - 1]) || isspace(str.ptr[str.len - 1])) {
-    str.len--;
+  // equality of anything else compares as text, in quotes against spaces
+  appendManyCString(l->out, "\"");
+  emitValue(l, a, delayed);
+  if (symbol == '=') {
+    appendManyCString(l->out, "\"==\"");
+  } else {
+    appendManyCString(l->out, "\"");
+    appendManyCString(l->out, comparisonWord(symbol));
+    appendManyCString(l->out, "\"");
   }
-  return str;
+  emitValue(l, b, delayed);
+  appendManyCString(l->out, "\"");
 }
 
-static void emitStatement(Statement stmt, Allocator ally,
-                          Vec(Statement) * temporaries, Vec(char) * out,
-                          size_t *branch_labels, size_t *loop_labels,
-                          size_t *call_labels, Vec(Binding) * names,
-                          Vec(Statement) * outer_assignments,
-                          Vec(char) * functions) {
-  char equal = '=';
-  switch (stmt.type) {
-  case DeclarationStatement: {
-    if (stmt.declaration.value.type == FunctionExpression) {
-      appendManyCString(functions, ":");
-      appendSlice(functions, char, stmt.declaration.name);
-      appendManyCString(functions, "\r\n");
-      char tmp_str[32];
-      size_t tmp_str_len = 0;
-
-      Result(Vec_Statement) body_contents_res = createVec(ally, Statement, 2);
-      if (!body_contents_res.ok)
-        panic(body_contents_res.err);
-      Vec(Statement) body_contents = body_contents_res.val;
-
-      for (size_t i = 0;
-           i < stmt.declaration.value.function_expression.parameters_len; i++) {
-        Expression param =
-            stmt.declaration.value.function_expression.parameters[i];
-        tmp_str_len = (size_t)sprintf(tmp_str, "@set %1.*s=%%~%zu\r\n",
-                                      (int)param.identifier.len,
-                                      param.identifier.ptr, i + 1);
-        Result(Slice_char) str = alloc(ally, char, tmp_str_len);
-        if (!str.ok)
-          panic(str.err);
-        for (size_t j = 0; j < tmp_str_len; j++) {
-          str.val.ptr[j] = tmp_str[j];
-        }
-        Statement decl = {
-            .type = InlineBatchStatement,
-            .inline_batch = str.val,
-        };
-        append(&body_contents, Statement, &decl);
-      }
+// The comparisons of a branch or compare, of which symbol a b is the first
+typedef struct {
+  Comparison first;
+  Slice(Comparison) joined;
+} Condition;
 
-      if (!appendSlice(&body_contents, Statement,
-                       stmt.declaration.value.function_expression.body->block
-                           ->statements)) {
-        panic("Failed to copy body contents");
-      }
-      shrinkToLength(&body_contents, Statement);
-      Block bodyBlockWithParams = {
-          .statements = body_contents.slice,
-      };
-      Statement bodyWithParams = {
-          .type = BlockStatement,
-          .block = &bodyBlockWithParams,
-      };
-      emitStatement(bodyWithParams, ally, temporaries, functions, branch_labels,
-                    loop_labels, call_labels, names, outer_assignments,
-                    functions);
-      break;
+static Condition branchCondition(Terminator term) {
+  return (Condition){
+      .first = {.symbol = term.symbol, .a = term.a, .b = term.b},
+      .joined = term.joined,
+  };
+}
+
+static Condition compareCondition(Instruction *inst) {
+  return (Condition){
+      .first = {.symbol = inst->symbol, .a = inst->a, .b = inst->b},
+      .joined = inst->joined,
+  };
+}
+
+static size_t conditionLength(Condition cond) { return cond.joined.len + 1; }
+
+static Comparison conditionAt(Condition cond, size_t i) {
+  return i == 0 ? cond.first : cond.joined.ptr[i - 1];
+}
+
+static bool joinsWith(Condition cond, char join) {
+  for (size_t i = 0; i < cond.joined.len; i++) {
+    if (cond.joined.ptr[i].join == join)
+      return true;
+  }
+  return false;
+}
+
+// Writes the comparisons from start on for as long as they are joined by
+// join as nested ifs, negated when asked to, and returns where they stop
+static size_t emitIfs(Lowering *l, Condition cond, size_t start, char join,
+                      bool negated, bool delayed) {
+  size_t i = start;
+  appendManyCString(l->out, "@if ");
+  do {
+    if (i > start)
+      appendManyCString(l->out, " if ");
+    Comparison comparison = conditionAt(cond, i);
+    emitCondition(l, comparison.symbol, comparison.a, comparison.b, negated,
+                  delayed);
+    i++;
+  } while (i < conditionLength(cond) && conditionAt(cond, i).join == join);
+  return i;
+}
+
+// Writes the lines that go to the label when the condition holds, or when
+// it does not if negated. An && is an if nested in the one before it and an
+// || a line of its own. Only a negated mix of both needs a label to get
+// past the goto when one of the ors holds.
+static void emitJump(Lowering *l, Condition cond, bool negated,
+                     const char *kind, size_t id, bool delayed) {
+  size_t len = conditionLength(cond);
+  if (negated && joinsWith(cond, '&') && joinsWith(cond, '|')) {
+    size_t holds = (*l->branch_labels)++;
+    emitJump(l, cond, false, "then", holds, delayed);
+    appendManyCString(l->out, "@goto :");
+    emitLabelName(l->out, kind, id);
+    appendManyCString(l->out, "\r\n:");
+    emitLabelName(l->out, "then", holds);
+    appendManyCString(l->out, "\r\n");
+    return;
+  }
+  // negated, the ands turn into ors and the other way around
+  char join = negated ? '|' : '&';
+  size_t i = 0;
+  while (i < len) {
+    i = emitIfs(l, cond, i, join, negated, delayed);
+    appendManyCString(l->out, " goto :");
+    emitLabelName(l->out, kind, id);
+    appendManyCString(l->out, "\r\n");
+  }
+}
+
+// Nested ifs can only open one ( ... ) block for ands, and cmd would take
+// an else for the innermost of them
+static bool conditionParenthesizes(Terminator term) {
+  return term.joined.len == 0 ||
+         (!joinsWith(branchCondition(term), '|') &&
+          term.otherwise == term.merge);
+}
+
+static int precedence(char symbol) {
+  return symbol == '+' || symbol == '-' ? 1 : 2;
+}
+
+// Whether a folded operation needs parentheses as an operand of parent
+static bool needsParens(char symbol, char parent, bool right) {
+  if (precedence(symbol) != precedence(parent))
+    return precedence(symbol) < precedence(parent);
+  // a - (b + c) and a / (b * c) do not regroup, a + (b - c) does
+  return right && parent != '+' && (parent != '*' || symbol != '*');
+}
+
+// The folded instruction in front of index that computes value, if any
+static Instruction *foldedDefinition(IrBlock *block, size_t index,
+                                     Value value) {
+  if (value.kind != ValueTemporary)
+    return NULL;
+  for (size_t i = index; i > 0; i--) {
+    Instruction *inst = &block->instructions.slice.ptr[i - 1];
+    if (!inst->folded)
+      return NULL;
+    if (inst->dst.kind == ValueTemporary && inst->dst.id == value.id)
+      return inst;
+  }
+  return NULL;
+}
+
+static bool arithmeticHasParens(IrBlock *block, Instruction *inst) {
+  size_t index = (size_t)(inst - block->instructions.slice.ptr);
+  Value operands[2] = {inst->a, inst->b};
+  for (size_t i = 0; i < 2; i++) {
+    Instruction *def = foldedDefinition(block, index, operands[i]);
+    if (def && (needsParens(def->symbol, inst->symbol, i == 1) ||
+                arithmeticHasParens(block, def)))
+      return true;
+  }
+  return false;
+}
+
+static void emitArithmetic(Lowering *l, IrBlock *block, Instruction *inst,
+                           bool delayed) {
+  size_t index = (size_t)(inst - block->instructions.slice.ptr);
+  Value operands[2] = {inst->a, inst->b};
+  for (size_t i = 0; i < 2; i++) {
+    if (i == 1) {
+      if (inst->symbol == '%')
+        appendManyCString(l->out, "%%");
+      else
+        append(l->out, char, &inst->symbol);
     }
-    appendManyCString(out, "@set ");
-    if (stmt.declaration.value.type == ArithmeticExpression &&
-        stmt.declaration.value.arithmetic.op != '=') {
-      appendManyCString(out, "/a ");
-    }
-    appendSlice(out, char, stmt.declaration.name);
-    append(out, char, &equal);
-    emitExpression(stmt.declaration.value, DeclarationStatement, ally,
-                   temporaries, out, call_labels);
-    Binding binding = {
-        .name = stmt.declaration.name,
-        .constant = stmt.declaration.constant,
-        .read = false,
-    };
-    if (!append(names, Binding, &binding)) {
-      panic("Could not append name");
+    Instruction *def = foldedDefinition(block, index, operands[i]);
+    if (!def) {
+      emitValue(l, operands[i], delayed);
+      continue;
     }
-    appendManyCString(out, "\r\n");
-  } break;
-  case AssignmentStatement: {
-    appendManyCString(out, "@set ");
-    if (stmt.assignment.value.type == ArithmeticExpression) {
-      appendManyCString(out, "/a ");
-    }
-    appendSlice(out, char, stmt.assignment.name);
-    append(out, char, &equal);
-    emitExpression(stmt.assignment.value, AssignmentStatement, ally,
-                   temporaries, out, call_labels);
-    bool name_exists = false;
-    for (size_t i = 0; i < names->slice.len; i++) {
-      if (eql(names->slice.ptr[i].name, stmt.assignment.name)) {
-        name_exists = true;
+    bool parens = needsParens(def->symbol, inst->symbol, i == 1);
+    if (parens)
+      appendManyCString(l->out, "(");
+    emitArithmetic(l, block, def, delayed);
+    if (parens)
+      appendManyCString(l->out, ")");
+  }
+}
+
+static bool namedResult(Lowering *l, Instruction *call) {
+  IrFunction *callee = findIrFunction(l->program, call->text);
+  return callee && callee->named_result;
+}
+
+// Passes a function with a named result the variable of the call, or
+// __ret__ when there is none or the caller may still return what is left
+// there. Returns whether the call sets its variable itself.
+static bool emitResultArgument(Lowering *l, Instruction *call) {
+  if (!namedResult(l, call))
+    return false;
+  appendManyCString(l->out, " ");
+  if (call->dst.kind == ValueNone || l->falls_off) {
+    appendManyCString(l->out, "__ret__");
+    return false;
+  }
+  emitVariable(l, call->dst);
+  return true;
+}
+
+// Where a return leaves its value
+static void emitResultName(Lowering *l) {
+  appendManyCString(l->out,
+                    l->fn->named_result && !l->macro ? "%~1" : "__ret__");
+}
+
+// Cache entries of memoized calls are named __memo_<function>_<arguments>,
+// joined by _ and all numbers. With a for variable the arguments were
+// captured in it.
+static void emitMemoName(Lowering *l, Instruction *call, char captured) {
+  appendManyCString(l->out, "__memo_");
+  appendSlice(l->out, char, call->text);
+  appendManyCString(l->out, "_");
+  if (captured) {
+    appendManyCString(l->out, "%%~");
+    append(l->out, char, &captured);
+    return;
+  }
+  for (size_t i = 0; i < call->args.len; i++) {
+    if (i > 0)
+      appendManyCString(l->out, "_");
+    emitValue(l, call->args.ptr[i], false);
+  }
+}
+
+static void captureMemoArguments(Lowering *l, Instruction *call, char var,
+                                 bool delayed) {
+  appendManyCString(l->out, "@for /f \"delims=\" %%");
+  append(l->out, char, &var);
+  appendManyCString(l->out, " in (\"\"");
+  for (size_t i = 0; i < call->args.len; i++) {
+    if (i > 0)
+      appendManyCString(l->out, "_");
+    emitValue(l, call->args.ptr[i], delayed);
+  }
+  appendManyCString(l->out, "\"\") do ");
+}
+
+// Only calls the function when the cache has no result for the arguments
+// yet, and fills it with the one the call returns
+static void emitMemoCall(Lowering *l, Instruction *inst, bool delayed) {
+  // %var% in a block has already been expanded, so the arguments are
+  // captured in a for variable first
+  char captured = delayed ? 'k' : 0;
+  if (delayed) {
+    captureMemoArguments(l, inst, captured, true);
+    appendManyCString(l->out, "(\r\n");
+  }
+  appendManyCString(l->out, "@if not defined ");
+  emitMemoName(l, inst, captured);
+  appendManyCString(l->out, " (\r\n@call :");
+  appendSlice(l->out, char, inst->text);
+  if (namedResult(l, inst))
+    appendManyCString(l->out, " __ret__");
+  for (size_t j = 0; j < inst->args.len; j++) {
+    appendManyCString(l->out, " ");
+    emitValue(l, inst->args.ptr[j], delayed);
+  }
+  appendManyCString(l->out, "\r\n@set ");
+  emitMemoName(l, inst, captured);
+  appendManyCString(l->out, "=!__ret__!\r\n)");
+  if (inst->dst.kind != ValueNone) {
+    appendManyCString(l->out, "\r\n@set ");
+    emitVariable(l, inst->dst);
+    appendManyCString(l->out, "=!");
+    emitMemoName(l, inst, captured);
+    appendManyCString(l->out, "!");
+  }
+  if (delayed)
+    appendManyCString(l->out, "\r\n)");
+}
+
+static void emitEndlocal(Lowering *l, Slice(Value) tunnels, bool delayed) {
+  if (!delayed) {
+    appendManyCString(l->out, "@endlocal");
+    for (size_t i = 0; i < tunnels.len; i++) {
+      appendManyCString(l->out, " && set \"");
+      emitVariable(l, tunnels.ptr[i]);
+      appendManyCString(l->out, "=");
+      emitValue(l, tunnels.ptr[i], false);
+      appendManyCString(l->out, "\"");
+    }
+    return;
+  }
+  // %var% in a block has already been expanded, so the values are captured
+  // in for variables before endlocal instead
+  if (tunnels.len > 26)
+    panic("Too many assignments to tunnel out of a parenthesized block");
+  for (size_t i = 0; i < tunnels.len; i++) {
+    char var = (char)('a' + i);
+    appendManyCString(l->out, "@for /f \"delims=\" %%");
+    append(l->out, char, &var);
+    appendManyCString(l->out, " in (\"\"");
+    emitValue(l, tunnels.ptr[i], true);
+    appendManyCString(l->out, "\"\") do ");
+  }
+  appendManyCString(l->out, "@endlocal");
+  for (size_t i = 0; i < tunnels.len; i++) {
+    char var = (char)('a' + i);
+    appendManyCString(l->out, " && set \"");
+    emitVariable(l, tunnels.ptr[i]);
+    appendManyCString(l->out, "=%%~");
+    append(l->out, char, &var);
+    appendManyCString(l->out, "\"");
+  }
+}
+
+static void emitSet(Lowering *l, bool first, Value target, Value value,
+                    bool delayed) {
+  appendManyCString(l->out, first ? "@set \"" : " & set \"");
+  emitVariable(l, target);
+  appendManyCString(l->out, "=");
+  emitValue(l, value, delayed);
+  appendManyCString(l->out, "\"");
+}
+
+static bool isSubroutineCall(Lowering *l, Instruction *inst) {
+  if (inst->op != IrCall)
+    return false;
+  IrFunction *callee = findIrFunction(l->program, inst->text);
+  return callee && callee->subroutine;
+}
+
+// Sets the parameters of callee like its prologue would have
+static void emitParameters(Lowering *l, Instruction *inst, IrFunction *callee,
+                           bool delayed) {
+  Slice(Instruction) prologue = callee->blocks.slice.ptr[0].instructions.slice;
+  for (size_t i = 0; i < prologue.len; i++) {
+    if (prologue.ptr[i].op != IrParam)
+      continue;
+    // missing arguments are empty like %~n
+    size_t index = prologue.ptr[i].index - 1;
+    Value arg = index < inst->args.len
+                    ? inst->args.ptr[index]
+                    : (Value){.kind = ValueString,
+                              .text = {.ptr = "", .len = 0}};
+    emitSet(l, false, prologue.ptr[i].dst, arg, delayed);
+  }
+}
+
+// Opens the frame of the subroutine and sets its parameters, then jumps to
+// it with the label to come back to in __return__. The whole line is
+// expanded before setlocal runs, so the arguments still read the caller's
+// variables.
+static void emitSubroutineCall(Lowering *l, Instruction *inst, bool delayed) {
+  if (delayed)
+    panic("emitSubroutineCall: Subroutine call in a parenthesized block");
+  IrFunction *callee = findIrFunction(l->program, inst->text);
+  appendManyCString(l->out, "@setlocal EnableDelayedExpansion");
+  emitParameters(l, inst, callee, false);
+  size_t label = (*l->return_labels)++;
+  char id[32];
+  int len = snprintf(id, sizeof(id), "%zu", label);
+  appendManyCString(l->out, " & set \"__return__=");
+  appendMany(l->out, char, id, (size_t)len);
+  appendManyCString(l->out, "\" & goto :");
+  appendSlice(l->out, char, inst->text);
+  appendManyCString(l->out, "\r\n:");
+  emitLabelName(l->out, "return", label);
+  if (inst->dst.kind == ValueNone)
+    return;
+  appendManyCString(l->out, "\r\n@set ");
+  emitVariable(l, inst->dst);
+  appendManyCString(l->out, "=%__ret__%");
+}
+
+static Slice(char) variableName(Lowering *l, Value value) {
+  if (value.kind == ValueTemporary)
+    return l->fn->temporaries.slice.ptr[value.id].name;
+  return value.kind == ValueVariable ? value.text
+                                     : (Slice(char)){.ptr = NULL, .len = 0};
+}
+
+// With delayed expansion every parameter is set before the next argument is
+// read, so an argument must not read a parameter that comes before it
+static bool argumentsInOrder(Lowering *l, Instruction *inst,
+                             IrFunction *callee) {
+  Slice(Instruction) prologue = callee->blocks.slice.ptr[0].instructions.slice;
+  for (size_t i = 0; i < prologue.len; i++) {
+    if (prologue.ptr[i].op != IrParam)
+      continue;
+    for (size_t j = prologue.ptr[i].index; j < inst->args.len; j++) {
+      if (eql(variableName(l, inst->args.ptr[j]), prologue.ptr[i].dst.text))
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool isMacroCall(Lowering *l, Instruction *inst, bool delayed) {
+  if (inst->op != IrCall || inst->memoized)
+    return false;
+  IrFunction *callee = findIrFunction(l->program, inst->text);
+  return callee &&
+         l->macros[(size_t)(callee - l->program->functions.slice.ptr)] &&
+         (!delayed || argumentsInOrder(l, inst, callee));
+}
+
+// Opens the frame of the function and sets its parameters like a subroutine
+// call, but then runs the body right there from the variable it is defined
+// in
+static void emitMacroCall(Lowering *l, Instruction *inst, bool delayed) {
+  IrFunction *callee = findIrFunction(l->program, inst->text);
+  appendManyCString(l->out, "@setlocal EnableDelayedExpansion");
+  emitParameters(l, inst, callee, delayed);
+  appendManyCString(l->out, " & %__macro_");
+  appendSlice(l->out, char, inst->text);
+  appendManyCString(l->out, "%");
+  if (inst->dst.kind == ValueNone)
+    return;
+  appendManyCString(l->out, "\r\n@set ");
+  emitVariable(l, inst->dst);
+  appendManyCString(l->out, delayed ? "=!__ret__!" : "=%__ret__%");
+}
+
+// Subroutines go back to the label in __return__, which the line has
+// already expanded by the time endlocal has dropped it. Macros just go on
+// with the line of the call. The jump is joined with & so that a failing
+// set /a before it does not fall through into the next function.
+static void emitExit(Lowering *l, bool chained) {
+  if (l->macro)
+    return;
+  if (chained)
+    appendManyCString(l->out, " & ");
+  appendManyCString(l->out, l->fn->subroutine ? "goto :_return%__return__%_"
+                                              : "exit /b 0");
+}
+
+// The caller already opened the frame of a subroutine or macro and set its
+// parameters
+static bool enteredByCaller(Lowering *l, IrBlock *block, size_t index) {
+  Instruction *inst = &block->instructions.slice.ptr[index];
+  return (l->fn->subroutine || l->macro) &&
+         block == &l->fn->blocks.slice.ptr[0] &&
+         (inst->op == IrParam || (index == 0 && inst->op == IrSetlocal));
+}
+
+// Without delayed expansion the whole line is expanded before any of the
+// sets run, so they all see the old values. With it every set sees the ones
+// before it, so a set waits until no other one still reads its target, and
+// a cycle of them goes through the scratch variable.
+static void emitParallelCopy(Lowering *l, Instruction *inst, bool delayed) {
+  if (!delayed) {
+    for (size_t i = 0; i < inst->targets.len; i++) {
+      emitSet(l, i == 0, inst->targets.ptr[i], inst->args.ptr[i], false);
+    }
+    return;
+  }
+  Result(Slice_Value) args_res = alloc(l->ally, Value, inst->args.len);
+  if (!args_res.ok)
+    panic(args_res.err);
+  Slice(Value) args = args_res.val;
+  memcpy(args.ptr, inst->args.ptr, args.len * sizeof(Value));
+  bool *done = allocFlags(l->ally, args.len);
+  size_t left = args.len;
+  bool first = true;
+  while (left > 0) {
+    bool progress = false;
+    for (size_t i = 0; i < args.len; i++) {
+      bool blocked = done[i];
+      for (size_t j = 0; j < args.len && !blocked; j++) {
+        blocked = j != i && !done[j] &&
+                  readsVariable(args.ptr[j], inst->targets.ptr[i]);
       }
+      if (blocked)
+        continue;
+      emitSet(l, first, inst->targets.ptr[i], args.ptr[i], true);
+      done[i] = true;
+      first = false;
+      progress = true;
+      left--;
+    }
+    if (progress)
+      continue;
+    for (size_t i = 0; i < args.len; i++) {
+      if (done[i])
+        continue;
+      emitSet(l, first, inst->dst, inst->targets.ptr[i], true);
+      first = false;
+      for (size_t j = 0; j < args.len; j++) {
+        if (readsVariable(args.ptr[j], inst->targets.ptr[i]))
+          args.ptr[j] = inst->dst;
+      }
+      break;
+    }
+  }
+}
+
+static bool freshCounter(Lowering *l, Value index) {
+  return l->counter.len > 0 && index.kind == ValueVariable &&
+         eql(index.text, l->counter);
+}
+
+// Under delayed expansion a variable index has to be expanded before the
+// element it names is. The %%i of a for /l over the index already is, any
+// other one goes through a for of its own.
+static bool indexNeedsFor(Lowering *l, Value index, bool delayed) {
+  return delayed && !freshCounter(l, index) &&
+         (index.kind == ValueVariable || index.kind == ValueTemporary);
+}
+
+// Starts the command of a load or store, with the for the index needs
+static void emitElementCommand(Lowering *l, Instruction *inst, bool delayed) {
+  if (!indexNeedsFor(l, inst->a, delayed)) {
+    appendManyCString(l->out, "@set ");
+    return;
+  }
+  appendManyCString(l->out, "@for %%k in (");
+  emitValue(l, inst->a, true);
+  appendManyCString(l->out, ") do @set ");
+}
+
+// The variable of element a of the array text
+static void emitElement(Lowering *l, Instruction *inst, bool delayed) {
+  appendSlice(l->out, char, inst->text);
+  appendManyCString(l->out, "[");
+  if (freshCounter(l, inst->a))
+    appendManyCString(l->out, "%%i");
+  else if (indexNeedsFor(l, inst->a, delayed))
+    appendManyCString(l->out, "%%k");
+  else
+    emitValue(l, inst->a, false);
+  appendManyCString(l->out, "]");
+}
+
+static void clearCounter(Value *value, void *context) {
+  Lowering *l = (Lowering *)context;
+  if (value->kind == ValueVariable && eql(value->text, l->counter))
+    l->counter = (Slice(char)){.ptr = NULL, .len = 0};
+}
+
+// The last of the prints to the file of the one at start that can go in a
+// ( ... ) > file block with it. Copies and arithmetic between them go in as
+// well, as long as they leave the name of the file alone.
+static size_t lastWrite(IrBlock *block, size_t start) {
+  Slice(Instruction) list = block->instructions.slice;
+  Value file = list.ptr[start].a;
+  size_t last = start;
+  for (size_t i = start + 1; i < list.len; i++) {
+    Instruction inst = list.ptr[i];
+    if (inst.folded)
+      continue;
+    if (inst.op == IrPrint && inst.symbol != '>' && sameFile(inst.a, file))
+      last = i;
+    else if ((inst.op != IrCopy && inst.op != IrArithmetic) ||
+             sameFile(inst.dst, file))
+      break;
+  }
+  return last;
+}
+
+// Writes the instructions of a block and returns whether the last line was
+// left open for the terminator to continue
+static bool lowerInstructions(Lowering *l, IrBlock *block, bool delayed) {
+  bool open = false;
+  // the last print of the ( ... ) > file block being written, when there is
+  // one
+  size_t last = 0;
+  bool grouped = false;
+  bool emptied = false;
+  bool outer = delayed;
+  Value outer_output = l->output;
+  for (size_t i = 0; i < block->instructions.slice.len; i++) {
+    Instruction *inst = &block->instructions.slice.ptr[i];
+    if (open)
+      appendManyCString(l->out, "\r\n");
+    open = false;
+    if (inst->folded || enteredByCaller(l, block, i))
+      continue;
+    // the ( ... ) > file around a with_output block has emptied it already
+    if (inst->op == IrPrint && inst->symbol == '>' &&
+        sameFile(inst->a, l->output))
+      continue;
+    if (!grouped && inst->op == IrPrint && inst->a.kind != ValueNone &&
+        !sameFile(inst->a, l->output))
+      last = lastWrite(block, i);
+    if (!grouped && last > i) {
+      // the block opens its file once for all of its prints
+      grouped = true;
+      appendManyCString(l->out, "@(\r\n");
+      l->output = inst->a;
+      delayed = true;
+      emptied = inst->symbol == '>';
+      if (emptied)
+        continue;
     }
-    if (!name_exists && outer_assignments) {
-      bool exists = false;
-      for (size_t i = 0; i < outer_assignments->slice.len; i++) {
-        Statement outer = outer_assignments->slice.ptr[i];
-        if (eql(outer.assignment.name, stmt.assignment.name)) {
-          exists = true;
+    switch (inst->op) {
+    case IrCopy: {
+      appendManyCString(l->out, "@set ");
+      emitVariable(l, inst->dst);
+      appendManyCString(l->out, "=");
+      emitValue(l, inst->a, delayed);
+    } break;
+    case IrArithmetic: {
+      bool quoted = arithmeticHasParens(block, inst);
+      appendManyCString(l->out, quoted ? "@set /a \"" : "@set /a ");
+      emitVariable(l, inst->dst);
+      appendManyCString(l->out, "=");
+      emitArithmetic(l, block, inst, delayed);
+      if (quoted)
+        appendManyCString(l->out, "\"");
+    } break;
+    case IrCompare: {
+      if (inst->joined.len > 0) {
+        // cleared first and set again by whichever of the ors holds
+        Condition cond = compareCondition(inst);
+        appendManyCString(l->out, "@set ");
+        emitVariable(l, inst->dst);
+        appendManyCString(l->out, "=0");
+        size_t next = 0;
+        while (next < conditionLength(cond)) {
+          appendManyCString(l->out, "\r\n");
+          next = emitIfs(l, cond, next, '&', false, delayed);
+          appendManyCString(l->out, " (\r\n@set ");
+          emitVariable(l, inst->dst);
+          appendManyCString(l->out, "=1\r\n)");
         }
+        break;
+      }
+      // set /a has no ordering of its own
+      if (isNumeric(inst->a) && isNumeric(inst->b) &&
+          (inst->symbol == '=' || inst->symbol == '!')) {
+        // the difference is 0 only when they are equal, and ^! stays the
+        // logical not of set /a under delayed expansion
+        appendManyCString(l->out, "@set /a \"");
+        emitVariable(l, inst->dst);
+        appendManyCString(l->out, inst->symbol == '=' ? "=^!(" : "=^!^!(");
+        emitValue(l, inst->a, delayed);
+        appendManyCString(l->out, "-");
+        emitValue(l, inst->b, delayed);
+        appendManyCString(l->out, ")\"");
+        break;
+      }
+      emitIfs(l, compareCondition(inst), 0, '&', false, delayed);
+      appendManyCString(l->out, " (\r\n@set ");
+      emitVariable(l, inst->dst);
+      appendManyCString(l->out, "=1\r\n) else (\r\n@set ");
+      emitVariable(l, inst->dst);
+      appendManyCString(l->out, "=0\r\n)");
+    } break;
+    case IrParam: {
+      // behind the name of the variable to return into
+      size_t index = inst->index + (l->fn->named_result ? 1 : 0);
+      char param[32];
+      int len = snprintf(param, sizeof(param), "=%%~%zu", index);
+      appendManyCString(l->out, "@set ");
+      emitVariable(l, inst->dst);
+      appendMany(l->out, char, param, (size_t)len);
+    } break;
+    case IrCall: {
+      if (inst->memoized) {
+        emitMemoCall(l, inst, delayed);
+        break;
+      }
+      if (isMacroCall(l, inst, delayed)) {
+        emitMacroCall(l, inst, delayed);
+        break;
+      }
+      if (isSubroutineCall(l, inst)) {
+        emitSubroutineCall(l, inst, delayed);
+        break;
+      }
+      appendManyCString(l->out, "@call :");
+      appendSlice(l->out, char, inst->text);
+      bool direct = emitResultArgument(l, inst);
+      for (size_t j = 0; j < inst->args.len; j++) {
+        appendManyCString(l->out, " ");
+        // cmd does not evaluate call arguments, arithmetic in them already
+        // went through a temporary
+        emitValue(l, inst->args.ptr[j], delayed);
+      }
+      if (inst->dst.kind == ValueNone || direct)
+        break;
+      appendManyCString(l->out, "\r\n@set ");
+      emitVariable(l, inst->dst);
+      appendManyCString(l->out, delayed ? "=!__ret__!" : "=%__ret__%");
+    } break;
+    case IrPrint: {
+      appendManyCString(l->out, "@");
+      if (inst->a.kind != ValueNone && !sameFile(inst->a, l->output)) {
+        appendManyCString(l->out, inst->symbol == '>' ? ">" : ">>");
+        emitQuoted(l, inst->a, delayed);
+        appendManyCString(l->out, " ");
       }
-      if (!exists) {
-        Statement outer_stmt = {
-            .type = AssignmentStatement,
-            .assignment =
-                {
-                    .name = stmt.assignment.name,
-                    .value =
-                        {
-                            .type = IdentifierExpression,
-                            .identifier = stmt.assignment.name,
-                        },
-                },
-        };
-        if (!append(outer_assignments, Statement, &outer_stmt)) {
-          panic("Failed to append outer assignment");
+      if (inst->symbol == '>') {
+        appendManyCString(l->out, "type nul");
+        break;
+      }
+      if (inst->symbol == 'w') {
+        // the prompt of set /p is the only output without a line break
+        appendManyCString(l->out, "<nul set /p \"=");
+        for (size_t j = 0; j < inst->args.len; j++) {
+          if (j > 0)
+            appendManyCString(l->out, " ");
+          if (inst->args.ptr[j].kind == ValueString)
+            appendSlice(l->out, char, inst->args.ptr[j].text);
+          else
+            emitValue(l, inst->args.ptr[j], delayed);
         }
+        appendManyCString(l->out, "\"");
+        break;
       }
+      appendManyCString(l->out, inst->args.len ? "echo" : "echo.");
+      for (size_t j = 0; j < inst->args.len; j++) {
+        appendManyCString(l->out, " ");
+        emitValue(l, inst->args.ptr[j], delayed);
+      }
+    } break;
+    case IrBatch: {
+      appendSlice(l->out, char, trim(inst->text));
+    } break;
+    case IrSetlocal: {
+      appendManyCString(l->out, "@setlocal EnableDelayedExpansion");
+    } break;
+    case IrEndlocal: {
+      emitEndlocal(l, inst->args, delayed);
+      open = true;
+    } break;
+    case IrParallelCopy: {
+      emitParallelCopy(l, inst, delayed);
+      open = true;
+    } break;
+    case IrUnset: {
+      for (size_t j = 0; j < inst->args.len; j++) {
+        appendManyCString(l->out, j ? " & set \"" : "@set \"");
+        emitVariable(l, inst->args.ptr[j]);
+        appendManyCString(l->out, "=\"");
+      }
+    } break;
+    case IrLoad: {
+      emitElementCommand(l, inst, delayed);
+      emitVariable(l, inst->dst);
+      appendManyCString(l->out, "=!");
+      emitElement(l, inst, delayed);
+      appendManyCString(l->out, "!");
+    } break;
+    case IrStore: {
+      emitElementCommand(l, inst, delayed);
+      emitElement(l, inst, delayed);
+      appendManyCString(l->out, "=");
+      emitValue(l, inst->b, delayed);
+    } break;
+    }
+    // calls and batch code may change the counter behind its back
+    if (inst->op == IrCall || inst->op == IrBatch)
+      l->counter = (Slice(char)){.ptr = NULL, .len = 0};
+    visitDefinitions(inst, clearCounter, l);
+    if (!open)
+      appendManyCString(l->out, "\r\n");
+    if (grouped && i == last) {
+      appendManyCString(l->out, emptied ? ") > " : ") >> ");
+      emitQuoted(l, l->output, outer);
+      appendManyCString(l->out, "\r\n");
+      l->output = outer_output;
+      delayed = outer;
+      grouped = false;
+    }
+  }
+  return open;
+}
+
+static bool isTailEntry(Lowering *l, size_t block) {
+  return l->fn->tail_recursive && block == l->fn->entry;
+}
+
+static bool countedLoop(Lowering *l, size_t header);
+
+static bool switchBlock(Lowering *l, Terminator term);
+
+// Whether the blocks from start up to stop can go in a cmd ( ... ) block,
+// which must not contain labels
+static bool parenthesizable(Lowering *l, size_t start, size_t stop) {
+  size_t block = start;
+  while (block != stop) {
+    IrBlock *current = &l->fn->blocks.slice.ptr[block];
+    if (isTailEntry(l, block))
+      return false;
+    for (size_t i = 0; i < current->instructions.slice.len; i++) {
+      Instruction inst = current->instructions.slice.ptr[i];
+      if (inst.op == IrBatch && !inlineBatchCanParenthesize(inst.text))
+        return false;
+      // the label a subroutine comes back to must not be in a block
+      if (isSubroutineCall(l, &inst) && !isMacroCall(l, &inst, true))
+        return false;
+    }
+    Terminator term = current->term;
+    switch (term.kind) {
+    case TermJump: {
+      // a tail call leaves the block with a goto
+      if (isTailEntry(l, term.target))
+        return true;
+      block = term.target;
+    } break;
+    case TermBranch: {
+      if (term.loop) {
+        if (!countedLoop(l, block))
+          return false;
+      } else if (!conditionParenthesizes(term) ||
+                 !parenthesizable(l, term.target, term.merge) ||
+                 !parenthesizable(l, term.otherwise, term.merge)) {
+        return false;
+      }
+      block = term.merge;
+    } break;
+    case TermSwitch: {
+      if (!switchBlock(l, term))
+        return false;
+      block = term.merge;
+    } break;
+    case TermNone:
+    case TermReturn:
+    case TermEnd: {
+      return true;
+    }
+    }
+  }
+  return true;
+}
+
+// Loops over a counter with a label free body become for /l
+static bool countedLoop(Lowering *l, size_t header) {
+  IrBlock *block = &l->fn->blocks.slice.ptr[header];
+  return block->term.loop && block->term.counted &&
+         block->instructions.slice.len == 0 &&
+         parenthesizable(l, block->term.target, header);
+}
+
+// Marks the blocks control reaches from start before getting to stop
+static void markRegion(IrFunction *fn, size_t start, size_t stop,
+                       bool *marked) {
+  if (start == stop || marked[start])
+    return;
+  marked[start] = true;
+  Terminator term = fn->blocks.slice.ptr[start].term;
+  for (size_t i = 0; i < successorCount(term); i++) {
+    markRegion(fn, successor(term, i), stop, marked);
+  }
+}
+
+typedef struct {
+  Value file;
+  bool kept;
+} FileUse;
+
+static void checkFileKept(Value *value, void *context) {
+  FileUse *use = context;
+  if (sameFile(*value, use->file))
+    use->kept = false;
+}
+
+// The one file everything the counted loop at header prints goes to, which
+// a ( ... ) > file block around the whole loop then opens only once. There
+// is none when it also prints to the console, calls anything that might, or
+// changes which file its variable names.
+static Value loopOutput(Lowering *l, size_t header) {
+  Slice(IrBlock) blocks = l->fn->blocks.slice;
+  bool *marked = allocFlags(l->ally, blocks.len);
+  markRegion(l->fn, blocks.ptr[header].term.target, header, marked);
+  FileUse use = {.file = {.kind = ValueNone}, .kept = true};
+  for (size_t b = 0; b < blocks.len; b++) {
+    Slice(Instruction) list = blocks.ptr[b].instructions.slice;
+    for (size_t i = 0; i < list.len && marked[b]; i++) {
+      Instruction inst = list.ptr[i];
+      if (inst.op == IrCall || inst.op == IrBatch)
+        return noValue();
+      if (inst.op != IrPrint)
+        continue;
+      if (inst.a.kind == ValueNone || inst.symbol == '>' ||
+          (use.file.kind != ValueNone && !sameFile(inst.a, use.file)))
+        return noValue();
+      use.file = inst.a;
+    }
+  }
+  for (size_t b = 0; b < blocks.len; b++) {
+    Slice(Instruction) list = blocks.ptr[b].instructions.slice;
+    for (size_t i = 0; i < list.len && marked[b]; i++) {
+      visitDefinitions(&list.ptr[i], checkFileKept, &use);
+    }
+  }
+  return use.kept ? use.file : noValue();
+}
+
+// The commands of a return are joined with &&, up to the jump out
+static void emitStep(Lowering *l, bool *chained) {
+  if (*chained)
+    appendManyCString(l->out, " && ");
+  *chained = true;
+}
+
+static void emitReturn(Lowering *l, IrBlock *block, Terminator term,
+                       bool delayed) {
+  Value value = term.value;
+  Slice(Instruction) list = block->instructions.slice;
+  Instruction *sum = NULL;
+  if (list.len > 0 && list.ptr[list.len - 1].folded)
+    sum = &list.ptr[list.len - 1];
+  if (sum && delayed) {
+    // __ret__ is free to compute the sum in before the frames go
+    appendManyCString(l->out, "@set /a \"__ret__=");
+    emitArithmetic(l, block, sum, true);
+    appendManyCString(l->out, "\"\r\n");
+    value = (Value){.kind = ValueVariable,
+                    .text = {.ptr = "__ret__", .len = 7}};
+  }
+  // the cache entries are read into for variables a, b, c, ... before
+  // endlocal drops them
+  for (size_t i = 0; i < term.memos.len; i++) {
+    Instruction *memo = &term.memos.ptr[i];
+    char key = (char)('a' + 2 * i);
+    char entry = (char)(key + 1);
+    captureMemoArguments(l, memo, key, delayed);
+    appendManyCString(l->out, "@for /f \"delims=\" %%");
+    append(l->out, char, &entry);
+    appendManyCString(l->out, " in (\"\"!");
+    emitMemoName(l, memo, key);
+    appendManyCString(l->out, "!\"\") do ");
+  }
+  bool captured = delayed && value.kind != ValueNone;
+  if (captured) {
+    appendManyCString(l->out, "@for /f \"delims=\" %%r in (\"\"");
+    emitValue(l, value, true);
+    appendManyCString(l->out, "\"\") do @");
+  } else {
+    appendManyCString(l->out, "@");
+  }
+  bool chained = false;
+  for (size_t i = 0; i < term.frames; i++) {
+    emitStep(l, &chained);
+    appendManyCString(l->out, "endlocal");
+  }
+  for (size_t i = 0; i < term.memos.len; i++) {
+    char key = (char)('a' + 2 * i);
+    char entry = (char)(key + 1);
+    emitStep(l, &chained);
+    appendManyCString(l->out, "set \"");
+    emitMemoName(l, &term.memos.ptr[i], key);
+    appendManyCString(l->out, "=%%~");
+    append(l->out, char, &entry);
+    appendManyCString(l->out, "\"");
+  }
+  if (captured) {
+    emitStep(l, &chained);
+    appendManyCString(l->out, "set \"");
+    emitResultName(l);
+    appendManyCString(l->out, "=%%~r\"");
+  } else if (sum) {
+    // %var% is expanded before endlocal runs, so the whole tree can be
+    // evaluated straight into the tunnel
+    emitStep(l, &chained);
+    appendManyCString(l->out, "set /a \"");
+    emitResultName(l);
+    appendManyCString(l->out, "=");
+    emitArithmetic(l, block, sum, false);
+    appendManyCString(l->out, "\"");
+  } else if (value.kind != ValueNone) {
+    emitStep(l, &chained);
+    appendManyCString(l->out, "set \"");
+    emitResultName(l);
+    appendManyCString(l->out, "=");
+    emitValue(l, value, false);
+    appendManyCString(l->out, "\"");
+  }
+  emitExit(l, chained);
+  appendManyCString(l->out, "\r\n");
+}
+
+// Whether the terminator can go on the line the last instruction left open
+static bool continuesLine(Lowering *l, Terminator term) {
+  switch (term.kind) {
+  case TermJump: {
+    // a tail call goes on with its goto, while a jump back to the header of
+    // a loop ends the range and the loop writes its own goto
+    return l->emitted[term.target] && isTailEntry(l, term.target);
+  }
+  case TermReturn: {
+    return term.value.kind == ValueNone && term.frames == 0;
+  }
+  case TermNone:
+  case TermBranch:
+  case TermSwitch:
+  case TermEnd: {
+    return false;
+  }
+  }
+}
+
+typedef enum {
+  // an if for each case in turn
+  DispatchChain,
+  // numbers without too many gaps between them, whose bounds are checked
+  // before the subject is jumped to
+  DispatchRange,
+  // words, which a for over their list checks the subject against
+  DispatchList,
+} Dispatch;
+
+// Plain decimals read the same in a label and in EQU
+static bool caseNumber(Value value, long long *out) {
+  Slice(char) text = value.text;
+  if (value.kind != ValueNumber || text.len == 0 ||
+      text.len > MAX_CASE_DIGITS || (text.len > 1 && text.ptr[0] == '0'))
+    return false;
+  long long number = 0;
+  for (size_t i = 0; i < text.len; i++) {
+    if (!isdigit((unsigned char)text.ptr[i]))
+      return false;
+    number = number * 10 + (text.ptr[i] - '0');
+  }
+  *out = number;
+  return true;
+}
+
+// Whether the case can end the name of its label
+static bool caseWord(Value value) {
+  long long number = 0;
+  if (value.kind == ValueNumber)
+    return caseNumber(value, &number);
+  if (value.text.len == 0)
+    return false;
+  for (size_t i = 0; i < value.text.len; i++) {
+    char c = value.text.ptr[i];
+    if (!isalnum((unsigned char)c) && c != '_')
+      return false;
+  }
+  return true;
+}
+
+// A missing label ends the whole script, so the subject is only jumped to
+// after it was checked against the cases. Labels are found without regard
+// to case, which rules out tables for cases that only differ in that.
+static Dispatch switchDispatch(Terminator term, long long *low,
+                               long long *high) {
+  Slice(Value) cases = term.cases;
+  for (size_t i = 0; i < cases.len; i++) {
+    if (!caseWord(cases.ptr[i]))
+      return DispatchChain;
+    for (size_t j = 0; j < i; j++) {
+      if (cases.ptr[j].text.len == cases.ptr[i].text.len &&
+          mentionsLabel(cases.ptr[j].text, cases.ptr[i].text))
+        return DispatchChain;
+    }
+  }
+  bool numbers = isNumeric(term.a);
+  for (size_t i = 0; i < cases.len && numbers; i++) {
+    long long number = 0;
+    numbers = caseNumber(cases.ptr[i], &number);
+    if (i == 0 || number < *low)
+      *low = number;
+    if (i == 0 || number > *high)
+      *high = number;
+  }
+  if (numbers && *high - *low < 2 * (long long)cases.len)
+    return DispatchRange;
+  return DispatchList;
+}
+
+static void emitCaseLabel(Lowering *l, size_t id, Dispatch dispatch,
+                          Terminator term, size_t index) {
+  emitLabelName(l->out, "sw", id);
+  if (dispatch != DispatchChain) {
+    appendSlice(l->out, char, term.cases.ptr[index].text);
+    return;
+  }
+  char key[32];
+  int len = snprintf(key, sizeof(key), "%zu", index);
+  appendMany(l->out, char, key, (size_t)len);
+}
+
+// Switches without a jump table whose cases need no labels become one
+// if ... else if chain in a cmd block, like the branches they stand for
+static bool switchBlock(Lowering *l, Terminator term) {
+  long long low = 0;
+  long long high = 0;
+  if (switchDispatch(term, &low, &high) != DispatchChain)
+    return false;
+  for (size_t i = 0; i < term.targets.len; i++) {
+    if (!parenthesizable(l, term.targets.ptr[i], term.merge))
+      return false;
+  }
+  return parenthesizable(l, term.otherwise, term.merge);
+}
+
+static bool lowerRange(Lowering *l, size_t start, size_t stop, bool delayed);
+
+// Jumps to the case of the subject with one computed goto when the cases
+// allow it, and with an if for each case otherwise
+static void lowerSwitch(Lowering *l, Terminator term, bool delayed) {
+  bool has_default = term.otherwise != term.merge;
+  if (switchBlock(l, term)) {
+    for (size_t i = 0; i < term.cases.len; i++) {
+      appendManyCString(l->out, i ? ") else if " : "@if ");
+      emitCondition(l, '=', term.a, term.cases.ptr[i], false, delayed);
+      appendManyCString(l->out, " (\r\n");
+      lowerRange(l, term.targets.ptr[i], term.merge, true);
+    }
+    if (has_default) {
+      appendManyCString(l->out, ") else (\r\n");
+      lowerRange(l, term.otherwise, term.merge, true);
+    }
+    appendManyCString(l->out, ")\r\n");
+    return;
+  }
+  size_t id = (*l->switch_labels)++;
+  long long low = 0;
+  long long high = 0;
+  Dispatch dispatch = switchDispatch(term, &low, &high);
+  switch (dispatch) {
+  case DispatchChain: {
+    for (size_t i = 0; i < term.cases.len; i++) {
+      appendManyCString(l->out, "@if ");
+      emitCondition(l, '=', term.a, term.cases.ptr[i], false, delayed);
+      appendManyCString(l->out, " goto :");
+      emitCaseLabel(l, id, dispatch, term, i);
+      appendManyCString(l->out, "\r\n");
     }
-    appendManyCString(out, "\r\n");
-  } break;
-  case InlineBatchStatement: {
-    // appendManyCString(out, "\r\n");
-    appendSlice(out, char, trim(stmt.inline_batch));
-    appendManyCString(out, "\r\n");
-  } break;
-  case BlockStatement: {
-    appendManyCString(out, "@setlocal EnableDelayedExpansion\r\n");
-    Result(Vec_Statement) new_outer_assignments_res =
-        createVec(ally, Statement, 1);
-    if (!new_outer_assignments_res.ok)
-      panic(new_outer_assignments_res.err);
-    Vec(Statement) new_outer_assignments = new_outer_assignments_res.val;
-    Result(Vec_Binding) block_names_res = createVec(ally, Binding, 8);
-    if (!block_names_res.ok)
-      panic(block_names_res.err);
-    Vec(Binding) block_names = block_names_res.val;
-    for (size_t i = 0; i < stmt.block->statements.len; i++) {
-      emitStatement(stmt.block->statements.ptr[i], ally, temporaries, out,
-                    branch_labels, loop_labels, call_labels, &block_names,
-                    &new_outer_assignments, functions);
-    }
-
-    appendManyCString(out, "@endlocal");
-    for (size_t i = 0; i < new_outer_assignments.slice.len; i++) {
-      Statement assignment = new_outer_assignments.slice.ptr[i];
-      appendManyCString(out, " && set \"");
-      appendSlice(out, char, assignment.assignment.name);
-      appendManyCString(out, "=%");
-      appendSlice(out, char, assignment.assignment.value.identifier);
-      appendManyCString(out, "%\"");
-    }
-    appendManyCString(out, "\r\n");
   } break;
-  case IfStatement: {
-    char temporary_string[128];
-    size_t temporary_string_len = 0;
-    Slice(char) branch_slice;
-    size_t branch_label = *branch_labels;
-    *branch_labels += 1;
-    appendManyCString(out, "@if not ");
-    emitExpression(stmt.if_statement->condition, IfStatement, ally, temporaries,
-                   out, call_labels);
-
-    appendManyCString(out, " goto :");
-    temporary_string_len = (size_t)sprintf(
-        temporary_string,
-        stmt.if_statement->alternate ? "_else%zu_" : "_endif%zu_",
-        branch_label);
-    branch_slice =
-        (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-    appendSlice(out, char, branch_slice);
-    appendManyCString(out, "\r\n");
-    emitStatement(*stmt.if_statement->consequence, ally, temporaries, out,
-                  branch_labels, loop_labels, call_labels, names,
-                  outer_assignments, functions);
-    appendManyCString(out, "@goto :");
-    temporary_string_len =
-        (size_t)sprintf(temporary_string, "_endif%zu_", branch_label);
-    branch_slice =
-        (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-    appendSlice(out, char, branch_slice);
-    appendManyCString(out, "\r\n");
-    if (stmt.if_statement->alternate) {
-      appendManyCString(out, ":");
-      temporary_string_len =
-          (size_t)sprintf(temporary_string, "_else%zu_", branch_label);
-      branch_slice =
-          (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-      appendSlice(out, char, branch_slice);
-      appendManyCString(out, "\r\n");
-      emitStatement(*stmt.if_statement->alternate, ally, temporaries, out,
-                    branch_labels, loop_labels, call_labels, names,
-                    outer_assignments, functions);
-    }
-    appendManyCString(out, ":");
-    temporary_string_len =
-        (size_t)sprintf(temporary_string, "_endif%zu_", branch_label);
-    branch_slice =
-        (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-    appendSlice(out, char, branch_slice);
-    appendManyCString(out, "\r\n");
+  case DispatchRange: {
+    char bounds[64];
+    appendManyCString(l->out, "@if ");
+    emitValue(l, term.a, delayed);
+    int len = snprintf(bounds, sizeof(bounds), " GEQ %lld if ", low);
+    appendMany(l->out, char, bounds, (size_t)len);
+    emitValue(l, term.a, delayed);
+    len = snprintf(bounds, sizeof(bounds), " LEQ %lld goto :", high);
+    appendMany(l->out, char, bounds, (size_t)len);
+    emitLabelName(l->out, "sw", id);
+    emitValue(l, term.a, delayed);
+    appendManyCString(l->out, "\r\n");
   } break;
-  case WhileStatement: {
-    char temporary_string[128];
-    size_t temporary_string_len = 0;
-    Slice(char) loop_slice;
-    size_t loop_label = *loop_labels;
-    *loop_labels += 1;
-    appendManyCString(out, ":");
-    temporary_string_len =
-        (size_t)sprintf(temporary_string, "_while%zu_", loop_label);
-    loop_slice =
-        (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-    appendSlice(out, char, loop_slice);
-    appendManyCString(out, "\r\n@if not ");
-    emitExpression(stmt.while_statement->condition, WhileStatement, ally,
-                   temporaries, out, call_labels);
-
-    appendManyCString(out, " goto :");
-    temporary_string_len =
-        (size_t)sprintf(temporary_string, "_endwhile%zu_", loop_label);
-    loop_slice =
-        (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-    appendSlice(out, char, loop_slice);
-    appendManyCString(out, "\r\n");
-    emitStatement(*stmt.while_statement->body, ally, temporaries, out,
-                  branch_labels, loop_labels, call_labels, names,
-                  outer_assignments, functions);
-    appendManyCString(out, "@goto :");
-    temporary_string_len =
-        (size_t)sprintf(temporary_string, "_while%zu_", loop_label);
-    loop_slice =
-        (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-    appendSlice(out, char, loop_slice);
-    appendManyCString(out, "\r\n:");
-    temporary_string_len =
-        (size_t)sprintf(temporary_string, "_endwhile%zu_", loop_label);
-    loop_slice =
-        (Slice(char)){.ptr = temporary_string, .len = temporary_string_len};
-    appendSlice(out, char, loop_slice);
-    appendManyCString(out, "\r\n");
+  case DispatchList: {
+    appendManyCString(l->out, "@for %%s in (");
+    for (size_t i = 0; i < term.cases.len; i++) {
+      if (i > 0)
+        appendManyCString(l->out, " ");
+      appendSlice(l->out, char, term.cases.ptr[i].text);
+    }
+    appendManyCString(l->out, ") do @if \"");
+    emitValue(l, term.a, delayed);
+    appendManyCString(l->out, "\"==\"%%s\" goto :");
+    emitLabelName(l->out, "sw", id);
+    appendManyCString(l->out, "%%s\r\n");
   } break;
-  case ReturnStatement: {
-    Result(Vec_Statement) ftemporaries_res = createVec(ally, Statement, 2);
-    if (!ftemporaries_res.ok)
-      panic(ftemporaries_res.err);
-    Vec(Statement) ftemporaries = ftemporaries_res.val;
-    Result(Vec_char) fbuffered_res = createVec(ally, char, 32);
-    if (!fbuffered_res.ok)
-      panic(fbuffered_res.err);
-    Vec(char) fbuffered = fbuffered_res.val;
-    appendManyCString(&fbuffered, "@endlocal");
-    if (stmt.return_statement) {
-      appendManyCString(&fbuffered, " && set \"__ret__=");
-      emitExpression(*stmt.return_statement, ReturnStatement, ally,
-                     &ftemporaries, &fbuffered, call_labels);
-      for (size_t j = 0; j < ftemporaries.slice.len; j++) {
-        emitStatement(ftemporaries.slice.ptr[j], ally, &ftemporaries, out,
-                      branch_labels, loop_labels, call_labels, names, NULL,
-                      &fbuffered);
-      }
+  }
+  appendManyCString(l->out, "@goto :");
+  emitLabelName(l->out, has_default ? "default" : "endswitch", id);
+  appendManyCString(l->out, "\r\n");
+  for (size_t i = 0; i < term.cases.len; i++) {
+    appendManyCString(l->out, ":");
+    emitCaseLabel(l, id, dispatch, term, i);
+    appendManyCString(l->out, "\r\n");
+    if (lowerRange(l, term.targets.ptr[i], term.merge, delayed)) {
+      appendManyCString(l->out, "@goto :");
+      emitLabelName(l->out, "endswitch", id);
+      appendManyCString(l->out, "\r\n");
+    }
+  }
+  // the numbers between the cases have to be labels too
+  for (long long n = low; dispatch == DispatchRange && n <= high; n++) {
+    bool hole = true;
+    for (size_t i = 0; i < term.cases.len && hole; i++) {
+      long long number = 0;
+      hole = !caseNumber(term.cases.ptr[i], &number) || number != n;
+    }
+    if (!hole)
+      continue;
+    char label[32];
+    int len = snprintf(label, sizeof(label), "%lld", n);
+    appendManyCString(l->out, ":");
+    emitLabelName(l->out, "sw", id);
+    appendMany(l->out, char, label, (size_t)len);
+    appendManyCString(l->out, "\r\n");
+  }
+  if (has_default) {
+    appendManyCString(l->out, ":");
+    emitLabelName(l->out, "default", id);
+    appendManyCString(l->out, "\r\n");
+    lowerRange(l, term.otherwise, term.merge, delayed);
+  }
+  appendManyCString(l->out, ":");
+  emitLabelName(l->out, "endswitch", id);
+  appendManyCString(l->out, "\r\n");
+}
+
+// Opens a for /l up to a variable, which it reads once when it starts. An
+// offset from the variable is computed into __last__ first.
+static void emitRuntimeFor(Lowering *l, CountedLoop *counted, bool delayed) {
+  Value last = variableValue(counted->bound);
+  char text[64];
+  if (counted->offset != 0) {
+    appendManyCString(l->out, "@set /a __last__=");
+    emitValue(l, last, delayed);
+    int len = snprintf(text, sizeof(text), "%+lld\r\n", counted->offset);
+    appendMany(l->out, char, text, (size_t)len);
+    last = variableValue((Slice(char)){.ptr = "__last__", .len = 8});
+  }
+  int len = snprintf(text, sizeof(text), "@for /l %%%%i in (%lld,%lld,",
+                     counted->start, counted->step);
+  appendMany(l->out, char, text, (size_t)len);
+  emitValue(l, last, delayed);
+  appendManyCString(l->out, ") do (\r\n");
+}
 
-      appendManyCString(&fbuffered, "\"");
+// Writes a with_output block as one ( ... ) > file block, which opens the
+// file once for all of it. Labels cannot go in there, and neither can
+// anything that prints to the console, or may do so like calls and inline
+// batch.
+static bool lowerOutputBlock(Lowering *l, Terminator term, bool delayed) {
+  if (!parenthesizable(l, term.target, term.merge))
+    return false;
+  Slice(IrBlock) blocks = l->fn->blocks.slice;
+  bool *marked = allocFlags(l->ally, blocks.len);
+  markRegion(l->fn, term.target, term.merge, marked);
+  for (size_t b = 0; b < blocks.len; b++) {
+    Slice(Instruction) list = blocks.ptr[b].instructions.slice;
+    for (size_t i = 0; i < list.len && marked[b]; i++) {
+      Instruction inst = list.ptr[i];
+      if (inst.op == IrCall || inst.op == IrBatch ||
+          (inst.op == IrPrint && inst.a.kind == ValueNone))
+        return false;
     }
-    appendManyCString(&fbuffered, " && exit /b 0\r\n");
-    shrinkToLength(&fbuffered, char);
-    appendSlice(out, char, fbuffered.slice);
-  } break;
-  case ExpressionStatement: {
-    Expression expr = stmt.expression;
-    switch (expr.type) {
-    case CallExpression: {
-      if (expr.call.callee->type != IdentifierExpression) {
-        fprintf(stdout, "Skipped unknown callee\n");
+  }
+  Value outer_output = l->output;
+  appendManyCString(l->out, "@(\r\n");
+  l->output = term.a;
+  lowerRange(l, term.target, term.merge, true);
+  appendManyCString(l->out, ") > ");
+  emitQuoted(l, term.a, delayed);
+  appendManyCString(l->out, "\r\n");
+  l->output = outer_output;
+  return true;
+}
+
+// Writes the blocks from start on until control reaches stop and returns
+// whether it does, rather than leaving through a goto or a return
+static bool lowerRange(Lowering *l, size_t start, size_t stop, bool delayed) {
+  size_t b = start;
+  while (b != stop) {
+    if (l->emitted[b]) {
+      if (!isTailEntry(l, b))
+        panic("lowerRange: Jump back to a block without a label");
+      appendManyCString(l->out, "@goto :_");
+      appendSlice(l->out, char, l->fn->name);
+      appendManyCString(l->out, "_entry_\r\n");
+      return false;
+    }
+    l->emitted[b] = true;
+    IrBlock *block = &l->fn->blocks.slice.ptr[b];
+    Terminator term = block->term;
+    if (isTailEntry(l, b)) {
+      appendManyCString(l->out, ":_");
+      appendSlice(l->out, char, l->fn->name);
+      appendManyCString(l->out, "_entry_\r\n");
+    }
+    if (term.kind == TermBranch && term.loop && countedLoop(l, b)) {
+      // the body keeps updating the induction variable itself, for /l only
+      // replaces the condition check and the jump back
+      CountedLoop *counted = term.counted;
+      Value file = loopOutput(l, b);
+      Value outer_output = l->output;
+      bool redirected =
+          file.kind != ValueNone && !sameFile(file, outer_output);
+      if (redirected) {
+        appendManyCString(l->out, "@(\r\n");
+        l->output = file;
+      }
+      if (counted->bound.len > 0) {
+        emitRuntimeFor(l, counted, delayed);
+      } else {
+        char line[128];
+        int len = snprintf(line, sizeof(line),
+                           "@for /l %%%%i in (%lld,%lld,%lld) do (\r\n",
+                           counted->start, counted->step,
+                           counted->end - counted->step);
+        appendMany(l->out, char, line, (size_t)len);
+      }
+      Slice(char) outer_counter = l->counter;
+      l->counter = counted->variable;
+      lowerRange(l, term.target, b, true);
+      l->counter = outer_counter;
+      appendManyCString(l->out, ")\r\n");
+      if (redirected) {
+        appendManyCString(l->out, ") >> ");
+        emitQuoted(l, file, delayed);
+        appendManyCString(l->out, "\r\n");
+        l->output = outer_output;
+      }
+      b = term.merge;
+      continue;
+    }
+    size_t loop_label = 0;
+    if (term.kind == TermBranch && term.loop) {
+      loop_label = (*l->loop_labels)++;
+      appendManyCString(l->out, ":");
+      emitLabelName(l->out, "while", loop_label);
+      appendManyCString(l->out, "\r\n");
+    }
+    bool open = lowerInstructions(l, block, delayed);
+    if (open && !continuesLine(l, term)) {
+      appendManyCString(l->out, "\r\n");
+      open = false;
+    }
+    switch (term.kind) {
+    case TermJump: {
+      if (!open && term.a.kind != ValueNone &&
+          lowerOutputBlock(l, term, delayed)) {
+        b = term.merge;
+        continue;
+      }
+      if (!open)
         break;
+      if (!isTailEntry(l, term.target))
+        panic("lowerRange: Jump back to a block without a label");
+      appendManyCString(l->out, " & goto :_");
+      appendSlice(l->out, char, l->fn->name);
+      appendManyCString(l->out, "_entry_\r\n");
+      return false;
+    }
+    case TermBranch: {
+      if (term.loop) {
+        emitJump(l, branchCondition(term), true, "endwhile", loop_label,
+                 delayed);
+        lowerRange(l, term.target, b, delayed);
+        appendManyCString(l->out, "@goto :");
+        emitLabelName(l->out, "while", loop_label);
+        appendManyCString(l->out, "\r\n:");
+        emitLabelName(l->out, "endwhile", loop_label);
+        appendManyCString(l->out, "\r\n");
+        b = term.merge;
+        continue;
       }
-      if (eql(expr.call.callee->identifier,
-              (Slice(char)){.ptr = "print", .len = 5})) {
-
-        appendManyCString(out, "@echo");
-        for (size_t j = 0; j < expr.call.parameters_len; j++) {
-          appendManyCString(out, " ");
-          emitExpression(expr.call.parameters[j], ExpressionStatement, ally,
-                         temporaries, out, call_labels);
+      bool has_else = term.otherwise != term.merge;
+      if (conditionParenthesizes(term) &&
+          parenthesizable(l, term.target, term.merge) &&
+          parenthesizable(l, term.otherwise, term.merge)) {
+        emitIfs(l, branchCondition(term), 0, '&', false, delayed);
+        appendManyCString(l->out, " (\r\n");
+        lowerRange(l, term.target, term.merge, true);
+        appendManyCString(l->out, ")");
+        if (has_else) {
+          appendManyCString(l->out, " else (\r\n");
+          lowerRange(l, term.otherwise, term.merge, true);
+          appendManyCString(l->out, ")");
         }
-        appendManyCString(out, "\r\n");
-      } else {
-        Result(Vec_char) call_res = createVec(ally, char, 32);
-        if (!call_res.ok)
-          panic(call_res.err);
-        Vec(char) call = call_res.val;
-        appendManyCString(&call, "@call :");
-        appendSlice(&call, char, expr.call.callee->identifier);
-        for (size_t i = 0; i < expr.call.parameters_len; i++) {
-          appendManyCString(&call, " ");
-          Expression param = expr.call.parameters[i];
-          emitExpression(param, ExpressionStatement, ally, temporaries, &call,
-                         call_labels);
+        appendManyCString(l->out, "\r\n");
+        b = term.merge;
+        continue;
+      }
+      size_t branch_label = (*l->branch_labels)++;
+      emitJump(l, branchCondition(term), true, has_else ? "else" : "endif",
+               branch_label, delayed);
+      bool through = lowerRange(l, term.target, term.merge, delayed);
+      if (has_else) {
+        if (through) {
+          appendManyCString(l->out, "@goto :");
+          emitLabelName(l->out, "endif", branch_label);
+          appendManyCString(l->out, "\r\n");
         }
-        appendManyCString(&call, "\r\n");
-        shrinkToLength(&call, char);
-        appendSlice(out, char, call.slice);
+        appendManyCString(l->out, ":");
+        emitLabelName(l->out, "else", branch_label);
+        appendManyCString(l->out, "\r\n");
+        lowerRange(l, term.otherwise, term.merge, delayed);
       }
-    } break;
-    case IdentifierExpression:
-    case NumericExpression:
-    case ArithmeticExpression:
-    case FunctionExpression:
-    case StringExpression: {
-      fprintf(stdout, "Skipped unknown expression: ");
-      fprintf(stdout, "%1.*s", (int)expr.string.len, expr.string.ptr);
-      fprintf(stdout, "\n");
-    } break;
+      appendManyCString(l->out, ":");
+      emitLabelName(l->out, "endif", branch_label);
+      appendManyCString(l->out, "\r\n");
+      b = term.merge;
+      continue;
     }
-  } break;
-  case StatementEOF: {
-    panic("StatementEOF");
-  } break;
+    case TermSwitch: {
+      lowerSwitch(l, term, delayed);
+      b = term.merge;
+      continue;
+    }
+    case TermReturn: {
+      if (open) {
+        emitExit(l, true);
+        appendManyCString(l->out, "\r\n");
+      } else {
+        emitReturn(l, block, term, delayed);
+      }
+      return false;
+    }
+    case TermEnd: {
+      appendManyCString(l->out, "\r\n@popd\r\n");
+      appendManyCString(l->out, "@endlocal\r\n");
+      appendManyCString(l->out, "@exit /b 0\r\n\r\n");
+      return false;
+    }
+    case TermNone: {
+      panic("lowerRange: Block without a terminator");
+    }
+    }
+    b = term.target;
   }
+  return true;
 }
 
-// static inline void emitTemporaries(Allocator ally, Vec(Statement) *
-// temporaries,
-//                                    Vec(char) * out, size_t *branch_labels,
-//                                    size_t *loop_labels, size_t *call_labels,
-//                                    Vec(Binding) * names,
-//                                    Vec(char) * functions) {
-//   for (size_t i = 0; i < temporaries->slice.len; i++) {
-//     Result(Vec_char) buffered = createVec(ally, char, 32);
-//     if (!buffered.ok)
-//       panic(buffered.err);
-//     size_t before = temporaries->slice.len;
-//     emitStatement(temporaries->slice.ptr[i], ally, temporaries,
-//     &buffered.val,
-//                   branch_labels, loop_labels, call_labels, names, NULL,
-//                   functions);
-//     if (before != temporaries->slice.len) {
-//       Vec(Statement) next_temporaries = {
-//           .slice =
-//               {
-//                   .ptr = temporaries->slice.ptr + before,
-//                   .len = temporaries->slice.len - before,
-//               },
-//           .ally = ally,
-//           .cap = temporaries->cap - before,
-//       };
-//       emitTemporaries(ally, &next_temporaries, out, branch_labels,
-//       loop_labels,
-//                       call_labels, names, functions);
-//       temporaries->cap = next_temporaries.cap + before;
-//     }
-//     appendSlice(out, char, buffered.val.slice);
-//   }
-// }
-
-static void outputBatch(Program prog, Allocator ally, Vec(char) * out) {
-  (void)ally;
-  appendManyCString(out, "@setlocal EnableDelayedExpansion\r\n");
-  appendManyCString(out, "@pushd \"%~dp0\"\r\n\r\n");
+// Strings are kept out of macros when their definition would change them,
+// as it is expanded with % once and its quotes must pair up
+static void checkMacroValue(Value *value, void *context) {
+  if (value->kind != ValueString)
+    return;
+  for (size_t i = 0; i < value->text.len; i++) {
+    if (value->text.ptr[i] == '"' || value->text.ptr[i] == '%')
+      *(bool *)context = false;
+  }
+}
 
-  Result(Vec_Statement) temporaries = createVec(ally, Statement, 1);
-  if (!temporaries.ok)
-    panic(temporaries.err);
+static bool macroInstruction(Instruction *inst, bool entry) {
+  switch (inst->op) {
+  case IrCompare: {
+    // the & after nested ifs belongs to the outer one
+    if (inst->joined.len > 0)
+      return false;
+    bool fits = true;
+    visitUses(inst, checkMacroValue, &fits);
+    return fits;
+  }
+  case IrCopy:
+  case IrArithmetic:
+  case IrParam:
+  case IrPrint:
+  case IrEndlocal:
+  case IrUnset:
+  case IrLoad:
+  case IrStore: {
+    bool fits = true;
+    visitUses(inst, checkMacroValue, &fits);
+    return fits;
+  }
+  case IrSetlocal: {
+    // only the frame the caller opens
+    return entry;
+  }
+  case IrCall:
+  case IrBatch:
+  case IrParallelCopy: {
+    return false;
+  }
+  }
+}
 
-  Result(Vec_char) buffered = createVec(ally, char, 32);
-  if (!buffered.ok)
-    panic(buffered.err);
+// Whether every path from block on ends in a return without going through
+// a loop or a call, which leaves the if ... else of the branches on the way
+// as the only control flow a macro needs
+static bool macroRegion(IrFunction *fn, size_t block) {
+  while (true) {
+    IrBlock *current = &fn->blocks.slice.ptr[block];
+    Slice(Instruction) list = current->instructions.slice;
+    for (size_t i = 0; i < list.len; i++) {
+      if (!macroInstruction(&list.ptr[i], block == 0 && i == 0))
+        return false;
+    }
+    Terminator term = current->term;
+    bool fits = term.memos.len == 0;
+    visitTerminatorUses(&term, checkMacroValue, &fits);
+    if (!fits)
+      return false;
+    switch (term.kind) {
+    case TermJump: {
+      block = term.target;
+      continue;
+    }
+    case TermBranch: {
+      // both arms are written out, which nested ifs have no else for
+      return !term.loop && term.joined.len == 0 &&
+             macroRegion(fn, term.target) && macroRegion(fn, term.otherwise);
+    }
+    case TermReturn: {
+      return true;
+    }
+    case TermNone:
+    case TermSwitch:
+    case TermEnd: {
+      return false;
+    }
+    }
+  }
+}
 
-  Result(Vec_char) functions_res = createVec(ally, char, 32);
-  if (!functions_res.ok)
-    panic(functions_res.err);
+// Writes the blocks of a macro from b on. The macro goes on with the line
+// of its call after a return, so both arms of a branch are written out
+// whole in ( ... ) blocks.
+static void lowerMacro(Lowering *l, size_t b) {
+  while (true) {
+    IrBlock *block = &l->fn->blocks.slice.ptr[b];
+    Terminator term = block->term;
+    bool open = lowerInstructions(l, block, true);
+    if (open)
+      appendManyCString(l->out, "\r\n");
+    switch (term.kind) {
+    case TermJump: {
+      b = term.target;
+      continue;
+    }
+    case TermBranch: {
+      appendManyCString(l->out, "@if ");
+      emitCondition(l, term.symbol, term.a, term.b, false, true);
+      appendManyCString(l->out, " (\r\n");
+      lowerMacro(l, term.target);
+      appendManyCString(l->out, ") else (\r\n");
+      lowerMacro(l, term.otherwise);
+      appendManyCString(l->out, ")\r\n");
+      return;
+    }
+    case TermReturn: {
+      if (!open || !continuesLine(l, term))
+        emitReturn(l, block, term, true);
+      return;
+    }
+    case TermNone:
+    case TermSwitch:
+    case TermEnd: {
+      panic("lowerMacro: Block that does not return");
+    }
+    }
+  }
+}
 
-  Vec(char) functions = functions_res.val;
+// Joins the lines of a macro body into the one line of its definition. It
+// is set before delayed expansion is enabled, so only the & between the
+// commands and the specials outside quotes need a caret to be kept.
+// Returns false when the body is too long to expand into the lines of its
+// calls.
+static bool defineMacro(Vec(char) * out, Slice(char) name, Slice(char) body) {
+  size_t start = out->slice.len;
+  appendManyCString(out, "@set __macro_");
+  appendSlice(out, char, name);
+  appendManyCString(out, "=");
+  size_t length = 0;
+  char last = 0;
+  size_t pos = 0;
+  while (pos < body.len) {
+    size_t end = pos;
+    while (end < body.len && body.ptr[end] != '\r' && body.ptr[end] != '\n')
+      end++;
+    Slice(char) line = {.ptr = body.ptr + pos, .len = end - pos};
+    pos = end + 1;
+    while (line.len > 0 && (line.ptr[0] == '@' || isblank(line.ptr[0]))) {
+      line.ptr++;
+      line.len--;
+    }
+    if (line.len == 0)
+      continue;
+    // a space before ) would end up in the value of a set
+    if (last == '(')
+      appendManyCString(out, " ");
+    else if (last && line.ptr[0] != ')')
+      appendManyCString(out, "^& ");
+    bool quoted = false;
+    for (size_t i = 0; i < line.len; i++) {
+      char c = line.ptr[i];
+      if (c == '"')
+        quoted = !quoted;
+      if (!quoted && strchr("^&|<>", c))
+        appendManyCString(out, "^");
+      append(out, char, &c);
+    }
+    last = line.ptr[line.len - 1];
+    length += line.len;
+  }
+  appendManyCString(out, "\r\n");
+  if (length <= MAX_MACRO_LENGTH)
+    return true;
+  out->slice.len = start;
+  return false;
+}
+
+// Small functions without loops or calls are also defined as macros, which
+// the calls that can expand them run without call, the label search and
+// the parsing of arguments
+static void defineMacros(IrProgram *program, Allocator ally, Vec(char) * out,
+                         bool *macros) {
+  Result(Vec_char) body_res = createVec(ally, char, 256);
+  if (!body_res.ok)
+    panic(body_res.err);
+  Vec(char) body = body_res.val;
+  Result(Vec_char) definitions_res = createVec(ally, char, 256);
+  if (!definitions_res.ok)
+    panic(definitions_res.err);
+  Vec(char) definitions = definitions_res.val;
+  size_t count = 0;
+  for (size_t i = 1; i < program->functions.slice.len; i++) {
+    IrFunction *fn = &program->functions.slice.ptr[i];
+    if (findIrFunction(program, fn->name) != fn || fn->tail_recursive ||
+        !macroRegion(fn, 0))
+      continue;
+    Lowering l = {
+        .ally = ally,
+        .program = program,
+        .fn = fn,
+        .out = &body,
+        .emitted = allocFlags(ally, fn->blocks.slice.len),
+        .macros = macros,
+        .macro = true,
+    };
+    body.slice.len = 0;
+    lowerMacro(&l, 0);
+    if (!defineMacro(&definitions, fn->name, body.slice))
+      continue;
+    macros[i] = true;
+    count++;
+  }
+  if (count == 0)
+    return;
+  appendManyCString(out, "@setlocal DisableDelayedExpansion\r\n");
+  appendSlice(out, char, definitions.slice);
+  fprintf(stdout, "Defined %zu function%s as macros\n", count,
+          count == 1 ? "" : "s");
+}
+
+// A macro whose every call expands it is never entered at its label
+static bool onlyMacroCalls(IrProgram *program, Allocator ally, bool *macros,
+                           IrFunction *fn) {
+  if (calledFromBatch(program, fn->name))
+    return false;
+  for (size_t i = 0; i < program->functions.slice.len; i++) {
+    Lowering l = {
+        .ally = ally,
+        .program = program,
+        .fn = &program->functions.slice.ptr[i],
+        .macros = macros,
+    };
+    for (size_t j = 0; j < l.fn->blocks.slice.len; j++) {
+      Slice(Instruction) list = l.fn->blocks.slice.ptr[j].instructions.slice;
+      for (size_t k = 0; k < list.len; k++) {
+        // the order of the arguments only matters with delayed expansion
+        if (list.ptr[k].op == IrCall && eql(list.ptr[k].text, fn->name) &&
+            !isMacroCall(&l, &list.ptr[k], true))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void outputBatch(IrProgram program, Allocator ally, Vec(char) * out,
+                        bool macros) {
+  bool *defined = allocFlags(ally, program.functions.slice.len);
+  if (macros)
+    defineMacros(&program, ally, out, defined);
+  appendManyCString(out, "@setlocal EnableDelayedExpansion\r\n");
+  appendManyCString(out, "@pushd \"%~dp0\"\r\n\r\n");
 
   size_t branch_labels = 0;
   size_t loop_labels = 0;
-  size_t call_labels = 0;
-
-  Result(Vec_Binding) names_res = createVec(ally, Binding, 8);
-  if (!names_res.ok)
-    panic(names_res.err);
-  Vec(Binding) names = names_res.val;
-
-  for (size_t i = 0; i < prog.statements.len; i++) {
-    Statement stmt = prog.statements.ptr[i];
-    emitStatement(stmt, ally, &temporaries.val, &buffered.val, &branch_labels,
-                  &loop_labels, &call_labels, &names, NULL, &functions);
-    // emitTemporaries(ally, &temporaries.val, out, &branch_labels,
-    // &loop_labels,
-    //                 &call_labels, &names, &functions);
-    for (size_t j = 0; j < temporaries.val.slice.len; j++) {
-      emitStatement(temporaries.val.slice.ptr[j], ally, &temporaries.val, out,
-                    &branch_labels, &loop_labels, &call_labels, &names, NULL,
-                    &functions);
-    }
-    temporaries.val.slice.len = 0;
-    appendSlice(out, char, buffered.val.slice);
-    buffered.val.slice.len = 0;
-  }
-
-  appendManyCString(out, "\r\n@popd\r\n");
-  appendManyCString(out, "@endlocal\r\n");
-  appendManyCString(out, "@exit /b 0\r\n\r\n");
-
-  appendSlice(out, char, functions.slice);
-
-  Slice(Statement) allocation = {.ptr = temporaries.val.slice.ptr,
-                                 .len = temporaries.val.cap};
-  resizeAllocation(ally, Statement, &allocation, 0);
+  size_t return_labels = 0;
+  size_t switch_labels = 0;
+  for (size_t i = 0; i < program.functions.slice.len; i++) {
+    IrFunction *fn = &program.functions.slice.ptr[i];
+    if (defined[i] && onlyMacroCalls(&program, ally, defined, fn))
+      continue;
+    Lowering l = {
+        .ally = ally,
+        .program = &program,
+        .fn = fn,
+        .out = out,
+        .emitted = allocFlags(ally, fn->blocks.slice.len),
+        .branch_labels = &branch_labels,
+        .loop_labels = &loop_labels,
+        .return_labels = &return_labels,
+        .switch_labels = &switch_labels,
+        .macros = defined,
+        .macro = false,
+        .falls_off = fallsOff(ally, fn),
+    };
+    if (i > 0) {
+      appendManyCString(out, ":");
+      appendSlice(out, char, fn->name);
+      appendManyCString(out, "\r\n");
+    }
+    lowerRange(&l, 0, (size_t)-1, false);
+  }
 }
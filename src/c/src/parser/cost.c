@@ -0,0 +1,564 @@
+#ifndef COST_H
+#define COST_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "ir.c"
+#include "peephole.c"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Estimates what running the emitted script costs without running it, so
+// --cost-report output can be diffed between compiler versions. The numbers
+// are static: every branch counts as taken, and a loop whose trip count is
+// unknown counts once.
+
+typedef struct {
+  Slice(char) text;
+  // byte offsets of the line and of the line after it
+  size_t start;
+  size_t end;
+  // how often the line runs, from the trip counts of the enclosing loops
+  size_t weight;
+} CostLine;
+
+typedef struct {
+  size_t first;
+  size_t last;
+  // the label a goto loop jumps back to, empty for for /l
+  Slice(char) label;
+  bool counted;
+  size_t trip_count;
+} CostLoop;
+
+typedef struct {
+  Slice(char) name;
+  Slice(char) label;
+  size_t first;
+  size_t last;
+  // a subroutine runs in the frame its caller opened
+  bool entered;
+} CostRegion;
+
+DefSlice(CostLine);
+DefVec(CostLine);
+DefResult(Vec_CostLine);
+DefSlice(CostLoop);
+DefVec(CostLoop);
+DefResult(Vec_CostLoop);
+DefSlice(CostRegion);
+DefVec(CostRegion);
+DefResult(Vec_CostRegion);
+
+typedef struct {
+  Allocator ally;
+  Slice(CostLine) lines;
+  Vec(CostLoop) loops;
+  Vec(CostRegion) regions;
+  size_t bytes;
+} CostModel;
+
+// The next command of a line chained with & or &&, without leading blanks
+// and @, or an empty slice at the end of the line
+static Slice(char) nextSegment(Slice(char) text, size_t *pos) {
+  while (*pos < text.len && strchr(" \t@&", text.ptr[*pos]))
+    (*pos)++;
+  Slice(char) segment = {.ptr = text.ptr + *pos, .len = 0};
+  bool quoted = false;
+  while (*pos < text.len && (quoted || text.ptr[*pos] != '&')) {
+    if (text.ptr[*pos] == '"')
+      quoted = !quoted;
+    (*pos)++;
+    segment.len++;
+  }
+  while (segment.len > 0 && isspace(segment.ptr[segment.len - 1]))
+    segment.len--;
+  return segment;
+}
+
+static bool isCostCommand(Slice(char) segment) {
+  return segment.len > 0 && segment.ptr[0] != ')' && segment.ptr[0] != ':';
+}
+
+static size_t countCommands(Slice(char) text) {
+  size_t count = 0;
+  size_t pos = 0;
+  for (Slice(char) segment = nextSegment(text, &pos); segment.len > 0;
+       segment = nextSegment(text, &pos)) {
+    if (isCostCommand(segment))
+      count++;
+  }
+  return count;
+}
+
+static bool opensBlock(Slice(char) text) {
+  return text.len > 0 && text.ptr[text.len - 1] == '(';
+}
+
+static bool closesBlock(Slice(char) text) {
+  return text.len > 0 && text.ptr[0] == ')';
+}
+
+static size_t findCostLabel(CostModel *model, Slice(char) name) {
+  for (size_t i = 0; i < model->lines.len; i++) {
+    Command cmd = {.text = model->lines.ptr[i].text,
+                   .quiet = false,
+                   .removed = false};
+    if (isLabel(cmd) && eqlIgnoreCase(labelName(cmd), name))
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+// Bytes cmd reads looking for the label, from the line after the jump on
+// and wrapping around at the end of the file
+static size_t scanDistance(CostModel *model, size_t from, size_t label) {
+  size_t start = model->lines.ptr[from].end;
+  size_t target = model->lines.ptr[label].start;
+  return target >= start ? target - start : model->bytes - start + target;
+}
+
+static bool parseSigned(Slice(char) text, size_t *pos, long long *value) {
+  while (*pos < text.len && text.ptr[*pos] == ' ')
+    (*pos)++;
+  bool negative = *pos < text.len && text.ptr[*pos] == '-';
+  if (negative)
+    (*pos)++;
+  if (*pos >= text.len || !isdigit(text.ptr[*pos]))
+    return false;
+  long long result = 0;
+  while (*pos < text.len && isdigit(text.ptr[*pos]))
+    result = result * 10 + (text.ptr[(*pos)++] - '0');
+  *value = negative ? -result : result;
+  while (*pos < text.len && strchr(" ,)", text.ptr[*pos]))
+    (*pos)++;
+  return true;
+}
+
+// for /l bounds that are literal numbers give the trip count
+static bool forTripCount(Slice(char) text, size_t *trip_count) {
+  size_t pos = 0;
+  while (pos + 5 <= text.len && memcmp(text.ptr + pos, " in (", 5) != 0)
+    pos++;
+  if (pos + 5 > text.len)
+    return false;
+  pos += 5;
+  long long from, step, to;
+  if (!parseSigned(text, &pos, &from) || !parseSigned(text, &pos, &step) ||
+      !parseSigned(text, &pos, &to))
+    return false;
+  if (step > 0 && to >= from)
+    *trip_count = (size_t)((to - from) / step + 1);
+  else if (step < 0 && from >= to)
+    *trip_count = (size_t)((from - to) / -step + 1);
+  else
+    *trip_count = 0;
+  return true;
+}
+
+static void appendLoop(CostModel *model, CostLoop loop) {
+  for (size_t i = 0; i < model->loops.slice.len; i++) {
+    CostLoop *other = &model->loops.slice.ptr[i];
+    // several gotos back to one label, like tail calls from two branches
+    if (other->first == loop.first && other->label.len && loop.label.len) {
+      if (loop.last > other->last)
+        other->last = loop.last;
+      return;
+    }
+  }
+  if (!append(&model->loops, CostLoop, &loop))
+    panic("Failed to append loop");
+}
+
+static void findCostLoops(CostModel *model) {
+  Result(Vec_Slice_char) targets_res = createVec(model->ally, Slice_char, 4);
+  Result(Vec_Slice_char) prefixes_res = createVec(model->ally, Slice_char, 4);
+  if (!targets_res.ok || !prefixes_res.ok)
+    panic("Failed to allocate jump targets");
+  Vec(Slice_char) targets = targets_res.val;
+  Vec(Slice_char) prefixes = prefixes_res.val;
+  for (size_t i = 0; i < model->lines.len; i++) {
+    Slice(char) text = model->lines.ptr[i].text;
+    if (commandStartsWith(text, "for /l ") && opensBlock(text)) {
+      CostLoop loop = {.first = i,
+                       .last = i,
+                       .label = {.ptr = NULL, .len = 0},
+                       .counted = false,
+                       .trip_count = 0};
+      loop.counted = forTripCount(text, &loop.trip_count);
+      size_t depth = 1;
+      for (size_t j = i + 1; j < model->lines.len && depth > 0; j++) {
+        if (closesBlock(model->lines.ptr[j].text))
+          depth--;
+        if (opensBlock(model->lines.ptr[j].text))
+          depth++;
+        loop.last = j;
+      }
+      appendLoop(model, loop);
+    }
+    targets.slice.len = 0;
+    prefixes.slice.len = 0;
+    // a call back to an earlier label is recursion, which returns
+    size_t pos = 0;
+    for (Slice(char) segment = nextSegment(text, &pos); segment.len > 0;
+         segment = nextSegment(text, &pos)) {
+      if (!commandStartsWith(segment, "call"))
+        collectJumps(segment, &targets, &prefixes);
+    }
+    for (size_t t = 0; t < targets.slice.len; t++) {
+      size_t label = findCostLabel(model, targets.slice.ptr[t]);
+      if (label == SIZE_MAX || label > i)
+        continue;
+      appendLoop(model, (CostLoop){.first = label,
+                                   .last = i,
+                                   .label = targets.slice.ptr[t],
+                                   .counted = false,
+                                   .trip_count = 0});
+    }
+  }
+  for (size_t l = 0; l < model->loops.slice.len; l++) {
+    CostLoop loop = model->loops.slice.ptr[l];
+    if (!loop.counted)
+      continue;
+    // the for line itself runs once, its body every iteration
+    for (size_t i = loop.first + 1; i < loop.last; i++) {
+      model->lines.ptr[i].weight *= loop.trip_count;
+    }
+  }
+}
+
+static int byFirstLine(const void *a, const void *b) {
+  const CostRegion *x = a;
+  const CostRegion *y = b;
+  return (x->first > y->first) - (x->first < y->first);
+}
+
+// Every function of the program that has a label in the output starts a
+// region there, which ends where the next one starts. Everything before the
+// first one is the main program.
+static void findCostRegions(CostModel *model, IrProgram *program) {
+  CostRegion main_region = {.name = {.ptr = "main", .len = 4},
+                            .label = {.ptr = NULL, .len = 0},
+                            .first = 0,
+                            .last = model->lines.len,
+                            .entered = false};
+  if (!append(&model->regions, CostRegion, &main_region))
+    panic("Failed to append region");
+  for (size_t i = 1; i < program->functions.slice.len; i++) {
+    IrFunction *fn = &program->functions.slice.ptr[i];
+    size_t first = findCostLabel(model, fn->label);
+    bool known = false;
+    for (size_t r = 0; r < model->regions.slice.len; r++) {
+      if (model->regions.slice.ptr[r].first == first)
+        known = true;
+    }
+    // functions that were only defined as macros have no label
+    if (first == SIZE_MAX || known)
+      continue;
+    CostRegion region = {.name = fn->name,
+                         .label = fn->label,
+                         .first = first,
+                         .last = model->lines.len,
+                         .entered = fn->subroutine};
+    if (!append(&model->regions, CostRegion, &region))
+      panic("Failed to append region");
+  }
+  Slice(CostRegion) regions = model->regions.slice;
+  qsort(regions.ptr, regions.len, sizeof(CostRegion), byFirstLine);
+  for (size_t r = 0; r + 1 < regions.len; r++) {
+    regions.ptr[r].last = regions.ptr[r + 1].first;
+  }
+}
+
+// Whether the command enters another function along with the frame opened
+// for it on the same line, as subroutine and macro calls do
+static bool entersFunction(CostModel *model, Slice(char) segment) {
+  if (commandStartsWith(segment, "%__macro_"))
+    return true;
+  if (!commandStartsWith(segment, "goto :"))
+    return false;
+  Slice(char) target = {.ptr = segment.ptr + 6, .len = segment.len - 6};
+  for (size_t r = 0; r < model->regions.slice.len; r++) {
+    Slice(char) label = model->regions.slice.ptr[r].label;
+    if (label.len > 0 && eqlIgnoreCase(label, target))
+      return true;
+  }
+  return false;
+}
+
+// Whether the command leaves the function, so the lines after it are
+// reached along another path with the frames that path has open
+static bool leavesFunction(Slice(char) segment) {
+  return commandStartsWith(segment, "exit") ||
+         commandStartsWith(segment, "goto :_return") ||
+         commandStartsWith(segment, "goto :eof");
+}
+
+static void writeJsonString(FILE *file, Slice(char) text) {
+  fputc('"', file);
+  for (size_t i = 0; i < text.len; i++) {
+    char c = text.ptr[i];
+    if (c == '"' || c == '\\')
+      fputc('\\', file);
+    fputc(c, file);
+  }
+  fputc('"', file);
+}
+
+static size_t indexOfName(Slice(Slice_char) names, Slice(char) name) {
+  for (size_t i = 0; i < names.len; i++) {
+    if (eqlIgnoreCase(names.ptr[i], name))
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+// Tracks the variables a set command defines or clears
+static void trackAssignment(Vec(Slice_char) * live, size_t *defined,
+                            Slice(char) segment) {
+  if (!commandStartsWith(segment, "set "))
+    return;
+  Slice(char) body = {.ptr = segment.ptr + 4, .len = segment.len - 4};
+  bool arithmetic = commandStartsWith(body, "/a ");
+  if (arithmetic) {
+    body.ptr += 3;
+    body.len -= 3;
+  }
+  if (body.len > 0 && body.ptr[0] == '"') {
+    body.ptr++;
+    body.len--;
+    if (body.len > 0 && body.ptr[body.len - 1] == '"')
+      body.len--;
+  }
+  size_t depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= body.len; i++) {
+    char c = i < body.len ? body.ptr[i] : ',';
+    if (c == '(')
+      depth++;
+    else if (c == ')' && depth > 0)
+      depth--;
+    if (i < body.len && !(arithmetic && depth == 0 && c == ','))
+      continue;
+    Slice(char) name = {.ptr = body.ptr + start, .len = 0};
+    while (start + name.len < i && name.ptr[name.len] != '=')
+      name.len++;
+    bool cleared = !arithmetic && start + name.len + 1 == i;
+    while (name.len > 0 && strchr(" +-*/%&|^<>", name.ptr[name.len - 1]))
+      name.len--;
+    start = i + 1;
+    if (name.len == 0)
+      continue;
+    size_t index = indexOfName(live->slice, name);
+    if (cleared && index != SIZE_MAX) {
+      live->slice.ptr[index] = live->slice.ptr[--live->slice.len];
+    } else if (!cleared && index == SIZE_MAX) {
+      if (!append(live, Slice_char, &name))
+        panic("Failed to append variable");
+      (*defined)++;
+    }
+  }
+}
+
+static void writeRegion(FILE *file, CostModel *model, CostRegion region) {
+  size_t commands = 0;
+  size_t weighted = 0;
+  size_t depth = region.entered ? 1 : 0;
+  size_t max_depth = depth;
+  size_t defined = 0;
+  size_t peak = 0;
+  Result(Vec_Slice_char) live_res = createVec(model->ally, Slice_char, 16);
+  if (!live_res.ok)
+    panic(live_res.err);
+  Vec(Slice_char) live = live_res.val;
+  for (size_t i = region.first; i < region.last; i++) {
+    CostLine line = model->lines.ptr[i];
+    size_t count = countCommands(line.text);
+    commands += count;
+    weighted += count * line.weight;
+    // the frame a subroutine or macro call opens is counted in the callee
+    bool enters = false;
+    bool leaves = false;
+    size_t pos = 0;
+    for (Slice(char) segment = nextSegment(line.text, &pos); segment.len > 0;
+         segment = nextSegment(line.text, &pos)) {
+      if (entersFunction(model, segment))
+        enters = true;
+      if (leavesFunction(segment))
+        leaves = true;
+    }
+    size_t before = depth;
+    pos = 0;
+    for (Slice(char) segment = nextSegment(line.text, &pos); segment.len > 0;
+         segment = nextSegment(line.text, &pos)) {
+      if (commandStartsWith(segment, "setlocal") && !enters &&
+          ++depth > max_depth)
+        max_depth = depth;
+      if (commandStartsWith(segment, "endlocal") && depth > 0)
+        depth--;
+      trackAssignment(&live, &defined, segment);
+      if (live.slice.len > peak)
+        peak = live.slice.len;
+    }
+    if (leaves)
+      depth = before;
+  }
+
+  fprintf(file, "    {\n      \"name\": ");
+  writeJsonString(file, region.name);
+  fprintf(file,
+          ",\n      \"line\": %zu,\n      \"commands\": %zu,\n"
+          "      \"weighted_commands\": %zu,\n"
+          "      \"setlocal_depth\": %zu,\n"
+          "      \"variables\": %zu,\n      \"live_variables\": %zu,\n",
+          region.first + 1, commands, weighted, max_depth, defined, peak);
+
+  fprintf(file, "      \"jumps\": [");
+  Result(Vec_Slice_char) targets_res = createVec(model->ally, Slice_char, 4);
+  Result(Vec_Slice_char) prefixes_res = createVec(model->ally, Slice_char, 4);
+  if (!targets_res.ok || !prefixes_res.ok)
+    panic("Failed to allocate jump targets");
+  Vec(Slice_char) targets = targets_res.val;
+  Vec(Slice_char) prefixes = prefixes_res.val;
+  size_t jumps = 0;
+  size_t scanned = 0;
+  for (size_t i = region.first; i < region.last; i++) {
+    CostLine line = model->lines.ptr[i];
+    size_t pos = 0;
+    for (Slice(char) segment = nextSegment(line.text, &pos); segment.len > 0;
+         segment = nextSegment(line.text, &pos)) {
+      targets.slice.len = 0;
+      prefixes.slice.len = 0;
+      collectJumps(segment, &targets, &prefixes);
+      bool computed = targets.slice.len == 0;
+      Slice(char) target =
+          computed ? (prefixes.slice.len ? prefixes.slice.ptr[0]
+                                         : (Slice(char)){.ptr = NULL, .len = 0})
+                   : targets.slice.ptr[0];
+      if ((!computed && eqlIgnoreCase(target, (Slice(char)){.ptr = "eof",
+                                                              .len = 3})) ||
+          (computed && prefixes.slice.len == 0))
+        continue;
+      size_t label = computed ? SIZE_MAX : findCostLabel(model, target);
+      fprintf(file, "%s\n        {\"line\": %zu, \"kind\": \"%s\", ",
+              jumps++ ? "," : "", i + 1,
+              commandStartsWith(segment, "call") ? "call" : "goto");
+      fprintf(file, "\"target\": ");
+      writeJsonString(file, target);
+      fprintf(file, ", \"computed\": %s, \"executions\": %zu, ",
+              computed ? "true" : "false", line.weight);
+      if (label == SIZE_MAX) {
+        fprintf(file, "\"scan_bytes\": null}");
+        continue;
+      }
+      size_t distance = scanDistance(model, i, label);
+      scanned += distance * line.weight;
+      fprintf(file, "\"scan_bytes\": %zu}", distance);
+    }
+  }
+  fprintf(file, "%s],\n      \"weighted_scan_bytes\": %zu,\n",
+          jumps ? "\n      " : "", scanned);
+
+  fprintf(file, "      \"loops\": [");
+  size_t loops = 0;
+  for (size_t l = 0; l < model->loops.slice.len; l++) {
+    CostLoop loop = model->loops.slice.ptr[l];
+    if (loop.first < region.first || loop.first >= region.last)
+      continue;
+    size_t body = 0;
+    size_t body_weighted = 0;
+    size_t nesting = 0;
+    // a goto loop ends with its back edge, a for loop with the closing
+    // parenthesis
+    size_t end = loop.label.len ? loop.last + 1 : loop.last;
+    for (size_t i = loop.first + 1; i < end; i++) {
+      size_t count = countCommands(model->lines.ptr[i].text);
+      body += count;
+      body_weighted += count * model->lines.ptr[i].weight;
+    }
+    for (size_t o = 0; o < model->loops.slice.len; o++) {
+      CostLoop outer = model->loops.slice.ptr[o];
+      if (o != l && outer.first <= loop.first && outer.last >= loop.last)
+        nesting++;
+    }
+    fprintf(file, "%s\n        {\"line\": %zu, \"kind\": \"%s\", ",
+            loops++ ? "," : "", loop.first + 1,
+            loop.label.len ? "goto" : "for");
+    if (loop.label.len) {
+      fprintf(file, "\"label\": ");
+      writeJsonString(file, loop.label);
+      fprintf(file, ", \"back_edge_scan_bytes\": %zu, ",
+              scanDistance(model, loop.last, loop.first));
+    }
+    if (loop.counted)
+      fprintf(file, "\"trip_count\": %zu, ", loop.trip_count);
+    else
+      fprintf(file, "\"trip_count\": null, ");
+    fprintf(file,
+            "\"depth\": %zu, \"commands\": %zu, \"weighted_commands\": %zu}",
+            nesting, body, body_weighted);
+  }
+  fprintf(file, "%s]\n    }", loops ? "\n      " : "");
+}
+
+static void writeCostReport(Allocator ally, IrProgram *program,
+                            Slice(char) batch, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Error: Could not write cost report: %s\n", path);
+    return;
+  }
+  Vec(Command) commands = splitCommands(ally, batch);
+  Result(Vec_CostLine) lines_res =
+      createVec(ally, CostLine, commands.slice.len + 1);
+  Result(Vec_CostLoop) loops_res = createVec(ally, CostLoop, 8);
+  Result(Vec_CostRegion) regions_res = createVec(ally, CostRegion, 8);
+  if (!lines_res.ok || !loops_res.ok || !regions_res.ok)
+    panic("Failed to allocate cost model");
+  Vec(CostLine) lines = lines_res.val;
+  for (size_t i = 0; i < commands.slice.len; i++) {
+    Command cmd = commands.slice.ptr[i];
+    size_t start = (size_t)(cmd.text.ptr - batch.ptr) - (cmd.quiet ? 1 : 0);
+    CostLine line = {.text = cmd.text,
+                     .start = start,
+                     .end = start + commandBytes(cmd),
+                     .weight = 1};
+    if (!append(&lines, CostLine, &line))
+      panic("Failed to append line");
+  }
+  CostModel model = {
+      .ally = ally,
+      .lines = lines.slice,
+      .loops = loops_res.val,
+      .regions = regions_res.val,
+      .bytes = batch.len,
+  };
+  findCostLoops(&model);
+  findCostRegions(&model, program);
+
+  size_t total = 0;
+  size_t weighted = 0;
+  for (size_t i = 0; i < model.lines.len; i++) {
+    size_t count = countCommands(model.lines.ptr[i].text);
+    total += count;
+    weighted += count * model.lines.ptr[i].weight;
+  }
+  fprintf(file,
+          "{\n  \"bytes\": %zu,\n  \"lines\": %zu,\n  \"commands\": %zu,\n"
+          "  \"weighted_commands\": %zu,\n  \"functions\": [\n",
+          model.bytes, model.lines.len, total, weighted);
+  for (size_t i = 0; i < model.regions.slice.len; i++) {
+    writeRegion(file, &model, model.regions.slice.ptr[i]);
+    fputs(i + 1 < model.regions.slice.len ? ",\n" : "\n", file);
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  fprintf(stdout,
+          "Cost report: %zu commands, %zu weighted by known trip counts, "
+          "in %s\n",
+          total, weighted, path);
+}
+
+#endif /* COST_H */
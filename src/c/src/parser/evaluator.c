@@ -0,0 +1,860 @@
+#ifndef EVALUATOR_H
+#define EVALUATOR_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "../std/eql.c"
+#include "ast.c"
+#include "inliner.c"
+#include "parser.c"
+#include "sema.c"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Calls of pure functions with constant arguments are run at compile time
+// and replaced by the literal they return. A function is pure when it only
+// reads and writes its own parameters and locals, contains no inline batch
+// and only calls pure functions, so running it leaves nothing behind.
+// Recursive pure functions whose calls are left get a cache at runtime.
+
+// steps one evaluation may take before it is given up
+#define EVALUATION_FUEL 10000
+#define EVALUATION_DEPTH 32
+#define MAX_OPERANDS 64
+
+typedef struct {
+  bool number;
+  long long value;
+  // the literal of a string
+  Slice(char) text;
+} Constant;
+
+typedef struct {
+  Slice(char) name;
+  Constant value;
+} ConstantBinding;
+
+DefSlice(ConstantBinding);
+DefVec(ConstantBinding);
+DefResult(Vec_ConstantBinding);
+DefResult(Slice_InlineCandidate);
+
+typedef struct {
+  Allocator ally;
+  // the functions by name, with their calls counted
+  Inliner functions;
+  bool *pure;
+  // pure functions whose calls go through a cache
+  bool *memoized;
+  Vec(ConstantBinding) variables;
+  // where the variables of the running call start
+  size_t frame;
+  size_t fuel;
+  size_t depth;
+  Constant returned;
+} Evaluator;
+
+typedef enum {
+  EvalNext,
+  EvalReturn,
+  EvalFailed,
+} EvalFlow;
+
+static size_t pureIndex(Evaluator *ev, Slice(char) name) {
+  InlineCandidate *candidate = findCandidate(&ev->functions, name);
+  if (!candidate || candidate->duplicate)
+    return (size_t)-1;
+  return (size_t)(candidate - ev->functions.candidates.slice.ptr);
+}
+
+static bool expressionPure(Evaluator *ev, Expression expr,
+                           Slice(Slice_char) locals) {
+  switch (expr.type) {
+  case IdentifierExpression: {
+    return nameListHas(locals, expr.identifier);
+  }
+  case NumericExpression:
+  case StringExpression: {
+    return true;
+  }
+  case CallExpression: {
+    if (expr.call.callee->type != IdentifierExpression ||
+        nameListHas(locals, expr.call.callee->identifier))
+      return false;
+    size_t index = pureIndex(ev, expr.call.callee->identifier);
+    if (index == (size_t)-1 || !ev->pure[index])
+      return false;
+    for (size_t i = 0; i < expr.call.parameters_len; i++) {
+      if (!expressionPure(ev, expr.call.parameters[i], locals))
+        return false;
+    }
+    return true;
+  }
+  case ArithmeticExpression: {
+    return expressionPure(ev, *expr.arithmetic.left, locals) &&
+           expressionPure(ev, *expr.arithmetic.right, locals);
+  }
+  case FunctionExpression:
+  case ArrayExpression:
+  case IndexExpression: {
+    return false;
+  }
+  }
+}
+
+static bool statementPure(Evaluator *ev, Statement stmt,
+                          Slice(Slice_char) locals) {
+  switch (stmt.type) {
+  case ExpressionStatement: {
+    return expressionPure(ev, stmt.expression, locals);
+  }
+  case DeclarationStatement: {
+    return expressionPure(ev, stmt.declaration.value, locals);
+  }
+  case AssignmentStatement: {
+    return !stmt.assignment.index &&
+           nameListHas(locals, stmt.assignment.name) &&
+           expressionPure(ev, stmt.assignment.value, locals);
+  }
+  case IfStatement: {
+    return expressionPure(ev, stmt.if_statement->condition, locals) &&
+           statementPure(ev, *stmt.if_statement->consequence, locals) &&
+           (!stmt.if_statement->alternate ||
+            statementPure(ev, *stmt.if_statement->alternate, locals));
+  }
+  case WhileStatement: {
+    return expressionPure(ev, stmt.while_statement->condition, locals) &&
+           statementPure(ev, *stmt.while_statement->body, locals);
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    if (!expressionPure(ev, switch_statement->subject, locals))
+      return false;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      if (!statementPure(ev, *switch_statement->cases.ptr[i].body, locals))
+        return false;
+    }
+    return !switch_statement->otherwise ||
+           statementPure(ev, *switch_statement->otherwise, locals);
+  }
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      if (!statementPure(ev, stmt.block->statements.ptr[i], locals))
+        return false;
+    }
+    return true;
+  }
+  case ReturnStatement: {
+    return !stmt.return_statement ||
+           expressionPure(ev, *stmt.return_statement, locals);
+  }
+  case InlineBatchStatement: {
+    return false;
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+// Starts from every function being pure and takes it back from the ones
+// that touch something else, until that stops changing
+static void findPureFunctions(Evaluator *ev) {
+  Slice(InlineCandidate) candidates = ev->functions.candidates.slice;
+  for (size_t i = 0; i < candidates.len; i++) {
+    ev->pure[i] = !candidates.ptr[i].duplicate;
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < candidates.len; i++) {
+      if (!ev->pure[i])
+        continue;
+      Expression function = candidates.ptr[i].function;
+      Result(Vec_Slice_char) locals_res = createVec(ev->ally, Slice_char, 4);
+      if (!locals_res.ok)
+        panic(locals_res.err);
+      Vec(Slice_char) locals = locals_res.val;
+      for (size_t j = 0; j < function.function_expression.parameters_len;
+           j++) {
+        if (!append(&locals, Slice_char,
+                    &function.function_expression.parameters[j].identifier))
+          panic("Failed to append parameter");
+      }
+      collectDeclaredNames(*function.function_expression.body, &locals);
+      if (!statementPure(ev, *function.function_expression.body,
+                         locals.slice)) {
+        ev->pure[i] = false;
+        changed = true;
+      }
+    }
+  }
+}
+
+static long long wrapInt32(long long value) {
+  unsigned long long bits = (unsigned long long)value & 0xffffffffULL;
+  if (bits >= 0x80000000ULL)
+    return (long long)bits - 0x100000000LL;
+  return (long long)bits;
+}
+
+// Only plain decimals read the same in set /a and in a string comparison
+static bool parseDecimal(Slice(char) text, long long *out) {
+  size_t start = text.len > 0 && text.ptr[0] == '-' ? 1 : 0;
+  size_t digits = text.len - start;
+  if (digits == 0 || digits > 10 || (digits > 1 && text.ptr[start] == '0'))
+    return false;
+  long long value = 0;
+  for (size_t i = start; i < text.len; i++) {
+    if (text.ptr[i] < '0' || text.ptr[i] > '9')
+      return false;
+    value = value * 10 + (text.ptr[i] - '0');
+  }
+  if (start)
+    value = -value;
+  if (value != wrapInt32(value))
+    return false;
+  *out = value;
+  return true;
+}
+
+static bool toNumber(Constant constant, long long *out) {
+  if (constant.number) {
+    *out = constant.value;
+    return true;
+  }
+  return parseDecimal(constant.text, out);
+}
+
+static Constant numberConstant(long long value) {
+  return (Constant){.number = true, .value = value};
+}
+
+static bool constantsEqual(Constant a, Constant b) {
+  if (a.number && b.number)
+    return a.value == b.value;
+  char a_buf[32];
+  char b_buf[32];
+  Slice(char) a_text = a.text;
+  Slice(char) b_text = b.text;
+  if (a.number)
+    a_text = (Slice(char)){.ptr = a_buf,
+                           .len = (size_t)snprintf(a_buf, sizeof(a_buf),
+                                                   "%lld", a.value)};
+  if (b.number)
+    b_text = (Slice(char)){.ptr = b_buf,
+                           .len = (size_t)snprintf(b_buf, sizeof(b_buf),
+                                                   "%lld", b.value)};
+  return eql(a_text, b_text);
+}
+
+// Conditions hold when they are the boolean 1
+static bool isTrue(Constant constant) {
+  return constantsEqual(constant, numberConstant(1));
+}
+
+static bool isProductSymbol(char symbol) {
+  return symbol == '*' || symbol == '/' || symbol == '%';
+}
+
+typedef struct {
+  Expression operands[MAX_OPERANDS];
+  Constant values[MAX_OPERANDS];
+  char symbols[MAX_OPERANDS];
+  size_t len;
+} OperandChain;
+
+static bool evaluateExpression(Evaluator *ev, Expression expr, Constant *out);
+
+static bool flattenOperands(Expression expr, char symbol,
+                            OperandChain *chain) {
+  if (expr.type == ArithmeticExpression) {
+    return flattenOperands(*expr.arithmetic.left, symbol, chain) &&
+           flattenOperands(*expr.arithmetic.right, expr.arithmetic.op, chain);
+  }
+  if (chain->len == MAX_OPERANDS)
+    return false;
+  chain->symbols[chain->len] = symbol;
+  chain->operands[chain->len++] = expr;
+  return true;
+}
+
+// Reads the operands from start to end left to right like the IR builder
+// does, before any of them is combined
+static bool evaluateOperands(Evaluator *ev, OperandChain *chain, size_t start,
+                             size_t end) {
+  for (size_t i = start; i < end; i++) {
+    if (!evaluateExpression(ev, chain->operands[i], &chain->values[i]))
+      return false;
+  }
+  return true;
+}
+
+static bool evaluateProduct(OperandChain *chain, size_t end, size_t *pos,
+                            long long *out) {
+  long long left;
+  if (!toNumber(chain->values[(*pos)++], &left))
+    return false;
+  while (*pos < end && isProductSymbol(chain->symbols[*pos])) {
+    char symbol = chain->symbols[*pos];
+    long long right;
+    if (!toNumber(chain->values[(*pos)++], &right))
+      return false;
+    if (symbol == '*') {
+      left = wrapInt32(left * right);
+      continue;
+    }
+    // set /a fails on these instead of giving a value
+    if (right == 0 || (left == -2147483648LL && right == -1))
+      return false;
+    left = symbol == '/' ? left / right : left % right;
+  }
+  *out = left;
+  return true;
+}
+
+static bool evaluateSum(OperandChain *chain, size_t start, size_t end,
+                        long long *out) {
+  size_t pos = start;
+  long long total;
+  if (!evaluateProduct(chain, end, &pos, &total))
+    return false;
+  while (pos < end) {
+    char symbol = chain->symbols[pos];
+    long long term;
+    if ((symbol != '+' && symbol != '-') ||
+        !evaluateProduct(chain, end, &pos, &term))
+      return false;
+    total = wrapInt32(symbol == '+' ? total + term : total - term);
+  }
+  *out = total;
+  return true;
+}
+
+static bool compareNumbers(char symbol, long long left, long long right) {
+  return symbol == '='   ? left == right
+         : symbol == '!' ? left != right
+         : symbol == '<' ? left < right
+         : symbol == 'L' ? left <= right
+         : symbol == '>' ? left > right
+                         : left >= right;
+}
+
+// The comparison between start and end, or its sum when there is none
+static bool evaluateComparison(Evaluator *ev, OperandChain *chain,
+                               size_t start, size_t end, long long *out) {
+  if (!evaluateOperands(ev, chain, start, end))
+    return false;
+  size_t split = end;
+  for (size_t i = start + 1; i < end && split == end; i++) {
+    if (isComparison(chain->symbols[i]))
+      split = i;
+  }
+  long long left;
+  if (!evaluateSum(chain, start, split, &left))
+    return false;
+  if (split == end) {
+    *out = left;
+    return true;
+  }
+  char symbol = chain->symbols[split];
+  // cmd orders anything that is not a number as text
+  for (size_t i = start; i < end && symbol != '=' && symbol != '!'; i++) {
+    if (!chain->values[i].number)
+      return false;
+  }
+  long long right;
+  if (!evaluateSum(chain, split, end, &right))
+    return false;
+  *out = compareNumbers(symbol, left, right);
+  return true;
+}
+
+static bool evaluateArithmetic(Evaluator *ev, Expression expr,
+                               Constant *out) {
+  OperandChain chain = {.len = 0};
+  if (!flattenOperands(expr, 0, &chain))
+    return false;
+  // && binds tighter than ||, and the comparisons whose outcome no longer
+  // matters are not read at all
+  bool holds = true;
+  size_t start = 0;
+  while (start < chain.len) {
+    size_t end = start + 1;
+    while (end < chain.len && !isLogical(chain.symbols[end]))
+      end++;
+    if (start == 0 && end == chain.len) {
+      long long value;
+      if (!evaluateComparison(ev, &chain, start, end, &value))
+        return false;
+      *out = numberConstant(value);
+      return true;
+    }
+    if (start > 0 && chain.symbols[start] == '|') {
+      if (holds) {
+        *out = numberConstant(1);
+        return true;
+      }
+      holds = true;
+    }
+    if (holds) {
+      long long value;
+      if (!evaluateComparison(ev, &chain, start, end, &value))
+        return false;
+      holds = value == 1;
+    }
+    start = end;
+  }
+  *out = numberConstant(holds);
+  return true;
+}
+
+static EvalFlow evaluateStatement(Evaluator *ev, Statement stmt);
+
+static bool callFunction(Evaluator *ev, size_t index, Constant *args,
+                         size_t args_len, Constant *out) {
+  if (ev->depth == EVALUATION_DEPTH)
+    return false;
+  Expression function = ev->functions.candidates.slice.ptr[index].function;
+  size_t outer = ev->frame;
+  size_t mark = ev->variables.slice.len;
+  ev->frame = mark;
+  for (size_t i = 0; i < function.function_expression.parameters_len; i++) {
+    // missing arguments are empty
+    ConstantBinding binding = {
+        .name = function.function_expression.parameters[i].identifier,
+        .value = i < args_len ? args[i]
+                              : (Constant){.number = false,
+                                           .text = {.ptr = "", .len = 0}},
+    };
+    if (!append(&ev->variables, ConstantBinding, &binding))
+      panic("Failed to append binding");
+  }
+  ev->depth++;
+  EvalFlow flow = evaluateStatement(ev, *function.function_expression.body);
+  ev->depth--;
+  ev->variables.slice.len = mark;
+  ev->frame = outer;
+  // falling off the end leaves __ret__ as it was
+  if (flow != EvalReturn)
+    return false;
+  *out = ev->returned;
+  return true;
+}
+
+static ConstantBinding *findBinding(Evaluator *ev, Slice(char) name) {
+  for (size_t i = ev->variables.slice.len; i > ev->frame; i--) {
+    if (eql(ev->variables.slice.ptr[i - 1].name, name))
+      return &ev->variables.slice.ptr[i - 1];
+  }
+  return NULL;
+}
+
+static bool evaluateExpression(Evaluator *ev, Expression expr,
+                               Constant *out) {
+  if (ev->fuel == 0)
+    return false;
+  ev->fuel--;
+  switch (expr.type) {
+  case IdentifierExpression: {
+    ConstantBinding *binding = findBinding(ev, expr.identifier);
+    if (!binding)
+      return false;
+    *out = binding->value;
+    return true;
+  }
+  case NumericExpression: {
+    long long value;
+    if (!parseDecimal(expr.number, &value))
+      return false;
+    *out = numberConstant(value);
+    return true;
+  }
+  case StringExpression: {
+    *out = (Constant){.number = false, .text = expr.string};
+    return true;
+  }
+  case ArithmeticExpression: {
+    return evaluateArithmetic(ev, expr, out);
+  }
+  case CallExpression: {
+    if (expr.call.callee->type != IdentifierExpression ||
+        expr.call.parameters_len > MAX_OPERANDS ||
+        findBinding(ev, expr.call.callee->identifier))
+      return false;
+    size_t index = pureIndex(ev, expr.call.callee->identifier);
+    if (index == (size_t)-1 || !ev->pure[index])
+      return false;
+    Constant args[MAX_OPERANDS];
+    for (size_t i = 0; i < expr.call.parameters_len; i++) {
+      if (!evaluateExpression(ev, expr.call.parameters[i], &args[i]))
+        return false;
+    }
+    return callFunction(ev, index, args, expr.call.parameters_len, out);
+  }
+  case FunctionExpression:
+  case ArrayExpression:
+  case IndexExpression: {
+    return false;
+  }
+  }
+}
+
+static EvalFlow evaluateStatement(Evaluator *ev, Statement stmt) {
+  if (ev->fuel == 0)
+    return EvalFailed;
+  ev->fuel--;
+  switch (stmt.type) {
+  case ExpressionStatement: {
+    Constant ignored;
+    return evaluateExpression(ev, stmt.expression, &ignored) ? EvalNext
+                                                             : EvalFailed;
+  }
+  case DeclarationStatement: {
+    ConstantBinding binding = {.name = stmt.declaration.name};
+    if (!evaluateExpression(ev, stmt.declaration.value, &binding.value))
+      return EvalFailed;
+    if (!append(&ev->variables, ConstantBinding, &binding))
+      panic("Failed to append binding");
+    return EvalNext;
+  }
+  case AssignmentStatement: {
+    Constant value;
+    if (stmt.assignment.index ||
+        !evaluateExpression(ev, stmt.assignment.value, &value))
+      return EvalFailed;
+    ConstantBinding *binding = findBinding(ev, stmt.assignment.name);
+    if (!binding)
+      return EvalFailed;
+    binding->value = value;
+    return EvalNext;
+  }
+  case IfStatement: {
+    Constant condition;
+    if (!evaluateExpression(ev, stmt.if_statement->condition, &condition))
+      return EvalFailed;
+    if (isTrue(condition))
+      return evaluateStatement(ev, *stmt.if_statement->consequence);
+    if (stmt.if_statement->alternate)
+      return evaluateStatement(ev, *stmt.if_statement->alternate);
+    return EvalNext;
+  }
+  case WhileStatement: {
+    while (true) {
+      Constant condition;
+      if (!evaluateExpression(ev, stmt.while_statement->condition,
+                              &condition))
+        return EvalFailed;
+      if (!isTrue(condition))
+        return EvalNext;
+      EvalFlow flow = evaluateStatement(ev, *stmt.while_statement->body);
+      if (flow != EvalNext)
+        return flow;
+    }
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    Constant subject;
+    if (!evaluateExpression(ev, switch_statement->subject, &subject))
+      return EvalFailed;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      Constant value;
+      if (!evaluateExpression(ev, switch_statement->cases.ptr[i].value,
+                              &value))
+        return EvalFailed;
+      if (constantsEqual(subject, value))
+        return evaluateStatement(ev, *switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      return evaluateStatement(ev, *switch_statement->otherwise);
+    return EvalNext;
+  }
+  case BlockStatement: {
+    // declarations in a block go away with it
+    size_t mark = ev->variables.slice.len;
+    EvalFlow flow = EvalNext;
+    for (size_t i = 0; i < stmt.block->statements.len && flow == EvalNext;
+         i++) {
+      flow = evaluateStatement(ev, stmt.block->statements.ptr[i]);
+    }
+    ev->variables.slice.len = mark;
+    return flow;
+  }
+  case ReturnStatement: {
+    ev->returned = (Constant){.number = false, .text = {.ptr = "", .len = 0}};
+    if (stmt.return_statement &&
+        !evaluateExpression(ev, *stmt.return_statement, &ev->returned))
+      return EvalFailed;
+    return EvalReturn;
+  }
+  case InlineBatchStatement: {
+    return EvalFailed;
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static Expression constantExpression(Allocator ally, Constant constant) {
+  if (!constant.number)
+    return (Expression){.type = StringExpression,
+                        .value_type = TypeString,
+                        .string = constant.text};
+  char text[32];
+  int len = snprintf(text, sizeof(text), "%lld", constant.value);
+  return (Expression){.type = NumericExpression,
+                      .value_type = TypeNumber,
+                      .number = allocName(ally, text, (size_t)len)};
+}
+
+typedef void CallVisitor(Evaluator *ev, Expression *call);
+
+static void visitCalls(Evaluator *ev, Statement *stmt, CallVisitor *visit);
+
+// Visits the arguments of a call before the call itself, so replacing them
+// is seen by the visit of the call
+static void visitCallsIn(Evaluator *ev, Expression *expr, CallVisitor *visit) {
+  switch (expr->type) {
+  case CallExpression: {
+    for (size_t i = 0; i < expr->call.parameters_len; i++) {
+      visitCallsIn(ev, &expr->call.parameters[i], visit);
+    }
+    visit(ev, expr);
+  } break;
+  case ArithmeticExpression: {
+    visitCallsIn(ev, expr->arithmetic.left, visit);
+    visitCallsIn(ev, expr->arithmetic.right, visit);
+  } break;
+  case FunctionExpression: {
+    visitCalls(ev, expr->function_expression.body, visit);
+  } break;
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr->array.elements_len; i++) {
+      visitCallsIn(ev, &expr->array.elements[i], visit);
+    }
+  } break;
+  case IndexExpression: {
+    visitCallsIn(ev, expr->element.index, visit);
+  } break;
+  case IdentifierExpression:
+  case NumericExpression:
+  case StringExpression: {
+  } break;
+  }
+}
+
+static void visitCalls(Evaluator *ev, Statement *stmt, CallVisitor *visit) {
+  switch (stmt->type) {
+  case ExpressionStatement: {
+    visitCallsIn(ev, &stmt->expression, visit);
+  } break;
+  case DeclarationStatement: {
+    visitCallsIn(ev, &stmt->declaration.value, visit);
+  } break;
+  case AssignmentStatement: {
+    if (stmt->assignment.index)
+      visitCallsIn(ev, stmt->assignment.index, visit);
+    visitCallsIn(ev, &stmt->assignment.value, visit);
+  } break;
+  case IfStatement: {
+    visitCallsIn(ev, &stmt->if_statement->condition, visit);
+    visitCalls(ev, stmt->if_statement->consequence, visit);
+    if (stmt->if_statement->alternate)
+      visitCalls(ev, stmt->if_statement->alternate, visit);
+  } break;
+  case WhileStatement: {
+    visitCallsIn(ev, &stmt->while_statement->condition, visit);
+    visitCalls(ev, stmt->while_statement->body, visit);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    visitCallsIn(ev, &switch_statement->subject, visit);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      visitCalls(ev, switch_statement->cases.ptr[i].body, visit);
+    }
+    if (switch_statement->otherwise)
+      visitCalls(ev, switch_statement->otherwise, visit);
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt->block->statements.len; i++) {
+      visitCalls(ev, &stmt->block->statements.ptr[i], visit);
+    }
+  } break;
+  case ReturnStatement: {
+    if (stmt->return_statement)
+      visitCallsIn(ev, stmt->return_statement, visit);
+  } break;
+  case InlineBatchStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static size_t calleeIndex(Evaluator *ev, Expression *call) {
+  if (call->call.callee->type != IdentifierExpression)
+    return (size_t)-1;
+  return pureIndex(ev, call->call.callee->identifier);
+}
+
+static void foldCall(Evaluator *ev, Expression *call) {
+  size_t index = calleeIndex(ev, call);
+  if (index == (size_t)-1 || !ev->pure[index])
+    return;
+  ev->variables.slice.len = 0;
+  ev->frame = 0;
+  ev->fuel = EVALUATION_FUEL;
+  ev->depth = 0;
+  Constant result;
+  if (!evaluateExpression(ev, *call, &result))
+    return;
+  *call = constantExpression(ev->ally, result);
+  ev->functions.candidates.slice.ptr[index].evaluated++;
+}
+
+// How often the body of a function calls it
+static size_t countSelfCalls(Evaluator *ev, size_t index) {
+  Slice(InlineCandidate) candidates = ev->functions.candidates.slice;
+  Result(Slice_InlineCandidate) saved_res =
+      alloc(ev->ally, InlineCandidate, candidates.len);
+  if (!saved_res.ok)
+    panic(saved_res.err);
+  Slice(InlineCandidate) saved = saved_res.val;
+  for (size_t j = 0; j < candidates.len; j++) {
+    saved.ptr[j] = candidates.ptr[j];
+    candidates.ptr[j].calls = 0;
+  }
+  countStatementReferences(
+      &ev->functions, *candidates.ptr[index].function.function_expression.body);
+  size_t self = candidates.ptr[index].calls;
+  for (size_t j = 0; j < candidates.len; j++) {
+    candidates.ptr[j] = saved.ptr[j];
+  }
+  return self;
+}
+
+// A recursive function whose outside calls were all evaluated still calls
+// itself, which must not keep it alive
+static void discountSelfCalls(Evaluator *ev) {
+  Slice(InlineCandidate) candidates = ev->functions.candidates.slice;
+  for (size_t i = 0; i < candidates.len; i++) {
+    if (candidates.ptr[i].evaluated > 0 && candidates.ptr[i].calls > 0)
+      candidates.ptr[i].calls -= countSelfCalls(ev, i);
+  }
+}
+
+// Cache entries are named after the arguments, which only numbers are safe
+// to put in
+static void checkMemoArguments(Evaluator *ev, Expression *call) {
+  size_t index = calleeIndex(ev, call);
+  if (index == (size_t)-1)
+    return;
+  Expression function = ev->functions.candidates.slice.ptr[index].function;
+  if (call->call.parameters_len != function.function_expression.parameters_len)
+    ev->memoized[index] = false;
+  for (size_t i = 0; i < call->call.parameters_len; i++) {
+    ValueType type = call->call.parameters[i].value_type;
+    if (type != TypeNumber && type != TypeBoolean)
+      ev->memoized[index] = false;
+  }
+}
+
+static void markMemoizedCall(Evaluator *ev, Expression *call) {
+  size_t index = calleeIndex(ev, call);
+  if (index != (size_t)-1 && ev->memoized[index])
+    call->call.memoized = true;
+}
+
+// A pure function that calls itself more than once, like a naive fibonacci,
+// sees the same arguments again and again, so its calls check a cache of
+// earlier results before they call it
+static void findMemoizedFunctions(Evaluator *ev, Program *prog) {
+  Slice(InlineCandidate) candidates = ev->functions.candidates.slice;
+  ev->memoized = allocFlags(ev->ally, candidates.len);
+  bool any = false;
+  for (size_t i = 0; i < candidates.len; i++) {
+    InlineCandidate candidate = candidates.ptr[i];
+    Expression function = candidate.function;
+    ev->memoized[i] = ev->pure[i] && !candidate.escapes &&
+                      candidate.calls > 0 &&
+                      function.function_expression.parameters_len > 0 &&
+                      endsInReturn(function.function_expression.body) &&
+                      countSelfCalls(ev, i) > 1;
+    if (ev->memoized[i])
+      any = true;
+  }
+  if (!any)
+    return;
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    visitCalls(ev, &prog->statements.ptr[i], checkMemoArguments);
+  }
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    visitCalls(ev, &prog->statements.ptr[i], markMemoizedCall);
+  }
+  for (size_t i = 0; i < candidates.len; i++) {
+    if (ev->memoized[i])
+      fprintf(stdout, "Memoized %1.*s\n", (int)candidates.ptr[i].name.len,
+              candidates.ptr[i].name.ptr);
+  }
+}
+
+static void evaluatePureCalls(Allocator ally, Program *prog) {
+  Result(Vec_InlineCandidate) candidates_res =
+      createVec(ally, InlineCandidate, 4);
+  if (!candidates_res.ok)
+    panic(candidates_res.err);
+  Result(Vec_ConstantBinding) variables_res =
+      createVec(ally, ConstantBinding, 8);
+  if (!variables_res.ok)
+    panic(variables_res.err);
+  Evaluator ev = {
+      .ally = ally,
+      .functions = {.ally = ally,
+                    .candidates = candidates_res.val,
+                    .threshold = 0,
+                    .instances = 0},
+      .pure = NULL,
+      .memoized = NULL,
+      .variables = variables_res.val,
+      .frame = 0,
+      .fuel = 0,
+      .depth = 0,
+  };
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    collectFunctions(&ev.functions, prog->statements.ptr[i]);
+  }
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    countStatementReferences(&ev.functions, prog->statements.ptr[i]);
+  }
+  Slice(InlineCandidate) candidates = ev.functions.candidates.slice;
+  if (candidates.len == 0)
+    return;
+  ev.pure = allocFlags(ally, candidates.len);
+  findPureFunctions(&ev);
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    visitCalls(&ev, &prog->statements.ptr[i], foldCall);
+  }
+
+  for (size_t i = 0; i < candidates.len; i++) {
+    candidates.ptr[i].calls = 0;
+    candidates.ptr[i].escapes = false;
+  }
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    countStatementReferences(&ev.functions, prog->statements.ptr[i]);
+  }
+  discountSelfCalls(&ev);
+  removeUncalledFunctions(&ev.functions, &prog->statements);
+  for (size_t i = 0; i < candidates.len; i++) {
+    InlineCandidate candidate = candidates.ptr[i];
+    if (candidate.evaluated > 0) {
+      fprintf(stdout, "Evaluated %1.*s at %zu call site%s\n",
+              (int)candidate.name.len, candidate.name.ptr,
+              candidate.evaluated, candidate.evaluated == 1 ? "" : "s");
+    }
+  }
+  findMemoizedFunctions(&ev, prog);
+}
+
+#endif /* EVALUATOR_H */
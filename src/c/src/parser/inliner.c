@@ -0,0 +1,833 @@
+#ifndef INLINER_H
+#define INLINER_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "../std/eql.c"
+#include "ast.c"
+#include "parser.c"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Functions with at most this many syntax nodes are inlined at every call
+// site, functions with a single call site are inlined regardless of size
+#define DEFAULT_INLINE_THRESHOLD 12
+
+typedef struct {
+  Slice(char) name;
+  Expression function;
+  size_t calls;
+  size_t inlined;
+  // calls the evaluator replaced by what they return
+  size_t evaluated;
+  bool escapes;
+  bool duplicate;
+} InlineCandidate;
+
+DefSlice(InlineCandidate);
+DefVec(InlineCandidate);
+DefResult(Vec_InlineCandidate);
+
+typedef struct {
+  Allocator ally;
+  Vec(InlineCandidate) candidates;
+  size_t threshold;
+  // inlined calls whose variables are still in use, which numbers the next
+  size_t instances;
+} Inliner;
+
+static InlineCandidate *findCandidate(Inliner *inliner, Slice(char) name) {
+  for (size_t i = 0; i < inliner->candidates.slice.len; i++) {
+    if (eql(inliner->candidates.slice.ptr[i].name, name))
+      return &inliner->candidates.slice.ptr[i];
+  }
+  return NULL;
+}
+
+static void collectFunctions(Inliner *inliner, Statement stmt) {
+  switch (stmt.type) {
+  case DeclarationStatement: {
+    if (stmt.declaration.value.type != FunctionExpression)
+      break;
+    InlineCandidate *existing = findCandidate(inliner, stmt.declaration.name);
+    if (existing) {
+      existing->duplicate = true;
+      break;
+    }
+    InlineCandidate candidate = {
+        .name = stmt.declaration.name,
+        .function = stmt.declaration.value,
+        .calls = 0,
+        .inlined = 0,
+        .evaluated = 0,
+        .escapes = false,
+        .duplicate = false,
+    };
+    if (!append(&inliner->candidates, InlineCandidate, &candidate))
+      panic("Failed to append inline candidate");
+    collectFunctions(inliner, *stmt.declaration.value.function_expression.body);
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      collectFunctions(inliner, stmt.block->statements.ptr[i]);
+    }
+  } break;
+  case IfStatement: {
+    collectFunctions(inliner, *stmt.if_statement->consequence);
+    if (stmt.if_statement->alternate)
+      collectFunctions(inliner, *stmt.if_statement->alternate);
+  } break;
+  case WhileStatement: {
+    collectFunctions(inliner, *stmt.while_statement->body);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      collectFunctions(inliner, *switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      collectFunctions(inliner, *switch_statement->otherwise);
+  } break;
+  case ExpressionStatement:
+  case AssignmentStatement:
+  case InlineBatchStatement:
+  case ReturnStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static void countStatementReferences(Inliner *inliner, Statement stmt);
+
+static void countExpressionReferences(Inliner *inliner, Expression expr) {
+  switch (expr.type) {
+  case IdentifierExpression: {
+    InlineCandidate *candidate = findCandidate(inliner, expr.identifier);
+    if (candidate)
+      candidate->escapes = true;
+  } break;
+  case CallExpression: {
+    if (expr.call.callee->type == IdentifierExpression) {
+      InlineCandidate *candidate =
+          findCandidate(inliner, expr.call.callee->identifier);
+      if (candidate)
+        candidate->calls++;
+    } else {
+      countExpressionReferences(inliner, *expr.call.callee);
+    }
+    for (size_t i = 0; i < expr.call.parameters_len; i++) {
+      countExpressionReferences(inliner, expr.call.parameters[i]);
+    }
+  } break;
+  case ArithmeticExpression: {
+    countExpressionReferences(inliner, *expr.arithmetic.left);
+    countExpressionReferences(inliner, *expr.arithmetic.right);
+  } break;
+  case FunctionExpression: {
+    countStatementReferences(inliner, *expr.function_expression.body);
+  } break;
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr.array.elements_len; i++) {
+      countExpressionReferences(inliner, expr.array.elements[i]);
+    }
+  } break;
+  case IndexExpression: {
+    countExpressionReferences(inliner, *expr.element.index);
+  } break;
+  case NumericExpression:
+  case StringExpression: {
+  } break;
+  }
+}
+
+static void countStatementReferences(Inliner *inliner, Statement stmt) {
+  switch (stmt.type) {
+  case ExpressionStatement: {
+    countExpressionReferences(inliner, stmt.expression);
+  } break;
+  case DeclarationStatement: {
+    countExpressionReferences(inliner, stmt.declaration.value);
+  } break;
+  case AssignmentStatement: {
+    InlineCandidate *candidate = findCandidate(inliner, stmt.assignment.name);
+    if (candidate)
+      candidate->duplicate = true;
+    if (stmt.assignment.index)
+      countExpressionReferences(inliner, *stmt.assignment.index);
+    countExpressionReferences(inliner, stmt.assignment.value);
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      countStatementReferences(inliner, stmt.block->statements.ptr[i]);
+    }
+  } break;
+  case IfStatement: {
+    countExpressionReferences(inliner, stmt.if_statement->condition);
+    countStatementReferences(inliner, *stmt.if_statement->consequence);
+    if (stmt.if_statement->alternate)
+      countStatementReferences(inliner, *stmt.if_statement->alternate);
+  } break;
+  case WhileStatement: {
+    countExpressionReferences(inliner, stmt.while_statement->condition);
+    countStatementReferences(inliner, *stmt.while_statement->body);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    countExpressionReferences(inliner, switch_statement->subject);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      countStatementReferences(inliner, *switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      countStatementReferences(inliner, *switch_statement->otherwise);
+  } break;
+  case ReturnStatement: {
+    if (stmt.return_statement)
+      countExpressionReferences(inliner, *stmt.return_statement);
+  } break;
+  case InlineBatchStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static bool nameListHas(Slice(Slice_char) list, Slice(char) name) {
+  for (size_t i = 0; i < list.len; i++) {
+    if (eql(list.ptr[i], name))
+      return true;
+  }
+  return false;
+}
+
+static void collectDeclaredNames(Statement stmt, Vec(Slice_char) * names) {
+  switch (stmt.type) {
+  case DeclarationStatement: {
+    if (!nameListHas(names->slice, stmt.declaration.name) &&
+        !append(names, Slice_char, &stmt.declaration.name))
+      panic("Failed to append declared name");
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      collectDeclaredNames(stmt.block->statements.ptr[i], names);
+    }
+  } break;
+  case IfStatement: {
+    collectDeclaredNames(*stmt.if_statement->consequence, names);
+    if (stmt.if_statement->alternate)
+      collectDeclaredNames(*stmt.if_statement->alternate, names);
+  } break;
+  case WhileStatement: {
+    collectDeclaredNames(*stmt.while_statement->body, names);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      collectDeclaredNames(*switch_statement->cases.ptr[i].body, names);
+    }
+    if (switch_statement->otherwise)
+      collectDeclaredNames(*switch_statement->otherwise, names);
+  } break;
+  case ExpressionStatement:
+  case AssignmentStatement:
+  case InlineBatchStatement:
+  case ReturnStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static bool assignsName(Statement stmt, Slice(char) name) {
+  switch (stmt.type) {
+  case AssignmentStatement: {
+    return eql(stmt.assignment.name, name);
+  }
+  case DeclarationStatement: {
+    return eql(stmt.declaration.name, name);
+  }
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      if (assignsName(stmt.block->statements.ptr[i], name))
+        return true;
+    }
+    return false;
+  }
+  case IfStatement: {
+    return assignsName(*stmt.if_statement->consequence, name) ||
+           (stmt.if_statement->alternate &&
+            assignsName(*stmt.if_statement->alternate, name));
+  }
+  case WhileStatement: {
+    return assignsName(*stmt.while_statement->body, name);
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      if (assignsName(*switch_statement->cases.ptr[i].body, name))
+        return true;
+    }
+    return switch_statement->otherwise &&
+           assignsName(*switch_statement->otherwise, name);
+  }
+  case ExpressionStatement:
+  case InlineBatchStatement:
+  case ReturnStatement: {
+    return false;
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+// Bodies can be spliced into the caller when they only write their own
+// locals, contain no inline batch code and return at most at the very end
+static bool bodyInlinable(Statement stmt, Slice(Slice_char) locals,
+                          bool tail) {
+  switch (stmt.type) {
+  case DeclarationStatement: {
+    return stmt.declaration.value.type != FunctionExpression;
+  }
+  case AssignmentStatement: {
+    return nameListHas(locals, stmt.assignment.name);
+  }
+  case InlineBatchStatement: {
+    return false;
+  }
+  case ReturnStatement: {
+    return tail;
+  }
+  case ExpressionStatement: {
+    return true;
+  }
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      if (!bodyInlinable(stmt.block->statements.ptr[i], locals, false))
+        return false;
+    }
+    return true;
+  }
+  case IfStatement: {
+    return bodyInlinable(*stmt.if_statement->consequence, locals, false) &&
+           (!stmt.if_statement->alternate ||
+            bodyInlinable(*stmt.if_statement->alternate, locals, false));
+  }
+  case WhileStatement: {
+    return bodyInlinable(*stmt.while_statement->body, locals, false);
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      if (!bodyInlinable(*switch_statement->cases.ptr[i].body, locals, false))
+        return false;
+    }
+    return !switch_statement->otherwise ||
+           bodyInlinable(*switch_statement->otherwise, locals, false);
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static bool statementReaches(Inliner *inliner, Statement stmt,
+                             Slice(char) target, bool *visited);
+
+static bool expressionReaches(Inliner *inliner, Expression expr,
+                              Slice(char) target, bool *visited) {
+  switch (expr.type) {
+  case CallExpression: {
+    if (expr.call.callee->type == IdentifierExpression) {
+      Slice(char) callee = expr.call.callee->identifier;
+      if (eql(callee, target))
+        return true;
+      InlineCandidate *candidate = findCandidate(inliner, callee);
+      if (candidate) {
+        size_t index = (size_t)(candidate - inliner->candidates.slice.ptr);
+        if (!visited[index]) {
+          visited[index] = true;
+          if (statementReaches(inliner,
+                               *candidate->function.function_expression.body,
+                               target, visited))
+            return true;
+        }
+      }
+    }
+    for (size_t i = 0; i < expr.call.parameters_len; i++) {
+      if (expressionReaches(inliner, expr.call.parameters[i], target,
+                            visited))
+        return true;
+    }
+    return false;
+  }
+  case ArithmeticExpression: {
+    return expressionReaches(inliner, *expr.arithmetic.left, target,
+                             visited) ||
+           expressionReaches(inliner, *expr.arithmetic.right, target,
+                             visited);
+  }
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr.array.elements_len; i++) {
+      if (expressionReaches(inliner, expr.array.elements[i], target,
+                            visited))
+        return true;
+    }
+    return false;
+  }
+  case IndexExpression: {
+    return expressionReaches(inliner, *expr.element.index, target, visited);
+  }
+  case IdentifierExpression:
+  case NumericExpression:
+  case StringExpression:
+  case FunctionExpression: {
+    return false;
+  }
+  }
+}
+
+static bool statementReaches(Inliner *inliner, Statement stmt,
+                             Slice(char) target, bool *visited) {
+  switch (stmt.type) {
+  case ExpressionStatement: {
+    return expressionReaches(inliner, stmt.expression, target, visited);
+  }
+  case DeclarationStatement: {
+    return expressionReaches(inliner, stmt.declaration.value, target,
+                             visited);
+  }
+  case AssignmentStatement: {
+    return (stmt.assignment.index &&
+            expressionReaches(inliner, *stmt.assignment.index, target,
+                              visited)) ||
+           expressionReaches(inliner, stmt.assignment.value, target, visited);
+  }
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      if (statementReaches(inliner, stmt.block->statements.ptr[i], target,
+                           visited))
+        return true;
+    }
+    return false;
+  }
+  case IfStatement: {
+    return expressionReaches(inliner, stmt.if_statement->condition, target,
+                             visited) ||
+           statementReaches(inliner, *stmt.if_statement->consequence, target,
+                            visited) ||
+           (stmt.if_statement->alternate &&
+            statementReaches(inliner, *stmt.if_statement->alternate, target,
+                             visited));
+  }
+  case WhileStatement: {
+    return expressionReaches(inliner, stmt.while_statement->condition,
+                             target, visited) ||
+           statementReaches(inliner, *stmt.while_statement->body, target,
+                            visited);
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    if (expressionReaches(inliner, switch_statement->subject, target,
+                          visited))
+      return true;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      if (statementReaches(inliner, *switch_statement->cases.ptr[i].body,
+                           target, visited))
+        return true;
+    }
+    return switch_statement->otherwise &&
+           statementReaches(inliner, *switch_statement->otherwise, target,
+                            visited);
+  }
+  case ReturnStatement: {
+    return stmt.return_statement &&
+           expressionReaches(inliner, *stmt.return_statement, target,
+                             visited);
+  }
+  case InlineBatchStatement: {
+    return false;
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static bool isRecursive(Inliner *inliner, InlineCandidate *candidate) {
+  Result(Slice_char) visited_res =
+      alloc(inliner->ally, char, inliner->candidates.slice.len);
+  if (!visited_res.ok)
+    panic(visited_res.err);
+  bool *visited = (bool *)visited_res.val.ptr;
+  for (size_t i = 0; i < inliner->candidates.slice.len; i++) {
+    visited[i] = false;
+  }
+  return statementReaches(inliner,
+                          *candidate->function.function_expression.body,
+                          candidate->name, visited);
+}
+
+static bool shouldInline(Inliner *inliner, InlineCandidate *candidate) {
+  Statement *body = candidate->function.function_expression.body;
+  if (candidate->duplicate || body->type != BlockStatement)
+    return false;
+  if (candidate->calls != 1 && statementSize(*body) > inliner->threshold)
+    return false;
+  Result(Vec_Slice_char) locals_res = createVec(inliner->ally, Slice_char, 4);
+  if (!locals_res.ok)
+    panic(locals_res.err);
+  Vec(Slice_char) locals = locals_res.val;
+  for (size_t i = 0; i < candidate->function.function_expression.parameters_len;
+       i++) {
+    if (!append(&locals, Slice_char,
+                &candidate->function.function_expression.parameters[i]
+                     .identifier))
+      panic("Failed to append parameter");
+  }
+  collectDeclaredNames(*body, &locals);
+  Slice(Statement) statements = body->block->statements;
+  for (size_t i = 0; i < statements.len; i++) {
+    if (!bodyInlinable(statements.ptr[i], locals.slice,
+                       i == statements.len - 1))
+      return false;
+  }
+  return !isRecursive(inliner, candidate);
+}
+
+static bool isInlinableCall(Inliner *inliner, Expression expr,
+                            InlineCandidate **out) {
+  if (expr.type != CallExpression ||
+      expr.call.callee->type != IdentifierExpression)
+    return false;
+  InlineCandidate *candidate =
+      findCandidate(inliner, expr.call.callee->identifier);
+  if (!candidate ||
+      candidate->function.function_expression.parameters_len !=
+          expr.call.parameters_len ||
+      !shouldInline(inliner, candidate))
+    return false;
+  *out = candidate;
+  return true;
+}
+
+static bool isSimpleValue(Expression expr) {
+  return expr.type == IdentifierExpression ||
+         expr.type == NumericExpression || expr.type == StringExpression;
+}
+
+// Appends the renamed body of the call to prelude and returns the expression
+// holding its return value
+static Expression expandCall(Inliner *inliner, InlineCandidate *candidate,
+                             Expression call, Vec(Statement) * prelude) {
+  Allocator ally = inliner->ally;
+  size_t id = inliner->instances++;
+  candidate->inlined++;
+  Statement *body = candidate->function.function_expression.body;
+  Result(Vec_Rename) renames_res = createVec(ally, Rename, 4);
+  if (!renames_res.ok)
+    panic(renames_res.err);
+  Vec(Rename) renames = renames_res.val;
+  for (size_t i = 0; i < call.call.parameters_len; i++) {
+    Slice(char) param =
+        candidate->function.function_expression.parameters[i].identifier;
+    Expression arg = call.call.parameters[i];
+    Rename rename = {.from = param, .to = arg};
+    // a parameter the body never writes can refer to the argument directly
+    if (!isSimpleValue(arg) || assignsName(*body, param)) {
+      rename.to = (Expression){.type = IdentifierExpression,
+                               .identifier = makeName(ally, "inline", id,
+                                                      param)};
+      Statement decl = {
+          .type = DeclarationStatement,
+          .declaration = {.name = rename.to.identifier,
+                          .value = arg,
+                          .constant = false},
+      };
+      if (!append(prelude, Statement, &decl))
+        panic("Failed to append parameter declaration");
+    }
+    if (!append(&renames, Rename, &rename))
+      panic("Failed to append rename");
+  }
+  Result(Vec_Slice_char) locals_res = createVec(ally, Slice_char, 4);
+  if (!locals_res.ok)
+    panic(locals_res.err);
+  Vec(Slice_char) locals = locals_res.val;
+  collectDeclaredNames(*body, &locals);
+  for (size_t i = 0; i < locals.slice.len; i++) {
+    Rename rename = {
+        .from = locals.slice.ptr[i],
+        .to = {.type = IdentifierExpression,
+               .identifier = makeName(ally, "inline", id, locals.slice.ptr[i])},
+    };
+    if (!append(&renames, Rename, &rename))
+      panic("Failed to append rename");
+  }
+  Expression result = {.type = StringExpression,
+                       .string = {.ptr = "", .len = 0}};
+  Slice(Statement) statements = body->block->statements;
+  for (size_t i = 0; i < statements.len; i++) {
+    Statement stmt = cloneStatement(ally, statements.ptr[i], renames.slice);
+    if (stmt.type != ReturnStatement) {
+      if (!append(prelude, Statement, &stmt))
+        panic("Failed to append inlined statement");
+      continue;
+    }
+    if (!stmt.return_statement)
+      continue;
+    result = *stmt.return_statement;
+    if (!isSimpleValue(result)) {
+      Slice(char) name = makeName(ally, "inline", id, (Slice(char)){0});
+      Statement decl = {
+          .type = DeclarationStatement,
+          .declaration = {.name = name, .value = result, .constant = true},
+      };
+      if (!append(prelude, Statement, &decl))
+        panic("Failed to append return value");
+      result = (Expression){.type = IdentifierExpression,
+                            .value_type = result.value_type,
+                            .identifier = name};
+    }
+  }
+  return result;
+}
+
+static void inlineExpression(Inliner *inliner, Expression *expr,
+                             Vec(Statement) * prelude) {
+  switch (expr->type) {
+  case CallExpression: {
+    for (size_t i = 0; i < expr->call.parameters_len; i++) {
+      inlineExpression(inliner, &expr->call.parameters[i], prelude);
+    }
+    InlineCandidate *candidate = NULL;
+    if (isInlinableCall(inliner, *expr, &candidate))
+      *expr = expandCall(inliner, candidate, *expr, prelude);
+  } break;
+  case ArithmeticExpression: {
+    inlineExpression(inliner, expr->arithmetic.left, prelude);
+    // what follows && or || may never run, so its calls stay calls
+    if (!isLogical(expr->arithmetic.op))
+      inlineExpression(inliner, expr->arithmetic.right, prelude);
+  } break;
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr->array.elements_len; i++) {
+      inlineExpression(inliner, &expr->array.elements[i], prelude);
+    }
+  } break;
+  case IndexExpression: {
+    inlineExpression(inliner, expr->element.index, prelude);
+  } break;
+  case IdentifierExpression:
+  case NumericExpression:
+  case StringExpression:
+  case FunctionExpression: {
+  } break;
+  }
+}
+
+static void inlineStatements(Inliner *inliner, Slice(Statement) * list);
+
+static bool inlineStatement(Inliner *inliner, Statement *stmt,
+                            Vec(Statement) * prelude);
+
+// What an inlined call leaves in front of its site is located at the site,
+// so profiles and source maps point at the call
+static void locateAt(Slice(Statement) statements, SourceLocation at) {
+  for (size_t i = 0; i < statements.len; i++) {
+    statements.ptr[i].at = at;
+  }
+}
+
+// Inlines into a statement that stands on its own, such as an if branch,
+// wrapping it in a block when code has to be placed in front of it
+static void inlineSlot(Inliner *inliner, Statement *stmt) {
+  if (stmt->type == BlockStatement) {
+    inlineStatements(inliner, &stmt->block->statements);
+    return;
+  }
+  Result(Vec_Statement) prelude_res = createVec(inliner->ally, Statement, 2);
+  if (!prelude_res.ok)
+    panic(prelude_res.err);
+  Vec(Statement) prelude = prelude_res.val;
+  bool keep = inlineStatement(inliner, stmt, &prelude);
+  if (prelude.slice.len == 0 && keep)
+    return;
+  locateAt(prelude.slice, stmt->at);
+  if (keep && !append(&prelude, Statement, stmt))
+    panic("Failed to append statement");
+  Slice(Statement) statements = prelude.slice;
+  inlineStatements(inliner, &statements);
+  SourceLocation at = stmt->at;
+  *stmt = blockOf(inliner->ally, statements);
+  stmt->at = at;
+}
+
+// Returns false when the statement was fully replaced by its prelude
+static bool inlineStatement(Inliner *inliner, Statement *stmt,
+                            Vec(Statement) * prelude) {
+  switch (stmt->type) {
+  case ExpressionStatement: {
+    InlineCandidate *candidate = NULL;
+    if (stmt->expression.type == CallExpression) {
+      for (size_t i = 0; i < stmt->expression.call.parameters_len; i++) {
+        inlineExpression(inliner, &stmt->expression.call.parameters[i],
+                         prelude);
+      }
+      if (isInlinableCall(inliner, stmt->expression, &candidate)) {
+        Expression result =
+            expandCall(inliner, candidate, stmt->expression, prelude);
+        // the value is unused, only a call in it still has to run
+        if (result.type == CallExpression) {
+          Statement call = {.type = ExpressionStatement, .expression = result};
+          if (!append(prelude, Statement, &call))
+            panic("Failed to append call");
+        }
+        return false;
+      }
+    }
+    inlineExpression(inliner, &stmt->expression, prelude);
+  } break;
+  case DeclarationStatement: {
+    if (stmt->declaration.value.type == FunctionExpression) {
+      inlineSlot(inliner, stmt->declaration.value.function_expression.body);
+    } else {
+      inlineExpression(inliner, &stmt->declaration.value, prelude);
+    }
+  } break;
+  case AssignmentStatement: {
+    if (stmt->assignment.index)
+      inlineExpression(inliner, stmt->assignment.index, prelude);
+    inlineExpression(inliner, &stmt->assignment.value, prelude);
+  } break;
+  case ReturnStatement: {
+    if (stmt->return_statement)
+      inlineExpression(inliner, stmt->return_statement, prelude);
+  } break;
+  case IfStatement: {
+    inlineExpression(inliner, &stmt->if_statement->condition, prelude);
+    inlineSlot(inliner, stmt->if_statement->consequence);
+    if (stmt->if_statement->alternate)
+      inlineSlot(inliner, stmt->if_statement->alternate);
+  } break;
+  case WhileStatement: {
+    // the condition runs on every iteration, so calls in it stay calls
+    inlineSlot(inliner, stmt->while_statement->body);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    inlineExpression(inliner, &switch_statement->subject, prelude);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      inlineSlot(inliner, switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      inlineSlot(inliner, switch_statement->otherwise);
+  } break;
+  case BlockStatement: {
+    inlineStatements(inliner, &stmt->block->statements);
+  } break;
+  case InlineBatchStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+  return true;
+}
+
+static void inlineStatements(Inliner *inliner, Slice(Statement) * list) {
+  Result(Vec_Statement) out_res =
+      createVec(inliner->ally, Statement, list->len + 1);
+  if (!out_res.ok)
+    panic(out_res.err);
+  Vec(Statement) out = out_res.val;
+  for (size_t i = 0; i < list->len; i++) {
+    Statement stmt = list->ptr[i];
+    // what the calls of one statement leave is dead after it, so the next
+    // statement takes the same names again
+    size_t instances = inliner->instances;
+    Result(Vec_Statement) prelude_res =
+        createVec(inliner->ally, Statement, 2);
+    if (!prelude_res.ok)
+      panic(prelude_res.err);
+    Vec(Statement) prelude = prelude_res.val;
+    bool keep = inlineStatement(inliner, &stmt, &prelude);
+    locateAt(prelude.slice, stmt.at);
+    // inlined bodies may call further inlinable functions
+    Slice(Statement) expanded = prelude.slice;
+    inlineStatements(inliner, &expanded);
+    if (!appendSlice(&out, Statement, expanded))
+      panic("Failed to append inlined statements");
+    if (keep && !append(&out, Statement, &stmt))
+      panic("Failed to append statement");
+    inliner->instances = instances;
+  }
+  *list = out.slice;
+}
+
+// Drops the definitions of functions that no longer have any caller
+static void removeUncalledFunctions(Inliner *inliner,
+                                    Slice(Statement) * list) {
+  size_t kept = 0;
+  for (size_t i = 0; i < list->len; i++) {
+    Statement stmt = list->ptr[i];
+    if (stmt.type == DeclarationStatement &&
+        stmt.declaration.value.type == FunctionExpression) {
+      InlineCandidate *candidate =
+          findCandidate(inliner, stmt.declaration.name);
+      if (candidate && (candidate->inlined > 0 || candidate->evaluated > 0) &&
+          candidate->calls == 0 && !candidate->escapes &&
+          !candidate->duplicate)
+        continue;
+      Statement *body = stmt.declaration.value.function_expression.body;
+      if (body->type == BlockStatement)
+        removeUncalledFunctions(inliner, &body->block->statements);
+    } else if (stmt.type == BlockStatement) {
+      removeUncalledFunctions(inliner, &stmt.block->statements);
+    }
+    list->ptr[kept++] = stmt;
+  }
+  list->len = kept;
+}
+
+static void inlineFunctions(Allocator ally, Program *prog, size_t threshold) {
+  Result(Vec_InlineCandidate) candidates_res =
+      createVec(ally, InlineCandidate, 4);
+  if (!candidates_res.ok)
+    panic(candidates_res.err);
+  Inliner inliner = {
+      .ally = ally,
+      .candidates = candidates_res.val,
+      .threshold = threshold,
+      .instances = 0,
+  };
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    collectFunctions(&inliner, prog->statements.ptr[i]);
+  }
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    countStatementReferences(&inliner, prog->statements.ptr[i]);
+  }
+  inlineStatements(&inliner, &prog->statements);
+
+  for (size_t i = 0; i < inliner.candidates.slice.len; i++) {
+    inliner.candidates.slice.ptr[i].calls = 0;
+    inliner.candidates.slice.ptr[i].escapes = false;
+  }
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    countStatementReferences(&inliner, prog->statements.ptr[i]);
+  }
+  removeUncalledFunctions(&inliner, &prog->statements);
+  for (size_t i = 0; i < inliner.candidates.slice.len; i++) {
+    InlineCandidate candidate = inliner.candidates.slice.ptr[i];
+    if (candidate.inlined > 0) {
+      fprintf(stdout, "Inlined %1.*s at %zu call site%s\n",
+              (int)candidate.name.len, candidate.name.ptr, candidate.inlined,
+              candidate.inlined == 1 ? "" : "s");
+    }
+  }
+}
+
+#endif /* INLINER_H */
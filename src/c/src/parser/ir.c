@@ -0,0 +1,1667 @@
+#ifndef IR_H
+#define IR_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "../std/eql.c"
+#include "parser.c"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// A three-address form of the program between the syntax tree passes and
+// outputBatch. Every function is a list of basic blocks whose terminators
+// make up its control flow graph. Values are environment variables, literals
+// and numbered temporaries, which only get a variable name once the
+// allocate-temporaries pass has run.
+//
+// Branches and switches remember the block their arms meet again at, and
+// loop branches the block after the loop, so the lowering can still put
+// regions without labels in cmd ( ... ) blocks.
+
+typedef enum {
+  ValueNone = 0,
+  ValueVariable,
+  ValueTemporary,
+  ValueNumber,
+  ValueString,
+} ValueKind;
+
+typedef struct {
+  ValueKind kind;
+  // what sema inferred it to hold
+  ValueType type;
+  // the variable name or the literal
+  Slice(char) text;
+  size_t id;
+} Value;
+
+DefSlice(Value);
+DefResult(Slice_Value);
+DefVec(Value);
+DefResult(Vec_Value);
+
+typedef enum {
+  // dst = a
+  IrCopy,
+  // dst = a symbol b with symbol one of + - * / %
+  IrArithmetic,
+  // dst = 1 or 0 for a symbol b, symbol being one of the comparisons of
+  // the parser, with the joined ones after it
+  IrCompare,
+  // dst = parameter number index
+  IrParam,
+  // dst = text(args), dst may be none, memoized ones go through the cache
+  // of text first
+  IrCall,
+  // echoes args, into the file a when there is one. Symbol 'w' leaves out
+  // the line break and '>' empties the file instead.
+  IrPrint,
+  // inline batch kept as text
+  IrBatch,
+  IrSetlocal,
+  // leaves the innermost frame, keeping the values of args
+  IrEndlocal,
+  // sets all targets to args at once, dst is a scratch temporary to break
+  // cycles with
+  IrParallelCopy,
+  // clears the variables of args
+  IrUnset,
+  // dst = element a of the array text, for indexes only known at runtime
+  IrLoad,
+  // sets element a of the array text to b
+  IrStore,
+} IrOp;
+
+// A comparison of a condition, joined to the ones in front of it by &&
+// ('&') or || ('|'). && binds tighter, so a condition reads as ors of ands.
+typedef struct {
+  char join;
+  char symbol;
+  Value a;
+  Value b;
+} Comparison;
+
+DefSlice(Comparison);
+DefResult(Slice_Comparison);
+
+typedef struct {
+  IrOp op;
+  char symbol;
+  Value dst;
+  Value a;
+  Value b;
+  Slice(Value) args;
+  Slice(Value) targets;
+  // the comparisons after a symbol b of a compare
+  Slice(Comparison) joined;
+  Slice(char) text;
+  size_t index;
+  // computed where its only use is instead of into a variable
+  bool folded;
+  bool memoized;
+} Instruction;
+
+DefSlice(Instruction);
+DefResult(Slice_Instruction);
+DefVec(Instruction);
+DefResult(Vec_Instruction);
+
+DefSlice(size_t);
+DefResult(Slice_size_t);
+
+typedef enum {
+  TermNone = 0,
+  TermJump,
+  // goes to target when a symbol b, with the joined comparisons, holds and
+  // to otherwise when not
+  TermBranch,
+  // goes to the target of the first of cases that equals a, and to
+  // otherwise when none does
+  TermSwitch,
+  // leaves frames setlocal frames and the function with value
+  TermReturn,
+  // end of the top level
+  TermEnd,
+} TermKind;
+
+typedef struct {
+  TermKind kind;
+  size_t target;
+  size_t otherwise;
+  char symbol;
+  Value a;
+  Value b;
+  Slice(Comparison) joined;
+  // where the arms of a branch join, or the exit of a loop. A jump with a
+  // file in a goes into a with_output block, which prints to it up to merge.
+  size_t merge;
+  // whether this block is a while loop header
+  bool loop;
+  CountedLoop *counted;
+  // the literals of a switch and the block of each
+  Slice(Value) cases;
+  Slice(size_t) targets;
+  Value value;
+  size_t frames;
+  // memoized calls of the function, whose cache entries a return keeps
+  // past the endlocal of its frame
+  Slice(Instruction) memos;
+} Terminator;
+
+typedef struct {
+  Vec(Instruction) instructions;
+  Terminator term;
+} IrBlock;
+
+DefSlice(IrBlock);
+DefVec(IrBlock);
+DefResult(Vec_IrBlock);
+
+typedef struct {
+  // holds a call result, which gets a _ret slot instead of a _tmp one
+  bool call_result;
+  // the variable the temporary was allocated to
+  Slice(char) name;
+} Temporary;
+
+DefSlice(Temporary);
+DefVec(Temporary);
+DefResult(Vec_Temporary);
+
+typedef struct {
+  // empty for the top level
+  Slice(char) name;
+  // the label the output starts it at, which --minify shortens
+  Slice(char) label;
+  Vec(IrBlock) blocks;
+  // where self tail calls jump back to
+  size_t entry;
+  bool tail_recursive;
+  // entered with goto by callers that open its frame and set its parameters
+  // themselves, as it can never be running twice
+  bool subroutine;
+  // callers pass the name of the variable to return into as a first
+  // argument ahead of the parameters
+  bool named_result;
+  Vec(Temporary) temporaries;
+} IrFunction;
+
+DefSlice(IrFunction);
+DefVec(IrFunction);
+DefResult(Vec_IrFunction);
+
+typedef struct {
+  // the top level comes first
+  Vec(IrFunction) functions;
+} IrProgram;
+
+static bool *allocFlags(Allocator ally, size_t len) {
+  // the allocator has nothing to give for empty allocations
+  if (len == 0)
+    return NULL;
+  Result(Slice_void) res = alloc_(ally, sizeof(bool), len);
+  if (!res.ok)
+    panic(res.err);
+  memset(res.val.ptr, 0, len * sizeof(bool));
+  return res.val.ptr;
+}
+
+typedef void ValueVisitor(Value *value, void *context);
+
+static void visitComparisons(Slice(Comparison) joined, ValueVisitor *visit,
+                             void *context) {
+  for (size_t i = 0; i < joined.len; i++) {
+    visit(&joined.ptr[i].a, context);
+    visit(&joined.ptr[i].b, context);
+  }
+}
+
+static void visitUses(Instruction *inst, ValueVisitor *visit, void *context) {
+  switch (inst->op) {
+  case IrCopy:
+  case IrArithmetic:
+  case IrCompare:
+  case IrLoad:
+  case IrStore: {
+    visit(&inst->a, context);
+    if (inst->op != IrCopy && inst->op != IrLoad)
+      visit(&inst->b, context);
+    visitComparisons(inst->joined, visit, context);
+  } break;
+  case IrCall:
+  case IrPrint:
+  case IrEndlocal:
+  case IrParallelCopy: {
+    if (inst->op == IrPrint && inst->a.kind != ValueNone)
+      visit(&inst->a, context);
+    for (size_t i = 0; i < inst->args.len; i++) {
+      visit(&inst->args.ptr[i], context);
+    }
+  } break;
+  case IrParam:
+  case IrBatch:
+  case IrSetlocal:
+  case IrUnset: {
+  } break;
+  }
+}
+
+static void visitDefinitions(Instruction *inst, ValueVisitor *visit,
+                             void *context) {
+  switch (inst->op) {
+  case IrCopy:
+  case IrArithmetic:
+  case IrCompare:
+  case IrParam:
+  case IrCall:
+  case IrLoad: {
+    visit(&inst->dst, context);
+  } break;
+  case IrParallelCopy: {
+    visit(&inst->dst, context);
+    for (size_t i = 0; i < inst->targets.len; i++) {
+      visit(&inst->targets.ptr[i], context);
+    }
+  } break;
+  case IrUnset: {
+    for (size_t i = 0; i < inst->args.len; i++) {
+      visit(&inst->args.ptr[i], context);
+    }
+  } break;
+  case IrPrint:
+  case IrBatch:
+  case IrSetlocal:
+  case IrEndlocal:
+  case IrStore: {
+  } break;
+  }
+}
+
+static void visitTerminatorUses(Terminator *term, ValueVisitor *visit,
+                                void *context) {
+  switch (term->kind) {
+  case TermBranch: {
+    visit(&term->a, context);
+    visit(&term->b, context);
+    visitComparisons(term->joined, visit, context);
+  } break;
+  case TermSwitch: {
+    visit(&term->a, context);
+    for (size_t i = 0; i < term->cases.len; i++) {
+      visit(&term->cases.ptr[i], context);
+    }
+  } break;
+  case TermReturn: {
+    visit(&term->value, context);
+    for (size_t i = 0; i < term->memos.len; i++) {
+      for (size_t j = 0; j < term->memos.ptr[i].args.len; j++) {
+        visit(&term->memos.ptr[i].args.ptr[j], context);
+      }
+    }
+  } break;
+  case TermNone:
+  case TermJump:
+  case TermEnd: {
+  } break;
+  }
+}
+
+// How many blocks control can go to after a block
+static size_t successorCount(Terminator term) {
+  switch (term.kind) {
+  case TermJump: {
+    return 1;
+  }
+  case TermBranch: {
+    return 2;
+  }
+  case TermSwitch: {
+    return term.targets.len + 1;
+  }
+  case TermNone:
+  case TermReturn:
+  case TermEnd: {
+    return 0;
+  }
+  }
+}
+
+// The index-th of them, the default of a switch coming last
+static size_t successor(Terminator term, size_t index) {
+  switch (term.kind) {
+  case TermJump: {
+    return term.target;
+  }
+  case TermBranch: {
+    return index == 0 ? term.target : term.otherwise;
+  }
+  case TermSwitch: {
+    return index < term.targets.len ? term.targets.ptr[index]
+                                    : term.otherwise;
+  }
+  case TermNone:
+  case TermReturn:
+  case TermEnd: {
+    panic("successor: Terminator without successors");
+  }
+  }
+}
+
+typedef struct {
+  char symbol;
+  Expression operand;
+} ChainLink;
+
+DefSlice(ChainLink);
+DefVec(ChainLink);
+DefResult(Vec_ChainLink);
+
+typedef struct {
+  Allocator ally;
+  IrProgram *program;
+  size_t function;
+  size_t block;
+  // setlocal frames open at the current block
+  size_t frames;
+  // names declared in the open frames of the function, innermost last
+  Vec(Slice_char) declared;
+  // where the names of the innermost frame start
+  size_t frame;
+  // outer names the innermost frame assigns, which its endlocal keeps, or
+  // NULL when leaving the frame does not matter
+  Vec(Slice_char) * tunnels;
+} IrBuilder;
+
+static IrFunction *builderFunction(IrBuilder *b) {
+  return &b->program->functions.slice.ptr[b->function];
+}
+
+static IrBlock *builderBlock(IrBuilder *b) {
+  return &builderFunction(b)->blocks.slice.ptr[b->block];
+}
+
+static size_t newBlock(IrBuilder *b) {
+  Result(Vec_Instruction) res = createVec(b->ally, Instruction, 4);
+  if (!res.ok)
+    panic(res.err);
+  IrBlock block = {.instructions = res.val, .term = {.kind = TermNone}};
+  IrFunction *fn = builderFunction(b);
+  if (!append(&fn->blocks, IrBlock, &block))
+    panic("Failed to append block");
+  return fn->blocks.slice.len - 1;
+}
+
+// Statements after a return or tail call still get built, into a block
+// nothing jumps to
+static void openBlock(IrBuilder *b) {
+  if (builderBlock(b)->term.kind != TermNone)
+    b->block = newBlock(b);
+}
+
+static void addInstruction(IrBuilder *b, Instruction inst) {
+  if (!append(&builderBlock(b)->instructions, Instruction, &inst))
+    panic("Failed to append instruction");
+}
+
+static void terminate(IrBuilder *b, Terminator term) {
+  if (builderBlock(b)->term.kind == TermNone)
+    builderBlock(b)->term = term;
+}
+
+static Terminator jumpTo(size_t target) {
+  return (Terminator){.kind = TermJump, .target = target};
+}
+
+static Value noValue(void) { return (Value){.kind = ValueNone}; }
+
+static Value variableValue(Slice(char) name) {
+  return (Value){.kind = ValueVariable, .text = name};
+}
+
+static Value newTemporary(IrBuilder *b, bool call_result) {
+  IrFunction *fn = builderFunction(b);
+  Temporary temporary = {.call_result = call_result,
+                         .name = {.ptr = NULL, .len = 0}};
+  if (!append(&fn->temporaries, Temporary, &temporary))
+    panic("Failed to append temporary");
+  return (Value){.kind = ValueTemporary, .id = fn->temporaries.slice.len - 1};
+}
+
+static Slice(Value) allocValues(Allocator ally, size_t len) {
+  if (len == 0)
+    return (Slice(Value)){.ptr = NULL, .len = 0};
+  Result(Slice_Value) res = alloc(ally, Value, len);
+  if (!res.ok)
+    panic(res.err);
+  return res.val;
+}
+
+static void declareName(IrBuilder *b, Slice(char) name) {
+  if (!append(&b->declared, Slice_char, &name))
+    panic("Could not append name");
+}
+
+static bool isDeclared(IrBuilder *b, size_t from, Slice(char) name) {
+  for (size_t i = from; i < b->declared.slice.len; i++) {
+    if (eql(b->declared.slice.ptr[i], name))
+      return true;
+  }
+  return false;
+}
+
+// Names set in a frame that did not declare them belong to an outer one,
+// so its endlocal has to keep them
+static void noteAssignment(IrBuilder *b, Slice(char) name) {
+  if (!b->tunnels || isDeclared(b, b->frame, name))
+    return;
+  for (size_t i = 0; i < b->tunnels->slice.len; i++) {
+    if (eql(b->tunnels->slice.ptr[i], name))
+      return;
+  }
+  if (!append(b->tunnels, Slice_char, &name))
+    panic("Failed to append outer assignment");
+}
+
+// The variable holding the element of array at the literal index, which
+// the digits name once leading zeros are gone
+static Slice(char) elementName(Allocator ally, Slice(char) array,
+                               Slice(char) index) {
+  while (index.len > 1 && index.ptr[0] == '0') {
+    index.ptr++;
+    index.len--;
+  }
+  Result(Slice_char) res = alloc(ally, char, array.len + index.len + 2);
+  if (!res.ok)
+    panic(res.err);
+  memcpy(res.val.ptr, array.ptr, array.len);
+  res.val.ptr[array.len] = '[';
+  memcpy(res.val.ptr + array.len + 1, index.ptr, index.len);
+  res.val.ptr[res.val.len - 1] = ']';
+  return res.val;
+}
+
+// Elements belong to the frame of their array
+static void noteElementAssignment(IrBuilder *b, Slice(char) array,
+                                  Slice(char) element) {
+  if (b->tunnels && !isDeclared(b, b->frame, array))
+    noteAssignment(b, element);
+}
+
+static Value buildValue(IrBuilder *b, Expression expr);
+
+static Value buildCall(IrBuilder *b, Expression expr, Value dst) {
+  Slice(Value) args = allocValues(b->ally, expr.call.parameters_len);
+  for (size_t i = 0; i < args.len; i++) {
+    args.ptr[i] = buildValue(b, expr.call.parameters[i]);
+  }
+  addInstruction(b, (Instruction){.op = IrCall,
+                                  .dst = dst,
+                                  .args = args,
+                                  .text = expr.call.callee->identifier,
+                                  .memoized = expr.call.memoized});
+  return dst;
+}
+
+static void flattenChain(Vec(ChainLink) * chain, Expression expr,
+                         char symbol) {
+  if (expr.type != ArithmeticExpression) {
+    ChainLink link = {.symbol = symbol, .operand = expr};
+    if (!append(chain, ChainLink, &link))
+      panic("Failed to append operand");
+    return;
+  }
+  flattenChain(chain, *expr.arithmetic.left, symbol);
+  flattenChain(chain, *expr.arithmetic.right, expr.arithmetic.op);
+}
+
+// The parser leaves operators as one right leaning chain, which set /a used
+// to read with its own precedence. Comparisons split the chain in two.
+static Vec(ChainLink) arithmeticChain(IrBuilder *b, Expression expr) {
+  Result(Vec_ChainLink) res = createVec(b->ally, ChainLink, 4);
+  if (!res.ok)
+    panic(res.err);
+  flattenChain(&res.val, expr, 0);
+  return res.val;
+}
+
+static size_t comparisonIndex(Slice(ChainLink) chain) {
+  for (size_t i = 1; i < chain.len; i++) {
+    if (isComparison(chain.ptr[i].symbol))
+      return i;
+  }
+  return chain.len;
+}
+
+// Where the comparison starting at start ends, at the next && or ||
+static size_t comparisonEnd(Slice(ChainLink) chain, size_t start) {
+  size_t end = start + 1;
+  while (end < chain.len && !isLogical(chain.ptr[end].symbol))
+    end++;
+  return end;
+}
+
+static Slice(ChainLink) chainPart(Slice(ChainLink) chain, size_t start,
+                                  size_t end) {
+  return (Slice(ChainLink)){.ptr = chain.ptr + start, .len = end - start};
+}
+
+static bool isProduct(char symbol) {
+  return symbol == '*' || symbol == '/' || symbol == '%';
+}
+
+static Value emitBinary(IrBuilder *b, char symbol, Value left, Value right) {
+  Value dst = newTemporary(b, false);
+  dst.type = TypeNumber;
+  addInstruction(b, (Instruction){.op = IrArithmetic,
+                                  .symbol = symbol,
+                                  .dst = dst,
+                                  .a = left,
+                                  .b = right});
+  return dst;
+}
+
+static Value buildProduct(IrBuilder *b, Slice(ChainLink) chain,
+                          Slice(Value) operands, size_t *pos) {
+  Value left = operands.ptr[(*pos)++];
+  while (*pos < chain.len && isProduct(chain.ptr[*pos].symbol)) {
+    char symbol = chain.ptr[*pos].symbol;
+    left = emitBinary(b, symbol, left, operands.ptr[(*pos)++]);
+  }
+  return left;
+}
+
+static Value buildSum(IrBuilder *b, Slice(ChainLink) chain) {
+  // operands are read left to right before anything is computed, like cmd
+  // expands them
+  Slice(Value) operands = allocValues(b->ally, chain.len);
+  for (size_t i = 0; i < chain.len; i++) {
+    operands.ptr[i] = buildValue(b, chain.ptr[i].operand);
+  }
+  size_t pos = 0;
+  Value left = buildProduct(b, chain, operands, &pos);
+  while (pos < chain.len) {
+    char symbol = chain.ptr[pos].symbol;
+    left = emitBinary(b, symbol, left, buildProduct(b, chain, operands, &pos));
+  }
+  return left;
+}
+
+static Value trueValue(void) {
+  return (Value){
+      .kind = ValueNumber, .type = TypeNumber, .text = {.ptr = "1", .len = 1}};
+}
+
+// A comparison of a condition, anything else is true when it is the
+// boolean 1
+static Comparison buildComparison(IrBuilder *b, Slice(ChainLink) chain) {
+  size_t split = comparisonIndex(chain);
+  if (split == chain.len)
+    return (Comparison){
+        .symbol = '=', .a = buildSum(b, chain), .b = trueValue()};
+  return (Comparison){.symbol = chain.ptr[split].symbol,
+                      .a = buildSum(b, chainPart(chain, 0, split)),
+                      .b = buildSum(b, chainPart(chain, split, chain.len))};
+}
+
+// The comparisons after && and || must not run once the ones in front have
+// decided the condition. Computing them up front anyway cannot be told apart
+// as long as they call nothing and have no division set /a could fail on.
+static bool computableUpFront(Slice(ChainLink) chain) {
+  for (size_t i = comparisonEnd(chain, 0); i < chain.len; i++) {
+    Expression operand = chain.ptr[i].operand;
+    if (operand.type == CallExpression)
+      return false;
+    if (chain.ptr[i].symbol == '/' || chain.ptr[i].symbol == '%') {
+      // only a literal divisor is known not to be 0
+      if (operand.type != NumericExpression)
+        return false;
+      bool zero = true;
+      for (size_t j = 0; j < operand.number.len; j++) {
+        if (operand.number.ptr[j] != '0')
+          zero = false;
+      }
+      if (zero)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Computes every comparison of chain in front of the branch on them, which
+// cmd checks as nested ifs without any temporary for the outcome
+static Terminator joinedCondition(IrBuilder *b, Slice(ChainLink) chain) {
+  size_t end = comparisonEnd(chain, 0);
+  Comparison first = buildComparison(b, chainPart(chain, 0, end));
+  size_t count = 0;
+  for (size_t i = end; i < chain.len; i++) {
+    if (isLogical(chain.ptr[i].symbol))
+      count++;
+  }
+  Slice(Comparison) joined = {.ptr = NULL, .len = 0};
+  if (count > 0) {
+    Result(Slice_Comparison) joined_res = alloc(b->ally, Comparison, count);
+    if (!joined_res.ok)
+      panic(joined_res.err);
+    joined = joined_res.val;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t next = comparisonEnd(chain, end);
+    joined.ptr[i] = buildComparison(b, chainPart(chain, end, next));
+    joined.ptr[i].join = chain.ptr[end].symbol;
+    end = next;
+  }
+  return (Terminator){
+      .symbol = first.symbol, .a = first.a, .b = first.b, .joined = joined};
+}
+
+// Opens an if on flag symbol 1 whose body is built next, and returns the
+// block after it
+static size_t openGuard(IrBuilder *b, char symbol, Value flag) {
+  size_t body = newBlock(b);
+  size_t merge = newBlock(b);
+  terminate(b, (Terminator){.kind = TermBranch,
+                            .symbol = symbol,
+                            .a = flag,
+                            .b = trueValue(),
+                            .target = body,
+                            .otherwise = merge,
+                            .merge = merge});
+  b->block = body;
+  return merge;
+}
+
+static void closeGuard(IrBuilder *b, size_t merge) {
+  terminate(b, jumpTo(merge));
+  b->block = merge;
+}
+
+// Computes the ands from start up to the next || into flag, each one only
+// while the ones before it hold, and returns where they stop
+static size_t buildConjunction(IrBuilder *b, Slice(ChainLink) chain,
+                               size_t start, Value flag) {
+  size_t end = comparisonEnd(chain, start);
+  Comparison comparison = buildComparison(b, chainPart(chain, start, end));
+  addInstruction(b, (Instruction){.op = IrCompare,
+                                  .symbol = comparison.symbol,
+                                  .dst = flag,
+                                  .a = comparison.a,
+                                  .b = comparison.b});
+  if (end == chain.len || chain.ptr[end].symbol == '|')
+    return end;
+  size_t merge = openGuard(b, '=', flag);
+  end = buildConjunction(b, chain, end, flag);
+  closeGuard(b, merge);
+  return end;
+}
+
+// Computes a condition that cannot be computed up front into flag, with an
+// if around every comparison the ones before it may have decided
+static void buildShortCircuit(IrBuilder *b, Slice(ChainLink) chain,
+                              Value flag) {
+  size_t end = buildConjunction(b, chain, 0, flag);
+  if (end == chain.len)
+    return;
+  size_t merge = openGuard(b, '!', flag);
+  buildShortCircuit(b, chainPart(chain, end, chain.len), flag);
+  closeGuard(b, merge);
+}
+
+static Value newFlag(IrBuilder *b) {
+  Value flag = newTemporary(b, false);
+  flag.type = TypeBoolean;
+  return flag;
+}
+
+static Terminator buildCondition(IrBuilder *b, Expression expr) {
+  Slice(ChainLink) chain = arithmeticChain(b, expr).slice;
+  if (computableUpFront(chain))
+    return joinedCondition(b, chain);
+  Value flag = newFlag(b);
+  buildShortCircuit(b, chain, flag);
+  return (Terminator){.symbol = '=', .a = flag, .b = trueValue()};
+}
+
+static Value buildValue(IrBuilder *b, Expression expr) {
+  switch (expr.type) {
+  case IdentifierExpression: {
+    Value value = variableValue(expr.identifier);
+    value.type = expr.value_type;
+    return value;
+  }
+  case NumericExpression: {
+    return (Value){
+        .kind = ValueNumber, .type = TypeNumber, .text = expr.number};
+  }
+  case StringExpression: {
+    return (Value){
+        .kind = ValueString, .type = TypeString, .text = expr.string};
+  }
+  case CallExpression: {
+    // the length of an array is the value of its variable
+    if (expr.call.callee->type == IdentifierExpression &&
+        eql(expr.call.callee->identifier,
+            (Slice(char)){.ptr = "len", .len = 3}) &&
+        expr.call.parameters_len == 1)
+      return buildValue(b, expr.call.parameters[0]);
+    Value dst = newTemporary(b, true);
+    dst.type = expr.value_type;
+    return buildCall(b, expr, dst);
+  }
+  case ArithmeticExpression: {
+    Slice(ChainLink) chain = arithmeticChain(b, expr).slice;
+    if (comparisonIndex(chain) == chain.len &&
+        comparisonEnd(chain, 0) == chain.len)
+      return buildSum(b, chain);
+    Value dst = newFlag(b);
+    if (!computableUpFront(chain)) {
+      buildShortCircuit(b, chain, dst);
+      return dst;
+    }
+    Terminator condition = joinedCondition(b, chain);
+    addInstruction(b, (Instruction){.op = IrCompare,
+                                    .symbol = condition.symbol,
+                                    .dst = dst,
+                                    .a = condition.a,
+                                    .b = condition.b,
+                                    .joined = condition.joined});
+    return dst;
+  }
+  case FunctionExpression: {
+    panic("buildValue with FunctionExpression: Should not be called");
+  }
+  case ArrayExpression: {
+    panic("buildValue: Array literals can only be stored in a variable");
+  }
+  case IndexExpression: {
+    Expression index = *expr.element.index;
+    if (index.type == NumericExpression) {
+      Value value =
+          variableValue(elementName(b->ally, expr.element.array, index.number));
+      value.type = expr.value_type;
+      return value;
+    }
+    Value at = buildValue(b, index);
+    Value dst = newTemporary(b, false);
+    dst.type = expr.value_type;
+    addInstruction(b, (Instruction){.op = IrLoad,
+                                    .dst = dst,
+                                    .a = at,
+                                    .text = expr.element.array});
+    return dst;
+  }
+  }
+}
+
+static bool readsVariable(Value value, Value variable) {
+  return value.kind == ValueVariable && eql(value.text, variable.text);
+}
+
+// A compare with joined comparisons clears its result before it checks
+// them, so it must not be computed into a variable it reads
+static bool clearsOperand(Instruction inst, Value dst) {
+  if (inst.op != IrCompare || inst.joined.len == 0)
+    return false;
+  bool reads = readsVariable(inst.a, dst) || readsVariable(inst.b, dst);
+  for (size_t i = 0; i < inst.joined.len && !reads; i++) {
+    reads = readsVariable(inst.joined.ptr[i].a, dst) ||
+            readsVariable(inst.joined.ptr[i].b, dst);
+  }
+  return reads;
+}
+
+// Computes expr straight into dst when its last instruction defines it
+static void buildInto(IrBuilder *b, Expression expr, Value dst) {
+  Value value = buildValue(b, expr);
+  Vec(Instruction) *list = &builderBlock(b)->instructions;
+  if (value.kind == ValueTemporary && list->slice.len > 0) {
+    Instruction *last = &list->slice.ptr[list->slice.len - 1];
+    if (last->dst.kind == ValueTemporary && last->dst.id == value.id &&
+        !clearsOperand(*last, dst)) {
+      last->dst = dst;
+      return;
+    }
+  }
+  addInstruction(b, (Instruction){.op = IrCopy, .dst = dst, .a = value});
+}
+
+// Sets the elements of an array literal in order, then the variable of the
+// array to how many there are. Sema only lets a declaration take one, so
+// there are no elements of an older literal to clear.
+static void buildArray(IrBuilder *b, Expression array, Slice(char) name) {
+  char digits[32];
+  for (size_t i = 0; i < array.array.elements_len; i++) {
+    int len = snprintf(digits, sizeof(digits), "%zu", i);
+    Slice(char) element = elementName(
+        b->ally, name, (Slice(char)){.ptr = digits, .len = (size_t)len});
+    buildInto(b, array.array.elements[i], variableValue(element));
+  }
+  int len = snprintf(digits, sizeof(digits), "%zu", array.array.elements_len);
+  Result(Slice_char) count = alloc(b->ally, char, (size_t)len);
+  if (!count.ok)
+    panic(count.err);
+  memcpy(count.val.ptr, digits, (size_t)len);
+  Value length = {.kind = ValueNumber, .type = TypeNumber, .text = count.val};
+  addInstruction(b, (Instruction){
+                        .op = IrCopy, .dst = variableValue(name), .a = length});
+}
+
+// Reassigns the parameters of a self tail call and jumps back to the entry
+// of the function frame, which stays the same setlocal frame throughout
+static void buildTailCall(IrBuilder *b, Expression call) {
+  Slice(Value) targets = allocValues(b->ally, call.call.parameters_len);
+  Slice(Value) args = allocValues(b->ally, call.call.parameters_len);
+  size_t len = 0;
+  for (size_t i = 0; i < call.call.parameters_len; i++) {
+    Value arg = buildValue(b, call.call.parameters[i]);
+    Slice(char) param = call.call.tail_parameters[i].identifier;
+    // passing a parameter on unchanged needs no set
+    if (arg.kind == ValueVariable && eql(arg.text, param))
+      continue;
+    targets.ptr[len] = variableValue(param);
+    args.ptr[len++] = arg;
+  }
+  targets.len = len;
+  args.len = len;
+  if (len > 0)
+    addInstruction(b, (Instruction){.op = IrParallelCopy,
+                                    .dst = newTemporary(b, false),
+                                    .args = args,
+                                    .targets = targets});
+  terminate(b, jumpTo(builderFunction(b)->entry));
+}
+
+static void buildStatement(IrBuilder *b, Statement stmt);
+
+static void buildStatements(IrBuilder *b, Slice(Statement) statements) {
+  for (size_t i = 0; i < statements.len; i++) {
+    buildStatement(b, statements.ptr[i]);
+  }
+}
+
+static Slice(Value) tunnelValues(IrBuilder *b, Slice(Slice_char) names) {
+  Slice(Value) values = allocValues(b->ally, names.len);
+  for (size_t i = 0; i < names.len; i++) {
+    values.ptr[i] = variableValue(names.ptr[i]);
+  }
+  return values;
+}
+
+// each kept entry takes two for variables on the return line
+#define MAX_KEPT_MEMOS 4
+
+static void markReachable(IrFunction *fn, size_t block, bool *reached) {
+  if (reached[block])
+    return;
+  reached[block] = true;
+  Terminator term = fn->blocks.slice.ptr[block].term;
+  for (size_t i = 0; i < successorCount(term); i++) {
+    markReachable(fn, successor(term, i), reached);
+  }
+}
+
+// Cache entries set in a frame go away with its endlocal, so returns carry
+// out the ones of the memoized calls that can have run before them. A
+// caller then finds what its callee already worked out, like fib(n - 2)
+// after fib(n - 1).
+static void keepMemoEntries(Allocator ally, IrFunction *fn) {
+  size_t blocks = fn->blocks.slice.len;
+  Instruction kept[MAX_KEPT_MEMOS];
+  bool *reached[MAX_KEPT_MEMOS];
+  size_t len = 0;
+  for (size_t i = 0; i < blocks; i++) {
+    Slice(Instruction) list = fn->blocks.slice.ptr[i].instructions.slice;
+    for (size_t j = 0; j < list.len && len < MAX_KEPT_MEMOS; j++) {
+      if (list.ptr[j].op != IrCall || !list.ptr[j].memoized)
+        continue;
+      reached[len] = allocFlags(ally, blocks);
+      markReachable(fn, i, reached[len]);
+      kept[len++] = list.ptr[j];
+    }
+  }
+  for (size_t i = 0; i < blocks; i++) {
+    Terminator *term = &fn->blocks.slice.ptr[i].term;
+    if (term->kind != TermReturn || term->frames == 0)
+      continue;
+    size_t count = 0;
+    for (size_t j = 0; j < len; j++) {
+      if (reached[j][i])
+        count++;
+    }
+    if (count == 0)
+      continue;
+    Result(Slice_Instruction) memos_res = alloc(ally, Instruction, count);
+    if (!memos_res.ok)
+      panic(memos_res.err);
+    term->memos = memos_res.val;
+    // every return gets its own arguments for the passes to rewrite
+    count = 0;
+    for (size_t j = 0; j < len; j++) {
+      if (!reached[j][i])
+        continue;
+      Slice(Value) args = allocValues(ally, kept[j].args.len);
+      for (size_t k = 0; k < args.len; k++) {
+        args.ptr[k] = kept[j].args.ptr[k];
+      }
+      term->memos.ptr[count++] = (Instruction){
+          .op = IrCall, .args = args, .text = kept[j].text, .memoized = true};
+    }
+  }
+}
+
+static void buildFunction(IrBuilder *b, Slice(char) name, Expression expr) {
+  Result(Vec_IrBlock) blocks_res = createVec(b->ally, IrBlock, 4);
+  if (!blocks_res.ok)
+    panic(blocks_res.err);
+  Result(Vec_Temporary) temporaries_res = createVec(b->ally, Temporary, 4);
+  if (!temporaries_res.ok)
+    panic(temporaries_res.err);
+  IrFunction function = {
+      .name = name,
+      .label = name,
+      .blocks = blocks_res.val,
+      .entry = 0,
+      .tail_recursive = expr.function_expression.tail_recursive,
+      .subroutine = false,
+      .named_result = false,
+      .temporaries = temporaries_res.val,
+  };
+  if (!append(&b->program->functions, IrFunction, &function))
+    panic("Failed to append function");
+
+  Result(Vec_Slice_char) tunnels_res = createVec(b->ally, Slice_char, 2);
+  if (!tunnels_res.ok)
+    panic(tunnels_res.err);
+  IrBuilder inner = *b;
+  inner.function = b->program->functions.slice.len - 1;
+  inner.frames = 1;
+  inner.frame = b->declared.slice.len;
+  inner.tunnels = &tunnels_res.val;
+  inner.block = newBlock(&inner);
+  addInstruction(&inner, (Instruction){.op = IrSetlocal});
+  for (size_t i = 0; i < expr.function_expression.parameters_len; i++) {
+    Slice(char) param = expr.function_expression.parameters[i].identifier;
+    addInstruction(&inner, (Instruction){.op = IrParam,
+                                         .dst = variableValue(param),
+                                         .index = i + 1});
+    declareName(&inner, param);
+  }
+  if (function.tail_recursive) {
+    size_t entry = newBlock(&inner);
+    terminate(&inner, jumpTo(entry));
+    inner.block = entry;
+    builderFunction(&inner)->entry = entry;
+  }
+  Statement *body = expr.function_expression.body;
+  if (body->type == BlockStatement)
+    buildStatements(&inner, body->block->statements);
+  else
+    buildStatement(&inner, *body);
+  openBlock(&inner);
+  Slice(Value) tunnels = tunnelValues(&inner, tunnels_res.val.slice);
+  addInstruction(&inner, (Instruction){.op = IrEndlocal, .args = tunnels});
+  terminate(&inner, (Terminator){.kind = TermReturn, .frames = 0});
+  keepMemoEntries(b->ally, builderFunction(&inner));
+
+  // the vector may have moved while the body declared names
+  b->declared = inner.declared;
+  b->declared.slice.len = inner.frame;
+}
+
+static void buildBlock(IrBuilder *b, Block *block) {
+  if (!block->scoped) {
+    // shadowing locals were renamed by resolveScopes, so the statements run
+    // directly in the enclosing frame
+    buildStatements(b, block->statements);
+    return;
+  }
+  Result(Vec_Slice_char) tunnels_res = createVec(b->ally, Slice_char, 2);
+  if (!tunnels_res.ok)
+    panic(tunnels_res.err);
+  size_t outer_frame = b->frame;
+  Vec(Slice_char) *outer_tunnels = b->tunnels;
+  addInstruction(b, (Instruction){.op = IrSetlocal});
+  b->frames++;
+  b->frame = b->declared.slice.len;
+  b->tunnels = &tunnels_res.val;
+  buildStatements(b, block->statements);
+  openBlock(b);
+  Slice(Value) tunnels = tunnelValues(b, tunnels_res.val.slice);
+  addInstruction(b, (Instruction){.op = IrEndlocal, .args = tunnels});
+  b->frames--;
+  b->declared.slice.len = b->frame;
+  b->frame = outer_frame;
+  b->tunnels = outer_tunnels;
+  // names tunneled out of this block may have to leave the parent too
+  for (size_t i = 0; i < tunnels_res.val.slice.len; i++) {
+    noteAssignment(b, tunnels_res.val.slice.ptr[i]);
+  }
+}
+
+// The with_output(path) call and statement parseWithOutput makes a block of
+static bool isOutputBlock(Block block) {
+  if (block.statements.len != 2 ||
+      block.statements.ptr[0].type != ExpressionStatement)
+    return false;
+  Expression call = block.statements.ptr[0].expression;
+  return call.type == CallExpression && call.call.parameters_len == 1 &&
+         call.call.callee->type == IdentifierExpression &&
+         eql(call.call.callee->identifier,
+             (Slice(char)){.ptr = "with_output", .len = 11});
+}
+
+// Gives the block blocks of its own, so that the lowering can redirect all
+// of it at once
+static void buildOutputBlock(IrBuilder *b, Block *block) {
+  Expression path = block->statements.ptr[0].expression.call.parameters[0];
+  Value file = buildValue(b, path);
+  size_t entry = b->block;
+  size_t start = newBlock(b);
+  terminate(b, (Terminator){.kind = TermJump, .target = start, .a = file});
+  b->block = start;
+  buildBlock(b, block);
+  size_t stop = newBlock(b);
+  terminate(b, jumpTo(stop));
+  Terminator *jump = &builderFunction(b)->blocks.slice.ptr[entry].term;
+  if (jump->kind == TermJump && jump->target == start)
+    jump->merge = stop;
+  b->block = stop;
+}
+
+static void buildIf(IrBuilder *b, If *if_statement) {
+  Terminator branch = buildCondition(b, if_statement->condition);
+  size_t consequence = newBlock(b);
+  size_t alternate = if_statement->alternate ? newBlock(b) : 0;
+  size_t merge = newBlock(b);
+  branch.kind = TermBranch;
+  branch.target = consequence;
+  branch.otherwise = if_statement->alternate ? alternate : merge;
+  branch.merge = merge;
+  terminate(b, branch);
+  b->block = consequence;
+  buildStatement(b, *if_statement->consequence);
+  terminate(b, jumpTo(merge));
+  if (if_statement->alternate) {
+    b->block = alternate;
+    buildStatement(b, *if_statement->alternate);
+    terminate(b, jumpTo(merge));
+  }
+  b->block = merge;
+}
+
+static void buildWhile(IrBuilder *b, While *while_statement) {
+  Slice(ChainLink) chain =
+      arithmeticChain(b, while_statement->condition).slice;
+  // a condition that needs ifs of its own is computed in front of the loop
+  // and again at the end of every iteration, which leaves the header with
+  // a single check
+  Value flag = noValue();
+  if (!computableUpFront(chain)) {
+    flag = newFlag(b);
+    buildShortCircuit(b, chain, flag);
+  }
+  size_t header = newBlock(b);
+  terminate(b, jumpTo(header));
+  b->block = header;
+  Terminator branch =
+      flag.kind == ValueNone
+          ? joinedCondition(b, chain)
+          : (Terminator){.symbol = '=', .a = flag, .b = trueValue()};
+  size_t body = newBlock(b);
+  size_t exit = newBlock(b);
+  branch.kind = TermBranch;
+  branch.target = body;
+  branch.otherwise = exit;
+  branch.merge = exit;
+  branch.loop = true;
+  branch.counted = while_statement->counted;
+  terminate(b, branch);
+  b->block = body;
+  buildStatement(b, *while_statement->body);
+  if (flag.kind != ValueNone && builderBlock(b)->term.kind == TermNone)
+    buildShortCircuit(b, chain, flag);
+  terminate(b, jumpTo(header));
+  b->block = exit;
+}
+
+static void buildSwitch(IrBuilder *b, Switch *switch_statement) {
+  Slice(Case) list = switch_statement->cases;
+  Value subject = buildValue(b, switch_statement->subject);
+  Slice(Value) cases = allocValues(b->ally, list.len);
+  Result(Slice_size_t) targets_res = alloc(b->ally, size_t, list.len);
+  if (!targets_res.ok)
+    panic(targets_res.err);
+  Slice(size_t) targets = targets_res.val;
+  for (size_t i = 0; i < list.len; i++) {
+    cases.ptr[i] = buildValue(b, list.ptr[i].value);
+    targets.ptr[i] = newBlock(b);
+  }
+  size_t otherwise = switch_statement->otherwise ? newBlock(b) : 0;
+  size_t merge = newBlock(b);
+  Terminator dispatch = {
+      .kind = TermSwitch,
+      .a = subject,
+      .cases = cases,
+      .targets = targets,
+      .otherwise = switch_statement->otherwise ? otherwise : merge,
+      .merge = merge,
+  };
+  terminate(b, dispatch);
+  for (size_t i = 0; i < list.len; i++) {
+    b->block = targets.ptr[i];
+    buildStatement(b, *list.ptr[i].body);
+    terminate(b, jumpTo(merge));
+  }
+  if (switch_statement->otherwise) {
+    b->block = otherwise;
+    buildStatement(b, *switch_statement->otherwise);
+    terminate(b, jumpTo(merge));
+  }
+  b->block = merge;
+}
+
+static void buildStatement(IrBuilder *b, Statement stmt) {
+  openBlock(b);
+  switch (stmt.type) {
+  case DeclarationStatement: {
+    if (stmt.declaration.value.type == FunctionExpression) {
+      buildFunction(b, stmt.declaration.name, stmt.declaration.value);
+      break;
+    }
+    if (stmt.declaration.value.type == ArrayExpression)
+      buildArray(b, stmt.declaration.value, stmt.declaration.name);
+    else
+      buildInto(b, stmt.declaration.value,
+                variableValue(stmt.declaration.name));
+    declareName(b, stmt.declaration.name);
+  } break;
+  case AssignmentStatement: {
+    Slice(char) name = stmt.assignment.name;
+    Expression *index = stmt.assignment.index;
+    if (index && index->type == NumericExpression) {
+      Slice(char) element = elementName(b->ally, name, index->number);
+      buildInto(b, stmt.assignment.value, variableValue(element));
+      noteElementAssignment(b, name, element);
+      break;
+    }
+    if (index) {
+      Value at = buildValue(b, *index);
+      Value value = buildValue(b, stmt.assignment.value);
+      addInstruction(b, (Instruction){
+                            .op = IrStore, .a = at, .b = value, .text = name});
+      break;
+    }
+    buildInto(b, stmt.assignment.value, variableValue(name));
+    noteAssignment(b, name);
+  } break;
+  case InlineBatchStatement: {
+    addInstruction(b, (Instruction){.op = IrBatch, .text = stmt.inline_batch});
+  } break;
+  case BlockStatement: {
+    if (isOutputBlock(*stmt.block)) {
+      buildOutputBlock(b, stmt.block);
+      break;
+    }
+    buildBlock(b, stmt.block);
+  } break;
+  case IfStatement: {
+    buildIf(b, stmt.if_statement);
+  } break;
+  case WhileStatement: {
+    buildWhile(b, stmt.while_statement);
+  } break;
+  case SwitchStatement: {
+    buildSwitch(b, stmt.switch_statement);
+  } break;
+  case ReturnStatement: {
+    Expression *value = stmt.return_statement;
+    if (value && value->type == CallExpression && value->call.tail_parameters) {
+      buildTailCall(b, *value);
+      break;
+    }
+    terminate(b, (Terminator){.kind = TermReturn,
+                              .value = value ? buildValue(b, *value)
+                                             : noValue(),
+                              .frames = b->frames});
+  } break;
+  case ExpressionStatement: {
+    Expression expr = stmt.expression;
+    if (expr.type != CallExpression) {
+      fprintf(stdout, "Skipped unknown expression: ");
+      fprintf(stdout, "%1.*s", (int)expr.string.len, expr.string.ptr);
+      fprintf(stdout, "\n");
+      break;
+    }
+    if (expr.call.callee->type != IdentifierExpression) {
+      fprintf(stdout, "Skipped unknown callee\n");
+      break;
+    }
+    Slice(char) name = expr.call.callee->identifier;
+    bool console = eql(name, (Slice(char)){.ptr = "print", .len = 5});
+    bool partial = eql(name, (Slice(char)){.ptr = "write", .len = 5});
+    bool line = eql(name, (Slice(char)){.ptr = "writeln", .len = 7});
+    bool empty = eql(name, (Slice(char)){.ptr = "with_output", .len = 11});
+    if (console || partial || line || empty) {
+      // all but print take the file first
+      size_t skip = console ? 0 : 1;
+      if (expr.call.parameters_len < skip)
+        panic("buildStatement: Writing without a file to write to");
+      Value file =
+          console ? noValue() : buildValue(b, expr.call.parameters[0]);
+      Slice(Value) args =
+          allocValues(b->ally, empty ? 0 : expr.call.parameters_len - skip);
+      for (size_t i = 0; i < args.len; i++) {
+        args.ptr[i] = buildValue(b, expr.call.parameters[i + skip]);
+      }
+      addInstruction(b, (Instruction){.op = IrPrint,
+                                      .symbol = partial ? 'w'
+                                                : empty ? '>'
+                                                        : 0,
+                                      .a = file,
+                                      .args = args});
+    } else if (expr.call.tail_parameters) {
+      buildTailCall(b, expr);
+    } else {
+      buildCall(b, expr, noValue());
+    }
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+// The function a call goes to, or NULL for unknown ones and names that more
+// than one function has
+static IrFunction *findIrFunction(IrProgram *program, Slice(char) name) {
+  IrFunction *found = NULL;
+  for (size_t i = 1; i < program->functions.slice.len; i++) {
+    if (!eql(program->functions.slice.ptr[i].name, name))
+      continue;
+    if (found)
+      return NULL;
+    found = &program->functions.slice.ptr[i];
+  }
+  return found;
+}
+
+static bool callsReach(IrProgram *program, IrFunction *from,
+                       IrFunction *target, bool *visited) {
+  for (size_t i = 0; i < from->blocks.slice.len; i++) {
+    Slice(Instruction) list = from->blocks.slice.ptr[i].instructions.slice;
+    for (size_t j = 0; j < list.len; j++) {
+      if (list.ptr[j].op != IrCall)
+        continue;
+      IrFunction *callee = findIrFunction(program, list.ptr[j].text);
+      if (!callee)
+        continue;
+      if (callee == target)
+        return true;
+      size_t index = (size_t)(callee - program->functions.slice.ptr);
+      if (visited[index])
+        continue;
+      visited[index] = true;
+      if (callsReach(program, callee, target, visited))
+        return true;
+    }
+  }
+  return false;
+}
+
+// Labels are found without regard to case
+static bool mentionsLabel(Slice(char) text, Slice(char) name) {
+  for (size_t i = 0; i + name.len <= text.len; i++) {
+    size_t j = 0;
+    while (j < name.len && tolower((unsigned char)text.ptr[i + j]) ==
+                               tolower((unsigned char)name.ptr[j]))
+      j++;
+    if (j == name.len)
+      return true;
+  }
+  return false;
+}
+
+static bool isLabelChar(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+// Whether text jumps to the label, with call :name, goto :name or goto name.
+// Other mentions, like the function name in a --profile event, do not
+// count.
+static bool jumpsToLabel(Slice(char) text, Slice(char) name) {
+  for (size_t i = 0; i + name.len <= text.len; i++) {
+    Slice(char) word = {.ptr = text.ptr + i, .len = name.len};
+    if (!mentionsLabel(word, name) ||
+        (i + name.len < text.len && isLabelChar(text.ptr[i + name.len])))
+      continue;
+    if (i > 0 && text.ptr[i - 1] == ':')
+      return true;
+    size_t start = i;
+    while (start > 0 && isblank((unsigned char)text.ptr[start - 1]))
+      start--;
+    if (start < i && start >= 4 &&
+        mentionsLabel((Slice(char)){.ptr = text.ptr + start - 4, .len = 4},
+                      (Slice(char)){.ptr = "goto", .len = 4}) &&
+        (start == 4 || !isLabelChar(text.ptr[start - 5])))
+      return true;
+  }
+  return false;
+}
+
+// Inline batch may call a function itself, which then has to return with
+// exit /b like any other
+static bool calledFromBatch(IrProgram *program, Slice(char) name) {
+  for (size_t i = 0; i < program->functions.slice.len; i++) {
+    IrFunction fn = program->functions.slice.ptr[i];
+    for (size_t j = 0; j < fn.blocks.slice.len; j++) {
+      Slice(Instruction) list = fn.blocks.slice.ptr[j].instructions.slice;
+      for (size_t k = 0; k < list.len; k++) {
+        if (list.ptr[k].op == IrBatch && jumpsToLabel(list.ptr[k].text, name))
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void findSubroutines(Allocator ally, IrProgram *program) {
+  size_t count = 0;
+  for (size_t i = 1; i < program->functions.slice.len; i++) {
+    IrFunction *fn = &program->functions.slice.ptr[i];
+    bool *visited = allocFlags(ally, program->functions.slice.len);
+    fn->subroutine = findIrFunction(program, fn->name) == fn &&
+                     !callsReach(program, fn, fn, visited) &&
+                     !calledFromBatch(program, fn->name);
+    if (fn->subroutine)
+      count++;
+  }
+  if (count > 0)
+    fprintf(stdout, "Entering %zu function%s with goto\n", count,
+            count == 1 ? "" : "s");
+}
+
+// Whether a return without a value can be reached, which leaves __ret__ as
+// the last call set it
+static bool fallsOff(Allocator ally, IrFunction *fn) {
+  bool *reached = allocFlags(ally, fn->blocks.slice.len);
+  markReachable(fn, 0, reached);
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    Terminator term = fn->blocks.slice.ptr[i].term;
+    if (reached[i] && term.kind == TermReturn &&
+        term.value.kind == ValueNone)
+      return true;
+  }
+  return false;
+}
+
+// Functions entered with call that always return a value set it in the
+// caller's variable themselves
+static void findNamedResults(Allocator ally, IrProgram *program) {
+  size_t count = 0;
+  for (size_t i = 1; i < program->functions.slice.len; i++) {
+    IrFunction *fn = &program->functions.slice.ptr[i];
+    fn->named_result = findIrFunction(program, fn->name) == fn &&
+                       !fn->subroutine &&
+                       !calledFromBatch(program, fn->name) &&
+                       !fallsOff(ally, fn);
+    if (fn->named_result)
+      count++;
+  }
+  if (count > 0)
+    fprintf(stdout, "Returning into named variables from %zu function%s\n",
+            count, count == 1 ? "" : "s");
+}
+
+static IrProgram buildIr(Allocator ally, Program prog) {
+  Result(Vec_IrFunction) functions_res = createVec(ally, IrFunction, 4);
+  if (!functions_res.ok)
+    panic(functions_res.err);
+  IrProgram program = {.functions = functions_res.val};
+  Result(Vec_IrBlock) blocks_res = createVec(ally, IrBlock, 4);
+  if (!blocks_res.ok)
+    panic(blocks_res.err);
+  Result(Vec_Temporary) temporaries_res = createVec(ally, Temporary, 4);
+  if (!temporaries_res.ok)
+    panic(temporaries_res.err);
+  IrFunction top = {
+      .name = {.ptr = NULL, .len = 0},
+      .label = {.ptr = NULL, .len = 0},
+      .blocks = blocks_res.val,
+      .temporaries = temporaries_res.val,
+  };
+  if (!append(&program.functions, IrFunction, &top))
+    panic("Failed to append function");
+  Result(Vec_Slice_char) declared_res = createVec(ally, Slice_char, 8);
+  if (!declared_res.ok)
+    panic(declared_res.err);
+  // the prologue opens the frame of the top level
+  IrBuilder b = {
+      .ally = ally,
+      .program = &program,
+      .function = 0,
+      .frames = 1,
+      .declared = declared_res.val,
+      .frame = 0,
+      .tunnels = NULL,
+  };
+  b.block = newBlock(&b);
+  buildStatements(&b, prog.statements);
+  openBlock(&b);
+  terminate(&b, (Terminator){.kind = TermEnd});
+  findSubroutines(ally, &program);
+  findNamedResults(ally, &program);
+
+  size_t blocks = 0;
+  size_t instructions = 0;
+  for (size_t i = 0; i < program.functions.slice.len; i++) {
+    IrFunction fn = program.functions.slice.ptr[i];
+    blocks += fn.blocks.slice.len;
+    for (size_t j = 0; j < fn.blocks.slice.len; j++) {
+      instructions += fn.blocks.slice.ptr[j].instructions.slice.len;
+    }
+  }
+  fprintf(stdout, "Built IR with %zu functions, %zu blocks, %zu instructions\n",
+          program.functions.slice.len, blocks, instructions);
+  return program;
+}
+
+static void printValue(FILE *file, Value value) {
+  switch (value.kind) {
+  case ValueNone: {
+    fprintf(file, "none");
+  } break;
+  case ValueTemporary: {
+    fprintf(file, "%%%zu", value.id);
+  } break;
+  case ValueString: {
+    fprintf(file, "\"%.*s\"", (int)value.text.len, value.text.ptr);
+  } break;
+  case ValueVariable:
+  case ValueNumber: {
+    fprintf(file, "%.*s", (int)value.text.len, value.text.ptr);
+  } break;
+  }
+}
+
+static void printValues(FILE *file, Slice(Value) values) {
+  for (size_t i = 0; i < values.len; i++) {
+    if (i > 0)
+      fprintf(file, ", ");
+    printValue(file, values.ptr[i]);
+  }
+}
+
+static void printJoined(FILE *file, Slice(Comparison) joined) {
+  for (size_t i = 0; i < joined.len; i++) {
+    fprintf(file, " %s ", operatorText(joined.ptr[i].join));
+    printValue(file, joined.ptr[i].a);
+    fprintf(file, " %s ", operatorText(joined.ptr[i].symbol));
+    printValue(file, joined.ptr[i].b);
+  }
+}
+
+static void printInstruction(FILE *file, Instruction inst) {
+  fprintf(file, "  ");
+  if (inst.op != IrParallelCopy && inst.dst.kind != ValueNone) {
+    printValue(file, inst.dst);
+    fprintf(file, " = ");
+  }
+  switch (inst.op) {
+  case IrCopy: {
+    printValue(file, inst.a);
+  } break;
+  case IrArithmetic:
+  case IrCompare: {
+    printValue(file, inst.a);
+    fprintf(file, " %s ", operatorText(inst.symbol));
+    printValue(file, inst.b);
+    printJoined(file, inst.joined);
+  } break;
+  case IrParam: {
+    fprintf(file, "param %zu", inst.index);
+  } break;
+  case IrCall: {
+    fprintf(file, "call %s%.*s(", inst.memoized ? "memoized " : "",
+            (int)inst.text.len, inst.text.ptr);
+    printValues(file, inst.args);
+    fprintf(file, ")");
+  } break;
+  case IrPrint: {
+    if (inst.symbol == '>') {
+      fprintf(file, "empty ");
+      printValue(file, inst.a);
+      break;
+    }
+    fputs(inst.symbol == 'w' ? "write " : "print ", file);
+    if (inst.a.kind != ValueNone) {
+      fputs("to ", file);
+      printValue(file, inst.a);
+      fputs(inst.args.len ? ", " : "", file);
+    }
+    printValues(file, inst.args);
+  } break;
+  case IrBatch: {
+    fprintf(file, "batch ");
+    for (size_t i = 0; i < inst.text.len; i++) {
+      char c = inst.text.ptr[i];
+      if (c == '\n')
+        fprintf(file, "\\n");
+      else if (c != '\r')
+        fputc(c, file);
+    }
+  } break;
+  case IrSetlocal: {
+    fprintf(file, "setlocal");
+  } break;
+  case IrEndlocal: {
+    fputs(inst.args.len ? "endlocal " : "endlocal", file);
+    printValues(file, inst.args);
+  } break;
+  case IrParallelCopy: {
+    printValues(file, inst.targets);
+    fprintf(file, " = parallel ");
+    printValues(file, inst.args);
+    fprintf(file, " via ");
+    printValue(file, inst.dst);
+  } break;
+  case IrUnset: {
+    fprintf(file, "unset ");
+    printValues(file, inst.args);
+  } break;
+  case IrLoad:
+  case IrStore: {
+    fprintf(file, "%.*s[", (int)inst.text.len, inst.text.ptr);
+    printValue(file, inst.a);
+    fputs("]", file);
+    if (inst.op == IrStore) {
+      fputs(" = ", file);
+      printValue(file, inst.b);
+    }
+  } break;
+  }
+  fputs(inst.folded ? " ; folded\n" : "\n", file);
+}
+
+static void printTerminator(FILE *file, Terminator term) {
+  switch (term.kind) {
+  case TermNone: {
+    fprintf(file, "  unterminated\n");
+  } break;
+  case TermJump: {
+    fprintf(file, "  jump b%zu", term.target);
+    if (term.a.kind != ValueNone) {
+      fputs(" with output ", file);
+      printValue(file, term.a);
+      fprintf(file, " up to b%zu", term.merge);
+    }
+    fputs("\n", file);
+  } break;
+  case TermBranch: {
+    fputs(term.loop ? "  loop " : "  branch ", file);
+    printValue(file, term.a);
+    fprintf(file, " %s ", operatorText(term.symbol));
+    printValue(file, term.b);
+    printJoined(file, term.joined);
+    fprintf(file, ", b%zu, b%zu %s b%zu%s\n", term.target, term.otherwise,
+            term.loop ? "exit" : "merge", term.merge,
+            term.counted ? " counted" : "");
+  } break;
+  case TermSwitch: {
+    fputs("  switch ", file);
+    printValue(file, term.a);
+    for (size_t i = 0; i < term.cases.len; i++) {
+      fputs(i ? ", " : " [", file);
+      printValue(file, term.cases.ptr[i]);
+      fprintf(file, ": b%zu", term.targets.ptr[i]);
+    }
+    fprintf(file, "], b%zu merge b%zu\n", term.otherwise, term.merge);
+  } break;
+  case TermReturn: {
+    fprintf(file, "  return ");
+    printValue(file, term.value);
+    fprintf(file, " frames %zu", term.frames);
+    for (size_t i = 0; i < term.memos.len; i++) {
+      fprintf(file, ", keeps %.*s(", (int)term.memos.ptr[i].text.len,
+              term.memos.ptr[i].text.ptr);
+      printValues(file, term.memos.ptr[i].args);
+      fputs(")", file);
+    }
+    fputs("\n", file);
+  } break;
+  case TermEnd: {
+    fprintf(file, "  end\n");
+  } break;
+  }
+}
+
+// The --emit=ir dump
+static void printIr(FILE *file, IrProgram program) {
+  for (size_t i = 0; i < program.functions.slice.len; i++) {
+    IrFunction fn = program.functions.slice.ptr[i];
+    if (i == 0)
+      fprintf(file, "top level\n");
+    else
+      fprintf(file, "\nfunction %.*s%s%s%s\n", (int)fn.name.len, fn.name.ptr,
+              fn.tail_recursive ? " tail recursive" : "",
+              fn.subroutine ? " subroutine" : "",
+              fn.named_result ? " named result" : "");
+    for (size_t j = 0; j < fn.temporaries.slice.len; j++) {
+      Temporary temporary = fn.temporaries.slice.ptr[j];
+      if (temporary.name.len)
+        fprintf(file, "  %%%zu is %.*s\n", j, (int)temporary.name.len,
+                temporary.name.ptr);
+    }
+    for (size_t j = 0; j < fn.blocks.slice.len; j++) {
+      IrBlock block = fn.blocks.slice.ptr[j];
+      fprintf(file, "b%zu:%s\n", j,
+              fn.tail_recursive && j == fn.entry ? " entry" : "");
+      for (size_t k = 0; k < block.instructions.slice.len; k++) {
+        printInstruction(file, block.instructions.slice.ptr[k]);
+      }
+      printTerminator(file, block.term);
+    }
+  }
+}
+
+#endif /* IR_H */
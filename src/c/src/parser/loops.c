@@ -0,0 +1,298 @@
+#ifndef LOOPS_H
+#define LOOPS_H
+
+#include "../std/Allocator.c"
+#include "../std/eql.c"
+#include "parser.c"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+DefSlice(CountedLoop);
+DefResult(Slice_CountedLoop);
+
+static long long parseNumber(Slice(char) number) {
+  long long n = 0;
+  for (size_t i = 0; i < number.len; i++) {
+    n = n * 10 + (number.ptr[i] - '0');
+  }
+  return n;
+}
+
+static bool isIdentifier(Expression expr, Slice(char) name) {
+  return expr.type == IdentifierExpression && eql(expr.identifier, name);
+}
+
+// Returns the step of `name = name + n`, `name = n + name` or
+// `name = name - n`, or 0 when the assignment is anything else
+static long long inductionStep(Assignment assign) {
+  if (assign.value.type != ArithmeticExpression)
+    return 0;
+  Expression left = *assign.value.arithmetic.left;
+  Expression right = *assign.value.arithmetic.right;
+  switch (assign.value.arithmetic.op) {
+  case '+': {
+    if (isIdentifier(left, assign.name) && right.type == NumericExpression)
+      return parseNumber(right.number);
+    if (left.type == NumericExpression && isIdentifier(right, assign.name))
+      return parseNumber(left.number);
+  } break;
+  case '-': {
+    if (isIdentifier(left, assign.name) && right.type == NumericExpression)
+      return -parseNumber(right.number);
+  } break;
+  }
+  return 0;
+}
+
+// Whether stmt may change name in a way the step analysis cannot see
+static bool writesVariable(Statement stmt, Slice(char) name) {
+  switch (stmt.type) {
+  case DeclarationStatement: {
+    return eql(stmt.declaration.name, name);
+  }
+  case AssignmentStatement: {
+    // storing an element leaves the length in the name alone
+    return !stmt.assignment.index && eql(stmt.assignment.name, name);
+  }
+  case InlineBatchStatement:
+  case ReturnStatement: {
+    return true;
+  }
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      if (writesVariable(stmt.block->statements.ptr[i], name))
+        return true;
+    }
+    return false;
+  }
+  case IfStatement: {
+    return writesVariable(*stmt.if_statement->consequence, name) ||
+           (stmt.if_statement->alternate &&
+            writesVariable(*stmt.if_statement->alternate, name));
+  }
+  case WhileStatement: {
+    return writesVariable(*stmt.while_statement->body, name);
+  }
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      if (writesVariable(*switch_statement->cases.ptr[i].body, name))
+        return true;
+    }
+    return switch_statement->otherwise &&
+           writesVariable(*switch_statement->otherwise, name);
+  }
+  case ExpressionStatement: {
+    return false;
+  }
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+// Sums the steps of the top level induction updates in body, or returns 0
+// when the variable is written anywhere else
+static long long loopStep(Statement body, Slice(char) name) {
+  Slice(Statement) statements = {.ptr = &body, .len = 1};
+  if (body.type == BlockStatement)
+    statements = body.block->statements;
+  long long step = 0;
+  for (size_t i = 0; i < statements.len; i++) {
+    Statement stmt = statements.ptr[i];
+    if (stmt.type == AssignmentStatement && !stmt.assignment.index &&
+        eql(stmt.assignment.name, name)) {
+      long long n = inductionStep(stmt.assignment);
+      if (n == 0)
+        return 0;
+      step += n;
+    } else if (writesVariable(stmt, name)) {
+      return 0;
+    }
+  }
+  return step;
+}
+
+// Value the statement leaves in name when it stores a numeric literal there
+static bool numericStore(Statement stmt, Slice(char) name, long long *value) {
+  if (stmt.type == DeclarationStatement && eql(stmt.declaration.name, name) &&
+      stmt.declaration.value.type == NumericExpression) {
+    *value = parseNumber(stmt.declaration.value.number);
+    return true;
+  }
+  if (stmt.type == AssignmentStatement && !stmt.assignment.index &&
+      eql(stmt.assignment.name, name) &&
+      stmt.assignment.value.type == NumericExpression) {
+    *value = parseNumber(stmt.assignment.value.number);
+    return true;
+  }
+  return false;
+}
+
+// The variable a bound of n or len(n) reads at runtime, or an empty name
+static Slice(char) boundVariable(Expression bound) {
+  if (bound.type == CallExpression &&
+      bound.call.callee->type == IdentifierExpression &&
+      eql(bound.call.callee->identifier,
+          (Slice(char)){.ptr = "len", .len = 3}) &&
+      bound.call.parameters_len == 1)
+    bound = bound.call.parameters[0];
+  if (bound.type == IdentifierExpression)
+    return bound.identifier;
+  return (Slice(char)){.ptr = NULL, .len = 0};
+}
+
+// A bound only known at runtime gives the last value as an offset from it,
+// as long as the loop cannot change it
+static void recognizeRuntimeBound(Allocator ally, While *loop, char op,
+                                  Slice(char) variable, long long start,
+                                  long long step, Slice(char) bound) {
+  if (bound.len == 0 || eql(bound, variable) || op == '!' ||
+      (op == '<' || op == 'L') != (step > 0) ||
+      writesVariable(*loop->body, bound))
+    return;
+  Result(Slice_CountedLoop) counted_res = alloc(ally, CountedLoop, 1);
+  if (!counted_res.ok)
+    panic(counted_res.err);
+  long long offset = op == '<' ? -1 : op == '>' ? 1 : 0;
+  *counted_res.val.ptr = (CountedLoop){
+      .variable = variable,
+      .start = start,
+      .step = step,
+      .bound = bound,
+      .offset = offset,
+  };
+  loop->counted = counted_res.val.ptr;
+  fprintf(stdout, "Counted loop: %1.*s from %lld to %1.*s%s step %lld\n",
+          (int)variable.len, variable.ptr, start, (int)bound.len, bound.ptr,
+          offset < 0 ? " - 1" : offset > 0 ? " + 1" : "", step);
+}
+
+// Finds the literal the counter starts from in the statements before the
+// loop, looking past the ones that leave it alone
+static bool startValue(Slice(Statement) before, Slice(char) name,
+                       long long *start) {
+  for (size_t i = before.len; i > 0; i--) {
+    if (numericStore(before.ptr[i - 1], name, start))
+      return true;
+    if (writesVariable(before.ptr[i - 1], name))
+      return false;
+  }
+  return false;
+}
+
+static void recognizeCountedLoop(Allocator ally, While *loop,
+                                 Slice(Statement) before) {
+  Expression cond = loop->condition;
+  if (cond.type != ArithmeticExpression ||
+      !isComparison(cond.arithmetic.op) || cond.arithmetic.op == '=')
+    return;
+  char op = cond.arithmetic.op;
+  Expression *variable = cond.arithmetic.left;
+  Expression *bound = cond.arithmetic.right;
+  if (variable->type != IdentifierExpression) {
+    variable = cond.arithmetic.right;
+    bound = cond.arithmetic.left;
+    op = swapComparison(op);
+  }
+  if (variable->type != IdentifierExpression)
+    return;
+  long long start = 0;
+  if (!startValue(before, variable->identifier, &start))
+    return;
+  long long step = loopStep(*loop->body, variable->identifier);
+  if (step == 0)
+    return;
+  // the iterations can only be counted up front when both ends are known
+  if (bound->type != NumericExpression) {
+    recognizeRuntimeBound(ally, loop, op, variable->identifier, start, step,
+                          boundVariable(*bound));
+    return;
+  }
+  long long end = parseNumber(bound->number);
+  if (op == '!') {
+    // `!=` only terminates on an exact hit
+    if ((end - start) % step != 0 || (end - start) / step < 0)
+      return;
+  } else {
+    // the others stop at the first value past the bound, which has to lie
+    // in the direction of the step
+    if ((op == '<' || op == 'L') != (step > 0))
+      return;
+    long long limit = op == 'L' ? end + 1 : op == 'G' ? end - 1 : end;
+    long long distance = step > 0 ? limit - start : start - limit;
+    long long stride = step > 0 ? step : -step;
+    long long count = distance > 0 ? (distance + stride - 1) / stride : 0;
+    end = start + count * step;
+  }
+  Result(Slice_CountedLoop) counted_res = alloc(ally, CountedLoop, 1);
+  if (!counted_res.ok)
+    panic(counted_res.err);
+  *counted_res.val.ptr = (CountedLoop){
+      .variable = variable->identifier,
+      .start = start,
+      .step = step,
+      .end = end,
+  };
+  loop->counted = counted_res.val.ptr;
+  fprintf(stdout, "Counted loop: %1.*s from %lld to %lld step %lld\n",
+          (int)variable->identifier.len, variable->identifier.ptr, start, end,
+          step);
+}
+
+static void findCountedLoopsIn(Allocator ally, Statement *stmt,
+                               Slice(Statement) before);
+
+static void findCountedLoopsInList(Allocator ally, Slice(Statement) list) {
+  for (size_t i = 0; i < list.len; i++) {
+    findCountedLoopsIn(ally, &list.ptr[i],
+                       (Slice(Statement)){.ptr = list.ptr, .len = i});
+  }
+}
+
+static void findCountedLoopsIn(Allocator ally, Statement *stmt,
+                               Slice(Statement) before) {
+  Slice(Statement) none = {.ptr = NULL, .len = 0};
+  switch (stmt->type) {
+  case BlockStatement: {
+    findCountedLoopsInList(ally, stmt->block->statements);
+  } break;
+  case IfStatement: {
+    findCountedLoopsIn(ally, stmt->if_statement->consequence, none);
+    if (stmt->if_statement->alternate)
+      findCountedLoopsIn(ally, stmt->if_statement->alternate, none);
+  } break;
+  case WhileStatement: {
+    findCountedLoopsIn(ally, stmt->while_statement->body, none);
+    recognizeCountedLoop(ally, stmt->while_statement, before);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      findCountedLoopsIn(ally, switch_statement->cases.ptr[i].body, none);
+    }
+    if (switch_statement->otherwise)
+      findCountedLoopsIn(ally, switch_statement->otherwise, none);
+  } break;
+  case DeclarationStatement: {
+    if (stmt->declaration.value.type == FunctionExpression)
+      findCountedLoopsIn(ally, stmt->declaration.value.function_expression.body,
+                         none);
+  } break;
+  case AssignmentStatement:
+  case ExpressionStatement:
+  case InlineBatchStatement:
+  case ReturnStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static void findCountedLoops(Allocator ally, Program prog) {
+  findCountedLoopsInList(ally, prog.statements);
+}
+
+#endif /* LOOPS_H */
@@ -0,0 +1,593 @@
+#ifndef MINIFY_H
+#define MINIFY_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "ast.c"
+#include "ir.c"
+#include "parser.c"
+#include "peephole.c"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Renames the labels and variables of the emitted batch text to the
+// shortest free names and drops blank lines and indentation. The text is
+// walked command by command twice: once to count every name, once to
+// rewrite it. Names that occur in inline batch code, that the script only
+// reads from the environment or that cmd gives a meaning of its own are
+// left alone.
+
+typedef struct {
+  Slice(char) from;
+  // empty when the name is kept
+  Slice(char) to;
+  size_t uses;
+  // set by the script for variables, present for labels
+  bool defined;
+} MinifiedName;
+
+DefSlice(MinifiedName);
+DefVec(MinifiedName);
+DefResult(Vec_MinifiedName);
+
+typedef struct {
+  Allocator ally;
+  Vec(MinifiedName) variables;
+  Vec(MinifiedName) labels;
+  // names that occur in inline batch code
+  Vec(Slice_char) reserved;
+  // fixed part of computed goto targets
+  Vec(Slice_char) prefixes;
+  // tells which calls name the variable of their result
+  IrProgram *program;
+  // NULL while the names are being counted
+  Vec(char) * out;
+  // while in the value of a macro, whose commands are chained with ^&
+  bool macro;
+} Minifier;
+
+// variables cmd computes or reads itself, and the goto :eof target
+static char *const environment_names[] = {
+    "cd",          "date",         "time",         "random",
+    "errorlevel",  "cmdcmdline",   "cmdextversion", "path",
+    "pathext",     "comspec",      "prompt",       "temp",
+    "tmp",         "os",           "windir",       "systemroot",
+    "userprofile", "username",     "computername", "appdata",
+    "homedrive",   "homepath",     "programfiles", "eof",
+};
+
+static bool isNameChar(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+static bool inNames(Slice(Slice_char) names, Slice(char) name) {
+  for (size_t i = 0; i < names.len; i++) {
+    if (eqlIgnoreCase(names.ptr[i], name))
+      return true;
+  }
+  return false;
+}
+
+static bool isEnvironmentName(Slice(char) name) {
+  size_t count = sizeof(environment_names) / sizeof(environment_names[0]);
+  for (size_t i = 0; i < count; i++) {
+    Slice(char) known = {.ptr = environment_names[i],
+                         .len = strlen(environment_names[i])};
+    if (eqlIgnoreCase(known, name))
+      return true;
+  }
+  return false;
+}
+
+static MinifiedName *findMinified(Vec(MinifiedName) * names,
+                                  Slice(char) name) {
+  for (size_t i = 0; i < names->slice.len; i++) {
+    if (eqlIgnoreCase(names->slice.ptr[i].from, name))
+      return &names->slice.ptr[i];
+  }
+  return NULL;
+}
+
+static void emitMinified(Minifier *m, char *text, size_t len) {
+  if (m->out && !appendMany(m->out, char, text, len))
+    panic("Failed to append minified text");
+}
+
+static void emitName(Minifier *m, Vec(MinifiedName) * names, Slice(char) name,
+                     bool defines) {
+  MinifiedName *found = findMinified(names, name);
+  if (!m->out) {
+    if (!found) {
+      MinifiedName entry = {.from = name, .to = {.ptr = NULL, .len = 0}};
+      if (!append(names, MinifiedName, &entry))
+        panic("Failed to append name");
+      found = &names->slice.ptr[names->slice.len - 1];
+    }
+    found->uses++;
+    if (defines)
+      found->defined = true;
+    return;
+  }
+  Slice(char) to = found && found->to.len > 0 ? found->to : name;
+  emitMinified(m, to.ptr, to.len);
+}
+
+static Slice(char) scanName(Slice(char) text, size_t *pos) {
+  Slice(char) name = {.ptr = text.ptr + *pos, .len = 0};
+  while (*pos < text.len && isNameChar(text.ptr[*pos])) {
+    (*pos)++;
+    name.len++;
+  }
+  return name;
+}
+
+// Copies one character, or a whole %var% or !var! reference. Array
+// elements keep their names, only a variable in the index is renamed.
+static void scanChar(Minifier *m, Slice(char) text, size_t *pos) {
+  char c = text.ptr[*pos];
+  if (c == '%' && *pos + 1 < text.len && text.ptr[*pos + 1] == '%') {
+    // for variables stay as they are
+    emitMinified(m, "%%", 2);
+    *pos += 2;
+    return;
+  }
+  if (c == '%' || c == '!') {
+    size_t end = *pos + 1;
+    Slice(char) name = scanName(text, &end);
+    if (name.len > 0 && end < text.len && text.ptr[end] == c) {
+      emitMinified(m, &c, 1);
+      emitName(m, &m->variables, name, false);
+      emitMinified(m, &c, 1);
+      *pos = end + 1;
+      return;
+    }
+    if (name.len > 0 && end < text.len && text.ptr[end] == '[') {
+      emitMinified(m, text.ptr + *pos, end - *pos);
+      *pos = end;
+      while (*pos < text.len && text.ptr[*pos] != ']')
+        scanChar(m, text, pos);
+      if (*pos + 1 < text.len && text.ptr[*pos + 1] == c) {
+        emitMinified(m, text.ptr + *pos, 2);
+        *pos += 2;
+      }
+      return;
+    }
+  }
+  emitMinified(m, &c, 1);
+  (*pos)++;
+}
+
+static void scanSpaces(Minifier *m, Slice(char) text, size_t *pos) {
+  while (*pos < text.len && (text.ptr[*pos] == ' ' || text.ptr[*pos] == '\t'))
+    scanChar(m, text, pos);
+}
+
+// Copies keyword when it comes next as a whole word
+static bool scanKeyword(Minifier *m, Slice(char) text, size_t *pos,
+                        const char *keyword) {
+  Slice(char) rest = {.ptr = text.ptr + *pos, .len = text.len - *pos};
+  size_t len = strlen(keyword);
+  if (!commandStartsWith(rest, keyword) ||
+      (len < rest.len && isNameChar(rest.ptr[len]) &&
+       isNameChar(keyword[len - 1])))
+    return false;
+  emitMinified(m, rest.ptr, len);
+  *pos += len;
+  return true;
+}
+
+static void scanCommand(Minifier *m, Slice(char) text, size_t *pos);
+
+// Copies the rest of a command and continues with the one chained after it
+static void scanText(Minifier *m, Slice(char) text, size_t *pos,
+                     bool quoted) {
+  while (*pos < text.len) {
+    char c = text.ptr[*pos];
+    if (c == '"') {
+      quoted = !quoted;
+    } else if (c == '^' && !quoted && *pos + 1 < text.len) {
+      if (m->macro && strchr("&|", text.ptr[*pos + 1])) {
+        while (*pos + 1 < text.len && text.ptr[*pos] == '^' &&
+               strchr("&|", text.ptr[*pos + 1])) {
+          emitMinified(m, text.ptr + *pos, 2);
+          *pos += 2;
+        }
+        scanCommand(m, text, pos);
+        return;
+      }
+      emitMinified(m, text.ptr + *pos, 2);
+      *pos += 2;
+      continue;
+    } else if (c == ')' && !quoted && m->macro) {
+      // closes a block of the macro, maybe going on with its else
+      scanCommand(m, text, pos);
+      return;
+    } else if ((c == '&' || c == '|') && !quoted) {
+      while (*pos < text.len &&
+             (text.ptr[*pos] == '&' || text.ptr[*pos] == '|'))
+        scanChar(m, text, pos);
+      scanCommand(m, text, pos);
+      return;
+    }
+    scanChar(m, text, pos);
+  }
+}
+
+static void scanLabelTarget(Minifier *m, Slice(char) text, size_t *pos) {
+  Slice(char) name = scanName(text, pos);
+  if (*pos < text.len && (text.ptr[*pos] == '%' || text.ptr[*pos] == '!')) {
+    // only the prefix of a computed target is known
+    if (!m->out && !append(&m->prefixes, Slice_char, &name))
+      panic("Failed to append goto prefix");
+    emitMinified(m, name.ptr, name.len);
+    return;
+  }
+  emitName(m, &m->labels, name, false);
+}
+
+static void scanArithmetic(Minifier *m, Slice(char) text, size_t *pos,
+                           bool quoted) {
+  while (*pos < text.len) {
+    char c = text.ptr[*pos];
+    if (quoted ? c == '"' : (c == ' ' || c == '&' || c == '|' || c == '^'))
+      break;
+    if (isalpha((unsigned char)c) || c == '_') {
+      // set /a reads bare names as variables
+      Slice(char) name = scanName(text, pos);
+      bool assigns = *pos < text.len && text.ptr[*pos] == '=' &&
+                     (*pos + 1 >= text.len || text.ptr[*pos + 1] != '=');
+      if (*pos < text.len && text.ptr[*pos] == '[')
+        emitMinified(m, name.ptr, name.len);
+      else
+        emitName(m, &m->variables, name, assigns);
+    } else if (isdigit((unsigned char)c)) {
+      Slice(char) number = scanName(text, pos);
+      emitMinified(m, number.ptr, number.len);
+    } else {
+      scanChar(m, text, pos);
+    }
+  }
+  // the closing quote is still to come and ends the quoted part
+  scanText(m, text, pos, quoted);
+}
+
+static void scanOperand(Minifier *m, Slice(char) text, size_t *pos) {
+  if (*pos < text.len && text.ptr[*pos] == '"') {
+    scanChar(m, text, pos);
+    while (*pos < text.len && text.ptr[*pos] != '"')
+      scanChar(m, text, pos);
+    if (*pos < text.len)
+      scanChar(m, text, pos);
+    return;
+  }
+  while (*pos < text.len && text.ptr[*pos] != ' ' && text.ptr[*pos] != '=')
+    scanChar(m, text, pos);
+}
+
+static void scanCondition(Minifier *m, Slice(char) text, size_t *pos) {
+  scanSpaces(m, text, pos);
+  if (scanKeyword(m, text, pos, "not"))
+    scanSpaces(m, text, pos);
+  if (scanKeyword(m, text, pos, "/i"))
+    scanSpaces(m, text, pos);
+  if (scanKeyword(m, text, pos, "defined")) {
+    scanSpaces(m, text, pos);
+    emitName(m, &m->variables, scanName(text, pos), false);
+    return;
+  }
+  if (scanKeyword(m, text, pos, "exist")) {
+    scanSpaces(m, text, pos);
+    scanOperand(m, text, pos);
+    return;
+  }
+  scanOperand(m, text, pos);
+  scanSpaces(m, text, pos);
+  if (!scanKeyword(m, text, pos, "==")) {
+    Slice(char) op = scanName(text, pos);
+    emitMinified(m, op.ptr, op.len);
+  }
+  scanSpaces(m, text, pos);
+  scanOperand(m, text, pos);
+}
+
+static void scanCommand(Minifier *m, Slice(char) text, size_t *pos) {
+  scanSpaces(m, text, pos);
+  while (*pos < text.len && text.ptr[*pos] == '@')
+    scanChar(m, text, pos);
+  scanSpaces(m, text, pos);
+  if (scanKeyword(m, text, pos, "set")) {
+    scanSpaces(m, text, pos);
+    if (scanKeyword(m, text, pos, "/a")) {
+      scanSpaces(m, text, pos);
+      bool quoted = *pos < text.len && text.ptr[*pos] == '"';
+      if (quoted)
+        scanChar(m, text, pos);
+      scanArithmetic(m, text, pos, quoted);
+      return;
+    }
+    bool quoted = *pos < text.len && text.ptr[*pos] == '"';
+    if (quoted)
+      scanChar(m, text, pos);
+    Slice(char) name = scanName(text, pos);
+    bool assigns = *pos < text.len && text.ptr[*pos] == '=';
+    if (assigns)
+      emitName(m, &m->variables, name, true);
+    else
+      emitMinified(m, name.ptr, name.len);
+    if (assigns && !quoted && commandStartsWith(name, "__macro_")) {
+      scanChar(m, text, pos);
+      m->macro = true;
+      scanCommand(m, text, pos);
+      m->macro = false;
+      return;
+    }
+    scanText(m, text, pos, quoted);
+  } else if (scanKeyword(m, text, pos, "goto")) {
+    scanSpaces(m, text, pos);
+    if (*pos < text.len && text.ptr[*pos] == ':')
+      scanChar(m, text, pos);
+    scanLabelTarget(m, text, pos);
+    scanText(m, text, pos, false);
+  } else if (scanKeyword(m, text, pos, "call")) {
+    scanSpaces(m, text, pos);
+    if (*pos < text.len && text.ptr[*pos] == ':') {
+      scanChar(m, text, pos);
+      size_t end = *pos;
+      IrFunction *callee = findIrFunction(m->program, scanName(text, &end));
+      scanLabelTarget(m, text, pos);
+      if (callee && callee->named_result) {
+        // the callee sets the variable its first argument names
+        scanSpaces(m, text, pos);
+        emitName(m, &m->variables, scanName(text, pos), true);
+      }
+    }
+    scanText(m, text, pos, false);
+  } else if (scanKeyword(m, text, pos, "if")) {
+    scanCondition(m, text, pos);
+    scanSpaces(m, text, pos);
+    if (*pos < text.len && text.ptr[*pos] == '(') {
+      scanChar(m, text, pos);
+      scanSpaces(m, text, pos);
+    }
+    scanCommand(m, text, pos);
+  } else if (scanKeyword(m, text, pos, "for")) {
+    while (*pos < text.len) {
+      bool boundary = text.ptr[*pos - 1] == ' ';
+      if (boundary && scanKeyword(m, text, pos, "do")) {
+        scanCommand(m, text, pos);
+        return;
+      }
+      scanChar(m, text, pos);
+    }
+  } else if (*pos < text.len && text.ptr[*pos] == ')') {
+    scanChar(m, text, pos);
+    scanSpaces(m, text, pos);
+    if (scanKeyword(m, text, pos, "else")) {
+      scanSpaces(m, text, pos);
+      if (*pos < text.len && text.ptr[*pos] == '(')
+        scanChar(m, text, pos);
+      scanSpaces(m, text, pos);
+    }
+    scanCommand(m, text, pos);
+  } else {
+    scanText(m, text, pos, false);
+  }
+}
+
+static void scanLine(Minifier *m, Slice(char) line) {
+  size_t pos = 0;
+  while (pos < line.len && (line.ptr[pos] == ' ' || line.ptr[pos] == '\t'))
+    pos++;
+  if (pos + 1 < line.len && line.ptr[pos] == ':' && line.ptr[pos + 1] != ':') {
+    emitMinified(m, ":", 1);
+    pos++;
+    emitName(m, &m->labels, scanName(line, &pos), true);
+    emitMinified(m, line.ptr + pos, line.len - pos);
+    return;
+  }
+  scanCommand(m, line, &pos);
+}
+
+static void collectBatchNames(Minifier *m, Statement stmt);
+
+static void collectBatchNamesIn(Minifier *m, Expression expr) {
+  if (expr.type == FunctionExpression)
+    collectBatchNames(m, *expr.function_expression.body);
+}
+
+static void collectBatchNames(Minifier *m, Statement stmt) {
+  switch (stmt.type) {
+  case InlineBatchStatement: {
+    for (size_t pos = 0; pos < stmt.inline_batch.len;) {
+      Slice(char) name = scanName(stmt.inline_batch, &pos);
+      if (name.len == 0) {
+        pos++;
+      } else if (!append(&m->reserved, Slice_char, &name)) {
+        panic("Failed to append batch name");
+      }
+    }
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt.block->statements.len; i++) {
+      collectBatchNames(m, stmt.block->statements.ptr[i]);
+    }
+  } break;
+  case IfStatement: {
+    collectBatchNames(m, *stmt.if_statement->consequence);
+    if (stmt.if_statement->alternate)
+      collectBatchNames(m, *stmt.if_statement->alternate);
+  } break;
+  case WhileStatement: {
+    collectBatchNames(m, *stmt.while_statement->body);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      collectBatchNames(m, *switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      collectBatchNames(m, *switch_statement->otherwise);
+  } break;
+  case DeclarationStatement: {
+    collectBatchNamesIn(m, stmt.declaration.value);
+  } break;
+  case AssignmentStatement:
+  case ExpressionStatement:
+  case ReturnStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static int compareUses(const void *a, const void *b) {
+  size_t a_uses = ((const MinifiedName *)a)->uses;
+  size_t b_uses = ((const MinifiedName *)b)->uses;
+  return a_uses < b_uses ? 1 : a_uses > b_uses ? -1 : 0;
+}
+
+static bool keepsName(Minifier *m, MinifiedName name, bool label) {
+  if (!name.defined || inNames(m->reserved.slice, name.from) ||
+      isEnvironmentName(name.from))
+    return true;
+  for (size_t i = 0; label && i < m->prefixes.slice.len; i++) {
+    Slice(char) prefix = m->prefixes.slice.ptr[i];
+    if (prefix.len <= name.from.len &&
+        eqlIgnoreCase(prefix, (Slice(char)){.ptr = name.from.ptr,
+                                            .len = prefix.len}))
+      return true;
+  }
+  return false;
+}
+
+// Hands out a, b, ..., z, aa, ab, ... to the most used names first,
+// skipping anything a kept name or inline batch code already uses
+static size_t assignShortNames(Minifier *m, Vec(MinifiedName) * names,
+                               bool label) {
+  qsort(names->slice.ptr, names->slice.len, sizeof(MinifiedName),
+        compareUses);
+  size_t renamed = 0;
+  size_t next = 0;
+  for (size_t i = 0; i < names->slice.len; i++) {
+    MinifiedName *name = &names->slice.ptr[i];
+    if (keepsName(m, *name, label))
+      continue;
+    char short_name[16];
+    Slice(char) candidate = {.ptr = short_name, .len = 0};
+    while (true) {
+      size_t n = next++;
+      candidate.len = 0;
+      char reversed[16];
+      do {
+        reversed[candidate.len++] = (char)('a' + n % 26);
+        n /= 26;
+      } while (n-- > 0);
+      for (size_t j = 0; j < candidate.len; j++) {
+        short_name[j] = reversed[candidate.len - 1 - j];
+      }
+      MinifiedName *taken = findMinified(names, candidate);
+      if (inNames(m->reserved.slice, candidate) ||
+          isEnvironmentName(candidate) ||
+          (taken && keepsName(m, *taken, label)))
+        continue;
+      break;
+    }
+    name->to = allocName(m->ally, short_name, candidate.len);
+    renamed++;
+  }
+  return renamed;
+}
+
+static void writeNameMap(FILE *file, Slice(MinifiedName) names,
+                         const char *kind) {
+  for (size_t i = 0; i < names.len; i++) {
+    MinifiedName name = names.ptr[i];
+    if (name.to.len == 0)
+      continue;
+    fprintf(file, "%s %1.*s %1.*s\n", kind, (int)name.to.len, name.to.ptr,
+            (int)name.from.len, name.from.ptr);
+  }
+}
+
+static void minifyBatch(Allocator ally, Program prog, IrProgram *program,
+                        Vec(char) * out, const char *name_map) {
+  Result(Vec_MinifiedName) variables_res = createVec(ally, MinifiedName, 32);
+  if (!variables_res.ok)
+    panic(variables_res.err);
+  Result(Vec_MinifiedName) labels_res = createVec(ally, MinifiedName, 16);
+  if (!labels_res.ok)
+    panic(labels_res.err);
+  Result(Vec_Slice_char) reserved_res = createVec(ally, Slice_char, 16);
+  if (!reserved_res.ok)
+    panic(reserved_res.err);
+  Result(Vec_Slice_char) prefixes_res = createVec(ally, Slice_char, 4);
+  if (!prefixes_res.ok)
+    panic(prefixes_res.err);
+  Minifier m = {
+      .ally = ally,
+      .variables = variables_res.val,
+      .labels = labels_res.val,
+      .reserved = reserved_res.val,
+      .prefixes = prefixes_res.val,
+      .program = program,
+      .out = NULL,
+      .macro = false,
+  };
+  for (size_t i = 0; i < prog.statements.len; i++) {
+    collectBatchNames(&m, prog.statements.ptr[i]);
+  }
+
+  Vec(Command) lines = splitCommands(ally, out->slice);
+  for (size_t i = 0; i < lines.slice.len; i++) {
+    scanLine(&m, lines.slice.ptr[i].text);
+  }
+  size_t variables = assignShortNames(&m, &m.variables, false);
+  size_t labels = assignShortNames(&m, &m.labels, true);
+  for (size_t i = 1; i < program->functions.slice.len; i++) {
+    IrFunction *fn = &program->functions.slice.ptr[i];
+    MinifiedName *label = findMinified(&m.labels, fn->name);
+    if (label && label->to.len > 0)
+      fn->label = label->to;
+  }
+
+  Result(Vec_char) result_res = createVec(ally, char, out->slice.len);
+  if (!result_res.ok)
+    panic(result_res.err);
+  Vec(char) result = result_res.val;
+  m.out = &result;
+  for (size_t i = 0; i < lines.slice.len; i++) {
+    Command line = lines.slice.ptr[i];
+    size_t start = 0;
+    while (start < line.text.len &&
+           isspace((unsigned char)line.text.ptr[start]))
+      start++;
+    if (start == line.text.len)
+      continue;
+    if (line.quiet)
+      appendManyCString(&result, "@");
+    scanLine(&m, line.text);
+    appendManyCString(&result, "\r\n");
+  }
+  fprintf(stdout,
+          "Minified %zu variable%s and %zu label%s, saved %zu bytes\n",
+          variables, variables == 1 ? "" : "s", labels,
+          labels == 1 ? "" : "s", out->slice.len - result.slice.len);
+  *out = result;
+
+  if (!name_map)
+    return;
+  FILE *file = fopen(name_map, "w");
+  if (!file) {
+    fprintf(stderr, "Error: Could not write name map: %s\n", name_map);
+    return;
+  }
+  writeNameMap(file, m.variables.slice, "variable");
+  writeNameMap(file, m.labels.slice, "label");
+  fclose(file);
+}
+
+#endif /* MINIFY_H */
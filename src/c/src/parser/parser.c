@@ -7,6 +7,7 @@
 
 typedef struct If If;
 typedef struct While While;
+typedef struct Switch Switch;
 typedef struct Block Block;
 typedef struct Statement Statement;
 
@@ -17,20 +18,43 @@ typedef enum {
   StringExpression,
   ArithmeticExpression,
   FunctionExpression,
+  ArrayExpression,
+  IndexExpression,
 } ExpressionType;
 
+// What sema infers an expression to hold at runtime
+typedef enum {
+  // nothing assigned so far
+  TypeUnknown = 0,
+  TypeNumber,
+  TypeString,
+  // the integers 1 and 0
+  TypeBoolean,
+  TypeFunction,
+  // more than one of the above
+  TypeMixed,
+} ValueType;
+
 typedef struct Expression {
   ExpressionType type;
+  ValueType value_type;
   union {
     struct {
       struct Expression *callee;
       struct Expression *parameters;
       size_t parameters_len;
+      // parameters of the enclosing function when this is a self tail call
+      struct Expression *tail_parameters;
+      // whether the result is looked up in and added to a cache keyed by
+      // the arguments
+      bool memoized;
     } call;
     Slice(char) number;
     Slice(char) string;
     Slice(char) identifier;
     struct {
+      // two character operators are one here: == is '=', != is '!',
+      // <= is 'L', >= is 'G', && is '&' and || is '|'
       char op;
       struct Expression *left;
       struct Expression *right;
@@ -39,7 +63,19 @@ typedef struct Expression {
       struct Expression *parameters;
       size_t parameters_len;
       Statement *body;
+      // whether the body jumps back to its entry for self tail calls
+      bool tail_recursive;
     } function_expression;
+    // [a, b, c], only stored whole into a variable
+    struct {
+      struct Expression *elements;
+      size_t elements_len;
+    } array;
+    // array[index]
+    struct {
+      Slice(char) array;
+      struct Expression *index;
+    } element;
   };
 } Expression;
 
@@ -48,6 +84,49 @@ DefResult(Slice_Expression);
 DefVec(Expression);
 DefResult(Vec_Expression);
 
+static bool isComparison(char op) {
+  return op == '=' || op == '!' || op == '<' || op == 'L' || op == '>' ||
+         op == 'G';
+}
+
+// && and ||, which join comparisons
+static bool isLogical(char op) { return op == '&' || op == '|'; }
+
+// The comparison that holds exactly when op does not
+static char negateComparison(char op) {
+  return op == '='   ? '!'
+         : op == '!' ? '='
+         : op == '<' ? 'G'
+         : op == 'G' ? '<'
+         : op == '>' ? 'L'
+                     : '>';
+}
+
+// The comparison that holds for b op a when op holds for a and b
+static char swapComparison(char op) {
+  return op == '<'   ? '>'
+         : op == '>' ? '<'
+         : op == 'L' ? 'G'
+         : op == 'G' ? 'L'
+                     : op;
+}
+
+static const char *operatorText(char op) {
+  return op == '='   ? "=="
+         : op == '!' ? "!="
+         : op == 'L' ? "<="
+         : op == 'G' ? ">="
+         : op == '&' ? "&&"
+         : op == '|' ? "||"
+         : op == '<' ? "<"
+         : op == '>' ? ">"
+         : op == '+' ? "+"
+         : op == '-' ? "-"
+         : op == '*' ? "*"
+         : op == '/' ? "/"
+                     : "%";
+}
+
 typedef struct {
   Slice(char) name;
   Expression value;
@@ -57,6 +136,8 @@ typedef struct {
 typedef struct {
   Slice(char) name;
   Expression value;
+  // element being assigned, NULL for the whole variable
+  Expression *index;
 } Assignment;
 
 typedef enum {
@@ -68,11 +149,19 @@ typedef enum {
   BlockStatement,
   IfStatement,
   WhileStatement,
+  SwitchStatement,
   ReturnStatement,
 } StatementType;
 
+typedef struct {
+  size_t line;
+  size_t col;
+} SourceLocation;
+
 struct Statement {
   StatementType type;
+  // where the statement starts in the source, 0:0 for generated ones
+  SourceLocation at;
   union {
     Expression expression;
     Declaration declaration;
@@ -80,6 +169,7 @@ struct Statement {
     Slice(char) inline_batch;
     If *if_statement;
     While *while_statement;
+    Switch *switch_statement;
     Block *block;
     Expression *return_statement;
   };
@@ -96,19 +186,56 @@ struct If {
   Statement *alternate;
 };
 
+typedef struct {
+  Slice(char) variable;
+  long long start;
+  long long step;
+  // the first value past the last iteration
+  long long end;
+  // the variable the loop runs up to when that is not a literal, whose
+  // value plus offset is the last value taken. Empty for literal bounds.
+  Slice(char) bound;
+  long long offset;
+} CountedLoop;
+
 struct While {
   Expression condition;
   Statement *body;
+  CountedLoop *counted;
+};
+
+typedef struct {
+  // a number or string literal
+  Expression value;
+  Statement *body;
+} Case;
+
+DefSlice(Case);
+DefResult(Slice_Case);
+DefVec(Case);
+DefResult(Vec_Case);
+
+// Runs the body of the case whose value equals the subject, or the default
+// one when none does. Cases do not fall through.
+struct Switch {
+  Expression subject;
+  Slice(Case) cases;
+  // NULL without a default clause
+  Statement *otherwise;
 };
 
 struct Block {
   Slice(Statement) statements;
+  // whether the block needs its own setlocal frame at runtime
+  bool scoped;
 };
 
 DefSlice(If);
 DefResult(Slice_If);
 DefSlice(While);
 DefResult(Slice_While);
+DefSlice(Switch);
+DefResult(Slice_Switch);
 DefSlice(Block);
 DefResult(Slice_Block);
 
@@ -147,7 +274,7 @@ static void printExpression(Expression expr) {
 
     fprintf(stdout, "Arith(");
     printExpression(*expr.arithmetic.left);
-    fprintf(stdout, " %c ", expr.arithmetic.op);
+    fprintf(stdout, " %s ", operatorText(expr.arithmetic.op));
     printExpression(*expr.arithmetic.right);
     fprintf(stdout, ")");
   } break;
@@ -164,6 +291,21 @@ static void printExpression(Expression expr) {
     printStatement(*expr.function_expression.body);
 
   } break;
+  case ArrayExpression: {
+    fprintf(stdout, "Array [");
+    for (size_t i = 0; i < expr.array.elements_len; i++) {
+      if (i > 0)
+        fprintf(stdout, ", ");
+      printExpression(expr.array.elements[i]);
+    }
+    fprintf(stdout, "]");
+  } break;
+  case IndexExpression: {
+    fprintf(stdout, "Index(%1.*s[", (int)expr.element.array.len,
+            expr.element.array.ptr);
+    printExpression(*expr.element.index);
+    fprintf(stdout, "])");
+  } break;
   }
 }
 
@@ -183,7 +325,13 @@ static void printStatement(Statement stmt) {
   } break;
   case AssignmentStatement: {
     Assignment assign = stmt.assignment;
-    fprintf(stdout, "%1.*s = ", (int)assign.name.len, assign.name.ptr);
+    fprintf(stdout, "%1.*s", (int)assign.name.len, assign.name.ptr);
+    if (assign.index) {
+      fprintf(stdout, "[");
+      printExpression(*assign.index);
+      fprintf(stdout, "]");
+    }
+    fprintf(stdout, " = ");
     printExpression(assign.value);
     fprintf(stdout, "\n");
   } break;
@@ -208,6 +356,23 @@ static void printStatement(Statement stmt) {
     fprintf(stdout, ") ");
     printStatement(*stmt.while_statement->body);
   } break;
+  case SwitchStatement: {
+    fprintf(stdout, "Switch (");
+    printExpression(stmt.switch_statement->subject);
+    fprintf(stdout, ") {\n");
+    for (size_t i = 0; i < stmt.switch_statement->cases.len; i++) {
+      Case c = stmt.switch_statement->cases.ptr[i];
+      fprintf(stdout, "Case ");
+      printExpression(c.value);
+      fprintf(stdout, ": ");
+      printStatement(*c.body);
+    }
+    if (stmt.switch_statement->otherwise) {
+      fprintf(stdout, "Default: ");
+      printStatement(*stmt.switch_statement->otherwise);
+    }
+    fprintf(stdout, "}\n");
+  } break;
   case BlockStatement: {
     fprintf(stdout, "Block {\n");
     for (size_t i = 0; i < stmt.block->statements.len; i++) {
@@ -231,28 +396,31 @@ static inline Expression parseExpression(Allocator ally, TokenIterator *it,
                                          Token t);
 static Statement parseStatement(Allocator ally, TokenIterator *it);
 
-static Vec(Expression) parseParameters(Allocator ally, TokenIterator *it) {
+// Comma separated expressions up to the close token, which is consumed
+static Vec(Expression) parseList(Allocator ally, TokenIterator *it,
+                                 TokenType close) {
   Result(Vec_Expression) res = createVec(ally, Expression, 1);
   if (!res.ok) {
     panic(res.err);
   }
   Vec(Expression) parameters = res.val;
   Token param = nextToken(it);
-  while (param.type != TokenType_CloseParen) {
+  while (param.type != close) {
     if (param.type == TokenType_EOF) {
-      panic("parseExpression: Unclosed open paren");
+      panic(close == TokenType_CloseParen
+                ? "parseExpression: Unclosed open paren"
+                : "parseExpression: Unclosed open bracket");
     }
     Expression expr = parseExpression(ally, it, param);
     Token paramSep = nextToken(it);
-    if (paramSep.type != TokenType_Comma &&
-        paramSep.type != TokenType_CloseParen) {
-      panic("parseExpression: Parameter list expression not followed by "
-            "comma or close paren ^");
+    if (paramSep.type != TokenType_Comma && paramSep.type != close) {
+      panic("parseExpression: List expression not followed by comma or "
+            "closing token ^");
     }
     if (!append(&parameters, Expression, &expr)) {
       panic("Failed to append to parameter list");
     }
-    if (paramSep.type == TokenType_CloseParen) {
+    if (paramSep.type == close) {
       break;
     }
     param = nextToken(it);
@@ -261,94 +429,91 @@ static Vec(Expression) parseParameters(Allocator ally, TokenIterator *it) {
   return parameters;
 }
 
+static Vec(Expression) parseParameters(Allocator ally, TokenIterator *it) {
+  return parseList(ally, it, TokenType_CloseParen);
+}
+
+// The index of name[index], after the open bracket
+static Expression parseIndex(Allocator ally, TokenIterator *it,
+                             Slice(char) name) {
+  Result(Slice_Expression) res = alloc(ally, Expression, 1);
+  if (!res.ok)
+    panic(res.err);
+  *res.val.ptr = parseExpression(ally, it, nextToken(it));
+  if (nextToken(it).type != TokenType_CloseBracket)
+    panic("parseExpression: Missing ] after index");
+  return (Expression){.type = IndexExpression,
+                      .element = {.array = name, .index = res.val.ptr}};
+}
+
+// Reads the operator following an operand, or returns 0 when there is none
+static char parseOperator(TokenIterator *it) {
+  TokenType type = peekToken(it).type;
+  char op = type == TokenType_Star      ? '*'
+            : type == TokenType_Plus    ? '+'
+            : type == TokenType_Hyphen  ? '-'
+            : type == TokenType_Slash   ? '/'
+            : type == TokenType_Percent ? '%'
+            : type == TokenType_Equal   ? '=' // comparison
+            : type == TokenType_Excl    ? '!'
+            : type == TokenType_Less    ? '<'
+            : type == TokenType_Greater ? '>'
+            : type == TokenType_Amp     ? '&'
+            : type == TokenType_Pipe    ? '|'
+                                        : 0;
+  if (!op)
+    return 0;
+  nextToken(it);
+  TokenType second = peekToken(it).type;
+  if (op == '=' || op == '!') {
+    if (second != TokenType_Equal)
+      panic("Invalid expression following =");
+    // ==
+    //  ^
+    nextToken(it);
+  } else if (op == '&' || op == '|') {
+    if (second != type)
+      panic("Expected && or || in expression");
+    nextToken(it);
+  } else if ((op == '<' || op == '>') && second == TokenType_Equal) {
+    nextToken(it);
+    op = op == '<' ? 'L' : 'G';
+  }
+  return op;
+}
+
+// Operators are kept as one right leaning chain, whoever reads it applies
+// the precedence
+static Expression parseChain(Allocator ally, TokenIterator *it,
+                             Expression operand) {
+  char op = parseOperator(it);
+  if (!op)
+    return operand;
+  Result(Slice_Expression) lr_res = alloc(ally, Expression, 2);
+  if (!lr_res.ok)
+    panic(lr_res.err);
+  Expression *left = &lr_res.val.ptr[0];
+  Expression *right = &lr_res.val.ptr[1];
+  *left = operand;
+  *right = parseExpression(ally, it, nextToken(it));
+  return (Expression){
+      .type = ArithmeticExpression,
+      .arithmetic = {.op = op, .left = left, .right = right},
+  };
+}
+
 static inline Expression parseExpression(Allocator ally, TokenIterator *it,
                                          Token t) {
   switch (t.type) {
   case TokenType_Number: {
-    Token next = peekToken(it);
-    if (next.type != TokenType_Star && next.type != TokenType_Plus &&
-        next.type != TokenType_Excl && next.type != TokenType_Hyphen &&
-        next.type != TokenType_Slash && next.type != TokenType_Percent &&
-        next.type != TokenType_Equal) {
-      return (Expression){.type = NumericExpression, .number = t.number};
-    }
-    nextToken(it);
-    if (next.type == TokenType_Equal || next.type == TokenType_Excl) { // op
-      if (peekToken(it).type != TokenType_Equal) {
-        panic("Invalid expression following <num> =");
-      }
-      // ==
-      //  ^
-      nextToken(it);
-    }
-
-    Result(Slice_Expression) lr_res = alloc(ally, Expression, 2);
-    if (!lr_res.ok)
-      panic(lr_res.err);
-    Expression *left = &lr_res.val.ptr[0];
-    Expression *right = &lr_res.val.ptr[1];
-    *left = parseExpression(ally, it, t);
-    *right = parseExpression(ally, it, nextToken(it));
-    return (Expression){
-        .type = ArithmeticExpression,
-        .arithmetic =
-            {
-                .op = next.type == TokenType_Star      ? '*'
-                      : next.type == TokenType_Plus    ? '+'
-                      : next.type == TokenType_Hyphen  ? '-'
-                      : next.type == TokenType_Equal   ? '=' // comparison
-                      : next.type == TokenType_Excl    ? '!'
-                      : next.type == TokenType_Percent ? '%'
-                                                       : '/',
-                .left = left,
-                .right = right,
-            },
-    };
+    return parseChain(
+        ally, it, (Expression){.type = NumericExpression, .number = t.number});
   }
   case TokenType_String:
-    return (Expression){.type = StringExpression, .string = t.string};
+    return parseChain(
+        ally, it, (Expression){.type = StringExpression, .string = t.string});
   case TokenType_Ident: {
-    Token next = peekToken(it);
-    if (next.type == TokenType_Star || next.type == TokenType_Plus ||
-        next.type == TokenType_Excl || next.type == TokenType_Hyphen ||
-        next.type == TokenType_Slash || next.type == TokenType_Percent ||
-        next.type == TokenType_Equal) {
-      nextToken(it);
-      if (next.type == TokenType_Equal || next.type == TokenType_Excl) { // op
-        if (peekToken(it).type != TokenType_Equal) {
-          panic("Invalid expression following <num> =");
-        }
-        // ==
-        //  ^
-        nextToken(it);
-      }
-      Result(Slice_Expression) lr_res = alloc(ally, Expression, 2);
-      if (!lr_res.ok)
-        panic(lr_res.err);
-      Expression *left = &lr_res.val.ptr[0];
-      Expression *right = &lr_res.val.ptr[1];
-      *left = (Expression){
-          .type = IdentifierExpression,
-          .identifier = t.ident,
-      };
-      *right = parseExpression(ally, it, nextToken(it));
-      return (Expression){
-          .type = ArithmeticExpression,
-          .arithmetic =
-              {
-                  .op = next.type == TokenType_Star      ? '*'
-                        : next.type == TokenType_Plus    ? '+'
-                        : next.type == TokenType_Hyphen  ? '-'
-                        : next.type == TokenType_Equal   ? '=' // comparison
-                        : next.type == TokenType_Excl    ? '!'
-                        : next.type == TokenType_Percent ? '%'
-                                                         : '/',
-                  .left = left,
-                  .right = right,
-              },
-      };
-    }
-    if (next.type == TokenType_OpenParen) {
+    if (peekToken(it).type == TokenType_OpenParen) {
       // call expression
       nextToken(it);
       Vec(Expression) parameters = parseParameters(ally, it);
@@ -363,13 +528,55 @@ static inline Expression parseExpression(Allocator ally, TokenIterator *it,
           .identifier = t.ident,
       };
 
-      return (Expression){.type = CallExpression,
-                          .call = {.callee = callee,
-                                   .parameters = parameters.slice.ptr,
-                                   .parameters_len = parameters.slice.len}};
+      return parseChain(
+          ally, it,
+          (Expression){.type = CallExpression,
+                       .call = {.callee = callee,
+                                .parameters = parameters.slice.ptr,
+                                .parameters_len = parameters.slice.len}});
+    }
+    if (peekToken(it).type == TokenType_OpenBracket) {
+      nextToken(it); // [
+      return parseChain(ally, it, parseIndex(ally, it, t.ident));
     }
     // identifier expression
-    return (Expression){.type = IdentifierExpression, .identifier = t.ident};
+    return parseChain(
+        ally, it,
+        (Expression){.type = IdentifierExpression, .identifier = t.ident});
+  }
+  case TokenType_Excl: {
+    // !x is x != 1, since conditions only hold for the boolean 1
+    Token operand = nextToken(it);
+    if (operand.type != TokenType_Ident && operand.type != TokenType_Number &&
+        operand.type != TokenType_String) {
+      printToken(operand);
+      panic("\nExpected a value after ! ^");
+    }
+    Expression rest = parseExpression(ally, it, operand);
+    Result(Slice_Expression) res = alloc(ally, Expression, 3);
+    if (!res.ok)
+      panic(res.err);
+    Expression *value = &res.val.ptr[0];
+    Expression *one = &res.val.ptr[1];
+    Expression *right = one;
+    *value = rest;
+    *one = (Expression){.type = NumericExpression,
+                        .number = {.ptr = "1", .len = 1}};
+    if (rest.type == ArithmeticExpression) {
+      // the chain goes on after the 1
+      *value = *rest.arithmetic.left;
+      right = &res.val.ptr[2];
+      *right = (Expression){
+          .type = ArithmeticExpression,
+          .arithmetic = {.op = rest.arithmetic.op,
+                         .left = one,
+                         .right = rest.arithmetic.right},
+      };
+    }
+    return (Expression){
+        .type = ArithmeticExpression,
+        .arithmetic = {.op = '!', .left = value, .right = right},
+    };
   }
   case TokenType_OpenParen: {
     Vec(Expression) parameters = parseParameters(ally, it);
@@ -390,20 +597,32 @@ static inline Expression parseExpression(Allocator ally, TokenIterator *it,
     };
 
   } break;
+  case TokenType_OpenBracket: {
+    Vec(Expression) elements = parseList(ally, it, TokenType_CloseBracket);
+    return (Expression){
+        .type = ArrayExpression,
+        .array = {.elements = elements.slice.ptr,
+                  .elements_len = elements.slice.len},
+    };
+  }
   case TokenType_EOF:
   case TokenType_CloseParen:
   case TokenType_OpenCurly:
   case TokenType_CloseCurly:
+  case TokenType_CloseBracket:
   case TokenType_Semi:
   case TokenType_Comma:
   case TokenType_Colon:
   case TokenType_Equal:
-  case TokenType_Excl:
   case TokenType_Star:
   case TokenType_Plus:
   case TokenType_Hyphen:
   case TokenType_Slash:
   case TokenType_Percent:
+  case TokenType_Less:
+  case TokenType_Greater:
+  case TokenType_Amp:
+  case TokenType_Pipe:
   case TokenType_InlineBatch:
   case TokenType_Unknown: {
     printToken(t);
@@ -412,7 +631,230 @@ static inline Expression parseExpression(Allocator ally, TokenIterator *it,
   }
 }
 
+// Location of the next token, counted from 1 like editors do
+static SourceLocation nextTokenLocation(TokenIterator it) {
+  while (!tokenizerEnded(&it) && isspace(it.data.ptr[it.cur])) {
+    nextChar(&it);
+  }
+  size_t col = 1;
+  while (col <= it.cur && it.data.ptr[it.cur - col] != '\n') {
+    col++;
+  }
+  return (SourceLocation){.line = it.line, .col = col};
+}
+
+static Statement parseStatementAt(Allocator ally, TokenIterator *it);
+
+// Whether the tokens after an identifier are [index] = rather than an
+// element read starting an expression
+static bool startsElementAssignment(TokenIterator it) {
+  if (nextToken(&it).type != TokenType_OpenBracket)
+    return false;
+  size_t depth = 1;
+  while (depth > 0) {
+    TokenType type = nextToken(&it).type;
+    if (type == TokenType_EOF)
+      return false;
+    if (type == TokenType_OpenBracket)
+      depth++;
+    else if (type == TokenType_CloseBracket)
+      depth--;
+  }
+  return nextToken(&it).type == TokenType_Equal &&
+         peekToken(&it).type != TokenType_Equal;
+}
+
 static Statement parseStatement(Allocator ally, TokenIterator *it) {
+  SourceLocation at = nextTokenLocation(*it);
+  Statement stmt = parseStatementAt(ally, it);
+  stmt.at = at;
+  return stmt;
+}
+
+static Statement *parseStatementPtr(Allocator ally, TokenIterator *it) {
+  Result(Slice_Statement) res = alloc(ally, Statement, 1);
+  if (!res.ok)
+    panic(res.err);
+  *res.val.ptr = parseStatement(ally, it);
+  return res.val.ptr;
+}
+
+// switch (subject) { case value: statement ... default: statement }
+static Statement parseSwitch(Allocator ally, TokenIterator *it) {
+  if (peekToken(it).type != TokenType_OpenParen) {
+    panic("Missing ( after switch");
+  }
+  nextToken(it); // (
+  Expression subject = parseExpression(ally, it, nextToken(it));
+  if (peekToken(it).type != TokenType_CloseParen) {
+    printToken(peekToken(it));
+    panic("\nMissing ) after switch subject");
+  }
+  nextToken(it); // )
+  if (nextToken(it).type != TokenType_OpenCurly) {
+    panic("Missing { after switch");
+  }
+  Result(Vec_Case) cases_res = createVec(ally, Case, 4);
+  if (!cases_res.ok)
+    panic(cases_res.err);
+  Vec(Case) cases = cases_res.val;
+  Statement *otherwise = NULL;
+  Token t = nextToken(it);
+  while (t.type != TokenType_CloseCurly) {
+    if (t.type == TokenType_Ident &&
+        eql(t.ident, (Slice(char)){.ptr = "default", .len = 7})) {
+      if (otherwise)
+        panic("Switch with more than one default");
+      if (nextToken(it).type != TokenType_Colon)
+        panic("Missing : after default");
+      otherwise = parseStatementPtr(ally, it);
+    } else if (t.type == TokenType_Ident &&
+               eql(t.ident, (Slice(char)){.ptr = "case", .len = 4})) {
+      Token value = nextToken(it);
+      if (value.type != TokenType_Number && value.type != TokenType_String) {
+        printToken(value);
+        panic("\nCase value is not a number or string literal ^");
+      }
+      if (nextToken(it).type != TokenType_Colon)
+        panic("Missing : after case value");
+      Case c = {
+          .value = value.type == TokenType_Number
+                       ? (Expression){.type = NumericExpression,
+                                      .number = value.number}
+                       : (Expression){.type = StringExpression,
+                                      .string = value.string},
+          .body = parseStatementPtr(ally, it),
+      };
+      if (!append(&cases, Case, &c))
+        panic("Failed to append case");
+    } else {
+      printToken(t);
+      panic("\nparse: Expected case, default or } in switch ^");
+    }
+    t = nextToken(it);
+  }
+  if (cases.slice.len == 0)
+    panic("Switch without cases");
+  Result(Slice_Switch) switch_res = alloc(ally, Switch, 1);
+  if (!switch_res.ok)
+    panic(switch_res.err);
+  shrinkToLength(&cases, Case);
+  *switch_res.val.ptr = (Switch){
+      .subject = subject,
+      .cases = cases.slice,
+      .otherwise = otherwise,
+  };
+  return (Statement){
+      .type = SwitchStatement,
+      .switch_statement = switch_res.val.ptr,
+  };
+}
+
+// Points the prints of stmt at the file path, leaving the ones in functions
+// declared in it alone
+static void redirectPrints(Allocator ally, Statement *stmt, Expression path) {
+  switch (stmt->type) {
+  case ExpressionStatement: {
+    Expression *expr = &stmt->expression;
+    if (expr->type != CallExpression ||
+        expr->call.callee->type != IdentifierExpression ||
+        !eql(expr->call.callee->identifier,
+             (Slice(char)){.ptr = "print", .len = 5}))
+      break;
+    size_t len = expr->call.parameters_len;
+    Result(Slice_Expression) params_res = alloc(ally, Expression, len + 1);
+    if (!params_res.ok)
+      panic(params_res.err);
+    params_res.val.ptr[0] = path;
+    for (size_t i = 0; i < len; i++) {
+      params_res.val.ptr[i + 1] = expr->call.parameters[i];
+    }
+    expr->call.callee->identifier = (Slice(char)){.ptr = "writeln", .len = 7};
+    expr->call.parameters = params_res.val.ptr;
+    expr->call.parameters_len = len + 1;
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt->block->statements.len; i++) {
+      redirectPrints(ally, &stmt->block->statements.ptr[i], path);
+    }
+  } break;
+  case IfStatement: {
+    redirectPrints(ally, stmt->if_statement->consequence, path);
+    if (stmt->if_statement->alternate)
+      redirectPrints(ally, stmt->if_statement->alternate, path);
+  } break;
+  case WhileStatement: {
+    redirectPrints(ally, stmt->while_statement->body, path);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      redirectPrints(ally, switch_statement->cases.ptr[i].body, path);
+    }
+    if (switch_statement->otherwise)
+      redirectPrints(ally, switch_statement->otherwise, path);
+  } break;
+  case StatementEOF:
+  case DeclarationStatement:
+  case AssignmentStatement:
+  case InlineBatchStatement:
+  case ReturnStatement: {
+  } break;
+  }
+}
+
+// with_output (path) statement sends the prints of the statement to the
+// file path, which is emptied first. It becomes a block of a
+// with_output(path) call that empties the file and the statement with
+// writeln(path, ...) for every print, so path has to be a string or a
+// variable to be repeated.
+static Statement parseWithOutput(Allocator ally, TokenIterator *it) {
+  if (peekToken(it).type != TokenType_OpenParen) {
+    panic("Missing ( after with_output");
+  }
+  nextToken(it); // (
+  Expression path = parseExpression(ally, it, nextToken(it));
+  if (path.type != StringExpression && path.type != IdentifierExpression) {
+    printExpression(path);
+    panic("\nwith_output takes a string or a variable ^");
+  }
+  if (peekToken(it).type != TokenType_CloseParen) {
+    printToken(peekToken(it));
+    panic("\nMissing ) after with_output file");
+  }
+  nextToken(it); // )
+  Result(Slice_Expression) call_res = alloc(ally, Expression, 2);
+  if (!call_res.ok)
+    panic(call_res.err);
+  call_res.val.ptr[0] = (Expression){
+      .type = IdentifierExpression,
+      .identifier = {.ptr = "with_output", .len = 11},
+  };
+  call_res.val.ptr[1] = path;
+  Result(Slice_Statement) statements_res = alloc(ally, Statement, 2);
+  if (!statements_res.ok)
+    panic(statements_res.err);
+  Slice(Statement) statements = statements_res.val;
+  statements.ptr[0] = (Statement){
+      .type = ExpressionStatement,
+      .expression = {.type = CallExpression,
+                     .call = {.callee = &call_res.val.ptr[0],
+                              .parameters = &call_res.val.ptr[1],
+                              .parameters_len = 1,
+                              .tail_parameters = NULL,
+                              .memoized = false}},
+  };
+  statements.ptr[1] = parseStatement(ally, it);
+  redirectPrints(ally, &statements.ptr[1], path);
+  Result(Slice_Block) block_res = alloc(ally, Block, 1);
+  if (!block_res.ok)
+    panic(block_res.err);
+  block_res.val.ptr->statements = statements;
+  block_res.val.ptr->scoped = true;
+  return (Statement){.type = BlockStatement, .block = block_res.val.ptr};
+}
+
+static Statement parseStatementAt(Allocator ally, TokenIterator *it) {
   TokenIterator snapshot = *it;
   Token t = nextToken(it);
 
@@ -484,12 +926,20 @@ static Statement parseStatement(Allocator ally, TokenIterator *it) {
       *body = parseStatement(ally, it);
       while_statement->condition = condition;
       while_statement->body = body;
+      while_statement->counted = NULL;
       Statement s = {
           .type = WhileStatement,
           .while_statement = while_statement,
       };
       return s;
 
+    } else if (t.type == TokenType_Ident &&
+               eql(t.ident, (Slice(char)){.ptr = "switch", .len = 6})) {
+      return parseSwitch(ally, it);
+    } else if (t.type == TokenType_Ident &&
+               eql(t.ident,
+                   (Slice(char)){.ptr = "with_output", .len = 11})) {
+      return parseWithOutput(ally, it);
     } else if (t.type == TokenType_Ident &&
                eql(t.ident, (Slice(char)){.ptr = "return", .len = 6})) {
       if (peekToken(it).type == TokenType_Semi) {
@@ -552,6 +1002,23 @@ static Statement parseStatement(Allocator ally, TokenIterator *it) {
         panic("\nparse: Unknown token following expression statement ^");
       }
       return assign_stmt;
+    } else if (t.type == TokenType_Ident && startsElementAssignment(*it)) {
+      nextToken(it); // [
+      Expression element = parseIndex(ally, it, t.ident);
+      nextToken(it); // =
+      Expression value = parseExpression(ally, it, nextToken(it));
+      Statement assign_stmt = {
+          .type = AssignmentStatement,
+          .assignment = {.name = t.ident,
+                         .value = value,
+                         .index = element.element.index},
+      };
+      Token semi = nextToken(it);
+      if (semi.type != TokenType_Semi) {
+        printToken(semi);
+        panic("\nparse: Unknown token following expression statement ^");
+      }
+      return assign_stmt;
     } else {
       Statement s = {
           .type = ExpressionStatement,
@@ -597,12 +1064,15 @@ static Statement parseStatement(Allocator ally, TokenIterator *it) {
       panic(block_res.err);
     shrinkToLength(&statements, Statement);
     block_res.val.ptr->statements = statements.slice;
+    block_res.val.ptr->scoped = true;
     return (Statement){.type = BlockStatement, .block = block_res.val.ptr};
   } break;
   case TokenType_EOF:
   case TokenType_OpenParen:
   case TokenType_CloseParen:
   case TokenType_CloseCurly:
+  case TokenType_OpenBracket:
+  case TokenType_CloseBracket:
   case TokenType_Semi:
   case TokenType_Comma:
   case TokenType_Colon:
@@ -613,6 +1083,10 @@ static Statement parseStatement(Allocator ally, TokenIterator *it) {
   case TokenType_Hyphen:
   case TokenType_Slash:
   case TokenType_Percent:
+  case TokenType_Less:
+  case TokenType_Greater:
+  case TokenType_Amp:
+  case TokenType_Pipe:
   case TokenType_Unknown: {
     *it = snapshot; // restore
     return (Statement){.type = StatementEOF};
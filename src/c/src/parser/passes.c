@@ -0,0 +1,928 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "../std/eql.c"
+#include "ast.c"
+#include "ir.c"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Passes over the IR between buildIr and outputBatch. Each one rewrites a
+// single function, runIrPasses applies them in order to every function and
+// reports how long each pass took over the whole program.
+
+typedef void IrPassFunction(Allocator ally, IrFunction *fn);
+
+typedef struct {
+  const char *name;
+  IrPassFunction *run;
+} IrPass;
+
+static void markLive(Value *value, void *context) {
+  bool *live = (bool *)context;
+  if (value->kind == ValueTemporary)
+    live[value->id] = true;
+}
+
+static void markDead(Value *value, void *context) {
+  bool *live = (bool *)context;
+  if (value->kind == ValueTemporary)
+    live[value->id] = false;
+}
+
+static void countUse(Value *value, void *context) {
+  size_t *uses = (size_t *)context;
+  if (value->kind == ValueTemporary)
+    uses[value->id]++;
+}
+
+// Turns the temporaries live at the end of block into the ones live where
+// it starts
+static void liveBefore(IrBlock *block, bool *live) {
+  visitTerminatorUses(&block->term, markLive, live);
+  for (size_t i = block->instructions.slice.len; i > 0; i--) {
+    Instruction *inst = &block->instructions.slice.ptr[i - 1];
+    visitDefinitions(inst, markDead, live);
+    visitUses(inst, markLive, live);
+  }
+}
+
+typedef struct {
+  size_t temporaries;
+  // for every block, which temporaries are live at its start and end
+  bool *live_in;
+  bool *live_out;
+} Liveness;
+
+static Liveness computeLiveness(Allocator ally, IrFunction *fn) {
+  size_t n = fn->temporaries.slice.len;
+  size_t blocks = fn->blocks.slice.len;
+  Liveness liveness = {
+      .temporaries = n,
+      .live_in = allocFlags(ally, n * blocks),
+      .live_out = allocFlags(ally, n * blocks),
+  };
+  bool *live = allocFlags(ally, n);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = blocks; i > 0; i--) {
+      IrBlock *block = &fn->blocks.slice.ptr[i - 1];
+      bool *out = liveness.live_out + (i - 1) * n;
+      bool *in = liveness.live_in + (i - 1) * n;
+      for (size_t s = 0; s < successorCount(block->term); s++) {
+        size_t next = successor(block->term, s);
+        for (size_t t = 0; t < n; t++) {
+          if (liveness.live_in[next * n + t])
+            out[t] = true;
+        }
+      }
+      memcpy(live, out, n * sizeof(bool));
+      liveBefore(block, live);
+      for (size_t t = 0; t < n; t++) {
+        if (live[t] && !in[t]) {
+          in[t] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+  return liveness;
+}
+
+static void countUses(IrFunction *fn, size_t *uses) {
+  memset(uses, 0, fn->temporaries.slice.len * sizeof(size_t));
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    IrBlock *block = &fn->blocks.slice.ptr[i];
+    for (size_t j = 0; j < block->instructions.slice.len; j++) {
+      visitUses(&block->instructions.slice.ptr[j], countUse, uses);
+    }
+    visitTerminatorUses(&block->term, countUse, uses);
+  }
+}
+
+static void removeInstruction(Vec(Instruction) *list, size_t index) {
+  memmove(list->slice.ptr + index, list->slice.ptr + index + 1,
+          (list->slice.len - index - 1) * sizeof(Instruction));
+  list->slice.len--;
+}
+
+static size_t foldOperands(Slice(Instruction) list, Slice(size_t) uses,
+                           size_t index);
+
+// Folds the definition of value into the instruction at run when it is the
+// arithmetic right in front of it, and returns where the folded run starts
+static size_t foldOperand(Slice(Instruction) list, Slice(size_t) uses,
+                          Value value, size_t run) {
+  if (value.kind != ValueTemporary || run == 0 || uses.ptr[value.id] != 1)
+    return run;
+  Instruction *def = &list.ptr[run - 1];
+  if (def->op != IrArithmetic || def->dst.kind != ValueTemporary ||
+      def->dst.id != value.id)
+    return run;
+  def->folded = true;
+  return foldOperands(list, uses, run - 1);
+}
+
+static size_t foldOperands(Slice(Instruction) list, Slice(size_t) uses,
+                           size_t index) {
+  Instruction inst = list.ptr[index];
+  size_t run = foldOperand(list, uses, inst.b, index);
+  return foldOperand(list, uses, inst.a, run);
+}
+
+// Single use arithmetic becomes part of the set /a of its user, so a whole
+// expression tree is one command again. Only runs right in front of the
+// user are folded, nothing in between can change what they read.
+static void foldArithmetic(Allocator ally, IrFunction *fn) {
+  if (fn->temporaries.slice.len == 0)
+    return;
+  Result(Slice_size_t) uses_res =
+      alloc(ally, size_t, fn->temporaries.slice.len);
+  if (!uses_res.ok)
+    panic(uses_res.err);
+  Slice(size_t) uses = uses_res.val;
+  countUses(fn, uses.ptr);
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    IrBlock *block = &fn->blocks.slice.ptr[i];
+    Slice(Instruction) list = block->instructions.slice;
+    for (size_t j = 0; j < list.len; j++) {
+      if (list.ptr[j].op == IrArithmetic)
+        foldOperands(list, uses, j);
+    }
+    // a returned sum is computed straight into __ret__
+    Terminator term = block->term;
+    if (term.kind == TermReturn && list.len > 0)
+      foldOperand(list, uses, term.value, list.len);
+  }
+}
+
+typedef struct {
+  size_t temporaries;
+  bool *live;
+  bool *interferes;
+  bool *defined;
+} Interference;
+
+static void addInterference(Interference *graph, size_t a, size_t b) {
+  graph->interferes[a * graph->temporaries + b] = true;
+  graph->interferes[b * graph->temporaries + a] = true;
+}
+
+static void interfereWithLive(Value *value, void *context) {
+  Interference *graph = (Interference *)context;
+  if (value->kind != ValueTemporary)
+    return;
+  graph->defined[value->id] = true;
+  for (size_t t = 0; t < graph->temporaries; t++) {
+    if (graph->live[t] && t != value->id)
+      addInterference(graph, value->id, t);
+  }
+}
+
+static bool slotTaken(IrFunction *fn, Interference *graph, Slice(size_t) slots,
+                      size_t temporary, size_t slot) {
+  bool call_result = fn->temporaries.slice.ptr[temporary].call_result;
+  for (size_t t = 0; t < temporary; t++) {
+    if (graph->defined[t] && slots.ptr[t] == slot &&
+        fn->temporaries.slice.ptr[t].call_result == call_result &&
+        graph->interferes[temporary * graph->temporaries + t])
+      return true;
+  }
+  return false;
+}
+
+// Gives every temporary a _tmp or _ret variable. Temporaries that are never
+// live at the same time share one, so every statement starts counting from
+// zero again as long as nothing it computed is still needed.
+static void allocateTemporaries(Allocator ally, IrFunction *fn) {
+  size_t n = fn->temporaries.slice.len;
+  if (n == 0)
+    return;
+  Liveness liveness = computeLiveness(ally, fn);
+  Interference graph = {
+      .temporaries = n,
+      .live = allocFlags(ally, n),
+      .interferes = allocFlags(ally, n * n),
+      .defined = allocFlags(ally, n),
+  };
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    IrBlock *block = &fn->blocks.slice.ptr[i];
+    memcpy(graph.live, liveness.live_out + i * n, n * sizeof(bool));
+    visitTerminatorUses(&block->term, markLive, graph.live);
+    for (size_t j = block->instructions.slice.len; j > 0; j--) {
+      Instruction *inst = &block->instructions.slice.ptr[j - 1];
+      if (!inst->folded)
+        visitDefinitions(inst, interfereWithLive, &graph);
+      // the scratch of a parallel copy is set while its sources are read
+      for (size_t k = 0; inst->op == IrParallelCopy && k < inst->args.len;
+           k++) {
+        if (inst->args.ptr[k].kind == ValueTemporary)
+          addInterference(&graph, inst->dst.id, inst->args.ptr[k].id);
+      }
+      visitDefinitions(inst, markDead, graph.live);
+      visitUses(inst, markLive, graph.live);
+    }
+  }
+
+  Result(Slice_size_t) slots_res = alloc(ally, size_t, n);
+  if (!slots_res.ok)
+    panic(slots_res.err);
+  Slice(size_t) slots = slots_res.val;
+  Result(Vec_Slice_char) tmp_res = createVec(ally, Slice_char, 4);
+  if (!tmp_res.ok)
+    panic(tmp_res.err);
+  Result(Vec_Slice_char) ret_res = createVec(ally, Slice_char, 4);
+  if (!ret_res.ok)
+    panic(ret_res.err);
+  Slice(char) no_suffix = {.ptr = NULL, .len = 0};
+  for (size_t t = 0; t < n; t++) {
+    if (!graph.defined[t])
+      continue;
+    size_t slot = 0;
+    while (slotTaken(fn, &graph, slots, t, slot))
+      slot++;
+    slots.ptr[t] = slot;
+    bool call_result = fn->temporaries.slice.ptr[t].call_result;
+    Vec(Slice_char) *names = call_result ? &ret_res.val : &tmp_res.val;
+    while (names->slice.len <= slot) {
+      Slice(char) name = makeName(ally, call_result ? "ret" : "tmp",
+                                  names->slice.len, no_suffix);
+      if (!append(names, Slice_char, &name))
+        panic("Could not append name");
+    }
+    fn->temporaries.slice.ptr[t].name = names->slice.ptr[slot];
+  }
+}
+
+static void reachFrom(IrFunction *fn, size_t block, size_t avoid,
+                      bool *seen) {
+  if (block == avoid || seen[block])
+    return;
+  seen[block] = true;
+  Terminator term = fn->blocks.slice.ptr[block].term;
+  for (size_t i = 0; i < successorCount(term); i++) {
+    reachFrom(fn, successor(term, i), avoid, seen);
+  }
+}
+
+static bool jumpsTo(IrFunction *fn, size_t from, size_t to) {
+  Terminator term = fn->blocks.slice.ptr[from].term;
+  for (size_t i = 0; i < successorCount(term); i++) {
+    if (successor(term, i) == to)
+      return true;
+  }
+  return false;
+}
+
+static void reachBackFrom(IrFunction *fn, size_t block, bool *seen) {
+  if (seen[block])
+    return;
+  seen[block] = true;
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    if (jumpsTo(fn, i, block))
+      reachBackFrom(fn, i, seen);
+  }
+}
+
+// The blocks of the loop headed by header: the ones that get back to it
+// without leaving through it, starting from the jumps back that only code
+// past the header can make
+static bool *loopBlocks(Allocator ally, IrFunction *fn, size_t header) {
+  bool *outside = allocFlags(ally, fn->blocks.slice.len);
+  reachFrom(fn, 0, header, outside);
+  bool *in_loop = allocFlags(ally, fn->blocks.slice.len);
+  in_loop[header] = true;
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    if (!outside[i] && jumpsTo(fn, i, header))
+      reachBackFrom(fn, i, in_loop);
+  }
+  return in_loop;
+}
+
+#define NO_BLOCK ((size_t)-1)
+
+// The one block outside the loop that jumps to its header, if there is one
+static size_t loopPreheader(IrFunction *fn, bool *in_loop, size_t header) {
+  size_t preheader = NO_BLOCK;
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    if (in_loop[i] || !jumpsTo(fn, i, header))
+      continue;
+    if (preheader != NO_BLOCK)
+      return NO_BLOCK;
+    preheader = i;
+  }
+  return preheader;
+}
+
+// cmd makes these up again every time they are expanded, and a variable
+// with one of their names only shadows it when it has been set
+static bool isDynamicVariable(Slice(char) name) {
+  static const char *const names[] = {"CD",     "DATE",       "TIME",
+                                      "RANDOM", "ERRORLEVEL", "CMDEXTVERSION",
+                                      "CMDCMDLINE"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    size_t j = 0;
+    while (j < name.len && names[i][j] &&
+           toupper((unsigned char)name.ptr[j]) == names[i][j])
+      j++;
+    if (j == name.len && !names[i][j])
+      return true;
+  }
+  return false;
+}
+
+typedef struct {
+  // variables some instruction in the loop sets
+  Vec(Slice_char) assigned;
+  // calls and inline batch may set any variable
+  bool opaque;
+  // temporaries still computed inside the loop
+  bool *computed;
+  // how often each temporary is set in the whole function
+  size_t *definitions;
+} LoopDefinitions;
+
+static void noteLoopDefinition(Value *value, void *context) {
+  LoopDefinitions *loop = (LoopDefinitions *)context;
+  if (value->kind == ValueTemporary)
+    loop->computed[value->id] = true;
+  if (value->kind == ValueVariable &&
+      !append(&loop->assigned, Slice_char, &value->text))
+    panic("Could not append name");
+}
+
+static bool isInvariant(LoopDefinitions *loop, Value value) {
+  switch (value.kind) {
+  case ValueTemporary: {
+    return !loop->computed[value.id];
+  }
+  case ValueVariable: {
+    if (loop->opaque || isDynamicVariable(value.text))
+      return false;
+    for (size_t i = 0; i < loop->assigned.slice.len; i++) {
+      if (eql(loop->assigned.slice.ptr[i], value.text))
+        return false;
+    }
+    return true;
+  }
+  case ValueNone:
+  case ValueNumber:
+  case ValueString: {
+    return true;
+  }
+  }
+}
+
+static bool canHoist(LoopDefinitions *loop, Instruction inst) {
+  // the flag of a condition with && or || is set in more than one place
+  if (inst.dst.kind != ValueTemporary || loop->definitions[inst.dst.id] > 1)
+    return false;
+  switch (inst.op) {
+  case IrArithmetic: {
+    // the loop may not run at all, and set /a complains about dividing by
+    // zero, so only constant divisors move
+    if ((inst.symbol == '/' || inst.symbol == '%') &&
+        (inst.b.kind != ValueNumber ||
+         (inst.b.text.len == 1 && inst.b.text.ptr[0] == '0')))
+      return false;
+  } break;
+  case IrCopy:
+  case IrCompare: {
+  } break;
+  case IrParam:
+  case IrCall:
+  case IrPrint:
+  case IrBatch:
+  case IrSetlocal:
+  case IrEndlocal:
+  case IrParallelCopy:
+  case IrUnset:
+  case IrLoad:
+  case IrStore: {
+    return false;
+  }
+  }
+  for (size_t i = 0; i < inst.joined.len; i++) {
+    if (!isInvariant(loop, inst.joined.ptr[i].a) ||
+        !isInvariant(loop, inst.joined.ptr[i].b))
+      return false;
+  }
+  return isInvariant(loop, inst.a) && isInvariant(loop, inst.b);
+}
+
+// Moves computations whose operands the loop never changes in front of it,
+// so they run once instead of on every iteration. The header is part of the
+// loop, so a condition that does change is still computed before every
+// check.
+static void hoistInvariants(Allocator ally, IrFunction *fn) {
+  size_t n = fn->temporaries.slice.len;
+  if (n == 0)
+    return;
+  Result(Slice_size_t) definitions_res = alloc(ally, size_t, n);
+  if (!definitions_res.ok)
+    panic(definitions_res.err);
+  size_t *definitions = definitions_res.val.ptr;
+  memset(definitions, 0, n * sizeof(size_t));
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    Slice(Instruction) list = fn->blocks.slice.ptr[i].instructions.slice;
+    for (size_t j = 0; j < list.len; j++) {
+      visitDefinitions(&list.ptr[j], countUse, definitions);
+    }
+  }
+  size_t hoisted = 0;
+  for (size_t header = 0; header < fn->blocks.slice.len; header++) {
+    if (!fn->blocks.slice.ptr[header].term.loop)
+      continue;
+    bool *in_loop = loopBlocks(ally, fn, header);
+    size_t preheader = loopPreheader(fn, in_loop, header);
+    if (preheader == NO_BLOCK)
+      continue;
+    Result(Vec_Slice_char) assigned_res = createVec(ally, Slice_char, 4);
+    if (!assigned_res.ok)
+      panic(assigned_res.err);
+    LoopDefinitions loop = {
+        .assigned = assigned_res.val,
+        .opaque = false,
+        .computed = allocFlags(ally, n),
+        .definitions = definitions,
+    };
+    for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+      Slice(Instruction) list = fn->blocks.slice.ptr[i].instructions.slice;
+      for (size_t j = 0; in_loop[i] && j < list.len; j++) {
+        // a store may set any element variable
+        if (list.ptr[j].op == IrCall || list.ptr[j].op == IrBatch ||
+            list.ptr[j].op == IrStore)
+          loop.opaque = true;
+        visitDefinitions(&list.ptr[j], noteLoopDefinition, &loop);
+      }
+    }
+    // hoisting one computation can make the ones using it invariant too
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+        Vec(Instruction) *list = &fn->blocks.slice.ptr[i].instructions;
+        size_t j = 0;
+        while (in_loop[i] && j < list->slice.len) {
+          Instruction inst = list->slice.ptr[j];
+          if (!canHoist(&loop, inst)) {
+            j++;
+            continue;
+          }
+          removeInstruction(list, j);
+          if (!append(&fn->blocks.slice.ptr[preheader].instructions,
+                      Instruction, &inst))
+            panic("Failed to append instruction");
+          loop.computed[inst.dst.id] = false;
+          hoisted++;
+          changed = true;
+        }
+      }
+    }
+  }
+  if (hoisted > 0)
+    fprintf(stdout, "Hoisted %zu loop invariant computations\n", hoisted);
+}
+
+#define NO_TEMPORARY ((size_t)-1)
+
+typedef struct {
+  IrOp op;
+  char symbol;
+  // temporaries stand for the first one computing the same value
+  Value a;
+  Value b;
+  // the temporary that first computed this
+  size_t value;
+  // a temporary still holding it, NO_TEMPORARY when it was only folded
+  size_t available;
+} AvailableExpression;
+
+DefSlice(AvailableExpression);
+DefResult(Slice_AvailableExpression);
+DefVec(AvailableExpression);
+DefResult(Vec_AvailableExpression);
+DefSlice(Slice_AvailableExpression);
+DefResult(Slice_Slice_AvailableExpression);
+DefVec(size_t);
+DefResult(Vec_size_t);
+
+typedef struct {
+  IrFunction *fn;
+  size_t *definitions;
+  // the first temporary computing the same value, for matching
+  size_t *canonical;
+  // the temporary that replaces a removed one
+  size_t *renamed;
+  Vec(AvailableExpression) available;
+} ValueNumbering;
+
+static bool sameValue(Value a, Value b) {
+  if (a.kind != b.kind)
+    return false;
+  switch (a.kind) {
+  case ValueNone: {
+    return true;
+  }
+  case ValueTemporary: {
+    return a.id == b.id;
+  }
+  case ValueVariable:
+  case ValueNumber:
+  case ValueString: {
+    return eql(a.text, b.text);
+  }
+  }
+}
+
+static bool sameExpression(AvailableExpression a, AvailableExpression b) {
+  return a.op == b.op && a.symbol == b.symbol && sameValue(a.a, b.a) &&
+         sameValue(a.b, b.b) && a.value == b.value &&
+         a.available == b.available;
+}
+
+static bool isCommutative(char symbol) {
+  return symbol == '+' || symbol == '*' || symbol == '=' || symbol == '!';
+}
+
+static bool mentions(AvailableExpression expr, Value value) {
+  if (value.kind == ValueTemporary &&
+      (expr.value == value.id || expr.available == value.id))
+    return true;
+  return sameValue(expr.a, value) || sameValue(expr.b, value);
+}
+
+// Drops what mentions value, or every variable for calls and inline batch
+static void forget(ValueNumbering *numbering, Value value, bool variables) {
+  Vec(AvailableExpression) *list = &numbering->available;
+  size_t kept = 0;
+  for (size_t i = 0; i < list->slice.len; i++) {
+    AvailableExpression expr = list->slice.ptr[i];
+    bool clobbered = variables ? expr.a.kind == ValueVariable ||
+                                     expr.b.kind == ValueVariable
+                               : mentions(expr, value);
+    if (!clobbered)
+      list->slice.ptr[kept++] = expr;
+  }
+  list->slice.len = kept;
+}
+
+static void forgetDefinition(Value *value, void *context) {
+  ValueNumbering *numbering = (ValueNumbering *)context;
+  // temporaries are only set once, apart from parallel copy scratches
+  if (value->kind == ValueVariable ||
+      (value->kind == ValueTemporary &&
+       numbering->definitions[value->id] > 1))
+    forget(numbering, *value, false);
+}
+
+static void renameUse(Value *value, void *context) {
+  ValueNumbering *numbering = (ValueNumbering *)context;
+  if (value->kind == ValueTemporary)
+    value->id = numbering->renamed[value->id];
+}
+
+static Value canonicalValue(ValueNumbering *numbering, Value value) {
+  if (value.kind == ValueTemporary)
+    value.id = numbering->canonical[value.id];
+  return value;
+}
+
+static AvailableExpression *findExpression(ValueNumbering *numbering,
+                                           AvailableExpression expr) {
+  for (size_t i = 0; i < numbering->available.slice.len; i++) {
+    AvailableExpression *other = &numbering->available.slice.ptr[i];
+    if (other->op != expr.op || other->symbol != expr.symbol)
+      continue;
+    if (sameValue(other->a, expr.a) && sameValue(other->b, expr.b))
+      return other;
+    if (isCommutative(expr.symbol) && sameValue(other->a, expr.b) &&
+        sameValue(other->b, expr.a))
+      return other;
+  }
+  return NULL;
+}
+
+static bool containsExpression(Slice(AvailableExpression) list,
+                               AvailableExpression expr) {
+  for (size_t i = 0; i < list.len; i++) {
+    if (sameExpression(list.ptr[i], expr))
+      return true;
+  }
+  return false;
+}
+
+// What is available at the start of block: whatever every block jumping to
+// it had left, and nothing at all while a jump back to it is still to come
+static void startBlock(ValueNumbering *numbering, size_t block,
+                       Slice(Slice_AvailableExpression) ends, bool *reached,
+                       bool *done) {
+  IrFunction *fn = numbering->fn;
+  numbering->available.slice.len = 0;
+  size_t first = NO_BLOCK;
+  for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+    if (!reached[i] || !jumpsTo(fn, i, block))
+      continue;
+    if (!done[i])
+      return;
+    if (first == NO_BLOCK)
+      first = i;
+  }
+  if (first == NO_BLOCK)
+    return;
+  Slice(AvailableExpression) candidates = ends.ptr[first];
+  for (size_t c = 0; c < candidates.len; c++) {
+    bool everywhere = true;
+    for (size_t i = first + 1; i < fn->blocks.slice.len && everywhere; i++) {
+      if (reached[i] && jumpsTo(fn, i, block))
+        everywhere = containsExpression(ends.ptr[i], candidates.ptr[c]);
+    }
+    if (everywhere && !append(&numbering->available, AvailableExpression,
+                              &candidates.ptr[c]))
+      panic("Failed to append expression");
+  }
+}
+
+// Gives an arithmetic or comparison the value of an earlier one computing
+// the same, and returns whether the instruction can go
+static bool numberInstruction(ValueNumbering *numbering, Instruction *inst,
+                              size_t *reused) {
+  bool temporary = inst->dst.kind == ValueTemporary &&
+                   numbering->definitions[inst->dst.id] == 1;
+  if ((inst->op != IrArithmetic && inst->op != IrCompare) ||
+      inst->joined.len > 0 ||
+      (!temporary && inst->dst.kind != ValueVariable))
+    return false;
+  // every expansion of RANDOM and the like is a value of its own
+  if ((inst->a.kind == ValueVariable && isDynamicVariable(inst->a.text)) ||
+      (inst->b.kind == ValueVariable && isDynamicVariable(inst->b.text)))
+    return false;
+  AvailableExpression expr = {
+      .op = inst->op,
+      .symbol = inst->symbol,
+      .a = canonicalValue(numbering, inst->a),
+      .b = canonicalValue(numbering, inst->b),
+      .value = temporary ? inst->dst.id : NO_TEMPORARY,
+      .available = temporary && !inst->folded ? inst->dst.id : NO_TEMPORARY,
+  };
+  AvailableExpression *found = findExpression(numbering, expr);
+  if (found && found->available != NO_TEMPORARY) {
+    Value holder = {.kind = ValueTemporary, .id = found->available};
+    if (!temporary) {
+      *inst = (Instruction){.op = IrCopy, .dst = inst->dst, .a = holder};
+      (*reused)++;
+      return false;
+    }
+    numbering->canonical[inst->dst.id] = found->value;
+    numbering->renamed[inst->dst.id] = found->available;
+    (*reused)++;
+    return true;
+  }
+  if (!temporary)
+    return false;
+  if (found) {
+    // only folded so far, this one keeps the value around
+    numbering->canonical[inst->dst.id] = found->value;
+    found->available = expr.available;
+    return false;
+  }
+  if (!append(&numbering->available, AvailableExpression, &expr))
+    panic("Failed to append expression");
+  return false;
+}
+
+static void orderBlocks(IrFunction *fn, size_t block, bool *reached,
+                        Vec(size_t) *order) {
+  if (reached[block])
+    return;
+  reached[block] = true;
+  Terminator term = fn->blocks.slice.ptr[block].term;
+  for (size_t i = 0; i < successorCount(term); i++) {
+    orderBlocks(fn, successor(term, i), reached, order);
+  }
+  if (!append(order, size_t, &block))
+    panic("Failed to append block");
+}
+
+// Folded arithmetic whose user was removed is never written out, but at the
+// end of a block it would pass for the sum a return computes
+static void dropUnusedFolds(Allocator ally, IrFunction *fn) {
+  Result(Slice_size_t) uses_res =
+      alloc(ally, size_t, fn->temporaries.slice.len);
+  if (!uses_res.ok)
+    panic(uses_res.err);
+  size_t *uses = uses_res.val.ptr;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    countUses(fn, uses);
+    for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+      Vec(Instruction) *list = &fn->blocks.slice.ptr[i].instructions;
+      for (size_t j = list->slice.len; j > 0; j--) {
+        Instruction inst = list->slice.ptr[j - 1];
+        if (!inst.folded || inst.dst.kind != ValueTemporary ||
+            uses[inst.dst.id] > 0)
+          continue;
+        removeInstruction(list, j - 1);
+        changed = true;
+      }
+    }
+  }
+}
+
+// Computes every arithmetic and comparison only once as long as nothing
+// it reads was set in between. Later copies use the temporary of the first
+// one instead, also in blocks every path to goes through it. Runs after
+// folding so the sums that are part of a bigger set /a stay there.
+static void numberValues(Allocator ally, IrFunction *fn) {
+  size_t n = fn->temporaries.slice.len;
+  size_t blocks = fn->blocks.slice.len;
+  if (n == 0)
+    return;
+  Result(Slice_size_t) definitions_res = alloc(ally, size_t, n);
+  if (!definitions_res.ok)
+    panic(definitions_res.err);
+  Result(Slice_size_t) canonical_res = alloc(ally, size_t, n);
+  if (!canonical_res.ok)
+    panic(canonical_res.err);
+  Result(Slice_size_t) renamed_res = alloc(ally, size_t, n);
+  if (!renamed_res.ok)
+    panic(renamed_res.err);
+  Result(Vec_AvailableExpression) available_res =
+      createVec(ally, AvailableExpression, 8);
+  if (!available_res.ok)
+    panic(available_res.err);
+  ValueNumbering numbering = {
+      .fn = fn,
+      .definitions = definitions_res.val.ptr,
+      .canonical = canonical_res.val.ptr,
+      .renamed = renamed_res.val.ptr,
+      .available = available_res.val,
+  };
+  memset(numbering.definitions, 0, n * sizeof(size_t));
+  for (size_t t = 0; t < n; t++) {
+    numbering.canonical[t] = t;
+    numbering.renamed[t] = t;
+  }
+  for (size_t i = 0; i < blocks; i++) {
+    Slice(Instruction) list = fn->blocks.slice.ptr[i].instructions.slice;
+    for (size_t j = 0; j < list.len; j++) {
+      visitDefinitions(&list.ptr[j], countUse, numbering.definitions);
+    }
+  }
+
+  Result(Vec_size_t) order_res = createVec(ally, size_t, blocks);
+  if (!order_res.ok)
+    panic(order_res.err);
+  Vec(size_t) order = order_res.val;
+  bool *reached = allocFlags(ally, blocks);
+  orderBlocks(fn, 0, reached, &order);
+  bool *done = allocFlags(ally, blocks);
+  Result(Slice_Slice_AvailableExpression) ends_res =
+      alloc(ally, Slice_AvailableExpression, blocks);
+  if (!ends_res.ok)
+    panic(ends_res.err);
+  Slice(Slice_AvailableExpression) ends = ends_res.val;
+
+  size_t reused = 0;
+  for (size_t k = order.slice.len; k > 0; k--) {
+    size_t b = order.slice.ptr[k - 1];
+    IrBlock *block = &fn->blocks.slice.ptr[b];
+    startBlock(&numbering, b, ends, reached, done);
+    size_t j = 0;
+    while (j < block->instructions.slice.len) {
+      Instruction *inst = &block->instructions.slice.ptr[j];
+      visitUses(inst, renameUse, &numbering);
+      if (numberInstruction(&numbering, inst, &reused)) {
+        removeInstruction(&block->instructions, j);
+        continue;
+      }
+      if (inst->op == IrCall || inst->op == IrBatch || inst->op == IrStore)
+        forget(&numbering, (Value){.kind = ValueNone}, true);
+      if (inst->op == IrEndlocal)
+        numbering.available.slice.len = 0;
+      visitDefinitions(inst, forgetDefinition, &numbering);
+      j++;
+    }
+    visitTerminatorUses(&block->term, renameUse, &numbering);
+
+    Slice(AvailableExpression) end = {.ptr = NULL, .len = 0};
+    size_t len = numbering.available.slice.len;
+    if (len > 0) {
+      Result(Slice_AvailableExpression) end_res =
+          alloc(ally, AvailableExpression, len);
+      if (!end_res.ok)
+        panic(end_res.err);
+      end = end_res.val;
+      memcpy(end.ptr, numbering.available.slice.ptr,
+             len * sizeof(AvailableExpression));
+    }
+    ends.ptr[b] = end;
+    done[b] = true;
+  }
+  if (reused == 0)
+    return;
+  dropUnusedFolds(ally, fn);
+  fprintf(stdout, "Reused %zu common subexpressions\n", reused);
+}
+
+static bool slotIn(IrFunction *fn, bool *temporaries, Slice(char) name) {
+  for (size_t t = 0; t < fn->temporaries.slice.len; t++) {
+    if (temporaries[t] && eql(fn->temporaries.slice.ptr[t].name, name))
+      return true;
+  }
+  return false;
+}
+
+// Every temporary only lives until the statement that needed it is done,
+// so before a loop the variables they left behind are dead. Unsetting the
+// ones the loop does not set again keeps the environment every iteration
+// has to expand small.
+static void clearDeadTemporaries(Allocator ally, IrFunction *fn) {
+  if (fn->temporaries.slice.len == 0)
+    return;
+  // unsets only ever clear dead temporaries, so this stays valid
+  Liveness liveness = computeLiveness(ally, fn);
+  size_t n = fn->temporaries.slice.len;
+  for (size_t header = 0; header < fn->blocks.slice.len; header++) {
+    if (!fn->blocks.slice.ptr[header].term.loop)
+      continue;
+    bool *in_loop = loopBlocks(ally, fn, header);
+    size_t preheader = loopPreheader(fn, in_loop, header);
+    if (preheader == NO_BLOCK)
+      continue;
+
+    bool *before = allocFlags(ally, fn->blocks.slice.len);
+    reachBackFrom(fn, preheader, before);
+    bool *set_before = allocFlags(ally, n);
+    bool *set_inside = allocFlags(ally, n);
+    for (size_t i = 0; i < fn->blocks.slice.len; i++) {
+      if (!before[i] && !in_loop[i])
+        continue;
+      Slice(Instruction) list = fn->blocks.slice.ptr[i].instructions.slice;
+      for (size_t j = 0; j < list.len; j++) {
+        // the scratch of a parallel copy is only set for cycles
+        if (list.ptr[j].folded || list.ptr[j].op == IrParallelCopy)
+          continue;
+        visitDefinitions(&list.ptr[j], markLive,
+                         in_loop[i] ? set_inside : set_before);
+      }
+    }
+    bool *live = liveness.live_in + header * n;
+
+    Result(Vec_Value) cleared_res = createVec(ally, Value, 4);
+    if (!cleared_res.ok)
+      panic(cleared_res.err);
+    Vec(Value) cleared = cleared_res.val;
+    for (size_t t = 0; t < n; t++) {
+      Slice(char) name = fn->temporaries.slice.ptr[t].name;
+      if (!set_before[t] || slotIn(fn, live, name) ||
+          slotIn(fn, set_inside, name))
+        continue;
+      bool duplicate = false;
+      for (size_t i = 0; i < cleared.slice.len && !duplicate; i++) {
+        duplicate = eql(fn->temporaries.slice.ptr[cleared.slice.ptr[i].id].name,
+                        name);
+      }
+      if (duplicate)
+        continue;
+      Value value = {.kind = ValueTemporary, .id = t};
+      if (!append(&cleared, Value, &value))
+        panic("Failed to append cleared temporary");
+    }
+    if (cleared.slice.len == 0)
+      continue;
+    Instruction unset = {.op = IrUnset, .args = cleared.slice};
+    if (!append(&fn->blocks.slice.ptr[preheader].instructions, Instruction,
+                &unset))
+      panic("Failed to append instruction");
+  }
+}
+
+static const IrPass ir_passes[] = {
+    {.name = "hoist-invariants", .run = hoistInvariants},
+    {.name = "fold-arithmetic", .run = foldArithmetic},
+    {.name = "number-values", .run = numberValues},
+    {.name = "allocate-temporaries", .run = allocateTemporaries},
+    {.name = "clear-dead-temporaries", .run = clearDeadTemporaries},
+};
+
+static void runIrPasses(Allocator ally, IrProgram *program) {
+  for (size_t i = 0; i < sizeof(ir_passes) / sizeof(ir_passes[0]); i++) {
+    clock_t start = clock();
+    for (size_t j = 0; j < program->functions.slice.len; j++) {
+      ir_passes[i].run(ally, &program->functions.slice.ptr[j]);
+    }
+    clock_t end = clock();
+    fprintf(stdout, "IR pass %s: %.3fms\n", ir_passes[i].name,
+            (double)(end - start) * 1000.0 / (double)CLOCKS_PER_SEC);
+  }
+}
+
+#endif /* PASSES_H */
@@ -0,0 +1,394 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Cleans up the batch text outputBatch assembled, one line at a time. Every
+// line is a command, a label or a piece of a parenthesized block, and the
+// rules only ever look at neighbouring commands, so no control flow analysis
+// is needed beyond finding which labels are jumped to.
+
+typedef struct {
+  // without the leading @ and the line break
+  Slice(char) text;
+  bool quiet;
+  bool removed;
+} Command;
+
+DefSlice(Command);
+DefVec(Command);
+DefResult(Vec_Command);
+
+typedef struct {
+  const char *name;
+  size_t commands;
+  size_t bytes;
+} PeepholeRule;
+
+static size_t commandBytes(Command cmd) {
+  return (cmd.quiet ? 1 : 0) + cmd.text.len + 2;
+}
+
+static bool commandStartsWith(Slice(char) text, const char *prefix) {
+  size_t len = strlen(prefix);
+  if (text.len < len)
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    if (tolower(text.ptr[i]) != tolower(prefix[i]))
+      return false;
+  }
+  return true;
+}
+
+static bool eqlIgnoreCase(Slice(char) a, Slice(char) b) {
+  if (a.len != b.len)
+    return false;
+  for (size_t i = 0; i < a.len; i++) {
+    if (tolower(a.ptr[i]) != tolower(b.ptr[i]))
+      return false;
+  }
+  return true;
+}
+
+static bool containsAny(Slice(char) text, const char *chars) {
+  for (size_t i = 0; i < text.len; i++) {
+    if (strchr(chars, text.ptr[i]))
+      return true;
+  }
+  return false;
+}
+
+static bool isLabel(Command cmd) {
+  return cmd.text.len > 1 && cmd.text.ptr[0] == ':' && cmd.text.ptr[1] != ':';
+}
+
+static Slice(char) labelName(Command cmd) {
+  Slice(char) name = {.ptr = cmd.text.ptr + 1, .len = 0};
+  while (name.len < cmd.text.len - 1 && !isspace(name.ptr[name.len])) {
+    name.len++;
+  }
+  return name;
+}
+
+// Index of the next command after i that is still there, skipping blank
+// lines, or commands.len
+static size_t nextCommand(Slice(Command) commands, size_t i) {
+  for (i++; i < commands.len; i++) {
+    if (!commands.ptr[i].removed && commands.ptr[i].text.len > 0)
+      break;
+  }
+  return i;
+}
+
+static void removeCommand(Command *cmd, PeepholeRule *rule) {
+  cmd->removed = true;
+  rule->commands++;
+  rule->bytes += commandBytes(*cmd);
+}
+
+static Vec(Command) splitCommands(Allocator ally, Slice(char) batch) {
+  Result(Vec_Command) commands_res = createVec(ally, Command, 64);
+  if (!commands_res.ok)
+    panic(commands_res.err);
+  Vec(Command) commands = commands_res.val;
+  size_t start = 0;
+  for (size_t i = 0; i < batch.len; i++) {
+    if (batch.ptr[i] != '\n')
+      continue;
+    size_t end = i > start && batch.ptr[i - 1] == '\r' ? i - 1 : i;
+    Command cmd = {
+        .text = {.ptr = batch.ptr + start, .len = end - start},
+        .quiet = false,
+        .removed = false,
+    };
+    if (cmd.text.len > 0 && cmd.text.ptr[0] == '@') {
+      cmd.quiet = true;
+      cmd.text.ptr++;
+      cmd.text.len--;
+    }
+    if (!append(&commands, Command, &cmd))
+      panic("Failed to append command");
+    start = i + 1;
+  }
+  return commands;
+}
+
+// The expressions of a `set /a` command, without the surrounding quotes, or
+// an empty slice when the command is anything else
+static Slice(char) arithmeticBody(Command cmd) {
+  Slice(char) none = {.ptr = NULL, .len = 0};
+  if (!commandStartsWith(cmd.text, "set /a "))
+    return none;
+  Slice(char) body = {.ptr = cmd.text.ptr + 7, .len = cmd.text.len - 7};
+  if (body.len >= 2 && body.ptr[0] == '"' && body.ptr[body.len - 1] == '"') {
+    body.ptr++;
+    body.len -= 2;
+  }
+  if (body.len == 0 || containsAny(body, "\"&|<>^"))
+    return none;
+  return body;
+}
+
+// Whether body expands a variable that one of the assignments in assigned
+// sets, which would read the old value once both share a line
+static bool readsAssigned(Slice(char) body, Slice(char) assigned) {
+  size_t depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= assigned.len; i++) {
+    char c = i < assigned.len ? assigned.ptr[i] : ',';
+    if (c == '(') {
+      depth++;
+    } else if (c == ')' && depth > 0) {
+      depth--;
+    } else if (c == ',' && depth == 0) {
+      Slice(char) name = {.ptr = assigned.ptr + start, .len = 0};
+      while (start + name.len < i && name.ptr[name.len] != '=') {
+        name.len++;
+      }
+      // `n+=5` assigns n
+      while (name.len > 0 && strchr(" +-*/%&|^<>", name.ptr[name.len - 1])) {
+        name.len--;
+      }
+      while (name.len > 0 && name.ptr[0] == ' ') {
+        name.ptr++;
+        name.len--;
+      }
+      for (size_t j = 0; j + name.len + 2 <= body.len; j++) {
+        char perc = body.ptr[j];
+        if ((perc == '%' || perc == '!') &&
+            body.ptr[j + name.len + 1] == perc &&
+            eqlIgnoreCase((Slice(char)){.ptr = body.ptr + j + 1,
+                                        .len = name.len},
+                          name))
+          return true;
+      }
+      start = i + 1;
+    }
+  }
+  return false;
+}
+
+static bool mergeArithmetic(Allocator ally, Slice(Command) commands,
+                            PeepholeRule *rule) {
+  bool changed = false;
+  for (size_t i = 0; i < commands.len; i++) {
+    Command *first = &commands.ptr[i];
+    Slice(char) first_body = arithmeticBody(*first);
+    if (first->removed || first_body.len == 0)
+      continue;
+    size_t j = nextCommand(commands, i);
+    if (j == commands.len)
+      continue;
+    Command *second = &commands.ptr[j];
+    Slice(char) second_body = arithmeticBody(*second);
+    if (second_body.len == 0 || second->quiet != first->quiet ||
+        readsAssigned(second_body, first_body))
+      continue;
+    Result(Vec_char) text_res =
+        createVec(ally, char, first_body.len + second_body.len + 10);
+    if (!text_res.ok)
+      panic(text_res.err);
+    Vec(char) text = text_res.val;
+    appendManyCString(&text, "set /a \"");
+    appendSlice(&text, char, first_body);
+    appendManyCString(&text, ",");
+    appendSlice(&text, char, second_body);
+    appendManyCString(&text, "\"");
+    size_t before = commandBytes(*first) + commandBytes(*second);
+    second->text = text.slice;
+    first->removed = true;
+    rule->commands++;
+    rule->bytes += before - commandBytes(*second);
+    changed = true;
+  }
+  return changed;
+}
+
+static bool removeJumpsToNext(Slice(Command) commands, PeepholeRule *rule) {
+  bool changed = false;
+  for (size_t i = 0; i < commands.len; i++) {
+    Command *jump = &commands.ptr[i];
+    if (jump->removed || !commandStartsWith(jump->text, "goto :"))
+      continue;
+    Slice(char) target = {.ptr = jump->text.ptr + 6,
+                          .len = jump->text.len - 6};
+    if (target.len == 0 || containsAny(target, " &|()%!"))
+      continue;
+    size_t j = nextCommand(commands, i);
+    if (j == commands.len || !isLabel(commands.ptr[j]) ||
+        !eqlIgnoreCase(labelName(commands.ptr[j]), target))
+      continue;
+    removeCommand(jump, rule);
+    changed = true;
+  }
+  return changed;
+}
+
+// Collects the targets of every goto and call in text. A target built from
+// a variable only fixes its prefix, which goes into prefixes instead.
+static void collectJumps(Slice(char) text, Vec(Slice_char) * targets,
+                         Vec(Slice_char) * prefixes) {
+  for (size_t i = 0; i < text.len; i++) {
+    if (i > 0 && (isalnum(text.ptr[i - 1]) || text.ptr[i - 1] == '_'))
+      continue;
+    Slice(char) rest = {.ptr = text.ptr + i, .len = text.len - i};
+    size_t skip = 0;
+    if (commandStartsWith(rest, "goto ") || commandStartsWith(rest, "goto:"))
+      skip = 4;
+    else if (commandStartsWith(rest, "call :"))
+      skip = 5;
+    else
+      continue;
+    while (skip < rest.len && rest.ptr[skip] == ' ') {
+      skip++;
+    }
+    if (skip < rest.len && rest.ptr[skip] == ':')
+      skip++;
+    Slice(char) target = {.ptr = rest.ptr + skip, .len = 0};
+    size_t fixed = SIZE_MAX;
+    while (skip + target.len < rest.len &&
+           !strchr(" \t&|)\"", target.ptr[target.len])) {
+      if (fixed == SIZE_MAX && strchr("%!", target.ptr[target.len]))
+        fixed = target.len;
+      target.len++;
+    }
+    if (fixed != SIZE_MAX) {
+      target.len = fixed;
+      if (!append(prefixes, Slice_char, &target))
+        panic("Failed to append jump prefix");
+    } else if (!append(targets, Slice_char, &target)) {
+      panic("Failed to append jump target");
+    }
+  }
+}
+
+static bool removeUnusedLabels(Allocator ally, Slice(Command) commands,
+                               PeepholeRule *rule) {
+  Result(Vec_Slice_char) targets_res = createVec(ally, Slice_char, 16);
+  if (!targets_res.ok)
+    panic(targets_res.err);
+  Result(Vec_Slice_char) prefixes_res = createVec(ally, Slice_char, 4);
+  if (!prefixes_res.ok)
+    panic(prefixes_res.err);
+  Vec(Slice_char) targets = targets_res.val;
+  Vec(Slice_char) prefixes = prefixes_res.val;
+  for (size_t i = 0; i < commands.len; i++) {
+    if (!commands.ptr[i].removed && !isLabel(commands.ptr[i]))
+      collectJumps(commands.ptr[i].text, &targets, &prefixes);
+  }
+  bool changed = false;
+  for (size_t i = 0; i < commands.len; i++) {
+    Command *label = &commands.ptr[i];
+    if (label->removed || !isLabel(*label))
+      continue;
+    Slice(char) name = labelName(*label);
+    bool used = false;
+    for (size_t j = 0; j < targets.slice.len && !used; j++) {
+      used = eqlIgnoreCase(targets.slice.ptr[j], name);
+    }
+    for (size_t j = 0; j < prefixes.slice.len && !used; j++) {
+      Slice(char) prefix = prefixes.slice.ptr[j];
+      used = prefix.len <= name.len &&
+             eqlIgnoreCase(prefix, (Slice(char)){.ptr = name.ptr,
+                                                 .len = prefix.len});
+    }
+    if (!used) {
+      removeCommand(label, rule);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static bool removeEmptyFrames(Slice(Command) commands, PeepholeRule *rule) {
+  bool changed = false;
+  for (size_t i = 0; i < commands.len; i++) {
+    Command *open = &commands.ptr[i];
+    if (open->removed || !commandStartsWith(open->text, "setlocal") ||
+        containsAny(open->text, "&|"))
+      continue;
+    size_t j = nextCommand(commands, i);
+    if (j == commands.len ||
+        !eqlIgnoreCase(commands.ptr[j].text,
+                       (Slice(char)){.ptr = "endlocal", .len = 8}))
+      continue;
+    removeCommand(open, rule);
+    removeCommand(&commands.ptr[j], rule);
+    changed = true;
+  }
+  return changed;
+}
+
+// Trades the @ in front of every command for a single `@echo off`
+static void echoOff(Slice(Command) commands, PeepholeRule *rule) {
+  size_t quiet = 0;
+  for (size_t i = 0; i < commands.len; i++) {
+    if (!commands.ptr[i].removed && commands.ptr[i].quiet)
+      quiet++;
+  }
+  const size_t echo_off_len = 11; // @echo off\r\n
+  if (quiet <= echo_off_len)
+    return;
+  for (size_t i = 0; i < commands.len; i++) {
+    commands.ptr[i].quiet = false;
+  }
+  rule->bytes += quiet - echo_off_len;
+}
+
+static void peephole(Allocator ally, Vec(char) * out) {
+  Vec(Command) commands = splitCommands(ally, out->slice);
+  PeepholeRule merge = {.name = "merged set /a", .commands = 0, .bytes = 0};
+  PeepholeRule jumps = {.name = "goto next line", .commands = 0, .bytes = 0};
+  PeepholeRule labels = {.name = "unused label", .commands = 0, .bytes = 0};
+  PeepholeRule frames = {.name = "empty setlocal", .commands = 0, .bytes = 0};
+  PeepholeRule echo = {.name = "@ prefix", .commands = 0, .bytes = 0};
+
+  // removing one pattern can expose another, e.g. a goto whose label then
+  // goes unused, so run the rules until nothing changes
+  bool changed = true;
+  while (changed) {
+    changed = mergeArithmetic(ally, commands.slice, &merge);
+    if (removeJumpsToNext(commands.slice, &jumps))
+      changed = true;
+    if (removeUnusedLabels(ally, commands.slice, &labels))
+      changed = true;
+    if (removeEmptyFrames(commands.slice, &frames))
+      changed = true;
+  }
+  echoOff(commands.slice, &echo);
+
+  Result(Vec_char) result_res = createVec(ally, char, out->slice.len + 16);
+  if (!result_res.ok)
+    panic(result_res.err);
+  Vec(char) result = result_res.val;
+  if (echo.bytes > 0)
+    appendManyCString(&result, "@echo off\r\n");
+  for (size_t i = 0; i < commands.slice.len; i++) {
+    Command cmd = commands.slice.ptr[i];
+    if (cmd.removed)
+      continue;
+    if (cmd.quiet)
+      appendManyCString(&result, "@");
+    appendSlice(&result, char, cmd.text);
+    appendManyCString(&result, "\r\n");
+  }
+  *out = result;
+
+  PeepholeRule *rules[] = {&merge, &jumps, &labels, &frames, &echo};
+  for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+    if (rules[i]->bytes == 0)
+      continue;
+    fprintf(stdout, "Peephole %s: removed %zu command%s, %zu byte%s\n",
+            rules[i]->name, rules[i]->commands,
+            rules[i]->commands == 1 ? "" : "s", rules[i]->bytes,
+            rules[i]->bytes == 1 ? "" : "s");
+  }
+}
+
+#endif /* PEEPHOLE_H */
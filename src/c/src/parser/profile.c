@@ -0,0 +1,248 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "ast.c"
+#include "parser.c"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Instruments the program for --profile. Every top level statement, loop
+// and function call appends a line to a trace file next to the script:
+//
+//   #<event> <line>:<col> [function] <time>
+//
+// with the events P (start), S (statement), L and E (loop entry and exit),
+// C and R (function entry and return), T (self tail call, after which the
+// C of the jump back does not start a new call) and Q (end). bcprof turns
+// the trace into a hotspot report, using the source map written next to the
+// output to point back from .bb locations to .cmd lines.
+
+static Statement profileEvent(Allocator ally, char event, SourceLocation at,
+                              Slice(char) function) {
+  char text[256];
+  int len = snprintf(text, sizeof(text),
+                     "@>>\"!__profile__!\" echo #%c %zu:%zu %.*s%s!time!",
+                     event, at.line, at.col, (int)function.len, function.ptr,
+                     function.len ? " " : "");
+  return (Statement){
+      .type = InlineBatchStatement,
+      .inline_batch = allocName(ally, text, (size_t)len),
+  };
+}
+
+static Slice(Statement) instrumentList(Allocator ally, Slice(Statement) list,
+                                       Statement *function);
+
+// A self tail call jumps back to the entry and logs its C again
+static bool isTailCall(Expression expr) {
+  return expr.type == CallExpression && expr.call.tail_parameters;
+}
+
+static Slice(char) noName(void) {
+  return (Slice(char)){.ptr = NULL, .len = 0};
+}
+
+static void appendStatement(Vec(Statement) * list, Statement stmt) {
+  if (!append(list, Statement, &stmt))
+    panic("Failed to append instrumented statement");
+}
+
+// Events go in front of the statement, so a lone branch or loop body
+// becomes a block. It runs in the enclosing frame like any other block
+// without shadowing locals.
+static void instrumentBranch(Allocator ally, Statement *stmt,
+                             Statement *function) {
+  if (stmt->type == BlockStatement) {
+    stmt->block->statements =
+        instrumentList(ally, stmt->block->statements, function);
+    return;
+  }
+  Slice(Statement) single = {.ptr = stmt, .len = 1};
+  Slice(Statement) instrumented = instrumentList(ally, single, function);
+  if (instrumented.len == 1) {
+    *stmt = instrumented.ptr[0];
+    return;
+  }
+  SourceLocation at = stmt->at;
+  *stmt = blockOf(ally, instrumented);
+  stmt->block->scoped = false;
+  stmt->at = at;
+}
+
+static void instrumentFunction(Allocator ally, Statement *function) {
+  Statement *body = function->declaration.value.function_expression.body;
+  if (body->type != BlockStatement)
+    return;
+  Slice(Statement) statements = body->block->statements;
+  Result(Vec_Statement) list_res =
+      createVec(ally, Statement, statements.len + 2);
+  if (!list_res.ok)
+    panic(list_res.err);
+  Vec(Statement) list = list_res.val;
+  SourceLocation at = function->at;
+  appendStatement(&list,
+                  profileEvent(ally, 'C', at, function->declaration.name));
+  Slice(Statement) instrumented = instrumentList(ally, statements, function);
+  if (!appendSlice(&list, Statement, instrumented))
+    panic("Failed to append instrumented statements");
+  if (statements.len == 0 ||
+      statements.ptr[statements.len - 1].type != ReturnStatement)
+    appendStatement(&list, profileEvent(ally, 'R', at, noName()));
+  body->block->statements = list.slice;
+}
+
+static Slice(Statement) instrumentList(Allocator ally, Slice(Statement) list,
+                                       Statement *function) {
+  Result(Vec_Statement) result_res = createVec(ally, Statement, list.len + 1);
+  if (!result_res.ok)
+    panic(result_res.err);
+  Vec(Statement) result = result_res.val;
+  for (size_t i = 0; i < list.len; i++) {
+    Statement stmt = list.ptr[i];
+    switch (stmt.type) {
+    case ReturnStatement: {
+      if (function)
+        appendStatement(&result,
+                        profileEvent(ally,
+                                     stmt.return_statement &&
+                                             isTailCall(*stmt.return_statement)
+                                         ? 'T'
+                                         : 'R',
+                                     function->at, noName()));
+      appendStatement(&result, stmt);
+    } break;
+    case ExpressionStatement: {
+      if (function && isTailCall(stmt.expression))
+        appendStatement(&result,
+                        profileEvent(ally, 'T', function->at, noName()));
+      appendStatement(&result, stmt);
+    } break;
+    case WhileStatement: {
+      instrumentBranch(ally, stmt.while_statement->body, function);
+      appendStatement(&result, profileEvent(ally, 'L', stmt.at, noName()));
+      appendStatement(&result, stmt);
+      appendStatement(&result, profileEvent(ally, 'E', stmt.at, noName()));
+    } break;
+    case IfStatement: {
+      instrumentBranch(ally, stmt.if_statement->consequence, function);
+      if (stmt.if_statement->alternate)
+        instrumentBranch(ally, stmt.if_statement->alternate, function);
+      appendStatement(&result, stmt);
+    } break;
+    case SwitchStatement: {
+      Switch *switch_statement = stmt.switch_statement;
+      for (size_t j = 0; j < switch_statement->cases.len; j++) {
+        instrumentBranch(ally, switch_statement->cases.ptr[j].body, function);
+      }
+      if (switch_statement->otherwise)
+        instrumentBranch(ally, switch_statement->otherwise, function);
+      appendStatement(&result, stmt);
+    } break;
+    case BlockStatement: {
+      stmt.block->statements =
+          instrumentList(ally, stmt.block->statements, function);
+      appendStatement(&result, stmt);
+    } break;
+    case DeclarationStatement: {
+      if (stmt.declaration.value.type == FunctionExpression)
+        instrumentFunction(ally, &list.ptr[i]);
+      appendStatement(&result, list.ptr[i]);
+    } break;
+    case AssignmentStatement:
+    case InlineBatchStatement: {
+      appendStatement(&result, stmt);
+    } break;
+    case StatementEOF: {
+      panic("StatementEOF");
+    }
+    }
+  }
+  shrinkToLength(&result, Statement);
+  return result.slice;
+}
+
+static void instrumentProgram(Allocator ally, Program *prog) {
+  Result(Vec_Statement) list_res =
+      createVec(ally, Statement, prog->statements.len * 2 + 3);
+  if (!list_res.ok)
+    panic(list_res.err);
+  Vec(Statement) list = list_res.val;
+  char setup[] = "@set \"__profile__=%~dpn0.trace\"\r\n"
+                 "@>\"!__profile__!\" echo #P 0:0 !time!";
+  appendStatement(&list,
+                  (Statement){.type = InlineBatchStatement,
+                              .inline_batch = allocName(
+                                  ally, setup, sizeof(setup) - 1)});
+  SourceLocation none = {.line = 0, .col = 0};
+  SourceLocation last = none;
+  for (size_t i = 0; i < prog->statements.len; i++) {
+    Statement *stmt = &prog->statements.ptr[i];
+    // the statements an inlined call left share the location of the call
+    bool same = stmt->at.line == last.line && stmt->at.col == last.col;
+    if (!same && (stmt->type != DeclarationStatement ||
+                  stmt->declaration.value.type != FunctionExpression)) {
+      appendStatement(&list, profileEvent(ally, 'S', stmt->at, noName()));
+      last = stmt->at;
+    }
+    Slice(Statement) single = {.ptr = stmt, .len = 1};
+    Slice(Statement) instrumented = instrumentList(ally, single, NULL);
+    if (!appendSlice(&list, Statement, instrumented))
+      panic("Failed to append instrumented statements");
+  }
+  appendStatement(&list, profileEvent(ally, 'Q', none, noName()));
+  fprintf(stdout, "Instrumented %zu top level statements for profiling\n",
+          prog->statements.len);
+  shrinkToLength(&list, Statement);
+  prog->statements = list.slice;
+}
+
+// Maps every .cmd line to the .bb location of the event before it. Labels
+// start code that is only reached by a jump, so they end the mapping until
+// the next event.
+static void writeSourceMap(Slice(char) batch, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Error: Could not write source map: %s\n", path);
+    return;
+  }
+  size_t line = 1;
+  size_t start = 0;
+  bool mapped = false;
+  size_t bb_line = 0;
+  size_t bb_col = 0;
+  for (size_t i = 0; i < batch.len; i++) {
+    if (batch.ptr[i] != '\n')
+      continue;
+    Slice(char) text = {.ptr = batch.ptr + start, .len = i - start};
+    if (text.len > 0 && text.ptr[0] == ':')
+      mapped = false;
+    for (size_t j = 0; j + 8 < text.len; j++) {
+      if (memcmp(text.ptr + j, "echo #", 6) != 0)
+        continue;
+      size_t pos = j + 8;
+      size_t event_line = 0;
+      size_t event_col = 0;
+      while (pos < text.len && isdigit((unsigned char)text.ptr[pos]))
+        event_line = event_line * 10 + (size_t)(text.ptr[pos++] - '0');
+      if (pos < text.len && text.ptr[pos] == ':')
+        pos++;
+      while (pos < text.len && isdigit((unsigned char)text.ptr[pos]))
+        event_col = event_col * 10 + (size_t)(text.ptr[pos++] - '0');
+      mapped = event_line > 0;
+      bb_line = event_line;
+      bb_col = event_col;
+      break;
+    }
+    if (mapped)
+      fprintf(file, "%zu %zu:%zu\n", line, bb_line, bb_col);
+    line++;
+    start = i + 1;
+  }
+  fclose(file);
+}
+
+#endif /* PROFILE_H */
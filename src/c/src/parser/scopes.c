@@ -0,0 +1,168 @@
+#ifndef SCOPES_H
+#define SCOPES_H
+
+#include "../std/Allocator.c"
+#include "../std/Vec.c"
+#include "ast.c"
+#include "parser.c"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Resolves block scoping at compile time: a block whose locals never shadow
+// a visible name can run without setlocal, so shadowing declarations get a
+// unique name instead. Blocks around inline batch code keep their setlocal,
+// since the batch text may rely on it and cannot be renamed.
+
+typedef struct {
+  Allocator ally;
+  // every visible declaration, innermost last
+  Vec(Rename) renames;
+  size_t locals;
+} Scopes;
+
+static void declare(Scopes *scopes, Slice(char) name, Slice(char) to) {
+  Rename rename = {
+      .from = name,
+      .to = {.type = IdentifierExpression, .identifier = to},
+  };
+  if (!append(&scopes->renames, Rename, &rename))
+    panic("Failed to append scope entry");
+}
+
+static void resolveBlock(Scopes *scopes, Block *block);
+static void resolveStatement(Scopes *scopes, Statement *stmt, bool rename);
+
+static void resolveExpression(Scopes *scopes, Expression *expr) {
+  switch (expr->type) {
+  case IdentifierExpression: {
+    expr->identifier = renameTarget(scopes->renames.slice, expr->identifier);
+  } break;
+  case CallExpression: {
+    resolveExpression(scopes, expr->call.callee);
+    for (size_t i = 0; i < expr->call.parameters_len; i++) {
+      resolveExpression(scopes, &expr->call.parameters[i]);
+    }
+  } break;
+  case ArithmeticExpression: {
+    resolveExpression(scopes, expr->arithmetic.left);
+    resolveExpression(scopes, expr->arithmetic.right);
+  } break;
+  case FunctionExpression: {
+    // the function frame keeps its setlocal, so its own parameters and
+    // top level locals stay as they are
+    size_t mark = scopes->renames.slice.len;
+    for (size_t i = 0; i < expr->function_expression.parameters_len; i++) {
+      Slice(char) param = expr->function_expression.parameters[i].identifier;
+      declare(scopes, param, param);
+    }
+    Statement *body = expr->function_expression.body;
+    if (body->type == BlockStatement) {
+      for (size_t i = 0; i < body->block->statements.len; i++) {
+        resolveStatement(scopes, &body->block->statements.ptr[i], false);
+      }
+    } else {
+      resolveStatement(scopes, body, false);
+    }
+    scopes->renames.slice.len = mark;
+  } break;
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr->array.elements_len; i++) {
+      resolveExpression(scopes, &expr->array.elements[i]);
+    }
+  } break;
+  case IndexExpression: {
+    resolveExpression(scopes, expr->element.index);
+    expr->element.array =
+        renameTarget(scopes->renames.slice, expr->element.array);
+  } break;
+  case NumericExpression:
+  case StringExpression: {
+  } break;
+  }
+}
+
+static void resolveStatement(Scopes *scopes, Statement *stmt, bool rename) {
+  switch (stmt->type) {
+  case DeclarationStatement: {
+    if (stmt->declaration.value.type == FunctionExpression) {
+      declare(scopes, stmt->declaration.name, stmt->declaration.name);
+      resolveExpression(scopes, &stmt->declaration.value);
+      break;
+    }
+    // the value still sees the binding being shadowed
+    resolveExpression(scopes, &stmt->declaration.value);
+    Slice(char) name = stmt->declaration.name;
+    if (rename && findRename(scopes->renames.slice, name)) {
+      stmt->declaration.name = makeName(scopes->ally, "local",
+                                        scopes->locals++, name);
+    }
+    declare(scopes, name, stmt->declaration.name);
+  } break;
+  case AssignmentStatement: {
+    if (stmt->assignment.index)
+      resolveExpression(scopes, stmt->assignment.index);
+    resolveExpression(scopes, &stmt->assignment.value);
+    stmt->assignment.name =
+        renameTarget(scopes->renames.slice, stmt->assignment.name);
+  } break;
+  case ExpressionStatement: {
+    resolveExpression(scopes, &stmt->expression);
+  } break;
+  case ReturnStatement: {
+    if (stmt->return_statement)
+      resolveExpression(scopes, stmt->return_statement);
+  } break;
+  case IfStatement: {
+    resolveExpression(scopes, &stmt->if_statement->condition);
+    resolveStatement(scopes, stmt->if_statement->consequence, rename);
+    if (stmt->if_statement->alternate)
+      resolveStatement(scopes, stmt->if_statement->alternate, rename);
+  } break;
+  case WhileStatement: {
+    resolveExpression(scopes, &stmt->while_statement->condition);
+    resolveStatement(scopes, stmt->while_statement->body, rename);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    resolveExpression(scopes, &switch_statement->subject);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      resolveStatement(scopes, switch_statement->cases.ptr[i].body, rename);
+    }
+    if (switch_statement->otherwise)
+      resolveStatement(scopes, switch_statement->otherwise, rename);
+  } break;
+  case BlockStatement: {
+    resolveBlock(scopes, stmt->block);
+  } break;
+  case InlineBatchStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static void resolveBlock(Scopes *scopes, Block *block) {
+  size_t mark = scopes->renames.slice.len;
+  block->scoped = containsInlineBatch(
+      (Statement){.type = BlockStatement, .block = block});
+  for (size_t i = 0; i < block->statements.len; i++) {
+    resolveStatement(scopes, &block->statements.ptr[i], !block->scoped);
+  }
+  scopes->renames.slice.len = mark;
+}
+
+static void resolveScopes(Allocator ally, Program prog) {
+  Result(Vec_Rename) renames_res = createVec(ally, Rename, 16);
+  if (!renames_res.ok)
+    panic(renames_res.err);
+  Scopes scopes = {.ally = ally, .renames = renames_res.val, .locals = 0};
+  for (size_t i = 0; i < prog.statements.len; i++) {
+    resolveStatement(&scopes, &prog.statements.ptr[i], false);
+  }
+  if (scopes.locals > 0)
+    fprintf(stdout, "Renamed %zu shadowing block local%s\n", scopes.locals,
+            scopes.locals == 1 ? "" : "s");
+}
+
+#endif /* SCOPES_H */
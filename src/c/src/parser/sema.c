@@ -10,6 +10,8 @@ typedef struct {
   Slice(char) name;
   bool read;
   bool constant;
+  // last given an array literal, whose elements can be indexed
+  bool array;
 } Binding;
 
 DefSlice(Binding);
@@ -24,14 +26,47 @@ static bool nameListHasString(Slice(Binding) list, Slice(char) string) {
   return false;
 }
 
+// print, and writing to files with write(path, ...), writeln(path, ...)
+// and the with_output(path) a with_output block starts with, and len(array)
+static bool isBuiltin(Slice(char) name) {
+  return eql(name, (Slice(char)){.ptr = "print", .len = 5}) ||
+         eql(name, (Slice(char)){.ptr = "len", .len = 3}) ||
+         eql(name, (Slice(char)){.ptr = "write", .len = 5}) ||
+         eql(name, (Slice(char)){.ptr = "writeln", .len = 7}) ||
+         eql(name, (Slice(char)){.ptr = "with_output", .len = 11});
+}
+
 static void analyzeStatement(Vec(Binding) * names, Statement stmt);
 
+static Binding *bindingOf(Slice(Binding) names, Slice(char) name) {
+  for (size_t i = 0; i < names.len; i++) {
+    if (eql(names.ptr[i].name, name))
+      return &names.ptr[i];
+  }
+  return NULL;
+}
+
+// The array in xs[i] or len(xs)
+static void analyzeArray(Slice(Binding) names, Slice(char) name, bool read) {
+  Binding *binding = bindingOf(names, name);
+  if (!binding) {
+    fprintf(stdout, "Referring to undeclared name: %1.*s\n", (int)name.len,
+            name.ptr);
+    return;
+  }
+  if (!binding->array)
+    fprintf(stdout, "Indexing a variable that is not an array: %1.*s\n",
+            (int)name.len, name.ptr);
+  if (read)
+    binding->read = true;
+}
+
 static void analyzeExpression(Allocator ally, Slice(Binding) names,
                               Expression expr) {
   switch (expr.type) {
   case IdentifierExpression: {
     if (!nameListHasString(names, expr.identifier)) {
-      if (!eql(expr.identifier, (Slice_char){.ptr = "print", .len = 5})) {
+      if (!isBuiltin(expr.identifier)) {
         fprintf(stdout, "Referring to undeclared name: %1.*s\n",
                 (int)expr.identifier.len, expr.identifier.ptr);
       }
@@ -41,17 +76,48 @@ static void analyzeExpression(Allocator ally, Slice(Binding) names,
           names.ptr[i].read = true;
         }
       }
+      // the name only holds the length, the elements would stay behind
+      Binding *binding = bindingOf(names, expr.identifier);
+      if (binding->array) {
+        fprintf(stdout, "Using an array as a value: %1.*s",
+                (int)expr.identifier.len, expr.identifier.ptr);
+        panic("\nArrays are only indexed or given to len");
+      }
     }
   } break;
   case CallExpression: {
+    Expression callee = *expr.call.callee;
+    if (callee.type == IdentifierExpression &&
+        eql(callee.identifier, (Slice(char)){.ptr = "len", .len = 3}) &&
+        !nameListHasString(names, callee.identifier)) {
+      if (expr.call.parameters_len != 1 ||
+          expr.call.parameters[0].type != IdentifierExpression) {
+        fprintf(stdout, "len takes one array variable\n");
+        break;
+      }
+      analyzeArray(names, expr.call.parameters[0].identifier, true);
+      break;
+    }
     analyzeExpression(ally, names, *expr.call.callee);
     for (size_t i = 0; i < expr.call.parameters_len; i++) {
       analyzeExpression(ally, names, expr.call.parameters[i]);
     }
   } break;
   case ArithmeticExpression: {
-    analyzeExpression(ally, names, *expr.arithmetic.left);
-    analyzeExpression(ally, names, *expr.arithmetic.right);
+    // the chain leans right, so every left is an operand of it
+    size_t comparisons = 0;
+    bool chained = false;
+    while (expr.type == ArithmeticExpression) {
+      analyzeExpression(ally, names, *expr.arithmetic.left);
+      if (isLogical(expr.arithmetic.op))
+        comparisons = 0;
+      if (isComparison(expr.arithmetic.op) && ++comparisons > 1)
+        chained = true;
+      expr = *expr.arithmetic.right;
+    }
+    analyzeExpression(ally, names, expr);
+    if (chained)
+      fprintf(stdout, "Comparisons need && or || between them\n");
   } break;
   case FunctionExpression: {
     Result(Vec_Binding) locals_res = createVec(ally, Binding, 1);
@@ -71,6 +137,15 @@ static void analyzeExpression(Allocator ally, Slice(Binding) names,
     }
     analyzeStatement(&locals, *expr.function_expression.body);
   } break;
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr.array.elements_len; i++) {
+      analyzeExpression(ally, names, expr.array.elements[i]);
+    }
+  } break;
+  case IndexExpression: {
+    analyzeArray(names, expr.element.array, true);
+    analyzeExpression(ally, names, *expr.element.index);
+  } break;
   case NumericExpression:
   case StringExpression: {
     // no-op
@@ -87,9 +162,12 @@ static void analyzeStatement(Vec(Binding) * names, Statement stmt) {
       return;
     }
     analyzeExpression(names->ally, names->slice, stmt.declaration.value);
-    Binding binding = {.name = stmt.declaration.name,
-                       .constant = stmt.declaration.constant,
-                       .read = false};
+    Binding binding = {
+        .name = stmt.declaration.name,
+        .constant = stmt.declaration.constant,
+        .read = false,
+        .array = stmt.declaration.value.type == ArrayExpression,
+    };
     if (!append(names, Binding, &binding)) {
       panic("analyze: Failed to append to names");
     }
@@ -108,6 +186,19 @@ static void analyzeStatement(Vec(Binding) * names, Statement stmt) {
         }
       }
     }
+    if (stmt.assignment.index) {
+      analyzeArray(names->slice, stmt.assignment.name, false);
+      analyzeExpression(names->ally, names->slice, *stmt.assignment.index);
+    } else if (stmt.assignment.value.type == ArrayExpression) {
+      // a shorter literal would leave the elements past it behind
+      fprintf(stdout, "Assigning an array literal to: %1.*s",
+              (int)stmt.assignment.name.len, stmt.assignment.name.ptr);
+      panic("\nArray literals only start a new name with := or ::");
+    } else {
+      Binding *binding = bindingOf(names->slice, stmt.assignment.name);
+      if (binding)
+        binding->array = false;
+    }
     analyzeExpression(names->ally, names->slice, stmt.assignment.value);
   } break;
   case ExpressionStatement: {
@@ -125,6 +216,27 @@ static void analyzeStatement(Vec(Binding) * names, Statement stmt) {
                       stmt.while_statement->condition);
     analyzeStatement(names, *stmt.while_statement->body);
   } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt.switch_statement;
+    analyzeExpression(names->ally, names->slice, switch_statement->subject);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      Expression value = switch_statement->cases.ptr[i].value;
+      Slice(char) text =
+          value.type == NumericExpression ? value.number : value.string;
+      for (size_t j = 0; j < i; j++) {
+        Expression earlier = switch_statement->cases.ptr[j].value;
+        if (eql(text, earlier.type == NumericExpression ? earlier.number
+                                                        : earlier.string)) {
+          fprintf(stdout, "Duplicate case value: %1.*s\n", (int)text.len,
+                  text.ptr);
+          break;
+        }
+      }
+      analyzeStatement(names, *switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      analyzeStatement(names, *switch_statement->otherwise);
+  } break;
   case BlockStatement: {
     for (size_t i = 0; i < stmt.block->statements.len; i++) {
       analyzeStatement(names, stmt.block->statements.ptr[i]);
@@ -161,4 +273,501 @@ static void analyze(Allocator ally, Program prog) {
   }
 }
 
+typedef struct {
+  Slice(char) name;
+  // the function the name is local to, or NO_FUNCTION
+  size_t scope;
+  ValueType type;
+} TypedName;
+
+DefSlice(TypedName);
+DefVec(TypedName);
+DefResult(Vec_TypedName);
+
+typedef struct {
+  // empty when the function is not bound to a constant
+  Slice(char) name;
+  Expression *function;
+  ValueType returns;
+  // called through something else than its name, so its parameters can
+  // get anything
+  bool escapes;
+  // parameters and names declared in the body, which setlocal keeps apart
+  // from the same names anywhere else
+  Vec(Slice_char) locals;
+} TypedFunction;
+
+DefSlice(TypedFunction);
+DefVec(TypedFunction);
+DefResult(Vec_TypedFunction);
+
+#define NO_FUNCTION ((size_t)-1)
+
+typedef struct {
+  Vec(TypedName) names;
+  // joined over the elements of each array
+  Vec(TypedName) elements;
+  Vec(TypedFunction) functions;
+  // the function whose returns are being collected, or whose locals while
+  // collecting functions
+  size_t current;
+  bool changed;
+  // set for one last round once the types are settled
+  bool checking;
+} Inference;
+
+static ValueType joinTypes(ValueType a, ValueType b) {
+  if (a == TypeUnknown)
+    return b;
+  if (b == TypeUnknown || a == b)
+    return a;
+  return TypeMixed;
+}
+
+static void joinType(Inference *inference, ValueType *into, ValueType type) {
+  ValueType joined = joinTypes(*into, type);
+  if (joined != *into) {
+    *into = joined;
+    inference->changed = true;
+  }
+}
+
+static ValueType *typeIn(Vec(TypedName) * list, size_t scope,
+                         Slice(char) name) {
+  for (size_t i = 0; i < list->slice.len; i++) {
+    if (list->slice.ptr[i].scope == scope && eql(list->slice.ptr[i].name, name))
+      return &list->slice.ptr[i].type;
+  }
+  TypedName typed = {.name = name, .scope = scope, .type = TypeUnknown};
+  if (!append(list, TypedName, &typed))
+    panic("Failed to append typed name");
+  return &list->slice.ptr[list->slice.len - 1].type;
+}
+
+// Names the current function does not declare are the ones of the script
+static size_t scopeOf(Inference *inference, Slice(char) name) {
+  if (inference->current == NO_FUNCTION)
+    return NO_FUNCTION;
+  Slice(Slice_char) locals =
+      inference->functions.slice.ptr[inference->current].locals.slice;
+  for (size_t i = 0; i < locals.len; i++) {
+    if (eql(locals.ptr[i], name))
+      return inference->current;
+  }
+  return NO_FUNCTION;
+}
+
+static ValueType *nameType(Inference *inference, Slice(char) name) {
+  return typeIn(&inference->names, scopeOf(inference, name), name);
+}
+
+static ValueType *elementType(Inference *inference, Slice(char) name) {
+  return typeIn(&inference->elements, scopeOf(inference, name), name);
+}
+
+static size_t findTypedFunction(Inference *inference, Slice(char) name) {
+  for (size_t i = 0; i < inference->functions.slice.len; i++) {
+    TypedFunction fn = inference->functions.slice.ptr[i];
+    if (fn.name.len > 0 && eql(fn.name, name))
+      return i;
+  }
+  return NO_FUNCTION;
+}
+
+static void collectTypedFunctions(Inference *inference, Statement *stmt);
+
+static void collectTypedFunction(Inference *inference, Expression *expr,
+                                 Slice(char) name) {
+  Slice(char) anonymous = {.ptr = NULL, .len = 0};
+  switch (expr->type) {
+  case FunctionExpression: {
+    Result(Vec_Slice_char) locals_res =
+        createVec(inference->names.ally, Slice_char, 4);
+    if (!locals_res.ok)
+      panic(locals_res.err);
+    TypedFunction fn = {
+        .name = name,
+        .function = expr,
+        .returns = TypeUnknown,
+        .escapes = name.len == 0,
+        .locals = locals_res.val,
+    };
+    for (size_t i = 0; i < expr->function_expression.parameters_len; i++) {
+      if (!append(&fn.locals, Slice_char,
+                  &expr->function_expression.parameters[i].identifier))
+        panic("Failed to append parameter");
+    }
+    if (!append(&inference->functions, TypedFunction, &fn))
+      panic("Failed to append function");
+    size_t outer = inference->current;
+    inference->current = inference->functions.slice.len - 1;
+    collectTypedFunctions(inference, expr->function_expression.body);
+    inference->current = outer;
+  } break;
+  case CallExpression: {
+    for (size_t i = 0; i < expr->call.parameters_len; i++) {
+      collectTypedFunction(inference, &expr->call.parameters[i], anonymous);
+    }
+  } break;
+  case ArithmeticExpression: {
+    collectTypedFunction(inference, expr->arithmetic.left, anonymous);
+    collectTypedFunction(inference, expr->arithmetic.right, anonymous);
+  } break;
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr->array.elements_len; i++) {
+      collectTypedFunction(inference, &expr->array.elements[i], anonymous);
+    }
+  } break;
+  case IndexExpression: {
+    collectTypedFunction(inference, expr->element.index, anonymous);
+  } break;
+  case IdentifierExpression:
+  case NumericExpression:
+  case StringExpression: {
+  } break;
+  }
+}
+
+static void collectTypedFunctions(Inference *inference, Statement *stmt) {
+  Slice(char) anonymous = {.ptr = NULL, .len = 0};
+  switch (stmt->type) {
+  case ExpressionStatement: {
+    collectTypedFunction(inference, &stmt->expression, anonymous);
+  } break;
+  case DeclarationStatement: {
+    if (inference->current != NO_FUNCTION &&
+        !append(&inference->functions.slice.ptr[inference->current].locals,
+                Slice_char, &stmt->declaration.name))
+      panic("Failed to append local");
+    // only constants keep referring to the same function
+    collectTypedFunction(inference, &stmt->declaration.value,
+                         stmt->declaration.constant ? stmt->declaration.name
+                                                    : anonymous);
+  } break;
+  case AssignmentStatement: {
+    if (stmt->assignment.index)
+      collectTypedFunction(inference, stmt->assignment.index, anonymous);
+    collectTypedFunction(inference, &stmt->assignment.value, anonymous);
+  } break;
+  case IfStatement: {
+    collectTypedFunction(inference, &stmt->if_statement->condition,
+                         anonymous);
+    collectTypedFunctions(inference, stmt->if_statement->consequence);
+    if (stmt->if_statement->alternate)
+      collectTypedFunctions(inference, stmt->if_statement->alternate);
+  } break;
+  case WhileStatement: {
+    collectTypedFunction(inference, &stmt->while_statement->condition,
+                         anonymous);
+    collectTypedFunctions(inference, stmt->while_statement->body);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    collectTypedFunction(inference, &switch_statement->subject, anonymous);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      collectTypedFunctions(inference, switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      collectTypedFunctions(inference, switch_statement->otherwise);
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt->block->statements.len; i++) {
+      collectTypedFunctions(inference, &stmt->block->statements.ptr[i]);
+    }
+  } break;
+  case ReturnStatement: {
+    if (stmt->return_statement)
+      collectTypedFunction(inference, stmt->return_statement, anonymous);
+  } break;
+  case InlineBatchStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  } break;
+  }
+}
+
+// The parser leaves operators as one right leaning chain, a comparison or
+// && and || anywhere in it makes the whole chain one
+static bool isComparisonChain(Expression expr) {
+  while (expr.type == ArithmeticExpression) {
+    if (isComparison(expr.arithmetic.op) || isLogical(expr.arithmetic.op))
+      return true;
+    expr = *expr.arithmetic.right;
+  }
+  return false;
+}
+
+static ValueType inferExpression(Inference *inference, Expression *expr);
+
+static void rejectStringOperand(char op, Expression operand) {
+  if (operand.value_type != TypeString)
+    return;
+  fprintf(stdout, "Ordering a string with %s: ", operatorText(op));
+  printExpression(operand);
+  panic("\nOnly numbers compare with <, <=, > and >=");
+}
+
+// < and friends compare numbers. Strings always take the quoted == and !=,
+// so a name that only ever holds one cannot be ordered. The chain leans
+// right, its own right operand ends at the next && or ||.
+static void checkOrdering(Expression *expr) {
+  char op = expr->arithmetic.op;
+  if (!isComparison(op) || op == '=' || op == '!')
+    return;
+  rejectStringOperand(op, *expr->arithmetic.left);
+  Expression *right = expr->arithmetic.right;
+  if (right->type != ArithmeticExpression)
+    rejectStringOperand(op, *right);
+  else if (isLogical(right->arithmetic.op))
+    rejectStringOperand(op, *right->arithmetic.left);
+}
+
+static ValueType inferCall(Inference *inference, Expression *expr) {
+  size_t index = NO_FUNCTION;
+  if (expr->call.callee->type == IdentifierExpression)
+    index = findTypedFunction(inference, expr->call.callee->identifier);
+  if (index == NO_FUNCTION) {
+    inferExpression(inference, expr->call.callee);
+    for (size_t i = 0; i < expr->call.parameters_len; i++) {
+      inferExpression(inference, &expr->call.parameters[i]);
+    }
+    bool len = expr->call.callee->type == IdentifierExpression &&
+               eql(expr->call.callee->identifier,
+                   (Slice(char)){.ptr = "len", .len = 3});
+    return len ? TypeNumber : TypeMixed;
+  }
+  expr->call.callee->value_type = TypeFunction;
+  Expression *function = inference->functions.slice.ptr[index].function;
+  size_t params = function->function_expression.parameters_len;
+  for (size_t i = 0; i < expr->call.parameters_len || i < params; i++) {
+    // missing arguments are empty
+    ValueType type =
+        i < expr->call.parameters_len
+            ? inferExpression(inference, &expr->call.parameters[i])
+            : TypeString;
+    if (i < params)
+      joinType(inference,
+               typeIn(&inference->names, index,
+                      function->function_expression.parameters[i].identifier),
+               type);
+  }
+  return inference->functions.slice.ptr[index].returns;
+}
+
+static bool endsInReturn(Statement *body) {
+  if (body->type == BlockStatement && body->block->statements.len > 0)
+    body = &body->block->statements.ptr[body->block->statements.len - 1];
+  return body->type == ReturnStatement;
+}
+
+static void inferStatement(Inference *inference, Statement *stmt);
+
+static void inferFunction(Inference *inference, Expression *expr) {
+  size_t index = NO_FUNCTION;
+  for (size_t i = 0; i < inference->functions.slice.len; i++) {
+    if (inference->functions.slice.ptr[i].function == expr)
+      index = i;
+  }
+  if (index == NO_FUNCTION)
+    panic("inferFunction: Function was not collected");
+  if (inference->functions.slice.ptr[index].escapes) {
+    for (size_t i = 0; i < expr->function_expression.parameters_len; i++) {
+      Slice(char) param = expr->function_expression.parameters[i].identifier;
+      joinType(inference, typeIn(&inference->names, index, param), TypeMixed);
+    }
+  }
+  size_t outer = inference->current;
+  inference->current = index;
+  inferStatement(inference, expr->function_expression.body);
+  inference->current = outer;
+  // falling off the end leaves __ret__ as the last call set it
+  if (!endsInReturn(expr->function_expression.body))
+    joinType(inference, &inference->functions.slice.ptr[index].returns,
+             TypeMixed);
+}
+
+static ValueType inferExpression(Inference *inference, Expression *expr) {
+  ValueType type = TypeMixed;
+  switch (expr->type) {
+  case IdentifierExpression: {
+    size_t index = findTypedFunction(inference, expr->identifier);
+    if (index == NO_FUNCTION) {
+      type = *nameType(inference, expr->identifier);
+      break;
+    }
+    TypedFunction *fn = &inference->functions.slice.ptr[index];
+    if (!fn->escapes) {
+      fn->escapes = true;
+      inference->changed = true;
+    }
+    type = TypeFunction;
+  } break;
+  case NumericExpression: {
+    type = TypeNumber;
+  } break;
+  case StringExpression: {
+    type = TypeString;
+  } break;
+  case CallExpression: {
+    type = inferCall(inference, expr);
+  } break;
+  case ArithmeticExpression: {
+    inferExpression(inference, expr->arithmetic.left);
+    inferExpression(inference, expr->arithmetic.right);
+    if (inference->checking)
+      checkOrdering(expr);
+    type = isComparisonChain(*expr) ? TypeBoolean : TypeNumber;
+  } break;
+  case FunctionExpression: {
+    inferFunction(inference, expr);
+    type = TypeFunction;
+  } break;
+  case ArrayExpression: {
+    for (size_t i = 0; i < expr->array.elements_len; i++) {
+      inferExpression(inference, &expr->array.elements[i]);
+    }
+    type = TypeNumber;
+  } break;
+  case IndexExpression: {
+    inferExpression(inference, expr->element.index);
+    type = *elementType(inference, expr->element.array);
+  } break;
+  }
+  expr->value_type = type;
+  return type;
+}
+
+// Setting a name that is bound to a function means calls through it may
+// go somewhere else. An array literal sets its elements and leaves the
+// length in the name.
+static void inferAssignment(Inference *inference, Slice(char) name,
+                            Expression *value) {
+  ValueType type = inferExpression(inference, value);
+  for (size_t i = 0;
+       value->type == ArrayExpression && i < value->array.elements_len; i++) {
+    joinType(inference, elementType(inference, name),
+             value->array.elements[i].value_type);
+  }
+  size_t index = findTypedFunction(inference, name);
+  if (index != NO_FUNCTION &&
+      inference->functions.slice.ptr[index].function != value) {
+    TypedFunction *fn = &inference->functions.slice.ptr[index];
+    fn->name = (Slice(char)){.ptr = NULL, .len = 0};
+    fn->escapes = true;
+    inference->changed = true;
+  }
+  joinType(inference, nameType(inference, name), type);
+}
+
+static void inferStatement(Inference *inference, Statement *stmt) {
+  switch (stmt->type) {
+  case ExpressionStatement: {
+    inferExpression(inference, &stmt->expression);
+  } break;
+  case DeclarationStatement: {
+    inferAssignment(inference, stmt->declaration.name,
+                    &stmt->declaration.value);
+  } break;
+  case AssignmentStatement: {
+    if (stmt->assignment.index) {
+      inferExpression(inference, stmt->assignment.index);
+      joinType(inference, elementType(inference, stmt->assignment.name),
+               inferExpression(inference, &stmt->assignment.value));
+      break;
+    }
+    inferAssignment(inference, stmt->assignment.name,
+                    &stmt->assignment.value);
+  } break;
+  case IfStatement: {
+    inferExpression(inference, &stmt->if_statement->condition);
+    inferStatement(inference, stmt->if_statement->consequence);
+    if (stmt->if_statement->alternate)
+      inferStatement(inference, stmt->if_statement->alternate);
+  } break;
+  case WhileStatement: {
+    inferExpression(inference, &stmt->while_statement->condition);
+    inferStatement(inference, stmt->while_statement->body);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    inferExpression(inference, &switch_statement->subject);
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      inferExpression(inference, &switch_statement->cases.ptr[i].value);
+      inferStatement(inference, switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      inferStatement(inference, switch_statement->otherwise);
+  } break;
+  case BlockStatement: {
+    for (size_t i = 0; i < stmt->block->statements.len; i++) {
+      inferStatement(inference, &stmt->block->statements.ptr[i]);
+    }
+  } break;
+  case ReturnStatement: {
+    ValueType type = TypeString;
+    if (stmt->return_statement)
+      type = inferExpression(inference, stmt->return_statement);
+    if (inference->current != NO_FUNCTION)
+      joinType(inference,
+               &inference->functions.slice.ptr[inference->current].returns,
+               type);
+  } break;
+  case InlineBatchStatement: {
+    // trusted to keep the types of whatever it sets
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  } break;
+  }
+}
+
+// Gives every expression the type of what it holds at runtime. Names have
+// one type in each function they are local to and one for the rest of the
+// script, joined over everything assigned to them, parameters over all the
+// calls of their function. Runs until nothing
+// changes since calls can come before the function they call.
+static void inferTypes(Allocator ally, Program prog) {
+  Result(Vec_TypedName) names_res = createVec(ally, TypedName, 8);
+  if (!names_res.ok)
+    panic(names_res.err);
+  Result(Vec_TypedFunction) functions_res = createVec(ally, TypedFunction, 4);
+  if (!functions_res.ok)
+    panic(functions_res.err);
+  Result(Vec_TypedName) elements_res = createVec(ally, TypedName, 4);
+  if (!elements_res.ok)
+    panic(elements_res.err);
+  Inference inference = {
+      .names = names_res.val,
+      .elements = elements_res.val,
+      .functions = functions_res.val,
+      .current = NO_FUNCTION,
+      .changed = true,
+      .checking = false,
+  };
+  for (size_t i = 0; i < prog.statements.len; i++) {
+    collectTypedFunctions(&inference, &prog.statements.ptr[i]);
+  }
+  size_t rounds = 0;
+  while (inference.changed) {
+    inference.changed = false;
+    for (size_t i = 0; i < prog.statements.len; i++) {
+      inferStatement(&inference, &prog.statements.ptr[i]);
+    }
+    rounds++;
+  }
+  inference.checking = true;
+  for (size_t i = 0; i < prog.statements.len; i++) {
+    inferStatement(&inference, &prog.statements.ptr[i]);
+  }
+  size_t numeric = 0;
+  for (size_t i = 0; i < inference.names.slice.len; i++) {
+    ValueType type = inference.names.slice.ptr[i].type;
+    if (type == TypeNumber || type == TypeBoolean)
+      numeric++;
+  }
+  fprintf(stdout, "Inferred types in %zu rounds, %zu of %zu names numeric\n",
+          rounds, numeric, inference.names.slice.len);
+}
+
 #endif /* SEMA_H */
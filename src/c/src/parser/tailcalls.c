@@ -0,0 +1,150 @@
+#ifndef TAILCALLS_H
+#define TAILCALLS_H
+
+#include "../std/eql.c"
+#include "parser.c"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Marks calls a function makes to itself as its last action, so codegen can
+// reassign the parameters and jump back to the function entry instead of
+// growing the call stack and the setlocal nesting with every iteration.
+
+typedef struct {
+  Slice(char) name;
+  Expression *parameters;
+  size_t parameters_len;
+  size_t marked;
+} TailFunction;
+
+static bool markSelfCall(TailFunction *fn, Expression *expr) {
+  if (expr->type != CallExpression ||
+      expr->call.callee->type != IdentifierExpression ||
+      !eql(expr->call.callee->identifier, fn->name) ||
+      expr->call.parameters_len != fn->parameters_len)
+    return false;
+  expr->call.tail_parameters = fn->parameters;
+  fn->marked++;
+  return true;
+}
+
+static void markTailCallsIn(TailFunction *fn, Statement *stmt, bool tail) {
+  switch (stmt->type) {
+  case ReturnStatement: {
+    if (stmt->return_statement)
+      markSelfCall(fn, stmt->return_statement);
+  } break;
+  case ExpressionStatement: {
+    // falling off the end after the call returns nothing either way
+    if (tail)
+      markSelfCall(fn, &stmt->expression);
+  } break;
+  case BlockStatement: {
+    // jumping out of a block with its own setlocal would leak the frame
+    if (stmt->block->scoped)
+      break;
+    size_t len = stmt->block->statements.len;
+    for (size_t i = 0; i < len; i++) {
+      markTailCallsIn(fn, &stmt->block->statements.ptr[i],
+                      tail && i == len - 1);
+    }
+  } break;
+  case IfStatement: {
+    markTailCallsIn(fn, stmt->if_statement->consequence, tail);
+    if (stmt->if_statement->alternate)
+      markTailCallsIn(fn, stmt->if_statement->alternate, tail);
+  } break;
+  case WhileStatement: {
+    markTailCallsIn(fn, stmt->while_statement->body, false);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      markTailCallsIn(fn, switch_statement->cases.ptr[i].body, tail);
+    }
+    if (switch_statement->otherwise)
+      markTailCallsIn(fn, switch_statement->otherwise, tail);
+  } break;
+  case DeclarationStatement:
+  case AssignmentStatement:
+  case InlineBatchStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static void findTailCallsIn(Statement *stmt);
+
+static void findTailCallsInList(Slice(Statement) list) {
+  for (size_t i = 0; i < list.len; i++) {
+    findTailCallsIn(&list.ptr[i]);
+  }
+}
+
+static void markTailCalls(Slice(char) name, Expression *function) {
+  TailFunction fn = {
+      .name = name,
+      .parameters = function->function_expression.parameters,
+      .parameters_len = function->function_expression.parameters_len,
+      .marked = 0,
+  };
+  // the body is the function frame itself, so its statements are walked
+  // directly rather than as a nested block
+  Statement *body = function->function_expression.body;
+  Slice(Statement) statements = {.ptr = body, .len = 1};
+  if (body->type == BlockStatement)
+    statements = body->block->statements;
+  for (size_t i = 0; i < statements.len; i++) {
+    markTailCallsIn(&fn, &statements.ptr[i], i == statements.len - 1);
+  }
+  function->function_expression.tail_recursive = fn.marked > 0;
+  if (fn.marked > 0)
+    fprintf(stdout, "Tail calls in %1.*s: %zu\n", (int)name.len, name.ptr,
+            fn.marked);
+}
+
+static void findTailCallsIn(Statement *stmt) {
+  switch (stmt->type) {
+  case BlockStatement: {
+    findTailCallsInList(stmt->block->statements);
+  } break;
+  case IfStatement: {
+    findTailCallsIn(stmt->if_statement->consequence);
+    if (stmt->if_statement->alternate)
+      findTailCallsIn(stmt->if_statement->alternate);
+  } break;
+  case WhileStatement: {
+    findTailCallsIn(stmt->while_statement->body);
+  } break;
+  case SwitchStatement: {
+    Switch *switch_statement = stmt->switch_statement;
+    for (size_t i = 0; i < switch_statement->cases.len; i++) {
+      findTailCallsIn(switch_statement->cases.ptr[i].body);
+    }
+    if (switch_statement->otherwise)
+      findTailCallsIn(switch_statement->otherwise);
+  } break;
+  case DeclarationStatement: {
+    if (stmt->declaration.value.type != FunctionExpression)
+      break;
+    findTailCallsIn(stmt->declaration.value.function_expression.body);
+    markTailCalls(stmt->declaration.name, &stmt->declaration.value);
+  } break;
+  case AssignmentStatement:
+  case ExpressionStatement:
+  case InlineBatchStatement:
+  case ReturnStatement: {
+  } break;
+  case StatementEOF: {
+    panic("StatementEOF");
+  }
+  }
+}
+
+static void findTailCalls(Program prog) {
+  findTailCallsInList(prog.statements);
+}
+
+#endif /* TAILCALLS_H */
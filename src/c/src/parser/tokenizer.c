@@ -16,6 +16,8 @@ typedef enum {
   TokenType_CloseParen,
   TokenType_OpenCurly,
   TokenType_CloseCurly,
+  TokenType_OpenBracket,
+  TokenType_CloseBracket,
   TokenType_Semi,
   TokenType_Comma,
   TokenType_String,
@@ -27,6 +29,10 @@ typedef enum {
   TokenType_Hyphen,
   TokenType_Slash,
   TokenType_Percent,
+  TokenType_Less,
+  TokenType_Greater,
+  TokenType_Amp,
+  TokenType_Pipe,
   TokenType_InlineBatch,
   TokenType_Unknown,
 } TokenType;
@@ -80,6 +86,12 @@ static void printToken(Token t) {
   case TokenType_CloseCurly: {
     printf("CloseCurly");
   } break;
+  case TokenType_OpenBracket: {
+    printf("OpenBracket");
+  } break;
+  case TokenType_CloseBracket: {
+    printf("CloseBracket");
+  } break;
   case TokenType_Semi: {
     printf("Semi");
   } break;
@@ -113,6 +125,18 @@ static void printToken(Token t) {
   case TokenType_Percent: {
     printf("Percent");
   } break;
+  case TokenType_Less: {
+    printf("Less");
+  } break;
+  case TokenType_Greater: {
+    printf("Greater");
+  } break;
+  case TokenType_Amp: {
+    printf("Amp");
+  } break;
+  case TokenType_Pipe: {
+    printf("Pipe");
+  } break;
   case TokenType_InlineBatch: {
     printf("Batch {%1.*s}", (int)t.inline_batch.len, t.inline_batch.ptr);
   } break;
@@ -193,6 +217,10 @@ static Token nextToken(TokenIterator *it) {
     return (Token){.type = TokenType_OpenCurly};
   case '}':
     return (Token){.type = TokenType_CloseCurly};
+  case '[':
+    return (Token){.type = TokenType_OpenBracket};
+  case ']':
+    return (Token){.type = TokenType_CloseBracket};
   case ';':
     return (Token){.type = TokenType_Semi};
   case ',':
@@ -213,6 +241,14 @@ static Token nextToken(TokenIterator *it) {
     return (Token){.type = TokenType_Slash};
   case '%':
     return (Token){.type = TokenType_Percent};
+  case '<':
+    return (Token){.type = TokenType_Less};
+  case '>':
+    return (Token){.type = TokenType_Greater};
+  case '&':
+    return (Token){.type = TokenType_Amp};
+  case '|':
+    return (Token){.type = TokenType_Pipe};
   }
 
   // keywords / identifiers
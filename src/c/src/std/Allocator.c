@@ -68,13 +68,15 @@ static void *bumpRealloc(void *ptr, size_t size, size_t old_size, void *state) {
     void *new_ptr = bumpRealloc(NULL, size, 0, state);
     if (!new_ptr)
       return NULL;
-    for (size_t i = 0; i < size; i++) {
+    for (size_t i = 0; i < size && i < old_size; i++) {
       ((char *)new_ptr)[i] = ((char *)ptr)[i];
     }
     return new_ptr;
   }
 
-  size_t align = (8 - (((size_t)bump->mem.ptr + bump->cur) % 8)) % 8;
+  // resizing the last allocation in place must not move it to realign
+  size_t align =
+      ptr ? 0 : (8 - (((size_t)bump->mem.ptr + bump->cur) % 8)) % 8;
 
   if (bump->cur - old_size + size + align > bump->mem.len) {
     // OOM